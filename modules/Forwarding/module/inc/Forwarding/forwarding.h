@@ -28,9 +28,36 @@
 #include <indigo/of_state_manager.h>
 
 
+/**
+ * What a flow add does when its table is full
+ *
+ * By default it fails.  Otherwise a flow is evicted to make room, and
+ * the state manager told it was removed.  The victim is chosen among a
+ * few flows sampled at random: the least recently hit, or the lowest
+ * priority, ties going to the least recently hit.
+ *
+ * OpenFlow table stats up to 1.3 have no field for evictions, so the
+ * per-table counts are shown only by the ucli "stats" command; the
+ * controller sees each eviction as a flow removed.
+ */
+
+typedef enum ind_fwd_eviction_e {
+  IND_FWD_EVICTION_NONE,
+  IND_FWD_EVICTION_LRU,
+  IND_FWD_EVICTION_IMPORTANCE,
+} ind_fwd_eviction_t;
+
 typedef struct {
   unsigned of_version;
-  unsigned max_flows;
+  unsigned max_flows;           /* Per table */
+  unsigned n_tables;            /* Pipeline length; 0 means 1 */
+  const char *snapshot_path;    /* Flow table saved here at finish and
+                                   reloaded at init; NULL for none */
+  unsigned restore_hold_ms;     /* How long reloaded flows forward before
+                                   the controller's flows replace them,
+                                   if no barrier comes first; 0 for the
+                                   default */
+  ind_fwd_eviction_t eviction;  /* When a table is full */
 } ind_fwd_config_t;
 
 extern indigo_error_t ind_fwd_init(ind_fwd_config_t *config);
@@ -48,6 +75,150 @@ extern indigo_error_t ind_fwd_enable_get(int *enable);
 
 extern indigo_error_t ind_fwd_finish(void);
 
+/**
+ * Change the eviction policy at run time
+ */
+
+extern indigo_error_t ind_fwd_eviction_set(ind_fwd_eviction_t policy);
+
+/**
+ * Resize the flow tables at run time
+ *
+ * Flows are kept, so a table can't shrink below the flows it holds.
+ */
+
+/** Most flows a table may hold */
+#define FWD_MAX_FLOWS_MAX (1 << 20)
+
+extern indigo_error_t ind_fwd_max_flows_set(unsigned max_flows);
+
+
+/**
+ * OpenFlow 1.1+ group table
+ *
+ * Group mods and group stats requests are handed over as received.
+ * The port manager reports port liveness, which drives fast-failover
+ * and select group bucket choice, and passes groups other than flood
+ * to ind_fwd_group_emit().
+ */
+
+extern indigo_error_t ind_fwd_group_mod(of_group_mod_t *group_mod);
+extern indigo_error_t ind_fwd_group_stats_get(of_group_stats_request_t *request,
+                                              of_group_stats_reply_t **reply);
+extern void ind_fwd_group_port_status_set(of_port_no_t of_port_num, int live);
+extern indigo_error_t ind_fwd_group_emit(uint32_t group_id,
+                                         of_port_no_t in_port,
+                                         uint8_t *data,
+                                         unsigned len);
+
+
+/**
+ * OpenFlow 1.3 meter table
+ *
+ * Flows name a meter with the meter instruction; the meter is applied
+ * after the flow matches and before its actions run.
+ */
+
+extern indigo_error_t ind_fwd_meter_mod(of_meter_mod_t *meter_mod);
+extern indigo_error_t ind_fwd_meter_stats_get(of_meter_stats_request_t *request,
+                                              of_meter_stats_reply_t **reply);
+
+
+/**
+ * Flow mod command queue
+ *
+ * With a non-zero depth, flow adds, modifies and deletes are queued and
+ * applied from the event loop in slices of at most slice_us, between
+ * packet bursts; each completion callback is issued as its flow mod is
+ * applied.  A depth of 0, the default, applies flow mods as they come.
+ *
+ * Packet outs, group mods, meter mods and stats requests apply what is
+ * queued before they are handled.  A barrier reply must not be sent
+ * before ind_fwd_flow_barrier() returns: it applies every queued flow
+ * mod and issues its callback, so errors go out ahead of the reply.
+ * After a warm restart, the first barrier also ends the restore hold.
+ */
+
+/** Most flow mods the queue may hold */
+#define FWD_FLOWQ_DEPTH_MAX 65536
+
+extern indigo_error_t ind_fwd_flow_queue_set(unsigned depth,
+                                             unsigned slice_us);
+extern indigo_error_t ind_fwd_flow_barrier(void);
+
+
+/**
+ * Flow mod batches
+ *
+ * Flow mods issued between begin and commit are staged, not applied;
+ * the commit applies them all, in order, in one pass, so the datapath
+ * never sees part of a batch.  Each flow mod's completion callback is
+ * issued at commit with its own result.  Flow and table stats read
+ * while a batch is open do not include it.
+ */
+
+extern indigo_error_t ind_fwd_flow_batch_begin(void);
+extern indigo_error_t ind_fwd_flow_batch_commit(void);
+
+
+/**
+ * Shadow flow table
+ *
+ * For a full resync, e.g. after controller failover.  After begin, flow
+ * adds go to an empty shadow table while the live table keeps
+ * forwarding; deletes of live flows succeed but leave them forwarding
+ * until the swap.  Commit swaps the shadow in with one pointer store;
+ * flows with the same table, cookie, priority and match as an old flow
+ * keep its counters.  The old table is freed once no packet is being
+ * looked up in it.
+ */
+
+extern indigo_error_t ind_fwd_shadow_begin(void);
+extern indigo_error_t ind_fwd_shadow_commit(void);
+
+
+/**
+ * Flow table snapshot, for warm restart
+ *
+ * Flows are saved with their keys, priorities, timeouts, actions and
+ * counters; NULL saves to the configured snapshot_path.  A snapshot
+ * found at init is reloaded before any port comes up, and its flows
+ * forward while the controller rebuilds the table in a shadow.  The
+ * shadow is swapped in at the controller's first barrier, or after
+ * restore_hold_ms without one.
+ */
+
+extern indigo_error_t ind_fwd_snapshot_save(const char *path);
+
+
+/**
+ * Flow memory
+ *
+ * What the live table's flows take, their data and keys.  Exact flows
+ * keep compact keys; full_key_bytes is what the same flows would take
+ * with every key a full FME entry.
+ *
+ * Flows with the same actions share one action list.  The action
+ * figures cover every table, shadow included; action_refs over
+ * action_lists is the sharing ratio.
+ *
+ * exact_buckets is the live tables' exact tier size, which grows only
+ * when an exact flow can't be placed.
+ */
+
+typedef struct {
+  unsigned flows;
+  unsigned compact_keys;        /* Flows with a compact key */
+  uint64_t bytes;
+  uint64_t full_key_bytes;
+  unsigned action_lists;        /* Distinct action lists */
+  unsigned action_refs;         /* Flows holding one */
+  uint64_t action_bytes;        /* Wire size of the distinct lists */
+  unsigned exact_buckets;       /* Exact tier buckets, every table */
+} ind_fwd_memory_stats_t;
+
+extern void ind_fwd_memory_stats_get(ind_fwd_memory_stats_t *stats);
+
 
 /**
  * Stats for packet in
@@ -36,6 +36,10 @@
 #include <PortManager/portmanager.h>
 #include <Configuration/configuration.h>
 #include <cjson/cJSON.h>
+#include <murmur/murmur.h>
+#include <SocketManager/socketmanager.h>
+#include <inttypes.h>
+#include <stdlib.h>
 
 static const char __file__[] = "$Id$";
 
@@ -52,6 +56,9 @@ static int init_done = 0;
 
 #define ARRAY_SIZE(a)  (sizeof(a) / sizeof((a)[0]))
 
+/* Group bucket packet copies up to this size are made on the stack */
+#define FWD_BUCKET_PKT_LOCAL  2048
+
 /* Short hand logging macros */
 #define LOG_ERROR AIM_LOG_ERROR
 #define LOG_WARN AIM_LOG_WARN 
@@ -61,16 +68,69 @@ static int init_done = 0;
 
 static ind_fwd_config_t my_config[1];
 
-static fme_t* fme; 
+/** \brief One stage of the flow table pipeline */
+struct fwd_table {
+    fme_t           *fme;           /**< Wildcard flows */
+    ind_fwd_exact_t *exact;         /**< Exact-match tier, consulted first */
+    /*
+     * Highest priority of any flow in the FME, and how many flows share it.
+     * An exact-tier hit at or above this priority can't be overridden by
+     * a wildcard flow, so the FME search is skipped.
+     */
+    int             wc_prio_max;
+    unsigned        wc_prio_max_count;
+    int             wc_prio_stale;  /**< Maximum needs a rescan */
+    unsigned        active_count;   /**< Number of flows defined */
+    unsigned        max_flows;      /**< Room in the FME and flows */
+    uint64_t        lookup_count;   /**< Number of packets looked up */
+    uint64_t        matched_count;  /**< Number of packets matched */
+    /*
+     * Every flow, in no particular order, so that eviction can pick
+     * candidates at random; a flow's slot is its table_idx.
+     */
+    struct fme_flow_data **flows;
+    uint64_t        evicted_count;  /**< Flows evicted to make room */
+};
+
+/** Flows looked at to choose one to evict */
+#define FWD_EVICT_SAMPLES 8
+
+static unsigned n_tables;
+
+#define FLOW_ID_HASH_TABLE_LEN 64 /* Size must be power of 2 */
+
+/**
+ * \brief A complete flow table: every pipeline stage and the flow id
+ * dictionary
+ *
+ * Flow mods go to the live one, or to a shadow being built beside it
+ * for a controller resync, which is then swapped in whole.
+ */
+struct fwd_state {
+    struct fwd_table *tables;       /**< Indexed by table id */
+    biglist_t        *flow_id_ht[FLOW_ID_HASH_TABLE_LEN];
+    unsigned         retired_count; /**< Deleted while a shadow was open */
+};
+
+static struct fwd_state *fwd_live;     /**< What the datapath reads */
+static struct fwd_state *fwd_shadow;   /**< Being built, or NULL */
+static struct fwd_state *fwd_retired;  /**< Swapped out, awaiting reclaim */
+static unsigned         fwd_readers;   /**< Datapath passes under way */
+
+static int      restore_hold;     /**< Restored flows await a swap */
 
-static unsigned active_count;   /**< Number of flows defined */
-static uint64_t lookup_count;   /**< Number of packets looked up */
-static uint64_t matched_count;  /**< Number of packets matched */
+static ind_fwd_eviction_t eviction;  /**< What goes when a table is full */
+static uint32_t evict_rand = 1;      /**< Eviction sampling state */
+static uint64_t shadow_swaps;
+static unsigned shadow_last_flows;
+static unsigned shadow_last_carried;
 
 static int module_enabled = 0; /**< Module enable state */
 
 static int expiration_enabled = 1;
 
+static int wc_prio_deferred;    /**< Hold rescans until index rebuild */
+
 static int
 fme_key_mask_dump__(fme_key_t* key, aim_pvs_t* pvs)
 {
@@ -189,6 +249,9 @@ indigo_fwd_forwarding_features_get(of_features_reply_t *features)
     OF_CAPABILITIES_FLAG_PORT_STATS_SET(capabilities, features->version);
     OF_CAPABILITIES_FLAG_QUEUE_STATS_SET(capabilities, features->version);
     OF_CAPABILITIES_FLAG_ARP_MATCH_IP_SET(capabilities, features->version);
+    if (features->version >= OF_VERSION_1_1) {
+        OF_CAPABILITIES_FLAG_GROUP_STATS_SET(capabilities, features->version);
+    }
 
     OF_FLAG_ENUM_SET(actions,
         OF_ACTION_TYPE_OUTPUT_BY_VERSION(features->version));
@@ -215,7 +278,7 @@ indigo_fwd_forwarding_features_get(of_features_reply_t *features)
     OF_FLAG_ENUM_SET(actions,
         OF_ACTION_TYPE_ENQUEUE_BY_VERSION(features->version));
 
-    of_features_reply_n_tables_set(features, 1);
+    of_features_reply_n_tables_set(features, n_tables);
     of_features_reply_capabilities_set(features, capabilities);
     /* Only 1.0 has actions in switch features */
     if (features->version == OF_VERSION_1_0) {
@@ -226,39 +289,28 @@ indigo_fwd_forwarding_features_get(of_features_reply_t *features)
 }
 
 
-struct fme_flow_data {
-    indigo_cookie_t  flow_id;         /* Flow id */
-    fme_entry_t*     fme_entry;       /* FME entry */
-    of_list_action_t *of_list_action; /* List of actions for flow */
-    uint64_t         cnt_pkts;        /* Running count of matched packets */
-    uint64_t         cnt_bytes;       /* Running sum of sizes of matched packets */
-};
-
-#define FLOW_ID_HASH_TABLE_LEN 64 /* Size must be power of 2 */
-static biglist_t *flow_id_ht[FLOW_ID_HASH_TABLE_LEN];
-
 static unsigned
 flow_id_hash(indigo_cookie_t flow_id)
 {
-   return (((unsigned) flow_id) & (ARRAY_SIZE(flow_id_ht) - 1));
+   return (((unsigned) flow_id) & (FLOW_ID_HASH_TABLE_LEN - 1));
 }
 
 static void
-flow_id_dict_insert(struct fme_flow_data *fme_flow_data)
+flow_id_dict_insert(struct fwd_state *st, struct fme_flow_data *fme_flow_data)
 {
    /* N.B. No check made for duplicate flow_ids */
 
-   biglist_t **b = &flow_id_ht[flow_id_hash(fme_flow_data->flow_id)];
+   biglist_t **b = &st->flow_id_ht[flow_id_hash(fme_flow_data->flow_id)];
 
-   *b = biglist_append(*b, fme_flow_data);
+   *b = biglist_prepend(*b, fme_flow_data);
 }
 
 static void
-flow_id_dict_erase(indigo_cookie_t flow_id)
+flow_id_dict_erase(struct fwd_state *st, indigo_cookie_t flow_id)
 {
    /* N.B. No check made for deleting something not there */
 
-   biglist_t **b = &flow_id_ht[flow_id_hash(flow_id)], *bl = *b, *ble;
+   biglist_t **b = &st->flow_id_ht[flow_id_hash(flow_id)], *bl = *b, *ble;
    struct fme_flow_data *fme_flow_data;
 
    BIGLIST_FOREACH(ble, bl) {
@@ -270,287 +322,1154 @@ flow_id_dict_erase(indigo_cookie_t flow_id)
    }
 }
 
+/* Retired flows still forward until the swap, but can't be found */
 static struct fme_flow_data *
-flow_id_dict_find(indigo_cookie_t flow_id)
+flow_id_dict_find(struct fwd_state *st, indigo_cookie_t flow_id)
 {
-   biglist_t *bl = flow_id_ht[flow_id_hash(flow_id)], *ble;
+   biglist_t *bl = st->flow_id_ht[flow_id_hash(flow_id)], *ble;
    struct fme_flow_data *p;
 
    BIGLIST_FOREACH(ble, bl) {
       p = BIGLIST_CAST(struct fme_flow_data *, ble);
-      if (p->flow_id == flow_id)  return (p);
+      if (p->flow_id == flow_id && !p->retired)  return (p);
    }
 
    return (0);
 }
 
+/** \brief Find a flow, in the shadow first; *st is set to its table */
+static struct fme_flow_data *
+flow_find(indigo_cookie_t flow_id, struct fwd_state **st)
+{
+   struct fme_flow_data *p;
+
+   if (fwd_shadow != NULL
+       && (p = flow_id_dict_find(fwd_shadow, flow_id)) != 0) {
+      *st = fwd_shadow;
+      return (p);
+   }
+   *st = fwd_live;
+   return (flow_id_dict_find(fwd_live, flow_id));
+}
 
-/** \brief Create a flow */
 
-void
-indigo_fwd_flow_create(indigo_cookie_t flow_id,
-                       of_flow_add_t   *flow_add,
-                       indigo_cookie_t callback_cookie)
+static void
+wc_prio_add(struct fwd_table *tbl, int prio)
 {
-    indigo_error_t       result          = INDIGO_ERROR_NONE;
-    fme_entry_t*          fme_entry       = 0;
-    struct fme_flow_data *fme_flow_data  = 0;
-    of_list_action_t     *of_list_action = 0;
-    uint16_t             pri;
-    of_match_t           of_match[1];
-    fme_key_t           fme_key; 
-    extern int fme_oc_printf(void*, const char*, ...); 
+    if (prio > tbl->wc_prio_max) {
+        tbl->wc_prio_max = prio;
+        tbl->wc_prio_max_count = 1;
+    } else if (prio == tbl->wc_prio_max) {
+        ++tbl->wc_prio_max_count;
+    }
+}
 
-    LOG_TRACE("Flow create called");
-    fme_flow_data = (struct fme_flow_data *) 
-        INDIGO_MEM_ALLOC(sizeof(struct fme_flow_data));
-    if (fme_flow_data == NULL) {
-        LOG_ERROR("INDIGO_MEM_ALLOC() failed");
-        result = INDIGO_ERROR_UNKNOWN;
-        goto done;
+/** \brief Recompute the wildcard maximum of every stale table, in one pass */
+
+static void
+wc_prio_rescan(struct fwd_state *st)
+{
+    biglist_t *ble;
+    struct fme_flow_data *p;
+    struct fwd_table *tbl;
+    unsigned table_id;
+    int idx, stale = 0;
+
+    for (table_id = 0; table_id < n_tables; table_id++) {
+        tbl = &st->tables[table_id];
+        if (tbl->wc_prio_stale) {
+            tbl->wc_prio_max = -1;
+            tbl->wc_prio_max_count = 0;
+            stale = 1;
+        }
+    }
+    if (!stale) {
+        return;
     }
-    memset(fme_flow_data, 0, sizeof(*fme_flow_data));
 
-    of_flow_add_priority_get(flow_add, &pri);
-    if (LOXI_FAILURE(of_flow_add_match_get(flow_add,
-                                           of_match
-                                           )
-                     )
-        ) {
-        LOG_ERROR("of_flow_add_match_get() failed");
-        result = INDIGO_ERROR_UNKNOWN;
-        goto done;
+    for (idx = 0; idx < FLOW_ID_HASH_TABLE_LEN; idx++) {
+        BIGLIST_FOREACH(ble, st->flow_id_ht[idx]) {
+            p = BIGLIST_CAST(struct fme_flow_data *, ble);
+            tbl = &st->tables[p->table_id];
+            if (!p->exact && tbl->wc_prio_stale) {
+                wc_prio_add(tbl, p->prio);
+            }
+        }
     }
-    of_list_action = of_flow_add_actions_get(flow_add);
-    if (of_list_action == NULL) {
-        LOG_ERROR("of_flow_add_actions_get() failed");
-        result = INDIGO_ERROR_UNKNOWN;
-        goto done;
+
+    for (table_id = 0; table_id < n_tables; table_id++) {
+        st->tables[table_id].wc_prio_stale = 0;
     }
-    fme_flow_data->of_list_action = of_list_action;
+}
 
+static void
+wc_prio_remove(struct fwd_state *st, struct fwd_table *tbl, int prio)
+{
+    if (tbl->wc_prio_stale
+        || prio != tbl->wc_prio_max || --tbl->wc_prio_max_count > 0) {
+        return;
+    }
 
-    LOG_TRACE("Adding flow to FME");
-    if (FME_FAILURE(fme_entry_create(&fme_entry))) {
-        LOG_ERROR("fme_entry_create() failed");
-        result = INDIGO_ERROR_UNKNOWN; /** \todo Check for table overflow? */
-        goto done;
+    /* Last flow at the maximum went away; rescan the wildcard flows */
+    tbl->wc_prio_stale = 1;
+    if (!wc_prio_deferred) {
+        wc_prio_rescan(st);
     }
+}
 
-    fme_entry->prio = pri; 
-    fme_entry->cookie = fme_flow_data; 
-    fme_flow_data->fme_entry = fme_entry;
-    
-    FME_MEMSET(&fme_key, 0, sizeof(fme_key)); 
 
-    /*
-     * We use the OF10 header as the key. 
-     */
-    fme_key.size = ppe_field_info_table[PPE_FIELD_OF10_LAST].offset_bytes; 
-    fme_key.dumper = fme_key_dump_mkey__; 
-    
-    /* For each match field F,
-       if F is specified (i.e. not wildcarded),
-       add it to the FME key. 
-    */
+/**
+ * \brief Put off index upkeep while a run of flow mods is applied
+ *
+ * Until ind_fwd_flow_index_rebuild(), a table whose highest wildcard
+ * priority goes away is only marked, rather than rescanned per delete.
+ * A stale maximum is never lower than the true one, so lookups stay
+ * correct meanwhile, if slower.
+ */
 
-#define ADD_FME_KEY_FIELD(u, v, w, ph)                                  \
-    if (OF_MATCH_MASK_ ## u ## _ACTIVE_TEST(of_match)) {                \
-        ppe_field_set_header(fme_key.values, v,                         \
-                             (of_match->fields. w) & (of_match->masks. w)); \
-        ppe_field_set_header(fme_key.masks, v, of_match->masks. w);     \
-        fme_key.keymask |= (1<<ph);                                     \
-    }                                                                     
-    
-#define ADD_FME_KEY_MAC_ADDR(u, v, w)                                   \
-    do {                                                                \
-        if (OF_MATCH_MASK_ ## u ## _ACTIVE_TEST(of_match)) {            \
-            of_mac_addr_t masked_value;                                 \
-            int idx;                                                    \
-            for (idx = 0; idx < OF_MAC_ADDR_BYTES; idx++) {             \
-                masked_value.addr[idx] = (of_match->masks. w .addr)[idx] & \
-                    (of_match->fields. w .addr)[idx];                   \
-            }                                                           \
-            ppe_wide_field_set_header(fme_key.values, v, masked_value.addr); \
-            ppe_wide_field_set_header(fme_key.masks, v, of_match->masks. w .addr); \
-            fme_key.keymask |= (1<<PPE_HEADER_ETHERNET);                \
-        }                                                                   \
-    } while (0)
+void
+ind_fwd_flow_index_defer(void)
+{
+    wc_prio_deferred = 1;
+}
 
-    /** \todo Non-canonical flows? */
-    
-    ADD_FME_KEY_FIELD(IN_PORT,    PPE_FIELD_OF10_INGRESS_PORT,  in_port, 
-                      PPE_HEADER_META);
-    ADD_FME_KEY_MAC_ADDR(ETH_SRC, PPE_FIELD_OF10_ETHER_SRC_MAC, eth_src);
-    ADD_FME_KEY_MAC_ADDR(ETH_DST, PPE_FIELD_OF10_ETHER_DST_MAC, eth_dst);
 
-    if (OF_MATCH_MASK_VLAN_VID_ACTIVE_TEST(of_match)) {
-        if (OF_MATCH_MASK_VLAN_VID_EXACT_TEST(of_match)
-            && (of_match->fields.vlan_vid 
-                == OF_MATCH_UNTAGGED_VLAN_ID(flow_add->version)
-                )
-            ) {
+/** \brief Rebuild indexes put off since ind_fwd_flow_index_defer() */
 
-            /* Match untagged packets */
-            ppe_field_set_header(fme_key.values, PPE_FIELD_OF10_PACKET_FORMAT, 
-                                 PPE_HEADER_ETHERII); 
-            ppe_field_set_header(fme_key.masks, PPE_FIELD_OF10_PACKET_FORMAT, 
-                                 -1);
-        } else {
-            /* Match tagged packets */
-            ppe_field_set_header(fme_key.values, PPE_FIELD_OF10_PACKET_FORMAT, 
-                                 PPE_HEADER_8021Q); 
-            ppe_field_set_header(fme_key.masks, PPE_FIELD_OF10_PACKET_FORMAT, 
-                                 -1); 
-            ADD_FME_KEY_FIELD(VLAN_VID, PPE_FIELD_OF10_VLAN, vlan_vid, 
-                              PPE_HEADER_8021Q);
-            ADD_FME_KEY_FIELD(VLAN_PCP, PPE_FIELD_OF10_PRI,  vlan_pcp, 
-                              PPE_HEADER_8021Q);
-        }
+void
+ind_fwd_flow_index_rebuild(void)
+{
+    wc_prio_deferred = 0;
+    wc_prio_rescan(fwd_live);
+    if (fwd_shadow != NULL) {
+        wc_prio_rescan(fwd_shadow);
     }
+}
 
-    ADD_FME_KEY_FIELD(ETH_TYPE,    PPE_FIELD_OF10_ETHER_TYPE, eth_type, 
-                      PPE_HEADER_ETHER);
 
-    /**
-     * Special case handling for Arp packets. 
-     *
-     * When a flowmod is specified with ethertype == ARP there is a 
-     * special interpretation of the source/dest/protocol fields in 
-     * the flowmod. 
-     *
-     * For IPv4 ARP flows the following mapping should be performed:
-     *    NW_PROTO -> ARP OPERATION
-     *    NW_SRC -> ARP Source Protocol Address
-     *    NW_DST -> ARP Target Protocol Address. 
-     *
-     * This applies to ARP Protocol Type == 0x800 only, so an implicit
-     * qualification on this must also be added. 
-     *
-     * @fixme constants
-     */
-    if (OF_MATCH_MASK_ETH_TYPE_ACTIVE_TEST(of_match) && 
-        of_match->fields.eth_type == 0x0806 &&
-        of_match->masks.eth_type == 0xffff) {
+/** \brief Free a flow table, its flows and their references */
 
-        ppe_field_set_header(fme_key.values, PPE_FIELD_OF10_ARP_PTYPE, 
-                             0x0800); 
-        ppe_field_set_header(fme_key.masks,  PPE_FIELD_OF10_ARP_PTYPE, 
-                             0xFFFF); 
-        ADD_FME_KEY_FIELD(IPV4_SRC, PPE_FIELD_OF10_ARP_SPA, ipv4_src, 
-                          PPE_HEADER_ARP); 
-        ADD_FME_KEY_FIELD(IPV4_DST, PPE_FIELD_OF10_ARP_TPA, ipv4_dst, 
-                          PPE_HEADER_ARP); 
-        ADD_FME_KEY_FIELD(IP_PROTO, PPE_FIELD_OF10_ARP_OPERATION, ip_proto, 
-                          PPE_HEADER_ARP); 
-        
-    }
-    
-    /**
-     * Special case LLC/SNAP Processing. 
-     *
-     * If the specified ethertype is 0x5FF, then match
-     * all Non-ethertype packets (LLC-only, or SNAP with OUI != 0). 
-     * 
-     * In this case we merely qualify the headermask with ETHERTYPE_MISSING. 
-     * 
-     */
-    else if(OF_MATCH_MASK_ETH_TYPE_ACTIVE_TEST(of_match) && 
-            of_match->fields.eth_type == 0x5FF) { 
-        fme_key.keymask = (1<<PPE_HEADER_ETHERTYPE_MISSING); 
-        ppe_field_set_header(fme_key.values, PPE_FIELD_OF10_ETHER_TYPE, 0);
-        ppe_field_set_header(fme_key.masks, PPE_FIELD_OF10_ETHER_TYPE, 0);
+static void
+fwd_state_destroy(struct fwd_state *st)
+{
+    biglist_t *bl, *ble;
+    struct fme_flow_data *p;
+    unsigned idx;
+
+    if (st == NULL) {
+        return;
     }
 
-    /**
-     * Normal field mapping applies. 
-     */
-    else {
+    /* Walk the FME table entries and delete the cookies */
+    for (idx = 0; idx < FLOW_ID_HASH_TABLE_LEN; idx++) {
+        bl = st->flow_id_ht[idx];
 
-        ADD_FME_KEY_FIELD(IP_DSCP,     PPE_FIELD_OF10_IP4_TOS,      ip_dscp, 
-                          PPE_HEADER_IP4);
-        ADD_FME_KEY_FIELD(IP_PROTO,    PPE_FIELD_OF10_IP4_PROTO,   ip_proto, 
-                          PPE_HEADER_IP4);
-        ADD_FME_KEY_FIELD(IPV4_SRC,    PPE_FIELD_OF10_IP4_SRC_ADDR, ipv4_src, 
-                          PPE_HEADER_IP4);
-        ADD_FME_KEY_FIELD(IPV4_DST,    PPE_FIELD_OF10_IP4_DST_ADDR, ipv4_dst, 
-                          PPE_HEADER_IP4);
-        ADD_FME_KEY_FIELD(TCP_SRC,     PPE_FIELD_OF10_L4_SRC_PORT,  tcp_src, 
-                          PPE_HEADER_L4);
-        ADD_FME_KEY_FIELD(TCP_DST,     PPE_FIELD_OF10_L4_DST_PORT,  tcp_dst, 
-                          PPE_HEADER_L4);
-        ADD_FME_KEY_FIELD(UDP_SRC,     PPE_FIELD_OF10_L4_SRC_PORT,  udp_src, 
-                          PPE_HEADER_L4);
-        ADD_FME_KEY_FIELD(UDP_DST,     PPE_FIELD_OF10_L4_DST_PORT,  udp_dst, 
-                          PPE_HEADER_L4);
-        ADD_FME_KEY_FIELD(SCTP_SRC,    PPE_FIELD_OF10_L4_SRC_PORT,  sctp_src, 
-                          PPE_HEADER_L4);
-        ADD_FME_KEY_FIELD(SCTP_DST,    PPE_FIELD_OF10_L4_DST_PORT,  sctp_dst, 
-                          PPE_HEADER_L4);
-        ADD_FME_KEY_FIELD(ICMPV4_TYPE, PPE_FIELD_OF10_ICMP_TYPE,    icmpv4_type, 
-                          PPE_HEADER_ICMP);
-        ADD_FME_KEY_FIELD(ICMPV4_CODE, PPE_FIELD_OF10_ICMP_CODE,    icmpv4_code, 
-                          PPE_HEADER_ICMP);
+        BIGLIST_FOREACH(ble, bl) {
+            p = BIGLIST_CAST(struct fme_flow_data *, ble);
+            if (p->of_list_action) {
+                ind_fwd_actions_release(p->of_list_action);
+            }
+            if (p->meter_id != 0) {
+                ind_fwd_meter_flow_detach(p->meter_id);
+            }
+            ind_fwd_flow_free(p);
+        }       
+        biglist_free(bl); 
+    }
 
+    if (st->tables != NULL) {
+        for (idx = 0; idx < n_tables; idx++) {
+            if (st->tables[idx].fme)    fme_destroy_all(st->tables[idx].fme);
+            if (st->tables[idx].exact)  ind_fwd_exact_destroy(st->tables[idx].exact);
+            if (st->tables[idx].flows)  INDIGO_MEM_FREE(st->tables[idx].flows);
+        }
+        INDIGO_MEM_FREE(st->tables);
     }
+    INDIGO_MEM_FREE(st);
+}
 
 
-    {
-        time_t   now;
-        uint16_t tmout;
+/** \brief Create the FME of table table_id */
 
-        time(&now);
+static indigo_error_t
+fwd_table_fme_create(fme_t **fme, unsigned table_id, unsigned max_flows)
+{
+    char name[32];
 
-        of_flow_add_hard_timeout_get(flow_add, &tmout);
-        if (tmout != 0) { 
+    snprintf(name, sizeof(name), "flowman flow table %u", table_id);
+    if (FME_FAILURE(fme_create(fme, name, max_flows))) { 
+        LOG_ERROR("fme_create() failed");
+        return (INDIGO_ERROR_RESOURCE);
+    }
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Allocate an empty flow table with every pipeline stage */
+
+static struct fwd_state *
+fwd_state_create(void)
+{
+    struct fwd_state *st;
+    struct fwd_table *tbl;
+    unsigned i;
+
+    if ((st = INDIGO_MEM_ALLOC(sizeof(*st))) == NULL) {
+        LOG_ERROR("INDIGO_MEM_ALLOC() failed");
+        return (NULL);
+    }
+    INDIGO_MEM_SET(st, 0, sizeof(*st));
+
+    st->tables = INDIGO_MEM_ALLOC(n_tables * sizeof(*st->tables));
+    if (st->tables == NULL) {
+        LOG_ERROR("INDIGO_MEM_ALLOC() failed");
+        goto error;
+    }
+    INDIGO_MEM_SET(st->tables, 0, n_tables * sizeof(*st->tables));
+
+    for (i = 0; i < n_tables; i++) {
+        tbl = &st->tables[i];
+        tbl->wc_prio_max = -1;
+
+        if (INDIGO_FAILURE(fwd_table_fme_create(&tbl->fme, i,
+                                                my_config->max_flows))) {
+            goto error;
+        }
+
+        if (INDIGO_FAILURE(ind_fwd_exact_create(&tbl->exact))) {
+            LOG_ERROR("ind_fwd_exact_create() failed");
+            goto error;
+        }
+
+        tbl->flows = INDIGO_MEM_ALLOC(my_config->max_flows
+                                      * sizeof(tbl->flows[0]));
+        if (tbl->flows == NULL) {
+            LOG_ERROR("INDIGO_MEM_ALLOC() failed");
+            goto error;
+        }
+        tbl->max_flows = my_config->max_flows;
+    }
+
+    return (st);
+
+ error:
+    fwd_state_destroy(st);
+    return (NULL);
+}
+
+
+/**
+ * \brief Move the wildcard flows of a table to a new FME
+ *
+ * On failure the flows moved so far go back, and the old FME is as it
+ * was.
+ */
+
+static indigo_error_t
+fwd_table_fme_move(struct fwd_table *tbl, fme_t *to)
+{
+    struct fme_flow_data *p;
+    unsigned i, j;
+
+    for (i = 0; i < tbl->active_count; i++) {
+        p = tbl->flows[i];
+        if (p->exact) {
+            continue;
+        }
+        fme_remove_entry(tbl->fme, p->fme_entry);
+        if (FME_FAILURE(fme_add_entry(to, p->fme_entry))) {
+            LOG_ERROR("fme_add_entry() failed");
+            for (j = 0; j <= i; j++) {
+                p = tbl->flows[j];
+                if (p->exact) {
+                    continue;
+                }
+                if (j < i) {
+                    fme_remove_entry(to, p->fme_entry);
+                }
+                (void)fme_add_entry(tbl->fme, p->fme_entry);
+            }
+            return (INDIGO_ERROR_RESOURCE);
+        }
+    }
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/**
+ * \brief Give every table of st room for max_flows flows
+ *
+ * Flows are moved to new FMEs between packets, so none is missed.
+ */
+
+static indigo_error_t
+fwd_state_resize(struct fwd_state *st, unsigned max_flows)
+{
+    struct fwd_table     *tbl;
+    fme_t                *fme;
+    struct fme_flow_data **flows;
+    unsigned             i;
+
+    for (i = 0; i < n_tables; i++) {
+        tbl = &st->tables[i];
+        flows = INDIGO_MEM_ALLOC(max_flows * sizeof(tbl->flows[0]));
+        if (flows == NULL) {
+            LOG_ERROR("INDIGO_MEM_ALLOC() failed");
+            return (INDIGO_ERROR_RESOURCE);
+        }
+        if (INDIGO_FAILURE(fwd_table_fme_create(&fme, i, max_flows))) {
+            INDIGO_MEM_FREE(flows);
+            return (INDIGO_ERROR_RESOURCE);
+        }
+        if (INDIGO_FAILURE(fwd_table_fme_move(tbl, fme))) {
+            fme_destroy_all(fme);
+            INDIGO_MEM_FREE(flows);
+            return (INDIGO_ERROR_RESOURCE);
+        }
+
+        /* Now empty */
+        fme_destroy_all(tbl->fme);
+        tbl->fme = fme;
+        INDIGO_MEM_COPY(flows, tbl->flows,
+                        tbl->active_count * sizeof(flows[0]));
+        INDIGO_MEM_FREE(tbl->flows);
+        tbl->flows = flows;
+        tbl->max_flows = max_flows;
+    }
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Free the swapped out table, once no datapath pass holds it */
+
+static void
+fwd_state_reclaim(void)
+{
+    fwd_state_destroy(fwd_retired);
+    fwd_retired = NULL;
+}
+
+
+/**
+ * \brief Allocate a flow, cleared
+ *
+ * An exact flow gets its compact key packed after the flow data, if
+ * the key can be packed; flow->ckey is left NULL otherwise.
+ */
+
+struct fme_flow_data *
+ind_fwd_flow_alloc(const fme_key_t *key, int exact)
+{
+    struct fme_flow_data *flow;
+    unsigned             key_size = exact ? ind_fwd_ckey_size(key) : 0;
+
+    /* Not INDIGO_MEM_ALLOC(), which doesn't align to a line */
+    if (posix_memalign((void **)&flow, FWD_CACHE_LINE,
+                       sizeof(*flow) + key_size) != 0) {
+        LOG_ERROR("posix_memalign() failed");
+        return (NULL);
+    }
+    INDIGO_MEM_SET(flow, 0, sizeof(*flow));
+
+    if (key_size != 0) {
+        flow->ckey = FWD_FLOW_CKEY(flow);
+        ind_fwd_ckey_pack(key, flow->ckey);
+    }
+
+    return (flow);
+}
+
+
+void
+ind_fwd_flow_free(struct fme_flow_data *flow)
+{
+    free(flow);
+}
+
+
+/** \brief Take a flow out of its table and free it */
+
+static void
+flow_table_remove(struct fwd_state *st, struct fme_flow_data *flow)
+{
+    struct fwd_table *tbl = &st->tables[flow->table_id];
+
+    if (flow->exact) {
+        ind_fwd_exact_remove(tbl->exact, flow);
+    } else {
+        fme_remove_entry(tbl->fme, flow->fme_entry); 
+        wc_prio_remove(st, tbl, flow->prio);
+        fme_entry_destroy(flow->fme_entry); 
+    }
+
+    /* @fixme Get duration from FME data? */
+
+    ind_fwd_actions_release(flow->of_list_action);
+
+    if (flow->meter_id != 0) {
+        ind_fwd_meter_flow_detach(flow->meter_id);
+    }
+
+    flow_id_dict_erase(st, flow->flow_id);
+
+    /* The last flow takes the freed slot */
+    --tbl->active_count;
+    tbl->flows[flow->table_idx] = tbl->flows[tbl->active_count];
+    tbl->flows[flow->table_idx]->table_idx = flow->table_idx;
+
+    ind_fwd_flow_free(flow);
+}
+
+
+/** \brief Whether flow a is a better one to evict than flow b */
+
+static int
+flow_evict_before(struct fme_flow_data *a, struct fme_flow_data *b)
+{
+    int prio_a = a->prio, prio_b = b->prio;
+
+    if (eviction == IND_FWD_EVICTION_IMPORTANCE && prio_a != prio_b) {
+        return (prio_a < prio_b);
+    }
+    if (a->last_hit != b->last_hit) {
+        return (a->last_hit < b->last_hit);
+    }
+    return (prio_a < prio_b);
+}
+
+
+/**
+ * \brief Evict a flow from a full table
+ *
+ * The victim is the best of a few flows picked at random, which takes
+ * the same time however big the table, and tells the state manager.
+ */
+
+static indigo_error_t
+flow_evict(struct fwd_state *st, struct fwd_table *tbl)
+{
+    struct fme_flow_data   *victim = NULL, *p;
+    indigo_fi_flow_stats_t flow_stats;
+    unsigned               i;
+
+    if (eviction == IND_FWD_EVICTION_NONE || tbl->active_count == 0) {
+        return (INDIGO_ERROR_RESOURCE);
+    }
+
+    for (i = 0; i < FWD_EVICT_SAMPLES; i++) {
+        /* xorshift32 */
+        evict_rand ^= evict_rand << 13;
+        evict_rand ^= evict_rand >> 17;
+        evict_rand ^= evict_rand << 5;
+        p = tbl->flows[evict_rand % tbl->active_count];
+        /* Retired flows go at the next swap anyway */
+        if (!p->retired && (victim == NULL || flow_evict_before(p, victim))) {
+            victim = p;
+        }
+    }
+    if (victim == NULL) {
+        return (INDIGO_ERROR_RESOURCE);
+    }
+
+    LOG_VERBOSE("Evicting flow 0x%" PRIx64 " from table %d",
+                victim->flow_id, victim->table_id);
+    INDIGO_MEM_SET(&flow_stats, 0, sizeof(flow_stats));
+    flow_stats.flow_id = victim->flow_id;
+    flow_stats.packets = victim->cnt_pkts;
+    flow_stats.bytes = victim->cnt_bytes;
+
+    flow_table_remove(st, victim);
+    ++tbl->evicted_count;
+
+    /* There is no eviction reason before OF 1.4 */
+    indigo_core_flow_removed(INDIGO_FLOW_REMOVED_DELETE, &flow_stats);
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/**
+ * \brief Add a flow, with its FME entry set up, to a table
+ *
+ * Exact flows with a compact key go to the exact tier if it takes
+ * them, dropping the FME entry; others get the key in their FME entry
+ * and go to the FME.  Either way the flow is entered in the flow id
+ * dictionary.
+ */
+
+static indigo_error_t
+flow_table_insert(struct fwd_state *st, struct fme_flow_data *flow,
+                  fme_key_t *key, int exact)
+{
+    struct fwd_table *tbl = &st->tables[flow->table_id];
+
+    /*
+     * Exact flows don't occupy the FME, so enforce the limit here.
+     * Restored flows are no one's to evict for.
+     */
+    if (tbl->active_count >= tbl->max_flows
+        && (flow->retired || INDIGO_FAILURE(flow_evict(st, tbl)))) {
+        LOG_ERROR("Flow table full");
+        return (INDIGO_ERROR_RESOURCE);
+    }
+
+    if (exact && flow->ckey != NULL
+        && INDIGO_SUCCESS(ind_fwd_exact_insert(tbl->exact, flow))) {
+        LOG_TRACE("Flow added to exact match tier");
+        fme_entry_destroy(flow->fme_entry);
+        flow->fme_entry = NULL;
+    } else {
+        flow->ckey = NULL;
+        fme_entry_key_set(flow->fme_entry, key);
+        if (FME_FAILURE(fme_add_entry(tbl->fme, flow->fme_entry))) {
+            LOG_ERROR("fme_add_entry() failed"); 
+            return (INDIGO_ERROR_UNKNOWN);
+        }
+        wc_prio_add(tbl, flow->prio);
+    }
+
+    flow_id_dict_insert(st, flow);
+    flow->table_idx = tbl->active_count;
+    tbl->flows[tbl->active_count++] = flow;
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/**
+ * \brief Add a flow read back from a snapshot to the live table
+ *
+ * The flow is retired at once: it forwards, but the state manager
+ * doesn't know it, so it can't be found by flow id and goes away at
+ * the next shadow swap.
+ */
+
+indigo_error_t
+ind_fwd_flow_restore(struct fme_flow_data *flow, fme_key_t *key, int exact)
+{
+    indigo_error_t rv;
+
+    if (flow->table_id >= n_tables) {
+        LOG_ERROR("Bad table id %d", flow->table_id);
+        return (INDIGO_ERROR_PARAM);
+    }
+    if (flow->goto_table != FWD_TABLE_NONE
+        && (flow->goto_table <= flow->table_id
+            || flow->goto_table >= n_tables)) {
+        LOG_ERROR("Bad goto table %d from table %d",
+                  flow->goto_table, flow->table_id);
+        return (INDIGO_ERROR_PARAM);
+    }
+
+    key->dumper = fme_key_dump_mkey__;
+    flow->fme_entry->cookie = flow;
+    if (INDIGO_FAILURE(rv = flow_table_insert(fwd_live, flow, key, exact))) {
+        return (rv);
+    }
+    flow->retired = 1;
+    ++fwd_live->retired_count;
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Call f on every flow of the live table */
+
+void
+ind_fwd_flow_foreach(void (*f)(struct fme_flow_data *flow, void *cookie),
+                     void *cookie)
+{
+    biglist_t *ble;
+    unsigned idx;
+
+    for (idx = 0; idx < FLOW_ID_HASH_TABLE_LEN; idx++) {
+        BIGLIST_FOREACH(ble, fwd_live->flow_id_ht[idx]) {
+            f(BIGLIST_CAST(struct fme_flow_data *, ble), cookie);
+        }
+    }
+}
+
+
+/**
+ * \brief Remove the flows pick selects, telling the state manager
+ *
+ * For flows left naming a deleted group or meter.  While a shadow is
+ * built, live flows are retired instead, as a flow delete would do;
+ * they let go of their meter at once.  Returns the number removed.
+ */
+
+unsigned
+ind_fwd_flows_remove(int (*pick)(struct fme_flow_data *flow, void *cookie),
+                     void *cookie)
+{
+    struct fwd_state       *states[2] = { fwd_shadow, fwd_live }, *st;
+    struct fwd_table       *tbl;
+    struct fme_flow_data   *p;
+    indigo_fi_flow_stats_t flow_stats;
+    unsigned               s, table_id, i, n = 0;
+
+    for (s = 0; s < 2; s++) {
+        if ((st = states[s]) == NULL) {
+            continue;
+        }
+        for (table_id = 0; table_id < n_tables; table_id++) {
+            tbl = &st->tables[table_id];
+
+            /* Downward, as the last flow takes a removed flow's slot */
+            for (i = tbl->active_count; i-- > 0; ) {
+                p = tbl->flows[i];
+                if (p->retired || !pick(p, cookie)) {
+                    continue;
+                }
+
+                INDIGO_MEM_SET(&flow_stats, 0, sizeof(flow_stats));
+                flow_stats.flow_id = p->flow_id;
+                flow_stats.packets = p->cnt_pkts;
+                flow_stats.bytes = p->cnt_bytes;
+
+                if (st == fwd_live && fwd_shadow != NULL) {
+                    p->retired = 1;
+                    ++st->retired_count;
+                    if (p->meter_id != 0) {
+                        ind_fwd_meter_flow_detach(p->meter_id);
+                        p->meter_id = 0;
+                    }
+                } else {
+                    flow_table_remove(st, p);
+                }
+                ++n;
+
+                indigo_core_flow_removed(INDIGO_FLOW_REMOVED_DELETE,
+                                         &flow_stats);
+            }
+        }
+    }
+
+    return (n);
+}
+
+
+/** \brief Hash of what identifies a flow across a swap */
+
+static uint32_t
+flow_carry_hash(struct fme_flow_data *p)
+{
+    fme_key_t       scratch;
+    const fme_key_t *key = ind_fwd_flow_key(p, &scratch);
+
+    return murmur_hash(key->values, key->size,
+                       (uint32_t)p->cookie ^ (uint32_t)(p->cookie >> 32)
+                       ^ ((uint32_t)p->prio << 8) ^ p->table_id);
+}
+
+/** \brief True if two flows have the same table, cookie, priority and match */
+
+static int
+flow_carry_same(struct fme_flow_data *a, struct fme_flow_data *b)
+{
+    fme_key_t       scratch_a, scratch_b;
+    const fme_key_t *ka, *kb;
+
+    if (a->table_id != b->table_id || a->cookie != b->cookie
+        || a->prio != b->prio) {
+        return 0;
+    }
+    ka = ind_fwd_flow_key(a, &scratch_a);
+    kb = ind_fwd_flow_key(b, &scratch_b);
+
+    return (ka->keymask == kb->keymask && ka->size == kb->size
+            && memcmp(ka->values, kb->values, ka->size) == 0
+            && memcmp(ka->masks, kb->masks, ka->size) == 0);
+}
+
+
+/**
+ * \brief Give flows of the new table the counters of their old selves
+ *
+ * Old flows, retired ones included, are hashed into a scratch open
+ * addressing table, which each new flow probes once.  Returns how many
+ * flows had counters carried over.
+ */
+
+static unsigned
+flow_counters_carry(struct fwd_state *to, struct fwd_state *from)
+{
+    struct fme_flow_data **slots, *p, *q;
+    biglist_t *ble;
+    unsigned n = 0, size = 64, mask, i, idx, carried = 0;
+
+    for (idx = 0; idx < n_tables; idx++) {
+        n += from->tables[idx].active_count;
+    }
+    while (size < 2 * n) {
+        size *= 2;
+    }
+    mask = size - 1;
+
+    if ((slots = INDIGO_MEM_ALLOC(size * sizeof(slots[0]))) == NULL) {
+        LOG_ERROR("INDIGO_MEM_ALLOC() failed, flow counters not carried");
+        return (0);
+    }
+    INDIGO_MEM_SET(slots, 0, size * sizeof(slots[0]));
+
+    for (idx = 0; idx < FLOW_ID_HASH_TABLE_LEN; idx++) {
+        BIGLIST_FOREACH(ble, from->flow_id_ht[idx]) {
+            p = BIGLIST_CAST(struct fme_flow_data *, ble);
+            for (i = flow_carry_hash(p) & mask; slots[i] != NULL;
+                 i = (i + 1) & mask);
+            slots[i] = p;
+        }
+    }
+
+    for (idx = 0; idx < FLOW_ID_HASH_TABLE_LEN; idx++) {
+        BIGLIST_FOREACH(ble, to->flow_id_ht[idx]) {
+            p = BIGLIST_CAST(struct fme_flow_data *, ble);
+            for (i = flow_carry_hash(p) & mask; (q = slots[i]) != NULL;
+                 i = (i + 1) & mask) {
+                if (flow_carry_same(p, q)) {
+                    p->cnt_pkts += q->cnt_pkts;
+                    p->cnt_bytes += q->cnt_bytes;
+                    if (q->last_hit > p->last_hit) {
+                        p->last_hit = q->last_hit;
+                    }
+                    ++carried;
+                    break;
+                }
+            }
+        }
+    }
+
+    INDIGO_MEM_FREE(slots);
+
+    return (carried);
+}
+
+
+/** \brief True if no OF 1.0 match field is wildcarded */
+
+static int
+of_match_is_exact(of_match_t *of_match)
+{
+    return (OF_MATCH_MASK_IN_PORT_EXACT_TEST(of_match)
+            && OF_MATCH_MASK_ETH_SRC_EXACT_TEST(of_match)
+            && OF_MATCH_MASK_ETH_DST_EXACT_TEST(of_match)
+            && OF_MATCH_MASK_VLAN_VID_EXACT_TEST(of_match)
+            && OF_MATCH_MASK_VLAN_PCP_EXACT_TEST(of_match)
+            && OF_MATCH_MASK_ETH_TYPE_EXACT_TEST(of_match)
+            && OF_MATCH_MASK_IP_DSCP_EXACT_TEST(of_match)
+            && OF_MATCH_MASK_IP_PROTO_EXACT_TEST(of_match)
+            && OF_MATCH_MASK_IPV4_SRC_EXACT_TEST(of_match)
+            && OF_MATCH_MASK_IPV4_DST_EXACT_TEST(of_match)
+            && OF_MATCH_MASK_TCP_SRC_EXACT_TEST(of_match)
+            && OF_MATCH_MASK_TCP_DST_EXACT_TEST(of_match));
+}
+
+
+/**
+ * \brief Split an OF 1.1+ instruction list into actions and goto target
+ *
+ * Apply-actions becomes the flow's action list (an empty one if absent);
+ * goto-table must point forward, to a table that exists.  A meter
+ * instruction sets *meter_id, which is otherwise 0.
+ */
+
+static indigo_error_t
+flow_instructions_parse(of_list_instruction_t *of_list_instruction,
+                        uint8_t table_id,
+                        of_list_action_t **of_list_action,
+                        uint8_t *goto_table,
+                        uint32_t *meter_id)
+{
+    indigo_error_t   result = INDIGO_ERROR_NONE;
+    of_instruction_t of_instruction[1];
+    uint8_t          next_table_id;
+    int              rv;
+
+    *of_list_action = NULL;
+    *goto_table = FWD_TABLE_NONE;
+    *meter_id = 0;
+
+    OF_LIST_INSTRUCTION_ITER(of_list_instruction, of_instruction, rv) {
+        switch (of_instruction->header.object_id) {
+        case OF_INSTRUCTION_APPLY_ACTIONS:
+            if (*of_list_action != NULL) {
+                of_list_action_delete(*of_list_action);
+            }
+            *of_list_action = of_instruction_apply_actions_actions_get(
+                &of_instruction->apply_actions);
+            if (*of_list_action == NULL) {
+                LOG_ERROR("of_instruction_apply_actions_actions_get() failed");
+                result = INDIGO_ERROR_UNKNOWN;
+                goto done;
+            }
+            break;
+
+        case OF_INSTRUCTION_GOTO_TABLE:
+            of_instruction_goto_table_table_id_get(&of_instruction->goto_table,
+                                                   &next_table_id);
+            if (next_table_id <= table_id || next_table_id >= n_tables) {
+                LOG_ERROR("Bad goto table %d from table %d",
+                          next_table_id, table_id);
+                result = INDIGO_ERROR_PARAM;
+                goto done;
+            }
+            *goto_table = next_table_id;
+            break;
+
+        case OF_INSTRUCTION_METER:
+            of_instruction_meter_meter_id_get(&of_instruction->meter,
+                                              meter_id);
+            break;
+
+        default:
+            LOG_ERROR("Unsupported instruction: %s",
+                      of_object_id_str[of_instruction->header.object_id]);
+            result = INDIGO_ERROR_NOT_SUPPORTED;
+            goto done;
+        }
+    }
+
+    if (rv != OF_ERROR_NONE && rv != OF_ERROR_RANGE) {
+        LOG_ERROR("of_list_instruction_first/next() failed");
+        result = INDIGO_ERROR_PARAM;
+        goto done;
+    }
+
+    if (*of_list_action == NULL) {
+        *of_list_action = of_list_action_new(of_list_instruction->version);
+        if (*of_list_action == NULL) {
+            LOG_ERROR("of_list_action_new() failed");
+            result = INDIGO_ERROR_RESOURCE;
+        }
+    }
+
+ done:
+    if (INDIGO_FAILURE(result) && *of_list_action != NULL) {
+        of_list_action_delete(*of_list_action);
+        *of_list_action = NULL;
+    }
+
+    return result;
+}
+
+
+/** \brief Create a flow and issue the core callback */
+
+void
+ind_fwd_flow_create_apply(indigo_cookie_t flow_id,
+                          of_flow_add_t   *flow_add,
+                          indigo_cookie_t callback_cookie)
+{
+    indigo_error_t       result          = INDIGO_ERROR_NONE;
+    fme_entry_t*          fme_entry       = 0;
+    struct fme_flow_data *fme_flow_data  = 0;
+    of_list_action_t     *of_list_action = 0;
+    uint16_t             pri;
+    uint8_t              table_id = 0;
+    uint32_t             meter_id = 0;
+    uint64_t             cookie;
+    uint8_t              goto_table = FWD_TABLE_NONE;
+    struct fwd_state     *st = fwd_shadow != NULL ? fwd_shadow : fwd_live;
+    of_match_t           of_match[1];
+    fme_key_t           fme_key; 
+    extern int fme_oc_printf(void*, const char*, ...); 
+
+    LOG_TRACE("Flow create called");
+
+    of_flow_add_priority_get(flow_add, &pri);
+    of_flow_add_cookie_get(flow_add, &cookie);
+    if (LOXI_FAILURE(of_flow_add_match_get(flow_add,
+                                           of_match
+                                           )
+                     )
+        ) {
+        LOG_ERROR("of_flow_add_match_get() failed");
+        result = INDIGO_ERROR_UNKNOWN;
+        goto done;
+    }
+    if (flow_add->version >= OF_VERSION_1_1) {
+        of_list_instruction_t of_list_instruction[1];
+
+        of_flow_add_table_id_get(flow_add, &table_id);
+        if (table_id >= n_tables) {
+            LOG_ERROR("Bad table id %d", table_id);
+            result = INDIGO_ERROR_PARAM;
+            goto done;
+        }
+        of_flow_add_instructions_bind(flow_add, of_list_instruction);
+        if (INDIGO_FAILURE(result = flow_instructions_parse(
+                               of_list_instruction, table_id,
+                               &of_list_action,
+                               &goto_table,
+                               &meter_id))) {
+            goto done;
+        }
+    } else {
+        of_list_action = of_flow_add_actions_get(flow_add);
+        if (of_list_action == NULL) {
+            LOG_ERROR("of_flow_add_actions_get() failed");
+            result = INDIGO_ERROR_UNKNOWN;
+            goto done;
+        }
+    }
+
+    FME_MEMSET(&fme_key, 0, sizeof(fme_key)); 
+
+    /*
+     * We use the OF10 header as the key. 
+     */
+    fme_key.size = ppe_field_info_table[PPE_FIELD_OF10_LAST].offset_bytes; 
+    fme_key.dumper = fme_key_dump_mkey__; 
+    
+    /* For each match field F,
+       if F is specified (i.e. not wildcarded),
+       add it to the FME key. 
+    */
+
+#define ADD_FME_KEY_FIELD(u, v, w, ph)                                  \
+    if (OF_MATCH_MASK_ ## u ## _ACTIVE_TEST(of_match)) {                \
+        ppe_field_set_header(fme_key.values, v,                         \
+                             (of_match->fields. w) & (of_match->masks. w)); \
+        ppe_field_set_header(fme_key.masks, v, of_match->masks. w);     \
+        fme_key.keymask |= (1<<ph);                                     \
+    }                                                                     
+    
+#define ADD_FME_KEY_MAC_ADDR(u, v, w)                                   \
+    do {                                                                \
+        if (OF_MATCH_MASK_ ## u ## _ACTIVE_TEST(of_match)) {            \
+            of_mac_addr_t masked_value;                                 \
+            int idx;                                                    \
+            for (idx = 0; idx < OF_MAC_ADDR_BYTES; idx++) {             \
+                masked_value.addr[idx] = (of_match->masks. w .addr)[idx] & \
+                    (of_match->fields. w .addr)[idx];                   \
+            }                                                           \
+            ppe_wide_field_set_header(fme_key.values, v, masked_value.addr); \
+            ppe_wide_field_set_header(fme_key.masks, v, of_match->masks. w .addr); \
+            fme_key.keymask |= (1<<PPE_HEADER_ETHERNET);                \
+        }                                                                   \
+    } while (0)
+
+    /** \todo Non-canonical flows? */
+    
+    ADD_FME_KEY_FIELD(IN_PORT,    PPE_FIELD_OF10_INGRESS_PORT,  in_port, 
+                      PPE_HEADER_META);
+    ADD_FME_KEY_MAC_ADDR(ETH_SRC, PPE_FIELD_OF10_ETHER_SRC_MAC, eth_src);
+    ADD_FME_KEY_MAC_ADDR(ETH_DST, PPE_FIELD_OF10_ETHER_DST_MAC, eth_dst);
+
+    if (OF_MATCH_MASK_VLAN_VID_ACTIVE_TEST(of_match)) {
+        if (OF_MATCH_MASK_VLAN_VID_EXACT_TEST(of_match)
+            && (of_match->fields.vlan_vid 
+                == OF_MATCH_UNTAGGED_VLAN_ID(flow_add->version)
+                )
+            ) {
+
+            /* Match untagged packets */
+            ppe_field_set_header(fme_key.values, PPE_FIELD_OF10_PACKET_FORMAT, 
+                                 PPE_HEADER_ETHERII); 
+            ppe_field_set_header(fme_key.masks, PPE_FIELD_OF10_PACKET_FORMAT, 
+                                 -1);
+        } else {
+            /* Match tagged packets */
+            ppe_field_set_header(fme_key.values, PPE_FIELD_OF10_PACKET_FORMAT, 
+                                 PPE_HEADER_8021Q); 
+            ppe_field_set_header(fme_key.masks, PPE_FIELD_OF10_PACKET_FORMAT, 
+                                 -1); 
+            ADD_FME_KEY_FIELD(VLAN_VID, PPE_FIELD_OF10_VLAN, vlan_vid, 
+                              PPE_HEADER_8021Q);
+            ADD_FME_KEY_FIELD(VLAN_PCP, PPE_FIELD_OF10_PRI,  vlan_pcp, 
+                              PPE_HEADER_8021Q);
+        }
+    }
+
+    ADD_FME_KEY_FIELD(ETH_TYPE,    PPE_FIELD_OF10_ETHER_TYPE, eth_type, 
+                      PPE_HEADER_ETHER);
+
+    /**
+     * Special case handling for Arp packets. 
+     *
+     * When a flowmod is specified with ethertype == ARP there is a 
+     * special interpretation of the source/dest/protocol fields in 
+     * the flowmod. 
+     *
+     * For IPv4 ARP flows the following mapping should be performed:
+     *    NW_PROTO -> ARP OPERATION
+     *    NW_SRC -> ARP Source Protocol Address
+     *    NW_DST -> ARP Target Protocol Address. 
+     *
+     * This applies to ARP Protocol Type == 0x800 only, so an implicit
+     * qualification on this must also be added. 
+     *
+     * @fixme constants
+     */
+    if (OF_MATCH_MASK_ETH_TYPE_ACTIVE_TEST(of_match) && 
+        of_match->fields.eth_type == 0x0806 &&
+        of_match->masks.eth_type == 0xffff) {
+
+        ppe_field_set_header(fme_key.values, PPE_FIELD_OF10_ARP_PTYPE, 
+                             0x0800); 
+        ppe_field_set_header(fme_key.masks,  PPE_FIELD_OF10_ARP_PTYPE, 
+                             0xFFFF); 
+        ADD_FME_KEY_FIELD(IPV4_SRC, PPE_FIELD_OF10_ARP_SPA, ipv4_src, 
+                          PPE_HEADER_ARP); 
+        ADD_FME_KEY_FIELD(IPV4_DST, PPE_FIELD_OF10_ARP_TPA, ipv4_dst, 
+                          PPE_HEADER_ARP); 
+        ADD_FME_KEY_FIELD(IP_PROTO, PPE_FIELD_OF10_ARP_OPERATION, ip_proto, 
+                          PPE_HEADER_ARP); 
+        
+    }
+    
+    /**
+     * Special case LLC/SNAP Processing. 
+     *
+     * If the specified ethertype is 0x5FF, then match
+     * all Non-ethertype packets (LLC-only, or SNAP with OUI != 0). 
+     * 
+     * In this case we merely qualify the headermask with ETHERTYPE_MISSING. 
+     * 
+     */
+    else if(OF_MATCH_MASK_ETH_TYPE_ACTIVE_TEST(of_match) && 
+            of_match->fields.eth_type == 0x5FF) { 
+        fme_key.keymask = (1<<PPE_HEADER_ETHERTYPE_MISSING); 
+        ppe_field_set_header(fme_key.values, PPE_FIELD_OF10_ETHER_TYPE, 0);
+        ppe_field_set_header(fme_key.masks, PPE_FIELD_OF10_ETHER_TYPE, 0);
+    }
+
+    /**
+     * Normal field mapping applies. 
+     */
+    else {
+
+        ADD_FME_KEY_FIELD(IP_DSCP,     PPE_FIELD_OF10_IP4_TOS,      ip_dscp, 
+                          PPE_HEADER_IP4);
+        ADD_FME_KEY_FIELD(IP_PROTO,    PPE_FIELD_OF10_IP4_PROTO,   ip_proto, 
+                          PPE_HEADER_IP4);
+        ADD_FME_KEY_FIELD(IPV4_SRC,    PPE_FIELD_OF10_IP4_SRC_ADDR, ipv4_src, 
+                          PPE_HEADER_IP4);
+        ADD_FME_KEY_FIELD(IPV4_DST,    PPE_FIELD_OF10_IP4_DST_ADDR, ipv4_dst, 
+                          PPE_HEADER_IP4);
+        ADD_FME_KEY_FIELD(TCP_SRC,     PPE_FIELD_OF10_L4_SRC_PORT,  tcp_src, 
+                          PPE_HEADER_L4);
+        ADD_FME_KEY_FIELD(TCP_DST,     PPE_FIELD_OF10_L4_DST_PORT,  tcp_dst, 
+                          PPE_HEADER_L4);
+        ADD_FME_KEY_FIELD(UDP_SRC,     PPE_FIELD_OF10_L4_SRC_PORT,  udp_src, 
+                          PPE_HEADER_L4);
+        ADD_FME_KEY_FIELD(UDP_DST,     PPE_FIELD_OF10_L4_DST_PORT,  udp_dst, 
+                          PPE_HEADER_L4);
+        ADD_FME_KEY_FIELD(SCTP_SRC,    PPE_FIELD_OF10_L4_SRC_PORT,  sctp_src, 
+                          PPE_HEADER_L4);
+        ADD_FME_KEY_FIELD(SCTP_DST,    PPE_FIELD_OF10_L4_DST_PORT,  sctp_dst, 
+                          PPE_HEADER_L4);
+        ADD_FME_KEY_FIELD(ICMPV4_TYPE, PPE_FIELD_OF10_ICMP_TYPE,    icmpv4_type, 
+                          PPE_HEADER_ICMP);
+        ADD_FME_KEY_FIELD(ICMPV4_CODE, PPE_FIELD_OF10_ICMP_CODE,    icmpv4_code, 
+                          PPE_HEADER_ICMP);
+
+    }
+
+
+    /* Exact flows keep the key compact, in the flow's allocation */
+    fme_flow_data = ind_fwd_flow_alloc(&fme_key, of_match_is_exact(of_match));
+    if (fme_flow_data == NULL) {
+        result = INDIGO_ERROR_RESOURCE;
+        goto done;
+    }
+    fme_flow_data->cookie = cookie;
+    fme_flow_data->goto_table = goto_table;
+    fme_flow_data->table_id = table_id;
+
+    /* Held by the flow from here, freed with it */
+    fme_flow_data->of_list_action = ind_fwd_actions_intern(of_list_action);
+    of_list_action = 0;
+    if (fme_flow_data->of_list_action == NULL) {
+        result = INDIGO_ERROR_RESOURCE;
+        goto done;
+    }
+
+    if (meter_id != 0) {
+        if (INDIGO_FAILURE(result = ind_fwd_meter_flow_attach(meter_id))) {
+            goto done;
+        }
+        fme_flow_data->meter_id = meter_id;
+    }
+
+
+    LOG_TRACE("Adding flow to FME");
+    if (FME_FAILURE(fme_entry_create(&fme_entry))) {
+        LOG_ERROR("fme_entry_create() failed");
+        result = INDIGO_ERROR_UNKNOWN; /** \todo Check for table overflow? */
+        goto done;
+    }
+
+    fme_entry->prio = pri; 
+    fme_entry->cookie = fme_flow_data; 
+    fme_flow_data->fme_entry = fme_entry;
+    fme_flow_data->prio = pri;
+    
+    {
+        time_t   now;
+        uint16_t tmout;
+
+        time(&now);
+
+        of_flow_add_hard_timeout_get(flow_add, &tmout);
+        if (tmout != 0) { 
             fme_entry->absolute_timeout = now + tmout; 
+            fme_flow_data->hard_expiry = now + tmout;
         }
         of_flow_add_idle_timeout_get(flow_add, &tmout);
         if (tmout != 0) { 
             fme_entry->relative_timeout = tmout; 
+            fme_flow_data->idle_timeout = tmout;
         }
-    }
-
-    fme_entry_key_set(fme_entry, &fme_key); 
-    if(FME_FAILURE(fme_add_entry(fme, fme_entry))) {
-        LOG_ERROR("fme_add_entry() failed"); 
-        result = INDIGO_ERROR_UNKNOWN; 
-        goto done; 
+        fme_flow_data->last_hit = now;
     }
 
     fme_flow_data->flow_id = flow_id;
 
-    flow_id_dict_insert(fme_flow_data);
-    
-    ++active_count;
+    if (INDIGO_FAILURE(result = flow_table_insert(st, fme_flow_data, &fme_key,
+                                                  of_match_is_exact(of_match)))) {
+        goto done;
+    }
 
 
  done:
     if (INDIGO_FAILURE(result)) {
         if (of_list_action)  of_list_action_delete(of_list_action);
         if (fme_entry)       fme_entry_destroy(fme_entry);
-        if (fme_flow_data)   INDIGO_MEM_FREE(fme_flow_data);
+        if (fme_flow_data && fme_flow_data->of_list_action) {
+            ind_fwd_actions_release(fme_flow_data->of_list_action);
+        }
+        if (fme_flow_data) {
+            if (fme_flow_data->meter_id) {
+                ind_fwd_meter_flow_detach(fme_flow_data->meter_id);
+            }
+            ind_fwd_flow_free(fme_flow_data);
+        }
     }
 
     indigo_core_flow_create_callback(result,
                                      flow_id,
-                                     0, /* @FIXME hardcoded table id */
+                                     table_id,
                                      callback_cookie);
 }
 
 
-/** \brief Modify a flow */
+/** \brief Modify a flow and issue the core callback */
 
 void
-indigo_fwd_flow_modify(indigo_cookie_t flow_id,
-                       of_flow_modify_t *flow_modify,
-                       indigo_cookie_t callback_cookie)
+ind_fwd_flow_modify_apply(indigo_cookie_t flow_id,
+                          of_flow_modify_t *flow_modify,
+                          indigo_cookie_t callback_cookie)
 {
     indigo_error_t       result = INDIGO_ERROR_NONE;
     struct fme_flow_data *fme_flow_data;
+    struct fwd_state     *st;
     of_list_action_t     *of_list_action = 0, *old_of_list_action;
 
-    if ((fme_flow_data = flow_id_dict_find(flow_id)) == 0) {
+    if ((fme_flow_data = flow_find(flow_id, &st)) == 0) {
        LOG_ERROR("Flow not found");
        result = INDIGO_ERROR_NOT_FOUND;
        goto done;
@@ -559,21 +1478,54 @@ indigo_fwd_flow_modify(indigo_cookie_t flow_id,
     /* @todo Fill in flow_modify if non-NULL */
     LOG_TRACE("Flow modify called\n");
 
-    of_list_action = of_flow_modify_strict_actions_get(flow_modify);
-    if (of_list_action == NULL) {
-        LOG_ERROR("of_flow_modify_actions_get() failed to get actions");
-        result = INDIGO_ERROR_UNKNOWN;
-        goto done;
+    if (flow_modify->version >= OF_VERSION_1_1) {
+        of_list_instruction_t of_list_instruction[1];
+        uint8_t goto_table;
+        uint32_t meter_id;
+
+        of_flow_modify_strict_instructions_bind(flow_modify,
+                                                of_list_instruction);
+        if (INDIGO_FAILURE(result = flow_instructions_parse(
+                               of_list_instruction,
+                               fme_flow_data->table_id,
+                               &of_list_action, &goto_table, &meter_id))) {
+            goto done;
+        }
+        if (meter_id != fme_flow_data->meter_id) {
+            if (meter_id != 0
+                && INDIGO_FAILURE(result = ind_fwd_meter_flow_attach(meter_id))) {
+                goto done;
+            }
+            if (fme_flow_data->meter_id != 0) {
+                ind_fwd_meter_flow_detach(fme_flow_data->meter_id);
+            }
+            fme_flow_data->meter_id = meter_id;
+        }
+        fme_flow_data->goto_table = goto_table;
+    } else {
+        of_list_action = of_flow_modify_strict_actions_get(flow_modify);
+        if (of_list_action == NULL) {
+            LOG_ERROR("of_flow_modify_actions_get() failed to get actions");
+            result = INDIGO_ERROR_UNKNOWN;
+            goto done;
+        }
     }
 
+    /* Unchanged actions intern to the list the flow already holds */
     old_of_list_action = fme_flow_data->of_list_action;
-    fme_flow_data->of_list_action = of_list_action;
-    of_list_action_delete(old_of_list_action);  /* Free old action list */
+    fme_flow_data->of_list_action = ind_fwd_actions_intern(of_list_action);
+    of_list_action = 0;
+    if (fme_flow_data->of_list_action == NULL) {
+        fme_flow_data->of_list_action = old_of_list_action;
+        result = INDIGO_ERROR_RESOURCE;
+        goto done;
+    }
+    ind_fwd_actions_release(old_of_list_action);
 
     /** \todo Clear flow stats? */
 
  done:
-    if (INDIGO_FAILURE(result)) {
+    if (INDIGO_FAILURE(result) && of_list_action) {
         of_list_action_delete(of_list_action);
     }
 
@@ -581,17 +1533,18 @@ indigo_fwd_flow_modify(indigo_cookie_t flow_id,
 }
 
 
-/** \brief Delete a flow */
+/** \brief Delete a flow and issue the core callback */
 
 void
-indigo_fwd_flow_delete(indigo_cookie_t flow_id,
-                       indigo_cookie_t callback_cookie)
+ind_fwd_flow_delete_apply(indigo_cookie_t flow_id,
+                          indigo_cookie_t callback_cookie)
 {
     indigo_error_t   result = INDIGO_ERROR_NONE;
     struct fme_flow_data *fme_flow_data;
+    struct fwd_state *st;
     indigo_fi_flow_stats_t flow_stats;
 
-    if ((fme_flow_data = flow_id_dict_find(flow_id)) == 0) {
+    if ((fme_flow_data = flow_find(flow_id, &st)) == 0) {
        LOG_INFO("Request to delete non-existent flow");
        result = INDIGO_ERROR_NOT_FOUND;
        goto done;
@@ -601,23 +1554,93 @@ indigo_fwd_flow_delete(indigo_cookie_t flow_id,
     flow_stats.bytes = fme_flow_data->cnt_bytes;
     flow_stats.flow_id = flow_id;
 
-    fme_remove_entry(fme, fme_flow_data->fme_entry); 
-    fme_entry_destroy(fme_flow_data->fme_entry); 
+    /*
+     * While a shadow is built, live flows keep forwarding until the
+     * swap and are reclaimed with the rest of the old table.
+     */
+    if (st == fwd_live && fwd_shadow != NULL) {
+        fme_flow_data->retired = 1;
+        ++st->retired_count;
+        goto done;
+    }
 
-    /* @fixme Get duration from FME data? */
+    flow_table_remove(st, fme_flow_data);
 
-    of_list_action_delete(fme_flow_data->of_list_action);
+  done:
+    indigo_core_flow_delete_callback(result, &flow_stats,
+                                     callback_cookie);
 
-    flow_id_dict_erase(flow_id);
+}
 
-    INDIGO_MEM_FREE(fme_flow_data);
 
-    --active_count;
+/** \brief Create a flow, through the flow mod queue or open batch */
 
-  done:
-    indigo_core_flow_delete_callback(result, &flow_stats,
-                                     callback_cookie);
+void
+indigo_fwd_flow_create(indigo_cookie_t flow_id,
+                       of_flow_add_t   *flow_add,
+                       indigo_cookie_t callback_cookie)
+{
+    indigo_error_t result;
+
+    if (!ind_fwd_flowq_enabled()) {
+        ind_fwd_flow_create_apply(flow_id, flow_add, callback_cookie);
+        return;
+    }
+
+    if (INDIGO_FAILURE(result = ind_fwd_flowq_push(
+                           FWD_FLOWQ_ADD, flow_id, (of_object_t *)flow_add,
+                           callback_cookie))) {
+        indigo_core_flow_create_callback(result, flow_id, 0,
+                                         callback_cookie);
+    }
+}
+
+
+/** \brief Modify a flow, through the flow mod queue or open batch */
+
+void
+indigo_fwd_flow_modify(indigo_cookie_t flow_id,
+                       of_flow_modify_t *flow_modify,
+                       indigo_cookie_t callback_cookie)
+{
+    indigo_error_t result;
+
+    if (!ind_fwd_flowq_enabled()) {
+        ind_fwd_flow_modify_apply(flow_id, flow_modify, callback_cookie);
+        return;
+    }
+
+    if (INDIGO_FAILURE(result = ind_fwd_flowq_push(
+                           FWD_FLOWQ_MODIFY, flow_id,
+                           (of_object_t *)flow_modify, callback_cookie))) {
+        indigo_core_flow_modify_callback(result, NULL, callback_cookie);
+    }
+}
+
+
+/** \brief Delete a flow, through the flow mod queue or open batch */
+
+void
+indigo_fwd_flow_delete(indigo_cookie_t flow_id,
+                       indigo_cookie_t callback_cookie)
+{
+    indigo_error_t result;
+
+    if (!ind_fwd_flowq_enabled()) {
+        ind_fwd_flow_delete_apply(flow_id, callback_cookie);
+        return;
+    }
+
+    if (INDIGO_FAILURE(result = ind_fwd_flowq_push(
+                           FWD_FLOWQ_DELETE, flow_id, NULL,
+                           callback_cookie))) {
+        indigo_fi_flow_stats_t flow_stats;
 
+        INDIGO_MEM_SET(&flow_stats, 0, sizeof(flow_stats));
+        flow_stats.flow_id = flow_id;
+        indigo_core_flow_delete_callback(result, &flow_stats,
+                                         callback_cookie);
+    }
 }
 
 
@@ -629,9 +1652,12 @@ indigo_fwd_flow_stats_get(indigo_cookie_t flow_id,
 {
     indigo_error_t result = INDIGO_ERROR_NONE;
     struct fme_flow_data *fme_flow_data;
+    struct fwd_state *st;
     indigo_fi_flow_stats_t flow_stats;
 
-    if ((fme_flow_data = flow_id_dict_find(flow_id)) == 0) {
+    ind_fwd_flowq_drain();
+
+    if ((fme_flow_data = flow_find(flow_id, &st)) == 0) {
        LOG_ERROR("Flow not found");
        result = INDIGO_ERROR_NOT_FOUND;
        goto done;
@@ -663,9 +1689,13 @@ indigo_fwd_table_stats_get(of_table_stats_request_t *table_stats_request,
     of_version_t version;
     uint32_t xid;
     of_table_name_t table_name;
+    struct fwd_table *tbl;
+    unsigned table_id;
 
     version = table_stats_request->version;
 
+    ind_fwd_flowq_drain();
+
     table_stats_reply = of_table_stats_reply_new(version);
     if (table_stats_reply == NULL) {
         LOG_ERROR("of_list_table_stats_reply_new() failed");
@@ -688,25 +1718,34 @@ indigo_fwd_table_stats_get(of_table_stats_request_t *table_stats_request,
     of_table_stats_request_xid_get(table_stats_request, &xid);
     of_table_stats_reply_xid_set(table_stats_reply, xid);
 
-    of_table_stats_entry_table_id_set(of_table_stats_entry, 0);
-    FORWARDING_MEMSET(table_name, 0, sizeof(table_name));
-    strcpy(table_name, "Table 0");
-    of_table_stats_entry_name_set(of_table_stats_entry, table_name);
-    {
-        const of_wc_bmap_t of_wc_bmap = 0x3fffff; /* All wildcards */
-        of_table_stats_entry_wildcards_set(of_table_stats_entry, of_wc_bmap);
-    }
-    of_table_stats_entry_max_entries_set(of_table_stats_entry,
-                                         my_config->max_flows);
-    /* NOTE:  Active count is overridden by state manager */
-    of_table_stats_entry_active_count_set(of_table_stats_entry, active_count);
-    of_table_stats_entry_lookup_count_set(of_table_stats_entry, lookup_count);
-    of_table_stats_entry_matched_count_set(of_table_stats_entry, matched_count);
-    
-    if (LOXI_FAILURE(of_list_table_stats_entry_append(of_list_table_stats_entry, of_table_stats_entry))) {
-        LOG_ERROR("of_list_table_state_entry_append() failed");
-        result = INDIGO_ERROR_UNKNOWN;
-        goto done;
+    /* The entry is copied on append, so it is reused for every table */
+    for (table_id = 0; table_id < n_tables; table_id++) {
+        tbl = &fwd_live->tables[table_id];
+
+        of_table_stats_entry_table_id_set(of_table_stats_entry, table_id);
+        FORWARDING_MEMSET(table_name, 0, sizeof(table_name));
+        snprintf(table_name, sizeof(table_name), "Table %u", table_id);
+        of_table_stats_entry_name_set(of_table_stats_entry, table_name);
+        {
+            const of_wc_bmap_t of_wc_bmap = 0x3fffff; /* All wildcards */
+            of_table_stats_entry_wildcards_set(of_table_stats_entry, of_wc_bmap);
+        }
+        of_table_stats_entry_max_entries_set(of_table_stats_entry,
+                                             tbl->max_flows);
+        /* NOTE:  Active count is overridden by state manager */
+        of_table_stats_entry_active_count_set(of_table_stats_entry,
+                                              tbl->active_count);
+        of_table_stats_entry_lookup_count_set(of_table_stats_entry,
+                                              tbl->lookup_count);
+        of_table_stats_entry_matched_count_set(of_table_stats_entry,
+                                               tbl->matched_count);
+        /* NOTE:  No field for evicted_count; see ind_fwd_stats_show() */
+
+        if (LOXI_FAILURE(of_list_table_stats_entry_append(of_list_table_stats_entry, of_table_stats_entry))) {
+            LOG_ERROR("of_list_table_state_entry_append() failed");
+            result = INDIGO_ERROR_UNKNOWN;
+            goto done;
+        }
     }
         
     if (LOXI_FAILURE(of_table_stats_reply_entries_set(table_stats_reply, of_list_table_stats_entry))) {
@@ -812,11 +1851,20 @@ indigo_fwd_packet_receive(of_port_no_t of_port_num,
                           unsigned     len
                           );
 
-/** \brief Perform flow action on packet */
+static indigo_error_t
+fme_key_setup(ppe_packet_t* ppep, fme_key_t* key);
+
+/**
+ * \brief Perform flow action on packet
+ *
+ * fme_key is the key the packet was looked up with, or NULL if it
+ * didn't come through the flow table.
+ */
 
 static indigo_error_t
 pkt_action_do(of_port_no_t   in_port,
               ppe_packet_t* ppep, 
+              fme_key_t*     fme_key,
               of_action_t    *of_action
               )
 {
@@ -918,6 +1966,27 @@ pkt_action_do(of_port_no_t   in_port,
             }
         }
         break;
+    case OF_ACTION_GROUP:
+        {
+            uint32_t  group_id;
+            fme_key_t key;
+
+            of_action_group_group_id_get(&of_action->group, &group_id);
+            if (fme_key == NULL) {
+                if (INDIGO_FAILURE(fme_key_setup(ppep, &key))) {
+                    LOG_ERROR("fme_key_setup() failed");
+                    result = INDIGO_ERROR_UNKNOWN;
+                    break;
+                }
+                fme_key = &key;
+            }
+            result = ind_fwd_group_execute(group_id, in_port,
+                                           ppep->data, ppep->size, fme_key);
+            if (INDIGO_FAILURE(result)) {
+                LOG_ERROR("ind_fwd_group_execute() failed");
+            }
+        }
+        break;
     case OF_ACTION_SET_DL_DST:
         {
             of_mac_addr_t of_mac_addr[1];
@@ -1183,17 +2252,102 @@ fme_key_setup(ppe_packet_t* ppep, fme_key_t* key)
     ppe_field_copy(ppep, PPE_FIELD_OF10_ARP_PTYPE, PPE_FIELD_ARP_PTYPE); 
     ppe_field_copy(ppep, PPE_FIELD_OF10_ARP_OPERATION, PPE_FIELD_ARP_OPERATION); 
 
-    /*
-     * For OF 1.0 the ICMP type/code are in the L4 ports.
-     * See LOXI-4.
-     */
-    if (key->keymask & (1<<PPE_HEADER_ICMP)) {
-        key->keymask |= (1<<PPE_HEADER_L4);
-        ppe_field_copy(ppep, PPE_FIELD_OF10_L4_SRC_PORT, PPE_FIELD_ICMP_TYPE);
-        ppe_field_copy(ppep, PPE_FIELD_OF10_L4_DST_PORT, PPE_FIELD_ICMP_CODE);
+    /*
+     * For OF 1.0 the ICMP type/code are in the L4 ports.
+     * See LOXI-4.
+     */
+    if (key->keymask & (1<<PPE_HEADER_ICMP)) {
+        key->keymask |= (1<<PPE_HEADER_L4);
+        ppe_field_copy(ppep, PPE_FIELD_OF10_L4_SRC_PORT, PPE_FIELD_ICMP_TYPE);
+        ppe_field_copy(ppep, PPE_FIELD_OF10_L4_DST_PORT, PPE_FIELD_ICMP_CODE);
+    }
+    
+    return 0; 
+}
+
+/**
+ * \brief Raise the drop precedence of an IPv4 packet's DSCP
+ *
+ * Only the assured forwarding classes (AFxy, y = drop precedence 1..3)
+ * carry a drop precedence; other code points are left alone.
+ */
+
+static void
+dscp_prec_raise(ppe_packet_t *ppep, int levels)
+{
+    uint32_t tos, dscp, af_class, prec;
+
+    if (PPE_FAILURE(ppe_field_get(ppep, PPE_FIELD_IP4_TOS, &tos))) {
+        return;
+    }
+
+    dscp = tos >> 2;
+    af_class = dscp >> 3;
+    prec = (dscp >> 1) & 3;
+    if (af_class < 1 || af_class > 4 || prec == 0 || (dscp & 1)) {
+        return;
+    }
+
+    prec = prec + levels > 3 ? 3 : prec + levels;
+    tos = (((af_class << 3) | (prec << 1)) << 2) | (tos & 3);
+
+    if (PPE_FAILURE(ppe_field_set(ppep, PPE_FIELD_IP4_TOS, tos))
+        || PPE_FAILURE(ppe_packet_update(ppep))) {
+        LOG_ERROR("Failed to remark DSCP");
+    }
+}
+
+/**
+ * \brief Look up a packet key in one table
+ *
+ * Returns 1 and sets *flow on a match, 0 on a miss, negative on error.
+ */
+
+static int
+fwd_table_lookup(struct fwd_table *tbl,
+                 fme_key_t *fme_key,
+                 time_t now,
+                 int pkt_size,
+                 struct fme_flow_data **flow)
+{
+    struct fme_flow_data *exact_flow_data, *wc_flow_data;
+    fme_entry_t          *match_entry;
+    int                  n;
+
+    /*
+     * Try the exact tier first.  A hit there is final unless some
+     * wildcard flow has a strictly higher priority; on a tie the exact
+     * flow wins, as OF 1.0 requires.
+     */
+    exact_flow_data = ind_fwd_exact_lookup(tbl->exact, fme_key, now);
+    if (exact_flow_data != NULL
+        && exact_flow_data->prio >= tbl->wc_prio_max) {
+        *flow = exact_flow_data;
+        return 1;
+    }
+
+    if (FME_FAILURE(n = fme_match(tbl->fme, fme_key, now, pkt_size,
+                                  &match_entry))) {
+        return n;
+    }
+
+    if (n > 0) {
+        wc_flow_data = (struct fme_flow_data *) (match_entry->cookie);
+        if (exact_flow_data != NULL
+            && exact_flow_data->prio >= wc_flow_data->prio) {
+            *flow = exact_flow_data;
+        } else {
+            *flow = wc_flow_data;
+        }
+        return 1;
+    }
+
+    if (exact_flow_data != NULL) {
+        *flow = exact_flow_data;
+        return 1;
     }
-    
-    return 0; 
+
+    return 0;
 }
 
 /** \brief Process a received packet */
@@ -1207,12 +2361,16 @@ indigo_fwd_packet_receive(of_port_no_t of_port_num,
     indigo_error_t       result = INDIGO_ERROR_NONE;
     ppe_packet_t         ppep; 
     int                  n, rv;
-    fme_entry_t*         match_entry; 
     fme_key_t            fme_key; 
     struct fme_flow_data *fme_flow_data;
+    struct fwd_state     *st;
+    struct fwd_table     *tbl;
+    unsigned             table_id;
     of_list_action_t     *of_list_action;
     of_action_t          of_action[1];
     time_t               now;
+    uint64_t             now_ns = 0;  /* Read at most once per packet */
+    int                  meter_result;
 
     LOG_TRACE("%d bytes in from %d", len, of_port_num);
 
@@ -1228,59 +2386,105 @@ indigo_fwd_packet_receive(of_port_no_t of_port_num,
         return (INDIGO_ERROR_UNKNOWN); 
     }
 
-    ++lookup_count;
-
     time(&now);
-    
-    if (FME_FAILURE(n = fme_match(fme, 
-                                  &fme_key, 
-                                  expiration_enabled ? now : 0,
-                                  ppep.size, 
-                                  &match_entry))) { 
-        LOG_ERROR("fme_match() failed."); 
-        return (INDIGO_ERROR_UNKNOWN);
-    }
 
-    LOG_TRACE("FME returned %d for match on packet from %d", n, of_port_num); 
-    if (n == 0) {
-        if (INDIGO_FAILURE(result = pkt_in(&ppep,
-                                           OF_PACKET_IN_REASON_NO_MATCH
-                                           )
-                           )
-            ) {
-            LOG_ERROR("pkt_in() failed");
+    /* The table in use is held until the pass is done */
+    ++fwd_readers;
+    st = fwd_live;
+
+    for (table_id = 0; ; table_id = fme_flow_data->goto_table) {
+        tbl = &st->tables[table_id];
+        ++tbl->lookup_count;
+
+        if (FME_FAILURE(n = fwd_table_lookup(tbl,
+                                             &fme_key,
+                                             expiration_enabled ? now : 0,
+                                             ppep.size,
+                                             &fme_flow_data))) {
+            LOG_ERROR("fme_match() failed."); 
+            result = INDIGO_ERROR_UNKNOWN;
+            break;
+        }
+
+        LOG_TRACE("Table %d returned %d for match on packet from %d",
+                  table_id, n, of_port_num);
+        if (n == 0) {
+            if (INDIGO_FAILURE(result = pkt_in(&ppep,
+                                               OF_PACKET_IN_REASON_NO_MATCH
+                                               )
+                               )
+                ) {
+                LOG_ERROR("pkt_in() failed");
+            }
+            break;
         }
-        return (result);
-    }
 
-    ++matched_count;
+        ++tbl->matched_count;
 
-    fme_flow_data = (struct fme_flow_data *) (match_entry->cookie); 
+        /* Update flow stats */
 
-    /* Update flow stats */
+        ++fme_flow_data->cnt_pkts;
+        fme_flow_data->cnt_bytes += len;
+        fme_flow_data->last_hit = now;
 
-    ++fme_flow_data->cnt_pkts;
-    fme_flow_data->cnt_bytes += len;
+        if (fme_flow_data->meter_id != 0) {
+            if (now_ns == 0) {
+                now_ns = ind_fwd_clock_ns();
+            }
+            meter_result = ind_fwd_meter_apply(fme_flow_data->meter_id,
+                                               len, now_ns);
+            if (meter_result == METER_RESULT_DROP) {
+                LOG_TRACE("Packet dropped by meter %u",
+                          fme_flow_data->meter_id);
+                break;
+            }
+            if (meter_result > 0) {
+                dscp_prec_raise(&ppep, meter_result);
+            }
+        }
     
-    /* Process actions given in flow that packet matched.
-       \note The OF 1.0 spec says that in case of multiple matched flows of
-       equal priority, the switch is free to choose which flow's actions will
-       be applied, so we just use the first match; 
-    */
+        /* Process actions given in flow that packet matched.
+           \note The OF 1.0 spec says that in case of multiple matched flows of
+           equal priority, the switch is free to choose which flow's actions will
+           be applied, so we just use the first match; 
+        */
+
+        of_list_action = fme_flow_data->of_list_action;
+        OF_LIST_ACTION_ITER(of_list_action, of_action, rv) {
+            if (INDIGO_FAILURE(pkt_action_do(of_port_num,
+                                             &ppep,
+                                             &fme_key,
+                                             of_action
+                                             )
+                               )
+                ) {
+                LOG_ERROR("pkt_action_do() failed");
+                result = INDIGO_ERROR_UNKNOWN;
+                break;
+            }
+        }
 
-    of_list_action = fme_flow_data->of_list_action;
-    OF_LIST_ACTION_ITER(of_list_action, of_action, rv) {
-        if (INDIGO_FAILURE(pkt_action_do(of_port_num,
-                                         &ppep,
-                                         of_action
-                                         )
-                           )
-            ) {
-            LOG_ERROR("pkt_action_do() failed");
+        if (rv != OF_ERROR_NONE && rv != OF_ERROR_RANGE) {
+            LOG_ERROR("of_list_action_first/next() failed");
+            result = INDIGO_ERROR_PARAM;
+        }
+
+        if (INDIGO_FAILURE(result)
+            || fme_flow_data->goto_table == FWD_TABLE_NONE) {
+            break;
+        }
+
+        /* Later tables match the packet as rewritten so far */
+        if (INDIGO_FAILURE(fme_key_setup(&ppep, &fme_key))) { 
+            LOG_ERROR("fme_key_setup() failed"); 
             result = INDIGO_ERROR_UNKNOWN;
             break;
         }
     }
+
+    if (--fwd_readers == 0 && fwd_retired != NULL) {
+        fwd_state_reclaim();
+    }
   
     ppe_packet_denit(&ppep); 
     return (result);
@@ -1313,6 +2517,9 @@ indigo_fwd_packet_out(of_packet_out_t *of_packet_out)
     ppe_packet_t     ppep; 
     int              rv;
 
+    /* Flow mods sent before the packet out apply to it */
+    ind_fwd_flowq_drain();
+
     of_packet_out_in_port_get(of_packet_out, &of_port_num);
     of_packet_out_data_get(of_packet_out, of_octets);
 
@@ -1341,6 +2548,7 @@ indigo_fwd_packet_out(of_packet_out_t *of_packet_out)
     OF_LIST_ACTION_ITER(of_list_action, of_action, rv) {
         if (INDIGO_FAILURE(pkt_action_do(of_port_num,
                                          &ppep,
+                                         NULL,
                                          of_action
                                          ))) {
             LOG_ERROR("pkt_action_do() failed");
@@ -1351,7 +2559,7 @@ indigo_fwd_packet_out(of_packet_out_t *of_packet_out)
 
     if (rv != OF_ERROR_NONE && rv != OF_ERROR_RANGE) {
         LOG_ERROR("of_list_action_first/next() failed");
-        result = INDIGO_ERROR_UNKNOWN;
+        result = INDIGO_ERROR_PARAM;
     }
 
  done:
@@ -1362,6 +2570,257 @@ indigo_fwd_packet_out(of_packet_out_t *of_packet_out)
 }
 
 
+/**
+ * \brief Apply a group bucket's actions to a copy of a packet
+ *
+ * Each bucket edits its own copy, so buckets of an all group and the
+ * rest of the flow's action list all see the packet as it was.
+ */
+
+indigo_error_t
+ind_fwd_bucket_actions_do(of_port_no_t     in_port,
+                          uint8_t          *data,
+                          unsigned         len,
+                          of_list_action_t *of_list_action)
+{
+    indigo_error_t result = INDIGO_ERROR_NONE;
+    uint8_t        local_buf[FWD_BUCKET_PKT_LOCAL + 4], *buf = local_buf;
+    ppe_packet_t   ppep;
+    of_action_t    of_action[1];
+    int            rv;
+
+    /* Leave room for a VLAN tag to be pushed */
+    if (len > FWD_BUCKET_PKT_LOCAL) {
+        if ((buf = INDIGO_MEM_ALLOC(len + 4)) == NULL) {
+            LOG_ERROR("INDIGO_MEM_ALLOC() failed");
+            return (INDIGO_ERROR_RESOURCE);
+        }
+    }
+    FORWARDING_MEMCPY(buf, data, len);
+
+    if (INDIGO_FAILURE(ppe_pkt_setup(in_port, buf, len, &ppep))) {
+        LOG_ERROR("ppe_pkt_setup() failed");
+        result = INDIGO_ERROR_UNKNOWN;
+        goto done;
+    }
+
+    OF_LIST_ACTION_ITER(of_list_action, of_action, rv) {
+        if (INDIGO_FAILURE(pkt_action_do(in_port,
+                                         &ppep,
+                                         NULL,
+                                         of_action
+                                         ))) {
+            LOG_ERROR("pkt_action_do() failed");
+            result = INDIGO_ERROR_UNKNOWN;
+            break;
+        }
+    }
+
+    if (rv != OF_ERROR_NONE && rv != OF_ERROR_RANGE) {
+        LOG_ERROR("of_list_action_first/next() failed");
+        result = INDIGO_ERROR_PARAM;
+    }
+
+    ppe_packet_denit(&ppep); 
+
+ done:
+    if (buf != local_buf)  INDIGO_MEM_FREE(buf);
+
+    return (result);
+}
+
+
+/** \brief Send a packet through a group, from outside the pipeline */
+
+indigo_error_t
+ind_fwd_group_emit(uint32_t     group_id,
+                   of_port_no_t in_port,
+                   uint8_t      *data,
+                   unsigned     len)
+{
+    indigo_error_t result;
+    ppe_packet_t   ppep; 
+    fme_key_t      fme_key; 
+
+    if (INDIGO_FAILURE(ppe_pkt_setup(in_port, data, len, &ppep))) {
+        LOG_ERROR("ppe_pkt_setup() failed");
+        return (INDIGO_ERROR_UNKNOWN);
+    }
+    if (INDIGO_FAILURE(fme_key_setup(&ppep, &fme_key))) { 
+        LOG_ERROR("fme_key_setup() failed"); 
+        ppe_packet_denit(&ppep); 
+        return (INDIGO_ERROR_UNKNOWN); 
+    }
+
+    result = ind_fwd_group_execute(group_id, in_port, data, len, &fme_key);
+
+    ppe_packet_denit(&ppep); 
+    return (result);
+}
+
+
+/** \brief End the warm restart hold: the controller's table replaces
+    the restored one */
+
+static void
+restore_hold_expired(void *cookie)
+{
+    (void)cookie;
+
+    LOG_INFO("Warm restart hold over");
+    if (INDIGO_FAILURE(ind_fwd_shadow_commit())) {
+        /* Try again next time round */
+        LOG_ERROR("Restored flows not replaced");
+    }
+}
+
+
+/** \brief A barrier ends the controller's resync; its flows replace the
+    restored ones without waiting out the hold */
+
+void
+ind_fwd_restore_hold_end(void)
+{
+    if (restore_hold && INDIGO_FAILURE(ind_fwd_shadow_commit())) {
+        /* The hold timer tries again */
+        LOG_ERROR("Restored flows not replaced");
+    }
+}
+
+
+/**
+ * \brief Reload the flow table saved at the last shutdown
+ *
+ * Restored flows forward from the start.  Flow mods from the controller
+ * build a shadow table, swapped in at the controller's first barrier,
+ * which ends its resync, or when the hold time is up if none comes.
+ */
+
+static void
+snapshot_restore(void)
+{
+    unsigned hold_ms;
+
+    if (ind_fwd_snapshot_load(my_config->snapshot_path,
+                              my_config->of_version, n_tables) == 0) {
+        return;
+    }
+
+    hold_ms = my_config->restore_hold_ms ? my_config->restore_hold_ms
+        : FWD_RESTORE_HOLD_MS_DEFAULT;
+    if (INDIGO_FAILURE(ind_fwd_shadow_begin())
+        || INDIGO_FAILURE(ind_soc_timer_event_register(restore_hold_expired,
+                                                       NULL, hold_ms))) {
+        LOG_ERROR("Can't hold restored flows, dropping them");
+        if (fwd_shadow != NULL) {
+            fwd_state_destroy(fwd_shadow);
+            fwd_shadow = NULL;
+        }
+        fwd_state_destroy(fwd_live);
+        fwd_live = fwd_state_create();
+        return;
+    }
+    restore_hold = 1;
+}
+
+
+/**
+ * \brief Save the live flow table to a snapshot file
+ *
+ * Not while restored flows are held: the file they came from is still
+ * the best record of the table.
+ */
+
+indigo_error_t
+ind_fwd_snapshot_save(const char *path)
+{
+    if (!init_done) {
+        return (INDIGO_ERROR_INIT);
+    }
+    if (restore_hold) {
+        LOG_ERROR("Restored flows not yet replaced");
+        return (INDIGO_ERROR_PENDING);
+    }
+    if (path == NULL) {
+        path = my_config->snapshot_path;
+    }
+    if (path == NULL || path[0] == 0) {
+        LOG_ERROR("No flow table snapshot file");
+        return (INDIGO_ERROR_PARAM);
+    }
+
+    return (ind_fwd_snapshot_write(path, my_config->of_version, n_tables));
+}
+
+
+/**
+ * \brief Change how many flows each table holds
+ *
+ * The tables can't shrink below the flows they hold.  Tables resized
+ * before a failure keep their new size, which holds all their flows.
+ */
+
+indigo_error_t
+ind_fwd_max_flows_set(unsigned max_flows)
+{
+    indigo_error_t rv;
+    unsigned       table_id;
+
+    if (!init_done) {
+        return (INDIGO_ERROR_INIT);
+    }
+    if (max_flows == 0 || max_flows > FWD_MAX_FLOWS_MAX) {
+        LOG_ERROR("Bad flow table size %u", max_flows);
+        return (INDIGO_ERROR_PARAM);
+    }
+    if (max_flows == my_config->max_flows) {
+        return (INDIGO_ERROR_NONE);
+    }
+
+    /* Flow mods issued before now are applied at the old size */
+    ind_fwd_flowq_drain();
+
+    for (table_id = 0; table_id < n_tables; table_id++) {
+        if (fwd_live->tables[table_id].active_count > max_flows
+            || (fwd_shadow != NULL
+                && fwd_shadow->tables[table_id].active_count > max_flows)) {
+            LOG_ERROR("Table %u holds more than %u flows",
+                      table_id, max_flows);
+            return (INDIGO_ERROR_PARAM);
+        }
+    }
+
+    if (INDIGO_FAILURE(rv = fwd_state_resize(fwd_live, max_flows))
+        || (fwd_shadow != NULL
+            && INDIGO_FAILURE(rv = fwd_state_resize(fwd_shadow,
+                                                    max_flows)))) {
+        return (rv);
+    }
+
+    LOG_INFO("Flow tables resized from %u to %u flows",
+             my_config->max_flows, max_flows);
+    my_config->max_flows = max_flows;
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Choose what goes when a flow add finds its table full */
+
+indigo_error_t
+ind_fwd_eviction_set(ind_fwd_eviction_t policy)
+{
+    if (policy != IND_FWD_EVICTION_NONE && policy != IND_FWD_EVICTION_LRU
+        && policy != IND_FWD_EVICTION_IMPORTANCE) {
+        LOG_ERROR("Bad eviction policy %d", policy);
+        return (INDIGO_ERROR_PARAM);
+    }
+    eviction = policy;
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
 /** \brief Intialize */
 
 indigo_error_t
@@ -1369,10 +2828,14 @@ ind_fwd_init(ind_fwd_config_t *config)
 {
     *my_config = *config;
 
-    if (FME_FAILURE(fme_create(&fme, 
-                              "flowman flow table",
-                               my_config->max_flows))) { 
-        LOG_ERROR("fme_create() failed");
+    n_tables = my_config->n_tables == 0 ? 1 : my_config->n_tables;
+    eviction = my_config->eviction;
+    if (n_tables >= FWD_TABLE_NONE) {
+        LOG_ERROR("Too many flow tables: %u", n_tables);
+        return (INDIGO_ERROR_PARAM);
+    }
+
+    if ((fwd_live = fwd_state_create()) == NULL) {
         return (INDIGO_ERROR_UNKNOWN);
     }
 
@@ -1380,6 +2843,91 @@ ind_fwd_init(ind_fwd_config_t *config)
 
     init_done = 1;
 
+    if (my_config->snapshot_path != NULL && my_config->snapshot_path[0]) {
+        snapshot_restore();
+    }
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Start building a shadow flow table beside the live one */
+
+indigo_error_t
+ind_fwd_shadow_begin(void)
+{
+    if (!init_done) {
+        return (INDIGO_ERROR_INIT);
+    }
+    if (fwd_shadow != NULL) {
+        LOG_ERROR("Shadow flow table already open");
+        return (INDIGO_ERROR_PARAM);
+    }
+
+    /* Flow mods issued before now belong to the live table */
+    ind_fwd_flowq_drain();
+
+    if ((fwd_shadow = fwd_state_create()) == NULL) {
+        return (INDIGO_ERROR_RESOURCE);
+    }
+    LOG_INFO("Shadow flow table open");
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Swap the shadow flow table in, carrying over flow counters */
+
+indigo_error_t
+ind_fwd_shadow_commit(void)
+{
+    struct fwd_state *old;
+    unsigned         table_id;
+
+    if (fwd_shadow == NULL) {
+        LOG_ERROR("No shadow flow table open");
+        return (INDIGO_ERROR_PARAM);
+    }
+    if (fwd_retired != NULL) {
+        LOG_ERROR("Previous flow table not yet reclaimed");
+        return (INDIGO_ERROR_PENDING);
+    }
+
+    /* Flow mods issued before now belong to the shadow */
+    ind_fwd_flowq_drain();
+
+    shadow_last_carried = flow_counters_carry(fwd_shadow, fwd_live);
+    shadow_last_flows = 0;
+    for (table_id = 0; table_id < n_tables; table_id++) {
+        fwd_shadow->tables[table_id].lookup_count =
+            fwd_live->tables[table_id].lookup_count;
+        fwd_shadow->tables[table_id].matched_count =
+            fwd_live->tables[table_id].matched_count;
+        fwd_shadow->tables[table_id].evicted_count +=
+            fwd_live->tables[table_id].evicted_count;
+        shadow_last_flows += fwd_shadow->tables[table_id].active_count;
+    }
+
+    /* A single pointer store publishes the new table */
+    old = fwd_live;
+    fwd_live = fwd_shadow;
+    fwd_shadow = NULL;
+    ++shadow_swaps;
+
+    fwd_retired = old;
+    if (fwd_readers == 0) {
+        fwd_state_reclaim();
+    }
+
+    /* Restored flows have been replaced, whoever called the swap */
+    if (restore_hold) {
+        ind_soc_timer_event_unregister(restore_hold_expired, NULL);
+        restore_hold = 0;
+    }
+
+    LOG_INFO("Shadow flow table swapped in: %u flows, %u counters carried",
+             shadow_last_flows, shadow_last_carried);
+
     return (INDIGO_ERROR_NONE);
 }
 
@@ -1429,30 +2977,123 @@ indigo_fwd_expiration_enable_get(int *is_enabled)
 }
 
 
-/** \brief Tear down */
+/** \brief Add up the memory the live table's flows take */
 
-indigo_error_t
-ind_fwd_finish(void)
+void
+ind_fwd_memory_stats_get(ind_fwd_memory_stats_t *stats)
 {
-    biglist_t *bl, *ble;
-    int idx;
+    struct fwd_table     *tbl;
     struct fme_flow_data *p;
+    unsigned             table_id, i;
 
-    /* Walk the FME table entries and delete the cookies */
-    for (idx = 0; idx < FLOW_ID_HASH_TABLE_LEN; idx++) {
-        bl = flow_id_ht[idx];
+    INDIGO_MEM_SET(stats, 0, sizeof(*stats));
+    ind_fwd_actions_stats_get(&stats->action_lists, &stats->action_refs,
+                              &stats->action_bytes);
+    if (fwd_live == NULL) {
+        return;
+    }
 
-        BIGLIST_FOREACH(ble, bl) {
-            p = BIGLIST_CAST(struct fme_flow_data *, ble);
-            if (p->of_list_action) {
-                of_list_action_delete(p->of_list_action);
+    for (table_id = 0; table_id < n_tables; table_id++) {
+        tbl = &fwd_live->tables[table_id];
+        for (i = 0; i < tbl->active_count; i++) {
+            p = tbl->flows[i];
+            stats->bytes += sizeof(*p);
+            if (p->ckey != NULL) {
+                stats->bytes += ind_fwd_ckey_bytes(p->ckey);
+                ++stats->compact_keys;
+            } else {
+                stats->bytes += sizeof(fme_entry_t);
             }
-            INDIGO_MEM_FREE(p); 
-        }       
-        biglist_free(bl); 
+        }
+        stats->flows += tbl->active_count;
+        stats->exact_buckets += ind_fwd_exact_buckets(tbl->exact);
     }
-    
-    fme_destroy_all(fme); 
+    stats->full_key_bytes = (uint64_t)stats->flows
+        * (sizeof(struct fme_flow_data) + sizeof(fme_entry_t));
+}
+
+
+/** \brief Show flow table and flow mod queue counters */
+
+void
+ind_fwd_stats_show(aim_pvs_t *pvs)
+{
+    struct fwd_table       *tbl;
+    ind_fwd_memory_stats_t mem;
+    unsigned               table_id;
+
+    for (table_id = 0; table_id < n_tables; table_id++) {
+        tbl = &fwd_live->tables[table_id];
+        aim_printf(pvs, "table %u: %u/%u flows (%u exact), "
+                   "lookups %"PRIu64", matched %"PRIu64", "
+                   "evicted %"PRIu64"\n",
+                   table_id, tbl->active_count, tbl->max_flows,
+                   ind_fwd_exact_count(tbl->exact),
+                   tbl->lookup_count, tbl->matched_count,
+                   tbl->evicted_count);
+    }
+    ind_fwd_memory_stats_get(&mem);
+    if (mem.flows > 0) {
+        aim_printf(pvs, "flow memory: %"PRIu64" bytes/flow, "
+                   "%"PRIu64" with full keys; %u of %u keys compact\n",
+                   mem.bytes / mem.flows, mem.full_key_bytes / mem.flows,
+                   mem.compact_keys, mem.flows);
+    }
+    if (mem.action_lists > 0) {
+        aim_printf(pvs, "action lists: %u interned, %"PRIu64" bytes, "
+                   "held by %u flows (%u.%02u per list)\n",
+                   mem.action_lists, mem.action_bytes, mem.action_refs,
+                   mem.action_refs / mem.action_lists,
+                   mem.action_refs * 100 / mem.action_lists % 100);
+    }
+    aim_printf(pvs, "eviction %s\n",
+               eviction == IND_FWD_EVICTION_LRU ? "lru"
+               : eviction == IND_FWD_EVICTION_IMPORTANCE ? "importance"
+               : "none");
+    if (fwd_shadow != NULL) {
+        unsigned n = 0;
+
+        for (table_id = 0; table_id < n_tables; table_id++) {
+            n += fwd_shadow->tables[table_id].active_count;
+        }
+        aim_printf(pvs, "shadow table open: %u flows, %u live retired\n",
+                   n, fwd_live->retired_count);
+    }
+    aim_printf(pvs, "shadow swaps %"PRIu64", last %u flows, "
+               "%u counters carried\n",
+               shadow_swaps, shadow_last_flows, shadow_last_carried);
+    if (restore_hold) {
+        aim_printf(pvs, "restored flows held until the shadow swap\n");
+    }
+    ind_fwd_flowq_stats_show(pvs);
+}
+
+
+/** \brief Tear down */
+
+indigo_error_t
+ind_fwd_finish(void)
+{
+    if (restore_hold) {
+        ind_soc_timer_event_unregister(restore_hold_expired, NULL);
+        restore_hold = 0;
+    } else if (my_config->snapshot_path != NULL
+               && my_config->snapshot_path[0]) {
+        (void)ind_fwd_snapshot_save(NULL);
+    }
+
+    /* Flow mods still queued are dropped without callbacks */
+    ind_fwd_flowq_finish();
+
+    fwd_state_destroy(fwd_shadow);
+    fwd_shadow = NULL;
+    fwd_state_reclaim();
+    fwd_state_destroy(fwd_live);
+    fwd_live = NULL;
+
+    ind_fwd_group_finish();
+    ind_fwd_meter_finish();
+    ind_fwd_actions_finish();
 
     init_done = 0;
 
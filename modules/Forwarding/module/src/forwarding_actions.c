@@ -0,0 +1,178 @@
+/****************************************************************
+ *
+ *        Copyright 2013, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ***************************************************************/
+
+/**
+ * @file
+ * @brief Interned flow action lists
+ *
+ * Many flows have the same actions ("output:3").  Flows share one copy
+ * of each distinct action list, found by hashing its wire form, and a
+ * list is freed when the last flow holding it lets go.  Lists are never
+ * changed once interned; a flow modify swaps in another.
+ */
+
+#include "forwarding_log.h"
+#include "forwarding_int.h"
+#include <Forwarding/forwarding_porting.h>
+
+#include <indigo/memory.h>
+#include <BigList/biglist.h>
+#include <murmur/murmur.h>
+
+#define ACTIONS_HASH_TABLE_LEN  1024   /**< Buckets; power of 2 */
+
+/* Short hand logging macros */
+#define LOG_ERROR AIM_LOG_ERROR
+#define LOG_TRACE AIM_LOG_TRACE
+
+struct actions_entry {
+    of_list_action_t *actions;
+    uint32_t         hash;
+    unsigned         refcount;      /**< Flows holding the list */
+};
+
+static biglist_t *actions_ht[ACTIONS_HASH_TABLE_LEN];
+
+static unsigned actions_count;      /**< Distinct lists */
+static unsigned actions_refs;       /**< Flows holding one */
+static uint64_t actions_bytes;      /**< Wire bytes of distinct lists */
+
+
+static uint32_t
+actions_hash(of_list_action_t *actions)
+{
+    return murmur_hash(OF_OBJECT_BUFFER_INDEX(actions, 0), actions->length,
+                       actions->version);
+}
+
+static int
+actions_same(of_list_action_t *a, of_list_action_t *b)
+{
+    return (a->version == b->version && a->length == b->length
+            && memcmp(OF_OBJECT_BUFFER_INDEX(a, 0),
+                      OF_OBJECT_BUFFER_INDEX(b, 0), a->length) == 0);
+}
+
+
+/**
+ * \brief Get the shared copy of an action list
+ *
+ * Takes over actions: it becomes the shared copy, or is freed if there
+ * already is one.  Returns NULL, with actions freed, if out of memory.
+ */
+
+of_list_action_t *
+ind_fwd_actions_intern(of_list_action_t *actions)
+{
+    struct actions_entry *entry;
+    biglist_t            *ble, **bl;
+    uint32_t             hash = actions_hash(actions);
+
+    bl = &actions_ht[hash & (ACTIONS_HASH_TABLE_LEN - 1)];
+    BIGLIST_FOREACH(ble, *bl) {
+        entry = BIGLIST_CAST(struct actions_entry *, ble);
+        if (entry->hash == hash && actions_same(entry->actions, actions)) {
+            of_list_action_delete(actions);
+            ++entry->refcount;
+            ++actions_refs;
+            return entry->actions;
+        }
+    }
+
+    if ((entry = INDIGO_MEM_ALLOC(sizeof(*entry))) == NULL) {
+        LOG_ERROR("INDIGO_MEM_ALLOC() failed");
+        of_list_action_delete(actions);
+        return NULL;
+    }
+    entry->actions = actions;
+    entry->hash = hash;
+    entry->refcount = 1;
+    *bl = biglist_prepend(*bl, entry);
+
+    ++actions_count;
+    ++actions_refs;
+    actions_bytes += actions->length;
+
+    return actions;
+}
+
+
+/** \brief Let go of a list from ind_fwd_actions_intern() */
+
+void
+ind_fwd_actions_release(of_list_action_t *actions)
+{
+    struct actions_entry *entry;
+    biglist_t            *ble, **bl;
+    uint32_t             hash = actions_hash(actions);
+
+    bl = &actions_ht[hash & (ACTIONS_HASH_TABLE_LEN - 1)];
+    BIGLIST_FOREACH(ble, *bl) {
+        entry = BIGLIST_CAST(struct actions_entry *, ble);
+        if (entry->actions != actions) {
+            continue;
+        }
+        --actions_refs;
+        if (--entry->refcount == 0) {
+            *bl = biglist_remove(*bl, entry);
+            --actions_count;
+            actions_bytes -= actions->length;
+            of_list_action_delete(actions);
+            INDIGO_MEM_FREE(entry);
+        }
+        return;
+    }
+
+    LOG_ERROR("Action list %p not interned", actions);
+}
+
+
+void
+ind_fwd_actions_stats_get(unsigned *lists, unsigned *refs, uint64_t *bytes)
+{
+    *lists = actions_count;
+    *refs = actions_refs;
+    *bytes = actions_bytes;
+}
+
+
+/** \brief Free lists left over; flows should have released them all */
+
+void
+ind_fwd_actions_finish(void)
+{
+    biglist_t *ble;
+    unsigned  idx;
+
+    for (idx = 0; idx < ACTIONS_HASH_TABLE_LEN; idx++) {
+        BIGLIST_FOREACH(ble, actions_ht[idx]) {
+            struct actions_entry *entry =
+                BIGLIST_CAST(struct actions_entry *, ble);
+            of_list_action_delete(entry->actions);
+            INDIGO_MEM_FREE(entry);
+        }
+        biglist_free(actions_ht[idx]);
+        actions_ht[idx] = NULL;
+    }
+    if (actions_count != 0) {
+        LOG_ERROR("%u action lists still held at finish", actions_count);
+    }
+    actions_count = actions_refs = 0;
+    actions_bytes = 0;
+}
@@ -96,8 +96,107 @@ forwarding_config_show(struct aim_pvs_s* pvs)
 
 static struct {
     uint32_t log_flags;
+    unsigned flowq_depth;       /**< 0 = flow mods applied as they come */
+    unsigned flowq_slice_us;
+    int      eviction;          /**< -1 = left as it is */
+    unsigned max_flows;         /**< 0 = left as it is */
 } staged_config;
 
+#define FLOWQ_SLICE_US_DEFAULT 500
+
+/** \brief Parse "flow_mod_queue": {"depth": N, "slice_us": N} */
+
+static indigo_error_t
+flowq_parse(cJSON *config)
+{
+    cJSON *flowq, *item;
+
+    staged_config.flowq_depth = 0;
+    staged_config.flowq_slice_us = FLOWQ_SLICE_US_DEFAULT;
+
+    if ((flowq = cJSON_GetObjectItem(config, "flow_mod_queue")) == NULL) {
+        return INDIGO_ERROR_NONE;
+    }
+    if (flowq->type != cJSON_Object) {
+        AIM_LOG_ERROR("Config: flow_mod_queue must be an object");
+        return INDIGO_ERROR_PARAM;
+    }
+
+    if ((item = cJSON_GetObjectItem(flowq, "depth")) != NULL) {
+        if (item->type != cJSON_Number || item->valueint < 0
+            || item->valueint > FWD_FLOWQ_DEPTH_MAX) {
+            AIM_LOG_ERROR("Config: flow_mod_queue depth must be 0 to %u",
+                          FWD_FLOWQ_DEPTH_MAX);
+            return INDIGO_ERROR_PARAM;
+        }
+        staged_config.flowq_depth = item->valueint;
+    }
+
+    if ((item = cJSON_GetObjectItem(flowq, "slice_us")) != NULL) {
+        if (item->type != cJSON_Number || item->valueint <= 0) {
+            AIM_LOG_ERROR("Config: flow_mod_queue slice_us must be positive");
+            return INDIGO_ERROR_PARAM;
+        }
+        staged_config.flowq_slice_us = item->valueint;
+    }
+
+    return INDIGO_ERROR_NONE;
+}
+
+/** \brief Parse "flow_eviction": "none" | "lru" | "importance" */
+
+static indigo_error_t
+eviction_parse(cJSON *config)
+{
+    cJSON *item;
+
+    staged_config.eviction = -1;
+
+    if ((item = cJSON_GetObjectItem(config, "flow_eviction")) == NULL) {
+        return INDIGO_ERROR_NONE;
+    }
+    if (item->type != cJSON_String) {
+        AIM_LOG_ERROR("Config: flow_eviction must be a string");
+        return INDIGO_ERROR_PARAM;
+    }
+
+    if (!strcmp(item->valuestring, "none")) {
+        staged_config.eviction = IND_FWD_EVICTION_NONE;
+    } else if (!strcmp(item->valuestring, "lru")) {
+        staged_config.eviction = IND_FWD_EVICTION_LRU;
+    } else if (!strcmp(item->valuestring, "importance")) {
+        staged_config.eviction = IND_FWD_EVICTION_IMPORTANCE;
+    } else {
+        AIM_LOG_ERROR("Config: flow_eviction must be none, lru or importance");
+        return INDIGO_ERROR_PARAM;
+    }
+
+    return INDIGO_ERROR_NONE;
+}
+
+/** \brief Parse "max_flows": N, the size of each flow table */
+
+static indigo_error_t
+max_flows_parse(cJSON *config)
+{
+    cJSON *item;
+
+    staged_config.max_flows = 0;
+
+    if ((item = cJSON_GetObjectItem(config, "max_flows")) == NULL) {
+        return INDIGO_ERROR_NONE;
+    }
+    if (item->type != cJSON_Number || item->valueint <= 0
+        || item->valueint > FWD_MAX_FLOWS_MAX) {
+        AIM_LOG_ERROR("Config: max_flows must be 1 to %u",
+                      FWD_MAX_FLOWS_MAX);
+        return INDIGO_ERROR_PARAM;
+    }
+    staged_config.max_flows = item->valueint;
+
+    return INDIGO_ERROR_NONE;
+}
+
 static indigo_error_t
 ind_fwd_cfg_stage(cJSON *config)
 {
@@ -112,7 +211,14 @@ ind_fwd_cfg_stage(cJSON *config)
 
     /* Not supporting setting log options yet */
 
-    return INDIGO_ERROR_NONE;
+    if ((err = flowq_parse(config)) != INDIGO_ERROR_NONE) {
+        return err;
+    }
+    if ((err = eviction_parse(config)) != INDIGO_ERROR_NONE) {
+        return err;
+    }
+
+    return max_flows_parse(config);
 }
 
 static void
@@ -125,6 +231,21 @@ ind_fwd_cfg_commit(void)
     } else {
         lobj->common_flags = staged_config.log_flags;
     }
+
+    if (ind_fwd_flow_queue_set(staged_config.flowq_depth,
+                               staged_config.flowq_slice_us) < 0) {
+        AIM_LOG_ERROR("Config: could not set flow mod queue");
+    }
+
+    if (staged_config.eviction >= 0) {
+        (void)ind_fwd_eviction_set(staged_config.eviction);
+    }
+
+    if (staged_config.max_flows != 0
+        && ind_fwd_max_flows_set(staged_config.max_flows) < 0) {
+        AIM_LOG_ERROR("Config: could not resize flow tables to %u",
+                      staged_config.max_flows);
+    }
 }
 
 const struct ind_cfg_ops ind_fwd_cfg_ops = {
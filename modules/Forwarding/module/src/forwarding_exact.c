@@ -0,0 +1,461 @@
+/****************************************************************
+ *
+ *        Copyright 2013, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ***************************************************************/
+
+/**
+ * @file
+ * @brief Exact-match flow tier
+ *
+ * A fully specified OF 1.0 match still maps to one of a few FME key
+ * masks (tagged or untagged, IP or ARP, ...).  Each distinct mask is
+ * recorded as a "shape"; a packet key is masked and probed once per
+ * shape in a bucketized cuckoo hash.  Only a handful of shapes exist in
+ * practice, so lookup cost does not depend on the number of flows.
+ *
+ * Flows keep compact keys, so a packet key is packed to the shape's
+ * kept bytes before it is hashed and compared.
+ */
+
+#include "forwarding_log.h"
+#include "forwarding_int.h"
+#include <Forwarding/forwarding_porting.h>
+
+#include <indigo/memory.h>
+#include <murmur/murmur.h>
+
+#define EXACT_SHAPES_MAX    8    /**< Distinct key masks supported */
+#define EXACT_BUCKET_SLOTS  4    /**< Entries per bucket */
+#define EXACT_BUCKETS_INIT  256  /**< Initial bucket count; power of 2 */
+#define EXACT_KICKS_MAX     128  /**< Displacements before growing */
+
+/* Short hand logging macros */
+#define LOG_ERROR AIM_LOG_ERROR
+#define LOG_TRACE AIM_LOG_TRACE
+
+/** \brief A distinct exact-match key mask */
+struct exact_shape {
+    unsigned refcount;          /**< Flows using this shape; 0 = free */
+    uint32_t keymask;           /**< FME header keymask */
+    int      size;              /**< Key size in bytes */
+    uint64_t vmap;              /**< Compact key byte map */
+    unsigned n_values;          /**< Bytes kept */
+    uint8_t  pos[FWD_CKEY_SIZE_MAX];   /**< Key offset of each kept byte */
+    uint8_t  mask[FWD_CKEY_SIZE_MAX];  /**< Mask of each kept byte */
+};
+
+/** \brief A hash bucket; signatures first so a probe touches one line */
+struct exact_bucket {
+    uint32_t             sig[EXACT_BUCKET_SLOTS];
+    struct fme_flow_data *flow[EXACT_BUCKET_SLOTS];
+};
+
+struct ind_fwd_exact_s {
+    struct exact_bucket *buckets;
+    unsigned            n_buckets;    /**< Power of 2 */
+    unsigned            count;        /**< Number of flows stored */
+    unsigned            n_shapes;     /**< High water mark of shapes[] */
+    struct exact_shape  shapes[EXACT_SHAPES_MAX];
+};
+
+
+/* Signature is never 0 so that an empty slot can't match */
+static inline uint32_t
+exact_sig(uint32_t hash)
+{
+    return (hash >> 16) | 0x10000;
+}
+
+static inline unsigned
+exact_bucket_primary(ind_fwd_exact_t *et, uint32_t hash)
+{
+    return hash & (et->n_buckets - 1);
+}
+
+/* Partial-key cuckoo: the alternate bucket only needs the signature */
+static inline unsigned
+exact_bucket_alt(ind_fwd_exact_t *et, unsigned b, uint32_t sig)
+{
+    return (b ^ (sig * 0x5bd1e995)) & (et->n_buckets - 1);
+}
+
+
+static struct exact_bucket *
+exact_buckets_alloc(unsigned n_buckets)
+{
+    struct exact_bucket *buckets;
+
+    buckets = INDIGO_MEM_ALLOC(n_buckets * sizeof(*buckets));
+    if (buckets != NULL) {
+        FORWARDING_MEMSET(buckets, 0, n_buckets * sizeof(*buckets));
+    }
+    return buckets;
+}
+
+
+/**
+ * Place a flow, displacing others as needed.  Each displaced entry
+ * moves on to its other bucket, so the walk goes as deep as it needs
+ * to.  On failure every displaced entry is put back, so the table is
+ * as it was.
+ */
+
+static uint32_t exact_rand = 1;      /**< Victim slot selection state */
+
+static int
+exact_place(ind_fwd_exact_t *et, struct fme_flow_data *flow)
+{
+    struct fme_flow_data *cur = flow, *tmp;
+    uint32_t sig = exact_sig(cur->exact_hash), tmp_sig;
+    unsigned b = exact_bucket_primary(et, cur->exact_hash);
+    unsigned kicks, i, v;
+    struct {
+        unsigned b, slot;
+    } path[EXACT_KICKS_MAX];
+
+    for (kicks = 0; kicks < EXACT_KICKS_MAX; kicks++) {
+        unsigned cand[2], n_cand;
+        unsigned c;
+
+        /* A displaced entry just left its other bucket, which is full */
+        cand[0] = b;
+        cand[1] = exact_bucket_alt(et, b, sig);
+        n_cand = (kicks == 0) ? 2 : 1;
+        for (c = 0; c < n_cand; c++) {
+            struct exact_bucket *bkt = &et->buckets[cand[c]];
+            for (i = 0; i < EXACT_BUCKET_SLOTS; i++) {
+                if (bkt->flow[i] == NULL) {
+                    bkt->sig[i] = sig;
+                    bkt->flow[i] = cur;
+                    return 0;
+                }
+            }
+        }
+
+        /* Full; swap with a random victim, which then tries its other
+           bucket.  Random slots keep the walk from cycling. */
+        exact_rand ^= exact_rand << 13;
+        exact_rand ^= exact_rand >> 17;
+        exact_rand ^= exact_rand << 5;
+        v = exact_rand % EXACT_BUCKET_SLOTS;
+        path[kicks].b = b;
+        path[kicks].slot = v;
+        tmp = et->buckets[b].flow[v];
+        tmp_sig = et->buckets[b].sig[v];
+        et->buckets[b].flow[v] = cur;
+        et->buckets[b].sig[v] = sig;
+        cur = tmp;
+        sig = tmp_sig;
+        b = exact_bucket_alt(et, b, sig);
+    }
+
+    /* Undo the displacements, last first */
+    while (kicks-- > 0) {
+        struct exact_bucket *bkt = &et->buckets[path[kicks].b];
+        v = path[kicks].slot;
+        tmp = bkt->flow[v];
+        tmp_sig = bkt->sig[v];
+        bkt->flow[v] = cur;
+        bkt->sig[v] = sig;
+        cur = tmp;
+        sig = tmp_sig;
+    }
+
+    return -1;
+}
+
+
+/**
+ * Double the table and rehash everything, plus the pending entry
+ */
+
+static indigo_error_t
+exact_grow(ind_fwd_exact_t *et, struct fme_flow_data *pending)
+{
+    struct exact_bucket *old = et->buckets;
+    unsigned old_n = et->n_buckets, new_n = old_n * 2, b, i;
+    struct fme_flow_data *flow;
+
+    while (1) {
+        if ((et->buckets = exact_buckets_alloc(new_n)) == NULL) {
+            LOG_ERROR("Could not grow exact match table");
+            et->buckets = old;
+            et->n_buckets = old_n;
+            return INDIGO_ERROR_RESOURCE;
+        }
+        et->n_buckets = new_n;
+
+        if (pending == NULL || exact_place(et, pending) == 0) {
+            for (b = 0; b < old_n; b++) {
+                for (i = 0; i < EXACT_BUCKET_SLOTS; i++) {
+                    if ((flow = old[b].flow[i]) == NULL) {
+                        continue;
+                    }
+                    if (exact_place(et, flow) < 0) {
+                        goto retry;
+                    }
+                }
+            }
+            INDIGO_MEM_FREE(old);
+            LOG_TRACE("Exact match table grown to %u buckets", et->n_buckets);
+            return INDIGO_ERROR_NONE;
+        }
+
+    retry:
+        /* Pathological; try again with more room */
+        INDIGO_MEM_FREE(et->buckets);
+        new_n *= 2;
+    }
+}
+
+
+static int
+exact_shape_get(ind_fwd_exact_t *et, struct fwd_ckey *ckey)
+{
+    struct exact_shape *shape;
+    uint8_t pos[FWD_CKEY_SIZE_MAX], mask[FWD_CKEY_SIZE_MAX];
+    const uint8_t *partial = ckey->data + ckey->n_values;
+    unsigned i, idx, n = 0;
+    int free_idx = -1;
+
+    for (i = 0; i < ckey->size; i++) {
+        if (ckey->vmap & (1ULL << i)) {
+            pos[n] = i;
+            mask[n++] = (ckey->pmap & (1ULL << i)) ? *partial++ : 0xff;
+        }
+    }
+
+    for (idx = 0; idx < et->n_shapes; idx++) {
+        shape = &et->shapes[idx];
+        if (shape->refcount == 0) {
+            if (free_idx < 0) {
+                free_idx = idx;
+            }
+            continue;
+        }
+        if (shape->keymask == ckey->keymask && shape->size == ckey->size &&
+            shape->vmap == ckey->vmap &&
+            memcmp(shape->mask, mask, n) == 0) {
+            return idx;
+        }
+    }
+
+    if (free_idx < 0) {
+        if (et->n_shapes == EXACT_SHAPES_MAX) {
+            return -1;
+        }
+        free_idx = et->n_shapes++;
+    }
+
+    shape = &et->shapes[free_idx];
+    shape->keymask = ckey->keymask;
+    shape->size = ckey->size;
+    shape->vmap = ckey->vmap;
+    shape->n_values = n;
+    FORWARDING_MEMCPY(shape->pos, pos, n);
+    FORWARDING_MEMCPY(shape->mask, mask, n);
+    return free_idx;
+}
+
+
+indigo_error_t
+ind_fwd_exact_create(ind_fwd_exact_t **et_p)
+{
+    ind_fwd_exact_t *et;
+
+    if ((et = INDIGO_MEM_ALLOC(sizeof(*et))) == NULL) {
+        return INDIGO_ERROR_RESOURCE;
+    }
+    FORWARDING_MEMSET(et, 0, sizeof(*et));
+
+    if ((et->buckets = exact_buckets_alloc(EXACT_BUCKETS_INIT)) == NULL) {
+        INDIGO_MEM_FREE(et);
+        return INDIGO_ERROR_RESOURCE;
+    }
+    et->n_buckets = EXACT_BUCKETS_INIT;
+
+    *et_p = et;
+    return INDIGO_ERROR_NONE;
+}
+
+
+void
+ind_fwd_exact_destroy(ind_fwd_exact_t *et)
+{
+    if (et == NULL) {
+        return;
+    }
+    INDIGO_MEM_FREE(et->buckets);
+    INDIGO_MEM_FREE(et);
+}
+
+
+/**
+ * Insert a flow whose compact key is fully specified.
+ * Returns INDIGO_ERROR_RESOURCE if the key's mask can't be given a
+ * shape; the caller should then fall back to the wildcard table.
+ */
+
+indigo_error_t
+ind_fwd_exact_insert(ind_fwd_exact_t *et, struct fme_flow_data *flow)
+{
+    struct fwd_ckey *ckey = flow->ckey;
+    int shape;
+    indigo_error_t rv;
+
+    if ((shape = exact_shape_get(et, ckey)) < 0) {
+        return INDIGO_ERROR_RESOURCE;
+    }
+
+    flow->exact_shape = shape;
+    flow->exact_hash = murmur_hash(ckey->data, ckey->n_values, shape);
+
+    /* Keep the load factor below ~90% so cuckoo paths stay short */
+    if ((et->count + 1) * 10 > et->n_buckets * EXACT_BUCKET_SLOTS * 9) {
+        if (INDIGO_FAILURE(rv = exact_grow(et, NULL))) {
+            return rv;
+        }
+    }
+
+    /* A failed place leaves the table untouched, so a failed grow does
+       too and the flow goes to the wildcard table instead */
+    if (exact_place(et, flow) < 0) {
+        if (INDIGO_FAILURE(rv = exact_grow(et, flow))) {
+            return rv;
+        }
+    }
+
+    ++et->shapes[shape].refcount;
+    flow->exact = 1;
+    ++et->count;
+
+    return INDIGO_ERROR_NONE;
+}
+
+
+void
+ind_fwd_exact_remove(ind_fwd_exact_t *et, struct fme_flow_data *flow)
+{
+    uint32_t sig = exact_sig(flow->exact_hash);
+    unsigned cand[2], c, i;
+
+    cand[0] = exact_bucket_primary(et, flow->exact_hash);
+    cand[1] = exact_bucket_alt(et, cand[0], sig);
+
+    for (c = 0; c < 2; c++) {
+        struct exact_bucket *bkt = &et->buckets[cand[c]];
+        for (i = 0; i < EXACT_BUCKET_SLOTS; i++) {
+            if (bkt->flow[i] == flow) {
+                bkt->flow[i] = NULL;
+                bkt->sig[i] = 0;
+                --et->shapes[flow->exact_shape].refcount;
+                --et->count;
+                flow->exact = 0;
+                return;
+            }
+        }
+    }
+
+    LOG_ERROR("Flow not found in exact match table");
+}
+
+
+/* Mirror the FME's expiration semantics */
+static inline int
+exact_flow_expired(struct fme_flow_data *flow, time_t now)
+{
+    if (now == 0) {
+        return 0;
+    }
+    if (flow->hard_expiry && now >= flow->hard_expiry) {
+        return 1;
+    }
+    if (flow->idle_timeout &&
+        now >= flow->last_hit + flow->idle_timeout) {
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Find the highest priority exact flow matching a packet key.
+ * A now of 0 disables expiration checks.
+ */
+
+struct fme_flow_data *
+ind_fwd_exact_lookup(ind_fwd_exact_t *et, fme_key_t *key, time_t now)
+{
+    struct fme_flow_data *best = NULL, *flow;
+    uint8_t packed[FWD_CKEY_SIZE_MAX];
+    unsigned s, c, i, cand[2];
+    uint32_t hash, sig;
+    unsigned n;
+
+    for (s = 0; s < et->n_shapes; s++) {
+        struct exact_shape *shape = &et->shapes[s];
+
+        if (shape->refcount == 0 ||
+            (key->keymask & shape->keymask) != shape->keymask) {
+            continue;
+        }
+
+        for (n = 0; n < shape->n_values; n++) {
+            packed[n] = key->values[shape->pos[n]] & shape->mask[n];
+        }
+
+        hash = murmur_hash(packed, shape->n_values, s);
+        sig = exact_sig(hash);
+        cand[0] = exact_bucket_primary(et, hash);
+        cand[1] = exact_bucket_alt(et, cand[0], sig);
+
+        for (c = 0; c < 2; c++) {
+            struct exact_bucket *bkt = &et->buckets[cand[c]];
+            for (i = 0; i < EXACT_BUCKET_SLOTS; i++) {
+                if (bkt->sig[i] != sig) {
+                    continue;
+                }
+                flow = bkt->flow[i];
+                if (flow->exact_shape != s ||
+                    memcmp(FWD_FLOW_CKEY(flow)->data, packed,
+                           shape->n_values) != 0 ||
+                    exact_flow_expired(flow, now)) {
+                    continue;
+                }
+                if (best == NULL || flow->prio > best->prio) {
+                    best = flow;
+                }
+            }
+        }
+    }
+
+    return best;
+}
+
+
+unsigned
+ind_fwd_exact_count(ind_fwd_exact_t *et)
+{
+    return et->count;
+}
+
+
+unsigned
+ind_fwd_exact_buckets(ind_fwd_exact_t *et)
+{
+    return et->n_buckets;
+}
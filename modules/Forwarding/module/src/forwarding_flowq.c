@@ -0,0 +1,545 @@
+/****************************************************************
+ *
+ *        Copyright 2013, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ***************************************************************/
+
+/**
+ * @file
+ * @brief Flow mod command queue and batches
+ *
+ * With the queue on, flow adds, modifies and deletes are copied onto a
+ * FIFO instead of being applied as they arrive.  The queue is served
+ * from the event loop through an eventfd that stays readable while
+ * commands are pending, in slices of bounded time, so packet bursts
+ * are forwarded in between even when the controller pushes thousands
+ * of flows at once.  Each command's completion callback is issued when
+ * it is applied, in arrival order.
+ *
+ * Requests that read flow state, and controller messages that must
+ * come after the flow mods before them (packet outs, group and meter
+ * mods, barriers), drain the queue first.
+ *
+ * Between ind_fwd_flow_batch_begin() and ind_fwd_flow_batch_commit(),
+ * flow mods are instead staged, and the commit applies them all in one
+ * pass of the event loop; the datapath sees the table either before or
+ * after the whole batch.  Index upkeep that would otherwise be paid per
+ * flow is put off until the end of a batch or queue service pass.
+ */
+
+#include "forwarding_log.h"
+#include "forwarding_int.h"
+#include <Forwarding/forwarding.h>
+#include <Forwarding/forwarding_porting.h>
+
+#include <indigo/memory.h>
+#include <SocketManager/socketmanager.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+
+/* Short hand logging macros */
+#define LOG_ERROR AIM_LOG_ERROR
+#define LOG_INFO AIM_LOG_INFO
+#define LOG_TRACE AIM_LOG_TRACE
+
+#define FLOWQ_LAT_BUCKETS 16    /**< Apply latency <1us, <2us, ..., >=16ms */
+
+/** \brief A queued flow mod */
+
+struct flowq_cmd {
+    enum fwd_flowq_op op;
+    indigo_cookie_t   flow_id;
+    indigo_cookie_t   callback_cookie;
+    of_object_t       *obj;     /**< Copy of the message; NULL for delete */
+    uint64_t          enq_ns;
+};
+
+static struct {
+    struct flowq_cmd *cmds;     /**< Ring; NULL = queue off */
+    unsigned         depth;     /**< Ring capacity */
+    unsigned         head;      /**< Index of oldest command */
+    unsigned         count;
+    unsigned         slice_ns;  /**< Longest a service pass may run */
+    int              event_fd;  /**< Readable while commands are pending */
+    unsigned         depth_max;
+    uint64_t         cnt_queued;
+    uint64_t         cnt_applied;
+    uint64_t         cnt_full;      /**< Commands applied early, queue full */
+    uint64_t         cnt_drains;    /**< Full drains ahead of a read */
+    uint64_t         cnt_slices;
+    uint64_t         cnt_slices_exhausted;  /**< Ended with work left */
+    uint64_t         lat_sum_ns;    /**< Enqueue to callback */
+    uint64_t         lat_max_ns;
+    uint64_t         lat_hist[FLOWQ_LAT_BUCKETS];
+} flowq = { .event_fd = -1 };
+
+static struct {
+    int              open;
+    struct flowq_cmd *cmds;     /**< Staged commands, in arrival order */
+    unsigned         count;
+    unsigned         size;      /**< Allocated length of cmds */
+    unsigned         count_max;
+    uint64_t         cnt_batches;
+    uint64_t         cnt_applied;
+    uint64_t         last_commit_ns;
+    uint64_t         max_commit_ns;
+} flowb;
+
+
+/** \brief Apply a command, issue its callback and release its message */
+
+static void
+flowq_cmd_apply(struct flowq_cmd *cmd)
+{
+    uint64_t lat;
+    unsigned b;
+
+    switch (cmd->op) {
+    case FWD_FLOWQ_ADD:
+        ind_fwd_flow_create_apply(cmd->flow_id, (of_flow_add_t *)cmd->obj,
+                                  cmd->callback_cookie);
+        break;
+    case FWD_FLOWQ_MODIFY:
+        ind_fwd_flow_modify_apply(cmd->flow_id,
+                                  (of_flow_modify_t *)cmd->obj,
+                                  cmd->callback_cookie);
+        break;
+    case FWD_FLOWQ_DELETE:
+        ind_fwd_flow_delete_apply(cmd->flow_id, cmd->callback_cookie);
+        break;
+    }
+    if (cmd->obj != NULL) {
+        of_object_delete(cmd->obj);
+        cmd->obj = NULL;
+    }
+
+    lat = ind_fwd_clock_ns() - cmd->enq_ns;
+    flowq.lat_sum_ns += lat;
+    if (lat > flowq.lat_max_ns) {
+        flowq.lat_max_ns = lat;
+    }
+    for (b = 0; b < FLOWQ_LAT_BUCKETS - 1 && (1000ULL << b) <= lat; ++b);
+    ++flowq.lat_hist[b];
+}
+
+
+/** \brief Apply the oldest queued command */
+
+static void
+flowq_apply_one(void)
+{
+    struct flowq_cmd *cmd = &flowq.cmds[flowq.head];
+
+    flowq.head = (flowq.head + 1) % flowq.depth;
+    --flowq.count;
+    flowq_cmd_apply(cmd);
+    ++flowq.cnt_applied;
+}
+
+
+/** \brief Clear the eventfd once the queue is empty */
+
+static void
+flowq_event_clear(void)
+{
+    uint64_t val;
+
+    if (flowq.event_fd >= 0 && read(flowq.event_fd, &val, sizeof(val)) < 0
+        && errno != EAGAIN) {
+        LOG_ERROR("Flow mod queue eventfd read failed: %s", strerror(errno));
+    }
+}
+
+
+/** \brief Apply queued commands for up to one time slice */
+
+static void
+flowq_ready(int socket_id, void *cookie, int read_ready, int write_ready,
+            int error_seen)
+{
+    uint64_t start_ns;
+
+    (void)socket_id;
+    (void)cookie;
+    (void)read_ready;
+    (void)write_ready;
+    (void)error_seen;
+
+    if (flowq.count == 0) {
+        flowq_event_clear();
+        return;
+    }
+
+    ++flowq.cnt_slices;
+    start_ns = ind_fwd_clock_ns();
+    ind_fwd_flow_index_defer();
+    do {
+        flowq_apply_one();
+    } while (flowq.count
+             && ind_fwd_clock_ns() - start_ns < flowq.slice_ns);
+    ind_fwd_flow_index_rebuild();
+
+    /* The eventfd stays readable, so the rest waits for the next pass */
+    if (flowq.count) {
+        ++flowq.cnt_slices_exhausted;
+    } else {
+        flowq_event_clear();
+    }
+}
+
+
+/** \brief Return TRUE if flow mods go through the queue or a batch */
+
+int
+ind_fwd_flowq_enabled(void)
+{
+    return (flowq.cmds != NULL || flowb.open);
+}
+
+
+/** \brief Fill in a command; obj is copied and may be NULL */
+
+static indigo_error_t
+flowq_cmd_init(struct flowq_cmd *cmd, enum fwd_flowq_op op,
+               indigo_cookie_t flow_id, of_object_t *obj,
+               indigo_cookie_t callback_cookie)
+{
+    cmd->obj = NULL;
+    if (obj != NULL && (cmd->obj = of_object_dup(obj)) == NULL) {
+        LOG_ERROR("of_object_dup() failed");
+        return (INDIGO_ERROR_RESOURCE);
+    }
+    cmd->op = op;
+    cmd->flow_id = flow_id;
+    cmd->callback_cookie = callback_cookie;
+    cmd->enq_ns = ind_fwd_clock_ns();
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Stage a flow mod in the open batch */
+
+static indigo_error_t
+flowb_stage(enum fwd_flowq_op op, indigo_cookie_t flow_id,
+            of_object_t *obj, indigo_cookie_t callback_cookie)
+{
+    struct flowq_cmd *cmds;
+    unsigned         size;
+    indigo_error_t   rv;
+
+    if (flowb.count == flowb.size) {
+        size = flowb.size ? 2 * flowb.size : 256;
+        if ((cmds = INDIGO_MEM_ALLOC(size * sizeof(cmds[0]))) == NULL) {
+            LOG_ERROR("INDIGO_MEM_ALLOC() failed");
+            return (INDIGO_ERROR_RESOURCE);
+        }
+        if (flowb.cmds != NULL) {
+            INDIGO_MEM_COPY(cmds, flowb.cmds,
+                            flowb.count * sizeof(cmds[0]));
+            INDIGO_MEM_FREE(flowb.cmds);
+        }
+        flowb.cmds = cmds;
+        flowb.size = size;
+    }
+
+    if (INDIGO_FAILURE(rv = flowq_cmd_init(&flowb.cmds[flowb.count], op,
+                                           flow_id, obj,
+                                           callback_cookie))) {
+        return (rv);
+    }
+    ++flowb.count;
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Queue a flow mod, or stage it if a batch is open
+
+obj is copied and may be NULL.  If the queue is full its oldest command
+is applied first.
+*/
+
+indigo_error_t
+ind_fwd_flowq_push(enum fwd_flowq_op op, indigo_cookie_t flow_id,
+                   of_object_t *obj, indigo_cookie_t callback_cookie)
+{
+    struct flowq_cmd *cmd;
+    uint64_t         one = 1;
+    indigo_error_t   rv;
+
+    if (flowb.open) {
+        return (flowb_stage(op, flow_id, obj, callback_cookie));
+    }
+
+    if (flowq.count == flowq.depth) {
+        ++flowq.cnt_full;
+        flowq_apply_one();
+    }
+
+    cmd = &flowq.cmds[(flowq.head + flowq.count) % flowq.depth];
+    if (INDIGO_FAILURE(rv = flowq_cmd_init(cmd, op, flow_id, obj,
+                                           callback_cookie))) {
+        return (rv);
+    }
+
+    if (flowq.count++ == 0
+        && write(flowq.event_fd, &one, sizeof(one)) < 0) {
+        LOG_ERROR("Flow mod queue eventfd write failed: %s",
+                  strerror(errno));
+    }
+    ++flowq.cnt_queued;
+    if (flowq.count > flowq.depth_max) {
+        flowq.depth_max = flowq.count;
+    }
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Apply everything queued, ahead of a request reading flow state
+
+An open batch is left staged: until its commit, requests see the table
+as it was before the batch, never part of it.
+*/
+
+void
+ind_fwd_flowq_drain(void)
+{
+    if (flowq.count == 0) {
+        return;
+    }
+
+    ++flowq.cnt_drains;
+    ind_fwd_flow_index_defer();
+    while (flowq.count) {
+        flowq_apply_one();
+    }
+    ind_fwd_flow_index_rebuild();
+    flowq_event_clear();
+}
+
+
+/**
+ * \brief Apply every queued flow mod, ahead of a barrier reply
+ *
+ * After a warm restart, the first barrier also swaps the controller's
+ * flows in for the restored ones.
+ */
+
+indigo_error_t
+ind_fwd_flow_barrier(void)
+{
+    ind_fwd_flowq_drain();
+    ind_fwd_restore_hold_end();
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Start staging flow mods */
+
+indigo_error_t
+ind_fwd_flow_batch_begin(void)
+{
+    if (flowb.open) {
+        LOG_ERROR("Flow mod batch already open");
+        return (INDIGO_ERROR_PARAM);
+    }
+
+    flowb.open = 1;
+    LOG_TRACE("Flow mod batch begun");
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Apply every staged flow mod, in order, in one pass */
+
+indigo_error_t
+ind_fwd_flow_batch_commit(void)
+{
+    uint64_t start_ns;
+    unsigned i;
+
+    if (!flowb.open) {
+        LOG_ERROR("No flow mod batch open");
+        return (INDIGO_ERROR_PARAM);
+    }
+    flowb.open = 0;
+
+    /* Anything queued before the batch goes first */
+    ind_fwd_flowq_drain();
+
+    start_ns = ind_fwd_clock_ns();
+    ind_fwd_flow_index_defer();
+    for (i = 0; i < flowb.count; ++i) {
+        flowq_cmd_apply(&flowb.cmds[i]);
+    }
+    ind_fwd_flow_index_rebuild();
+    flowb.last_commit_ns = ind_fwd_clock_ns() - start_ns;
+
+    if (flowb.last_commit_ns > flowb.max_commit_ns) {
+        flowb.max_commit_ns = flowb.last_commit_ns;
+    }
+    if (flowb.count > flowb.count_max) {
+        flowb.count_max = flowb.count;
+    }
+    ++flowb.cnt_batches;
+    flowb.cnt_applied += flowb.count;
+    LOG_TRACE("Flow mod batch of %u committed in %"PRIu64" us",
+              flowb.count, flowb.last_commit_ns / 1000);
+    flowb.count = 0;
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Turn the flow mod queue on or off, or resize it */
+
+indigo_error_t
+ind_fwd_flow_queue_set(unsigned depth, unsigned slice_us)
+{
+    if (depth > FWD_FLOWQ_DEPTH_MAX || (depth && slice_us == 0)) {
+        LOG_ERROR("Flow mod queue: Bad depth %u or slice %u us",
+                  depth, slice_us);
+        return (INDIGO_ERROR_PARAM);
+    }
+
+    /* Pending commands are applied before the ring changes */
+    ind_fwd_flowq_drain();
+
+    if (depth == flowq.depth) {
+        flowq.slice_ns = slice_us * 1000;
+        return (INDIGO_ERROR_NONE);
+    }
+
+    if (flowq.cmds != NULL) {
+        ind_soc_socket_unregister(flowq.event_fd);
+        close(flowq.event_fd);
+        flowq.event_fd = -1;
+        INDIGO_MEM_FREE(flowq.cmds);
+        flowq.cmds = NULL;
+        flowq.depth = 0;
+        flowq.head = 0;
+    }
+
+    if (depth == 0) {
+        LOG_INFO("Flow mod queue off");
+        return (INDIGO_ERROR_NONE);
+    }
+
+    if ((flowq.cmds = INDIGO_MEM_ALLOC(depth * sizeof(flowq.cmds[0])))
+        == NULL) {
+        LOG_ERROR("INDIGO_MEM_ALLOC() failed");
+        return (INDIGO_ERROR_RESOURCE);
+    }
+    if ((flowq.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        LOG_ERROR("eventfd() failed: %s", strerror(errno));
+        goto error;
+    }
+    if (INDIGO_FAILURE(ind_soc_socket_register(flowq.event_fd, flowq_ready,
+                                               NULL))) {
+        LOG_ERROR("ind_soc_socket_register() failed");
+        close(flowq.event_fd);
+        goto error;
+    }
+
+    flowq.depth = depth;
+    flowq.slice_ns = slice_us * 1000;
+    LOG_INFO("Flow mod queue of %u, applied in %u us slices",
+             depth, slice_us);
+
+    return (INDIGO_ERROR_NONE);
+
+ error:
+    INDIGO_MEM_FREE(flowq.cmds);
+    flowq.cmds = NULL;
+    flowq.event_fd = -1;
+    return (INDIGO_ERROR_UNKNOWN);
+}
+
+
+/** \brief Show flow mod queue counters */
+
+void
+ind_fwd_flowq_stats_show(aim_pvs_t *pvs)
+{
+    unsigned b;
+
+    aim_printf(pvs, "flow mod batches: %"PRIu64"%s, flows %"PRIu64", "
+               "largest %u, commit last %"PRIu64" us, max %"PRIu64" us\n",
+               flowb.cnt_batches, flowb.open ? " (one open)" : "",
+               flowb.cnt_applied, flowb.count_max,
+               flowb.last_commit_ns / 1000, flowb.max_commit_ns / 1000);
+
+    if (flowq.cmds == NULL && flowq.cnt_queued == 0) {
+        aim_printf(pvs, "flow mod queue: off\n");
+        return;
+    }
+
+    aim_printf(pvs, "flow mod queue: depth %u/%u, max %u, slice %u us\n",
+               flowq.count, flowq.depth, flowq.depth_max,
+               flowq.slice_ns / 1000);
+    aim_printf(pvs, "  queued %"PRIu64", applied %"PRIu64", "
+               "applied early (full) %"PRIu64", drains %"PRIu64"\n",
+               flowq.cnt_queued, flowq.cnt_applied, flowq.cnt_full,
+               flowq.cnt_drains);
+    aim_printf(pvs, "  slices %"PRIu64", exhausted %"PRIu64"\n",
+               flowq.cnt_slices, flowq.cnt_slices_exhausted);
+    aim_printf(pvs, "  apply latency avg %"PRIu64" us, max %"PRIu64" us,",
+               flowq.cnt_applied
+               ? flowq.lat_sum_ns / flowq.cnt_applied / 1000 : 0,
+               flowq.lat_max_ns / 1000);
+    for (b = 0; b < FLOWQ_LAT_BUCKETS; ++b) {
+        aim_printf(pvs, " %s%uus:%"PRIu64,
+                   b == FLOWQ_LAT_BUCKETS - 1 ? ">=" : "<",
+                   b == FLOWQ_LAT_BUCKETS - 1 ? 1u << (b - 1) : 1u << b,
+                   flowq.lat_hist[b]);
+    }
+    aim_printf(pvs, "\n");
+}
+
+
+/** \brief Drop anything queued or staged and turn the queue off; at
+    module finish */
+
+void
+ind_fwd_flowq_finish(void)
+{
+    unsigned i;
+
+    for (i = 0; i < flowb.count; ++i) {
+        if (flowb.cmds[i].obj != NULL) {
+            of_object_delete(flowb.cmds[i].obj);
+        }
+    }
+    if (flowb.cmds != NULL) {
+        INDIGO_MEM_FREE(flowb.cmds);
+    }
+    INDIGO_MEM_SET(&flowb, 0, sizeof(flowb));
+
+    while (flowq.count) {
+        if (flowq.cmds[flowq.head].obj != NULL) {
+            of_object_delete(flowq.cmds[flowq.head].obj);
+        }
+        flowq.head = (flowq.head + 1) % flowq.depth;
+        --flowq.count;
+    }
+    (void)ind_fwd_flow_queue_set(0, 0);
+}
@@ -0,0 +1,745 @@
+/****************************************************************
+ *
+ *        Copyright 2013, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ***************************************************************/
+
+/**
+ * @file
+ * @brief OpenFlow group table
+ *
+ * All, select, indirect and fast-failover groups.  A select group
+ * spreads flows over its buckets through a table of hash slots, each
+ * naming a bucket; the slot is picked by hashing the packet's FME key,
+ * which the pipeline has already extracted.  When a bucket goes dead
+ * only the slots that pointed at it are handed to the survivors, so
+ * flows on live buckets keep their path.
+ */
+
+#include "forwarding_log.h"
+#include "forwarding_int.h"
+#include <Forwarding/forwarding.h>
+#include <Forwarding/forwarding_porting.h>
+
+#include <indigo/memory.h>
+#include <BigList/biglist.h>
+#include <murmur/murmur.h>
+
+#define GROUP_HASH_TABLE_LEN  64    /**< Group id hash buckets; power of 2 */
+#define GROUP_BUCKETS_MAX     64    /**< Buckets per group */
+#define GROUP_SELECT_SLOTS    256   /**< Select hash slots; power of 2 */
+#define GROUP_SLOT_NONE       0xff  /**< Slot with no live bucket */
+#define GROUP_CHAIN_MAX       8     /**< Nesting of group actions */
+#define GROUP_ID_MAX          0xffffff00
+#define GROUP_WATCH_PORT_ANY  0xffffffff
+
+#define LOXI_SUCCESS(x)  ((x) == OF_ERROR_NONE)
+#define LOXI_FAILURE(x)  (!LOXI_SUCCESS(x))
+
+/* Short hand logging macros */
+#define LOG_ERROR AIM_LOG_ERROR
+#define LOG_TRACE AIM_LOG_TRACE
+
+struct group_bucket {
+    of_list_action_t *of_list_action;
+    uint16_t         weight;
+    of_port_no_t     watch_port;
+    uint32_t         watch_group;
+    uint8_t          live;
+    uint64_t         cnt_pkts;
+    uint64_t         cnt_bytes;
+};
+
+struct group {
+    uint32_t            id;
+    uint8_t             type;         /**< OF_GROUP_TYPE_* */
+    unsigned            n_buckets;
+    struct group_bucket *buckets;
+    uint8_t             slots[GROUP_SELECT_SLOTS];  /**< Select only */
+    uint64_t            cnt_pkts;
+    uint64_t            cnt_bytes;
+};
+
+static biglist_t *group_ht[GROUP_HASH_TABLE_LEN];
+
+/* Ports reported down; anything else is taken to be live */
+static biglist_t *dead_ports;
+
+static unsigned group_depth;    /**< Current group action nesting */
+
+
+static inline unsigned
+group_hash(uint32_t id)
+{
+    return id & (GROUP_HASH_TABLE_LEN - 1);
+}
+
+static struct group *
+group_find(uint32_t id)
+{
+    biglist_t *ble;
+    struct group *group;
+
+    BIGLIST_FOREACH(ble, group_ht[group_hash(id)]) {
+        group = BIGLIST_CAST(struct group *, ble);
+        if (group->id == id)  return group;
+    }
+
+    return NULL;
+}
+
+static int
+port_is_live(of_port_no_t of_port_num)
+{
+    return biglist_find(dead_ports, (void *)(uintptr_t) of_port_num) == NULL;
+}
+
+
+/** \brief Liveness of one bucket from its watch port and group */
+
+static int
+bucket_is_live(struct group_bucket *bucket)
+{
+    struct group *watched;
+    unsigned i;
+
+    if (bucket->watch_port != GROUP_WATCH_PORT_ANY
+        && !port_is_live(bucket->watch_port)) {
+        return 0;
+    }
+
+    /* Live if any bucket of the watched group is, as last computed */
+    if (bucket->watch_group != OF_GROUP_ANY) {
+        if ((watched = group_find(bucket->watch_group)) == NULL) {
+            return 0;
+        }
+        for (i = 0; i < watched->n_buckets; i++) {
+            if (watched->buckets[i].live)  return 1;
+        }
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/**
+ * \brief Bring a select group's slot table in line with bucket liveness
+ *
+ * Each live bucket is owed a share of slots proportional to its weight.
+ * Slots held by dead buckets, and any excess over a bucket's share, are
+ * released and handed to buckets below their share; all other slots
+ * stay where they are.
+ */
+
+static void
+select_slots_rebalance(struct group *group)
+{
+    unsigned target[GROUP_BUCKETS_MAX], cur[GROUP_BUCKETS_MAX];
+    uint32_t total_weight = 0;
+    unsigned assigned = 0, i, b, s;
+
+    for (i = 0; i < group->n_buckets; i++) {
+        cur[i] = 0;
+        target[i] = 0;
+        if (group->buckets[i].live) {
+            total_weight += group->buckets[i].weight;
+        }
+    }
+
+    if (total_weight == 0) {
+        FORWARDING_MEMSET(group->slots, GROUP_SLOT_NONE, sizeof(group->slots));
+        return;
+    }
+
+    for (i = 0; i < group->n_buckets; i++) {
+        if (group->buckets[i].live) {
+            target[i] = GROUP_SELECT_SLOTS * group->buckets[i].weight
+                / total_weight;
+            assigned += target[i];
+        }
+    }
+    /* Rounding remainder goes to the first weighted live buckets */
+    for (i = 0; assigned < GROUP_SELECT_SLOTS; i = (i + 1) % group->n_buckets) {
+        if (group->buckets[i].live && group->buckets[i].weight > 0) {
+            ++target[i];
+            ++assigned;
+        }
+    }
+
+    for (s = 0; s < GROUP_SELECT_SLOTS; s++) {
+        b = group->slots[s];
+        if (b == GROUP_SLOT_NONE || b >= group->n_buckets
+            || cur[b] >= target[b]) {
+            group->slots[s] = GROUP_SLOT_NONE;
+        } else {
+            ++cur[b];
+        }
+    }
+
+    for (s = 0, b = 0; s < GROUP_SELECT_SLOTS; s++) {
+        if (group->slots[s] != GROUP_SLOT_NONE)  continue;
+        while (cur[b] >= target[b])  ++b;
+        group->slots[s] = b;
+        ++cur[b];
+    }
+}
+
+
+/**
+ * \brief Recompute bucket liveness; rebalance select groups that changed
+ *
+ * Returns whether any bucket changed.
+ */
+
+static int
+group_liveness_update(struct group *group)
+{
+    unsigned i, changed = 0;
+    uint8_t live;
+
+    for (i = 0; i < group->n_buckets; i++) {
+        live = bucket_is_live(&group->buckets[i]);
+        if (live != group->buckets[i].live) {
+            group->buckets[i].live = live;
+            changed = 1;
+        }
+    }
+
+    if (changed && group->type == OF_GROUP_TYPE_SELECT) {
+        select_slots_rebalance(group);
+    }
+
+    return changed;
+}
+
+/**
+ * \brief Recompute the liveness of every group
+ *
+ * A group watching one visited after it sees that group's old
+ * liveness, so passes repeat until none changes anything.  Each pass
+ * settles at least one more link of every watch chain; the bound on
+ * passes only guards against watch cycles.
+ */
+
+static void
+group_liveness_update_all(void)
+{
+    biglist_t *ble;
+    unsigned idx, n_groups, pass = 0;
+    int changed;
+
+    do {
+        changed = 0;
+        n_groups = 0;
+        for (idx = 0; idx < GROUP_HASH_TABLE_LEN; idx++) {
+            BIGLIST_FOREACH(ble, group_ht[idx]) {
+                changed |= group_liveness_update(BIGLIST_CAST(struct group *,
+                                                              ble));
+                ++n_groups;
+            }
+        }
+    } while (changed && ++pass <= n_groups);
+}
+
+
+static void
+group_buckets_free(struct group_bucket *buckets, unsigned n_buckets)
+{
+    unsigned i;
+
+    for (i = 0; i < n_buckets; i++) {
+        if (buckets[i].of_list_action) {
+            of_list_action_delete(buckets[i].of_list_action);
+        }
+    }
+    INDIGO_MEM_FREE(buckets);
+}
+
+
+/** \brief Build the bucket array for a group mod, validating against type */
+
+static indigo_error_t
+group_buckets_parse(uint8_t type,
+                    of_list_bucket_t *of_list_bucket,
+                    struct group_bucket **buckets_out,
+                    unsigned *n_buckets_out)
+{
+    indigo_error_t      result = INDIGO_ERROR_NONE;
+    struct group_bucket *buckets, *bucket;
+    of_bucket_t         of_bucket[1];
+    unsigned            n_buckets = 0;
+    int                 rv;
+
+    buckets = INDIGO_MEM_ALLOC(GROUP_BUCKETS_MAX * sizeof(*buckets));
+    if (buckets == NULL) {
+        LOG_ERROR("INDIGO_MEM_ALLOC() failed");
+        return INDIGO_ERROR_RESOURCE;
+    }
+    FORWARDING_MEMSET(buckets, 0, GROUP_BUCKETS_MAX * sizeof(*buckets));
+
+    OF_LIST_BUCKET_ITER(of_list_bucket, of_bucket, rv) {
+        if (n_buckets == GROUP_BUCKETS_MAX) {
+            LOG_ERROR("Too many buckets in group");
+            result = INDIGO_ERROR_RESOURCE;
+            goto done;
+        }
+        bucket = &buckets[n_buckets++];
+
+        of_bucket_weight_get(of_bucket, &bucket->weight);
+        of_bucket_watch_port_get(of_bucket, &bucket->watch_port);
+        of_bucket_watch_group_get(of_bucket, &bucket->watch_group);
+        bucket->of_list_action = of_bucket_actions_get(of_bucket);
+        if (bucket->of_list_action == NULL) {
+            LOG_ERROR("of_bucket_actions_get() failed");
+            result = INDIGO_ERROR_UNKNOWN;
+            goto done;
+        }
+
+        if (type == OF_GROUP_TYPE_FF
+            && bucket->watch_port == GROUP_WATCH_PORT_ANY
+            && bucket->watch_group == OF_GROUP_ANY) {
+            LOG_ERROR("Fast-failover bucket without watch port or group");
+            result = INDIGO_ERROR_PARAM;
+            goto done;
+        }
+        if (type != OF_GROUP_TYPE_SELECT) {
+            bucket->weight = 1;
+        }
+    }
+
+    if (rv != OF_ERROR_NONE && rv != OF_ERROR_RANGE) {
+        LOG_ERROR("of_list_bucket_first/next() failed");
+        result = INDIGO_ERROR_PARAM;
+        goto done;
+    }
+
+    if (type == OF_GROUP_TYPE_INDIRECT && n_buckets != 1) {
+        LOG_ERROR("Indirect group needs exactly one bucket");
+        result = INDIGO_ERROR_PARAM;
+        goto done;
+    }
+
+ done:
+    if (INDIGO_FAILURE(result)) {
+        group_buckets_free(buckets, n_buckets);
+        return result;
+    }
+
+    *buckets_out = buckets;
+    *n_buckets_out = n_buckets;
+    return INDIGO_ERROR_NONE;
+}
+
+
+/** \brief Install new buckets in a group, replacing any it had */
+
+static void
+group_buckets_install(struct group *group, uint8_t type,
+                      struct group_bucket *buckets, unsigned n_buckets)
+{
+    unsigned i;
+
+    if (group->buckets) {
+        group_buckets_free(group->buckets, group->n_buckets);
+    }
+
+    group->type = type;
+    group->buckets = buckets;
+    group->n_buckets = n_buckets;
+
+    for (i = 0; i < n_buckets; i++) {
+        buckets[i].live = bucket_is_live(&buckets[i]);
+    }
+
+    FORWARDING_MEMSET(group->slots, GROUP_SLOT_NONE, sizeof(group->slots));
+    if (type == OF_GROUP_TYPE_SELECT) {
+        select_slots_rebalance(group);
+    }
+}
+
+
+static void
+group_free(struct group *group)
+{
+    group_buckets_free(group->buckets, group->n_buckets);
+    INDIGO_MEM_FREE(group);
+}
+
+static void
+group_delete(struct group *group)
+{
+    biglist_t **bl = &group_ht[group_hash(group->id)];
+
+    *bl = biglist_remove(*bl, group);
+    group_free(group);
+}
+
+
+/** \brief Whether a flow sends to the group *cookie, or any for OF_GROUP_ALL */
+
+static int
+group_flow_pick(struct fme_flow_data *flow, void *cookie)
+{
+    uint32_t    id = *(uint32_t *)cookie, group_id;
+    of_action_t of_action[1];
+    int         rv;
+
+    if (flow->of_list_action == NULL) {
+        return 0;
+    }
+
+    OF_LIST_ACTION_ITER(flow->of_list_action, of_action, rv) {
+        if (of_action->header.object_id != OF_ACTION_GROUP)  continue;
+        if (id == OF_GROUP_ALL)  return 1;
+        of_action_group_group_id_get(&of_action->group, &group_id);
+        if (group_id == id)  return 1;
+    }
+
+    return 0;
+}
+
+
+/** \brief Add, modify or delete a group */
+
+indigo_error_t
+ind_fwd_group_mod(of_group_mod_t *group_mod)
+{
+    indigo_error_t      result = INDIGO_ERROR_NONE;
+    struct group        *group;
+    struct group_bucket *buckets = NULL;
+    unsigned            n_buckets = 0, idx;
+    of_list_bucket_t    of_list_bucket[1];
+    uint32_t            id;
+    uint8_t             type;
+
+    /* Flow mods sent before the group mod come first */
+    ind_fwd_flowq_drain();
+
+    of_group_mod_group_id_get(group_mod, &id);
+    of_group_mod_group_type_get(group_mod, &type);
+
+    LOG_TRACE("Group mod %s for group %u",
+              of_object_id_str[group_mod->object_id], id);
+
+    if (group_mod->object_id == OF_GROUP_DELETE) {
+        /* Flows sending to the group go with it, as OF 1.3 specifies */
+        if (id == OF_GROUP_ALL || group_find(id) != NULL) {
+            ind_fwd_flows_remove(group_flow_pick, &id);
+        }
+        if (id == OF_GROUP_ALL) {
+            for (idx = 0; idx < GROUP_HASH_TABLE_LEN; idx++) {
+                while (group_ht[idx] != NULL) {
+                    group_delete(BIGLIST_CAST(struct group *, group_ht[idx]));
+                }
+            }
+        } else if ((group = group_find(id)) != NULL) {
+            group_delete(group);
+        }
+        /* Buckets watching deleted groups may have died */
+        group_liveness_update_all();
+        return INDIGO_ERROR_NONE;
+    }
+
+    if (type != OF_GROUP_TYPE_ALL && type != OF_GROUP_TYPE_SELECT
+        && type != OF_GROUP_TYPE_INDIRECT && type != OF_GROUP_TYPE_FF) {
+        LOG_ERROR("Bad group type %d", type);
+        return INDIGO_ERROR_PARAM;
+    }
+
+    if (id > GROUP_ID_MAX) {
+        LOG_ERROR("Bad group id %u", id);
+        return INDIGO_ERROR_PARAM;
+    }
+
+    group = group_find(id);
+
+    switch (group_mod->object_id) {
+    case OF_GROUP_ADD:
+        if (group != NULL) {
+            LOG_ERROR("Group %u exists", id);
+            return INDIGO_ERROR_EXISTS;
+        }
+        break;
+    case OF_GROUP_MODIFY:
+        if (group == NULL) {
+            LOG_ERROR("Group %u not found", id);
+            return INDIGO_ERROR_NOT_FOUND;
+        }
+        break;
+    default:
+        LOG_ERROR("Unsupported group mod: %d", group_mod->object_id);
+        return INDIGO_ERROR_NOT_SUPPORTED;
+    }
+
+    of_group_mod_buckets_bind(group_mod, of_list_bucket);
+    if (INDIGO_FAILURE(result = group_buckets_parse(type, of_list_bucket,
+                                                    &buckets, &n_buckets))) {
+        return result;
+    }
+
+    if (group == NULL) {
+        group = INDIGO_MEM_ALLOC(sizeof(*group));
+        if (group == NULL) {
+            LOG_ERROR("INDIGO_MEM_ALLOC() failed");
+            group_buckets_free(buckets, n_buckets);
+            return INDIGO_ERROR_RESOURCE;
+        }
+        FORWARDING_MEMSET(group, 0, sizeof(*group));
+        group->id = id;
+        group_ht[group_hash(id)] = biglist_prepend(group_ht[group_hash(id)],
+                                                   group);
+    }
+
+    group_buckets_install(group, type, buckets, n_buckets);
+
+    /* Buckets watching this group may have come alive */
+    group_liveness_update_all();
+
+    return INDIGO_ERROR_NONE;
+}
+
+
+/** \brief Record a port going up or down; rebalances select groups */
+
+void
+ind_fwd_group_port_status_set(of_port_no_t of_port_num, int live)
+{
+    if (live == port_is_live(of_port_num)) {
+        return;
+    }
+
+    LOG_TRACE("Port %d is now %s", of_port_num, live ? "live" : "dead");
+
+    if (live) {
+        dead_ports = biglist_remove(dead_ports, (void *)(uintptr_t) of_port_num);
+    } else {
+        dead_ports = biglist_prepend(dead_ports, (void *)(uintptr_t) of_port_num);
+    }
+
+    group_liveness_update_all();
+}
+
+
+static indigo_error_t
+group_bucket_do(struct group_bucket *bucket,
+                of_port_no_t in_port,
+                uint8_t *data,
+                unsigned len)
+{
+    ++bucket->cnt_pkts;
+    bucket->cnt_bytes += len;
+
+    return ind_fwd_bucket_actions_do(in_port, data, len,
+                                     bucket->of_list_action);
+}
+
+
+/** \brief Send a packet through a group */
+
+indigo_error_t
+ind_fwd_group_execute(uint32_t group_id,
+                      of_port_no_t in_port,
+                      uint8_t *data,
+                      unsigned len,
+                      fme_key_t *fme_key)
+{
+    indigo_error_t result = INDIGO_ERROR_NONE, rv;
+    struct group   *group;
+    unsigned       i, slot;
+
+    if ((group = group_find(group_id)) == NULL) {
+        LOG_TRACE("Group %u not found", group_id);
+        return INDIGO_ERROR_NOT_FOUND;
+    }
+
+    if (group_depth >= GROUP_CHAIN_MAX) {
+        LOG_ERROR("Group %u nested too deeply", group_id);
+        return INDIGO_ERROR_RANGE;
+    }
+
+    ++group->cnt_pkts;
+    group->cnt_bytes += len;
+
+    ++group_depth;
+
+    switch (group->type) {
+    case OF_GROUP_TYPE_ALL:
+        for (i = 0; i < group->n_buckets; i++) {
+            rv = group_bucket_do(&group->buckets[i], in_port, data, len);
+            if (INDIGO_FAILURE(rv))  result = rv;
+        }
+        break;
+
+    case OF_GROUP_TYPE_SELECT:
+        slot = murmur_hash(fme_key->values, fme_key->size, group_id)
+            & (GROUP_SELECT_SLOTS - 1);
+        i = group->slots[slot];
+        if (i != GROUP_SLOT_NONE) {
+            result = group_bucket_do(&group->buckets[i], in_port, data, len);
+        }
+        break;
+
+    case OF_GROUP_TYPE_INDIRECT:
+        result = group_bucket_do(&group->buckets[0], in_port, data, len);
+        break;
+
+    case OF_GROUP_TYPE_FF:
+        for (i = 0; i < group->n_buckets; i++) {
+            if (group->buckets[i].live) {
+                result = group_bucket_do(&group->buckets[i], in_port,
+                                         data, len);
+                break;
+            }
+        }
+        break;
+    }
+
+    --group_depth;
+
+    return result;
+}
+
+
+static indigo_error_t
+group_stats_entry_append(of_list_group_stats_entry_t *list,
+                         struct group *group)
+{
+    indigo_error_t              result = INDIGO_ERROR_NONE;
+    of_group_stats_entry_t      *entry = NULL;
+    of_list_bucket_counter_t    *counters = NULL;
+    of_bucket_counter_t         *counter = NULL;
+    unsigned                    i;
+
+    if ((entry = of_group_stats_entry_new(list->version)) == NULL
+        || (counters = of_list_bucket_counter_new(list->version)) == NULL
+        || (counter = of_bucket_counter_new(list->version)) == NULL) {
+        LOG_ERROR("Failed to allocate group stats");
+        result = INDIGO_ERROR_RESOURCE;
+        goto done;
+    }
+
+    for (i = 0; i < group->n_buckets; i++) {
+        of_bucket_counter_packet_count_set(counter,
+                                           group->buckets[i].cnt_pkts);
+        of_bucket_counter_byte_count_set(counter,
+                                         group->buckets[i].cnt_bytes);
+        if (LOXI_FAILURE(of_list_bucket_counter_append(counters, counter))) {
+            LOG_ERROR("of_list_bucket_counter_append() failed");
+            result = INDIGO_ERROR_UNKNOWN;
+            goto done;
+        }
+    }
+
+    of_group_stats_entry_group_id_set(entry, group->id);
+    of_group_stats_entry_packet_count_set(entry, group->cnt_pkts);
+    of_group_stats_entry_byte_count_set(entry, group->cnt_bytes);
+    if (LOXI_FAILURE(of_group_stats_entry_bucket_stats_set(entry, counters))
+        || LOXI_FAILURE(of_list_group_stats_entry_append(list, entry))) {
+        LOG_ERROR("Failed to append group stats entry");
+        result = INDIGO_ERROR_UNKNOWN;
+    }
+
+ done:
+    of_bucket_counter_delete(counter);
+    of_list_bucket_counter_delete(counters);
+    of_group_stats_entry_delete(entry);
+
+    return result;
+}
+
+
+/** \brief Build a group stats reply for one group, or OF_GROUP_ALL */
+
+indigo_error_t
+ind_fwd_group_stats_get(of_group_stats_request_t *request,
+                        of_group_stats_reply_t **reply)
+{
+    indigo_error_t              result = INDIGO_ERROR_NONE;
+    of_list_group_stats_entry_t *list = NULL;
+    struct group                *group;
+    biglist_t                   *ble;
+    uint32_t                    id, xid;
+    unsigned                    idx;
+
+    *reply = NULL;
+
+    of_group_stats_request_group_id_get(request, &id);
+
+    if ((*reply = of_group_stats_reply_new(request->version)) == NULL
+        || (list = of_list_group_stats_entry_new(request->version)) == NULL) {
+        LOG_ERROR("Failed to allocate group stats reply");
+        result = INDIGO_ERROR_RESOURCE;
+        goto done;
+    }
+
+    of_group_stats_request_xid_get(request, &xid);
+    of_group_stats_reply_xid_set(*reply, xid);
+
+    if (id == OF_GROUP_ALL) {
+        for (idx = 0; idx < GROUP_HASH_TABLE_LEN; idx++) {
+            BIGLIST_FOREACH(ble, group_ht[idx]) {
+                group = BIGLIST_CAST(struct group *, ble);
+                if (INDIGO_FAILURE(result = group_stats_entry_append(list,
+                                                                     group))) {
+                    goto done;
+                }
+            }
+        }
+    } else if ((group = group_find(id)) != NULL) {
+        if (INDIGO_FAILURE(result = group_stats_entry_append(list, group))) {
+            goto done;
+        }
+    } else {
+        result = INDIGO_ERROR_NOT_FOUND;
+        goto done;
+    }
+
+    if (LOXI_FAILURE(of_group_stats_reply_entries_set(*reply, list))) {
+        LOG_ERROR("of_group_stats_reply_entries_set() failed");
+        result = INDIGO_ERROR_UNKNOWN;
+    }
+
+ done:
+    of_list_group_stats_entry_delete(list);
+    if (INDIGO_FAILURE(result)) {
+        of_group_stats_reply_delete(*reply);
+        *reply = NULL;
+    }
+
+    return result;
+}
+
+
+/** \brief Free all groups */
+
+void
+ind_fwd_group_finish(void)
+{
+    biglist_t *ble;
+    unsigned idx;
+
+    for (idx = 0; idx < GROUP_HASH_TABLE_LEN; idx++) {
+        BIGLIST_FOREACH(ble, group_ht[idx]) {
+            group_free(BIGLIST_CAST(struct group *, ble));
+        }
+        biglist_free(group_ht[idx]);
+        group_ht[idx] = NULL;
+    }
+
+    biglist_free(dead_ports);
+    dead_ports = NULL;
+}
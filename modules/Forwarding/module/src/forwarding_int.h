@@ -24,7 +24,215 @@
 #include <Forwarding/forwarding_config.h>
 #include <Forwarding/forwarding.h>
 #include <cjson/cJSON.h>
+#include <FME/fme.h>
+#include <time.h>
 
 extern const struct ind_cfg_ops ind_fwd_cfg_ops;
 
+/**
+ * \brief Compact flow key
+ *
+ * Holds only the key bytes a flow's mask covers, named by a byte map:
+ * OF 1.0 fields such as the VLAN id and priority share bytes, so bytes
+ * rather than fields are what is kept.  Values come first, then masks
+ * for the bytes whose mask is partial; other kept bytes have a full
+ * mask.  Exact flows keep their key this way instead of in an FME
+ * entry.
+ */
+struct fwd_ckey {
+    uint64_t vmap;              /* Key bytes kept */
+    uint64_t pmap;              /* Kept bytes with a partial mask */
+    uint32_t keymask;           /* FME header keymask */
+    uint8_t  size;              /* Key size in bytes */
+    uint8_t  n_values;          /* Bytes in vmap */
+    uint8_t  data[];            /* Values of vmap, then masks of pmap */
+};
+
+/** \brief Largest key a compact key can hold */
+#define FWD_CKEY_SIZE_MAX 64
+
+extern unsigned ind_fwd_ckey_size(const fme_key_t *key);
+extern void ind_fwd_ckey_pack(const fme_key_t *key, struct fwd_ckey *ckey);
+extern void ind_fwd_ckey_expand(const struct fwd_ckey *ckey, fme_key_t *key);
+extern unsigned ind_fwd_ckey_bytes(const struct fwd_ckey *ckey);
+
+#define FWD_CACHE_LINE 64
+
+/**
+ * \brief Per-flow data, hung off the FME entry cookie
+ *
+ * One allocation, aligned to a cache line.  What a packet matching the
+ * flow reads and writes is on a line of its own; an exact flow's
+ * compact key follows on the next, so an exact match touches two
+ * lines.  Data for flow mods, stats requests and table upkeep comes
+ * first, out of the way.
+ */
+struct fme_flow_data {
+    /* Cold */
+    indigo_cookie_t  flow_id;         /* Flow id */
+    uint64_t         cookie;          /* Controller's flow cookie */
+    fme_entry_t*     fme_entry;       /* FME entry; NULL if exact */
+    struct fwd_ckey  *ckey;           /* Compact key in key[]; NULL if none */
+    uint32_t         exact_hash;      /* Hash of key, if in exact tier */
+    uint32_t         table_idx;       /* Slot in the table's flow array */
+    uint8_t          exact;           /* Stored in the exact tier, not FME */
+    uint8_t          table_id;        /* Table holding the flow */
+    uint8_t          retired;         /* Deleted, forwarding until a swap */
+
+    /* Hot */
+    uint64_t         cnt_pkts         /* Running count of matched packets */
+                         __attribute__((aligned(FWD_CACHE_LINE)));
+    uint64_t         cnt_bytes;       /* Running sum of sizes of matched packets */
+    time_t           last_hit;        /* Time of last match, for idle timeout */
+    time_t           hard_expiry;     /* Hard timeout deadline; 0 for none */
+    of_list_action_t *of_list_action; /* Actions, interned */
+    uint32_t         meter_id;        /* Meter applied on match; 0 for none */
+    uint16_t         idle_timeout;    /* Seconds; 0 for none */
+    uint16_t         prio;            /* Flow priority */
+    uint8_t          exact_shape;     /* Exact tier key shape index */
+    uint8_t          goto_table;      /* Next table, or FWD_TABLE_NONE */
+
+    /* Compact key of an exact flow, as struct fwd_ckey */
+    uint64_t         key[] __attribute__((aligned(FWD_CACHE_LINE)));
+};
+
+/** \brief The compact key of a flow in the exact tier */
+#define FWD_FLOW_CKEY(flow) ((struct fwd_ckey *)(flow)->key)
+
+extern struct fme_flow_data *ind_fwd_flow_alloc(const fme_key_t *key,
+                                                int exact);
+extern void ind_fwd_flow_free(struct fme_flow_data *flow);
+
+/** \brief Flow data goto_table value when the pipeline ends at the flow */
+#define FWD_TABLE_NONE 0xff
+
+/** \brief A flow's full key, expanded into scratch if compact */
+extern const fme_key_t *ind_fwd_flow_key(const struct fme_flow_data *flow,
+                                         fme_key_t *scratch);
+
+/****************************************************************
+ * Exact-match tier
+ *
+ * Flows without wildcards are kept in a cuckoo hash in front of
+ * the FME rather than in the priority-ordered wildcard table.
+ ****************************************************************/
+
+typedef struct ind_fwd_exact_s ind_fwd_exact_t;
+
+extern indigo_error_t ind_fwd_exact_create(ind_fwd_exact_t **et);
+extern void ind_fwd_exact_destroy(ind_fwd_exact_t *et);
+extern indigo_error_t ind_fwd_exact_insert(ind_fwd_exact_t *et,
+                                           struct fme_flow_data *flow);
+extern void ind_fwd_exact_remove(ind_fwd_exact_t *et,
+                                 struct fme_flow_data *flow);
+extern struct fme_flow_data *ind_fwd_exact_lookup(ind_fwd_exact_t *et,
+                                                  fme_key_t *key,
+                                                  time_t now);
+extern unsigned ind_fwd_exact_count(ind_fwd_exact_t *et);
+extern unsigned ind_fwd_exact_buckets(ind_fwd_exact_t *et);
+
+/****************************************************************
+ * Interned action lists
+ *
+ * Flows hold shared, read-only action lists, one per distinct list.
+ ****************************************************************/
+
+extern of_list_action_t *ind_fwd_actions_intern(of_list_action_t *actions);
+extern void ind_fwd_actions_release(of_list_action_t *actions);
+extern void ind_fwd_actions_stats_get(unsigned *lists, unsigned *refs,
+                                      uint64_t *bytes);
+extern void ind_fwd_actions_finish(void);
+
+/****************************************************************
+ * Group table
+ ****************************************************************/
+
+extern indigo_error_t ind_fwd_group_execute(uint32_t group_id,
+                                            of_port_no_t in_port,
+                                            uint8_t *data,
+                                            unsigned len,
+                                            fme_key_t *fme_key);
+extern void ind_fwd_group_finish(void);
+
+/* Apply a bucket's actions to a copy of the packet; in forwarding.c */
+extern indigo_error_t ind_fwd_bucket_actions_do(of_port_no_t in_port,
+                                                uint8_t *data,
+                                                unsigned len,
+                                                of_list_action_t *of_list_action);
+
+/****************************************************************
+ * Meter table
+ ****************************************************************/
+
+#define METER_RESULT_DROP  (-1)
+#define METER_RESULT_PASS  0
+
+extern uint64_t ind_fwd_clock_ns(void);
+extern indigo_error_t ind_fwd_meter_flow_attach(uint32_t meter_id);
+extern void ind_fwd_meter_flow_detach(uint32_t meter_id);
+extern int ind_fwd_meter_apply(uint32_t meter_id, unsigned len,
+                               uint64_t now_ns);
+extern void ind_fwd_meter_finish(void);
+
+/****************************************************************
+ * Flow mod command queue and batches
+ ****************************************************************/
+
+enum fwd_flowq_op {
+    FWD_FLOWQ_ADD,
+    FWD_FLOWQ_MODIFY,
+    FWD_FLOWQ_DELETE
+};
+
+extern int ind_fwd_flowq_enabled(void);
+extern indigo_error_t ind_fwd_flowq_push(enum fwd_flowq_op op,
+                                         indigo_cookie_t flow_id,
+                                         of_object_t *obj,
+                                         indigo_cookie_t callback_cookie);
+extern void ind_fwd_flowq_drain(void);
+extern void ind_fwd_flowq_stats_show(aim_pvs_t *pvs);
+extern void ind_fwd_flowq_finish(void);
+
+/* Flow mods as applied, issuing the core callback; in forwarding.c */
+extern void ind_fwd_flow_create_apply(indigo_cookie_t flow_id,
+                                      of_flow_add_t *flow_add,
+                                      indigo_cookie_t callback_cookie);
+extern void ind_fwd_flow_modify_apply(indigo_cookie_t flow_id,
+                                      of_flow_modify_t *flow_modify,
+                                      indigo_cookie_t callback_cookie);
+extern void ind_fwd_flow_delete_apply(indigo_cookie_t flow_id,
+                                      indigo_cookie_t callback_cookie);
+extern void ind_fwd_flow_index_defer(void);
+extern void ind_fwd_flow_index_rebuild(void);
+
+extern void ind_fwd_stats_show(aim_pvs_t *pvs);
+
+/****************************************************************
+ * Flow table snapshot
+ ****************************************************************/
+
+/* Restore hold used when the configuration gives none; the controller's
+   first barrier normally ends it well before */
+#define FWD_RESTORE_HOLD_MS_DEFAULT 3000
+
+extern void ind_fwd_restore_hold_end(void);
+
+extern indigo_error_t ind_fwd_snapshot_write(const char *path,
+                                             unsigned of_version,
+                                             unsigned n_tables);
+extern unsigned ind_fwd_snapshot_load(const char *path,
+                                      unsigned of_version,
+                                      unsigned n_tables);
+
+/* In forwarding.c */
+extern indigo_error_t ind_fwd_flow_restore(struct fme_flow_data *flow,
+                                           fme_key_t *key,
+                                           int exact);
+extern void ind_fwd_flow_foreach(void (*f)(struct fme_flow_data *flow,
+                                           void *cookie),
+                                 void *cookie);
+extern unsigned ind_fwd_flows_remove(int (*pick)(struct fme_flow_data *flow,
+                                                 void *cookie),
+                                     void *cookie);
+
 #endif /* __FORWARDING_INT_H__ */
@@ -0,0 +1,149 @@
+/****************************************************************
+ *
+ *        Copyright 2013, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ***************************************************************/
+
+/**
+ * @file
+ * @brief Compact flow keys
+ *
+ * An FME key carries full-width values and masks for the whole OF 1.0
+ * header whatever the flow matches on.  A compact key keeps the bytes
+ * the mask covers and a map of where they go; it is expanded back to a
+ * full key only off the packet path, e.g. to save a snapshot.
+ */
+
+#include "forwarding_log.h"
+#include "forwarding_int.h"
+#include <Forwarding/forwarding_porting.h>
+
+#include <stddef.h>
+
+/* Short hand logging macros */
+#define LOG_ERROR AIM_LOG_ERROR
+#define LOG_TRACE AIM_LOG_TRACE
+
+
+/**
+ * \brief Memory a full key takes packed
+ *
+ * Returns 0 if the key is too big or has value bits outside its mask,
+ * which a compact key can't represent.
+ */
+
+unsigned
+ind_fwd_ckey_size(const fme_key_t *key)
+{
+    unsigned n = 0, i;
+
+    if (key->size < 0 || key->size > FWD_CKEY_SIZE_MAX) {
+        return 0;
+    }
+
+    for (i = 0; i < key->size; i++) {
+        if (key->values[i] & ~key->masks[i]) {
+            return 0;
+        }
+        if (key->masks[i] != 0) {
+            n += (key->masks[i] != 0xff) ? 2 : 1;
+        }
+    }
+
+    return offsetof(struct fwd_ckey, data) + n;
+}
+
+
+/** \brief Pack a full key into ind_fwd_ckey_size() bytes at ckey */
+
+void
+ind_fwd_ckey_pack(const fme_key_t *key, struct fwd_ckey *ckey)
+{
+    unsigned i;
+    uint8_t  *p;
+
+    ckey->vmap = 0;
+    ckey->pmap = 0;
+    ckey->keymask = key->keymask;
+    ckey->size = key->size;
+    ckey->n_values = 0;
+
+    for (i = 0; i < key->size; i++) {
+        if (key->masks[i] == 0) {
+            continue;
+        }
+        ckey->vmap |= 1ULL << i;
+        ckey->data[ckey->n_values++] = key->values[i];
+        if (key->masks[i] != 0xff) {
+            ckey->pmap |= 1ULL << i;
+        }
+    }
+
+    p = ckey->data + ckey->n_values;
+    for (i = 0; i < key->size; i++) {
+        if (ckey->pmap & (1ULL << i)) {
+            *p++ = key->masks[i];
+        }
+    }
+}
+
+
+/** \brief Expand a compact key into a full one; the dumper is not set */
+
+void
+ind_fwd_ckey_expand(const struct fwd_ckey *ckey, fme_key_t *key)
+{
+    const uint8_t *v = ckey->data, *m = ckey->data + ckey->n_values;
+    unsigned      i;
+
+    FORWARDING_MEMSET(key, 0, sizeof(*key));
+    key->keymask = ckey->keymask;
+    key->size = ckey->size;
+
+    for (i = 0; i < ckey->size; i++) {
+        if (ckey->vmap & (1ULL << i)) {
+            key->values[i] = *v++;
+            key->masks[i] = (ckey->pmap & (1ULL << i)) ? *m++ : 0xff;
+        }
+    }
+}
+
+
+/** \brief Memory a compact key takes */
+
+unsigned
+ind_fwd_ckey_bytes(const struct fwd_ckey *ckey)
+{
+    unsigned n_masks = 0, i;
+
+    for (i = 0; i < ckey->size; i++) {
+        if (ckey->pmap & (1ULL << i)) {
+            ++n_masks;
+        }
+    }
+    return offsetof(struct fwd_ckey, data) + ckey->n_values + n_masks;
+}
+
+
+const fme_key_t *
+ind_fwd_flow_key(const struct fme_flow_data *flow, fme_key_t *scratch)
+{
+    if (flow->fme_entry != NULL) {
+        return &flow->fme_entry->key;
+    }
+    ind_fwd_ckey_expand(flow->ckey, scratch);
+    return scratch;
+}
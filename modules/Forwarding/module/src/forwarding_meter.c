@@ -0,0 +1,520 @@
+/****************************************************************
+ *
+ *        Copyright 2013, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ***************************************************************/
+
+/**
+ * @file
+ * @brief OpenFlow meter table
+ *
+ * Each band has its own token bucket.  A packet that finds fewer tokens
+ * than it costs has exceeded that band's rate, and of the exceeded
+ * bands the one with the highest rate applies, as OF 1.3 specifies.
+ *
+ * Tokens are kept in units that make the refill a single multiply:
+ * 1e-6 bit for kb/s meters and 1e-9 packet for packet/s meters, so
+ * refill = rate * elapsed ns in both cases.
+ */
+
+#include "forwarding_log.h"
+#include "forwarding_int.h"
+#include <Forwarding/forwarding.h>
+#include <Forwarding/forwarding_porting.h>
+
+#include <indigo/memory.h>
+#include <BigList/biglist.h>
+
+#define METER_HASH_TABLE_LEN  64    /**< Meter id hash buckets; power of 2 */
+#define METER_BANDS_MAX       8     /**< Bands per meter */
+#define METER_ID_MAX          0xffff0000
+
+/* Token units per kbit of burst, or per packet */
+#define METER_TOKENS_PER_UNIT       1000000000ULL
+/* Without OF_METER_FLAG_BURST a band may burst for 100ms of its rate */
+#define METER_DEFAULT_BURST_NS      100000000ULL
+
+#define LOXI_SUCCESS(x)  ((x) == OF_ERROR_NONE)
+#define LOXI_FAILURE(x)  (!LOXI_SUCCESS(x))
+
+/* Short hand logging macros */
+#define LOG_ERROR AIM_LOG_ERROR
+#define LOG_TRACE AIM_LOG_TRACE
+
+struct meter_band {
+    uint8_t  type;          /**< OF_METER_BAND_* object id */
+    uint8_t  prec_level;    /**< DSCP remark only */
+    uint32_t rate;
+    uint64_t capacity;      /**< Bucket depth, in tokens */
+    uint64_t fill_ns;       /**< Time to fill an empty bucket */
+    uint64_t tokens;
+    uint64_t cnt_pkts;
+    uint64_t cnt_bytes;
+};
+
+struct meter {
+    uint32_t          id;
+    uint16_t          flags;        /**< OF_METER_FLAG_* */
+    unsigned          n_bands;
+    struct meter_band bands[METER_BANDS_MAX];
+    uint64_t          last_ns;      /**< Time of last refill */
+    uint64_t          created_ns;
+    unsigned          flow_count;
+    uint64_t          cnt_pkts;
+    uint64_t          cnt_bytes;
+};
+
+static biglist_t *meter_ht[METER_HASH_TABLE_LEN];
+
+
+static inline unsigned
+meter_hash(uint32_t id)
+{
+    return id & (METER_HASH_TABLE_LEN - 1);
+}
+
+static struct meter *
+meter_find(uint32_t id)
+{
+    biglist_t *ble;
+    struct meter *meter;
+
+    BIGLIST_FOREACH(ble, meter_ht[meter_hash(id)]) {
+        meter = BIGLIST_CAST(struct meter *, ble);
+        if (meter->id == id)  return meter;
+    }
+
+    return NULL;
+}
+
+
+/** \brief Monotonic clock, for callers that cache it across a packet */
+
+uint64_t
+ind_fwd_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/** \brief Parse a meter mod's bands; buckets start full */
+
+static indigo_error_t
+meter_bands_parse(of_meter_mod_t *meter_mod, uint16_t flags,
+                  struct meter_band *bands, unsigned *n_bands_out)
+{
+    of_list_meter_band_t of_list_meter_band[1];
+    of_meter_band_t      of_meter_band[1];
+    struct meter_band    *band;
+    unsigned             n_bands = 0;
+    uint32_t             burst_size = 0;
+    int                  rv;
+
+    if ((flags & OF_METER_FLAG_KBPS) && (flags & OF_METER_FLAG_PKTPS)) {
+        LOG_ERROR("Meter can't be both kb/s and packet/s");
+        return INDIGO_ERROR_PARAM;
+    }
+
+    of_meter_mod_meters_bind(meter_mod, of_list_meter_band);
+    OF_LIST_METER_BAND_ITER(of_list_meter_band, of_meter_band, rv) {
+        if (n_bands == METER_BANDS_MAX) {
+            LOG_ERROR("Too many meter bands");
+            return INDIGO_ERROR_RESOURCE;
+        }
+        band = &bands[n_bands++];
+        FORWARDING_MEMSET(band, 0, sizeof(*band));
+        band->type = of_meter_band->header.object_id;
+
+        switch (band->type) {
+        case OF_METER_BAND_DROP:
+            of_meter_band_drop_rate_get(&of_meter_band->drop, &band->rate);
+            of_meter_band_drop_burst_size_get(&of_meter_band->drop,
+                                              &burst_size);
+            break;
+        case OF_METER_BAND_DSCP_REMARK:
+            of_meter_band_dscp_remark_rate_get(&of_meter_band->dscp_remark,
+                                               &band->rate);
+            of_meter_band_dscp_remark_burst_size_get(
+                &of_meter_band->dscp_remark, &burst_size);
+            of_meter_band_dscp_remark_prec_level_get(
+                &of_meter_band->dscp_remark, &band->prec_level);
+            if (band->prec_level == 0) {
+                LOG_ERROR("DSCP remark band with zero precedence level");
+                return INDIGO_ERROR_PARAM;
+            }
+            break;
+        default:
+            LOG_ERROR("Unsupported meter band: %s",
+                      of_object_id_str[band->type]);
+            return INDIGO_ERROR_NOT_SUPPORTED;
+        }
+
+        if (band->rate == 0) {
+            LOG_ERROR("Meter band with zero rate");
+            return INDIGO_ERROR_PARAM;
+        }
+
+        if (flags & OF_METER_FLAG_BURST) {
+            band->capacity = burst_size * METER_TOKENS_PER_UNIT;
+        } else {
+            band->capacity = band->rate * METER_DEFAULT_BURST_NS;
+        }
+        band->fill_ns = band->capacity / band->rate;
+        band->tokens = band->capacity;
+    }
+
+    if (rv != OF_ERROR_NONE && rv != OF_ERROR_RANGE) {
+        LOG_ERROR("of_list_meter_band_first/next() failed");
+        return INDIGO_ERROR_PARAM;
+    }
+
+    *n_bands_out = n_bands;
+    return INDIGO_ERROR_NONE;
+}
+
+
+/** \brief Whether a flow uses the meter *cookie, or any for OF_METER_ALL */
+
+static int
+meter_flow_pick(struct fme_flow_data *flow, void *cookie)
+{
+    uint32_t id = *(uint32_t *)cookie;
+
+    return flow->meter_id != 0
+        && (id == OF_METER_ALL || flow->meter_id == id);
+}
+
+
+/** \brief Add, modify or delete a meter */
+
+indigo_error_t
+ind_fwd_meter_mod(of_meter_mod_t *meter_mod)
+{
+    indigo_error_t    result;
+    struct meter      *meter;
+    struct meter_band bands[METER_BANDS_MAX];
+    unsigned          n_bands = 0;
+    uint32_t          id;
+    uint16_t          command, flags;
+    biglist_t         **bl;
+
+    /* Flow mods sent before the meter mod come first */
+    ind_fwd_flowq_drain();
+
+    of_meter_mod_command_get(meter_mod, &command);
+    of_meter_mod_meter_id_get(meter_mod, &id);
+    of_meter_mod_flags_get(meter_mod, &flags);
+
+    LOG_TRACE("Meter mod %d for meter %u", command, id);
+
+    if (id == 0 || (id > METER_ID_MAX && id != OF_METER_ALL)) {
+        LOG_ERROR("Bad meter id %u", id);
+        return INDIGO_ERROR_PARAM;
+    }
+
+    meter = meter_find(id);
+
+    switch (command) {
+    case OF_METER_MOD_COMMAND_ADD:
+    case OF_METER_MOD_COMMAND_MODIFY:
+        if (id == OF_METER_ALL) {
+            return INDIGO_ERROR_PARAM;
+        }
+        if (command == OF_METER_MOD_COMMAND_ADD && meter != NULL) {
+            LOG_ERROR("Meter %u exists", id);
+            return INDIGO_ERROR_EXISTS;
+        }
+        if (command == OF_METER_MOD_COMMAND_MODIFY && meter == NULL) {
+            LOG_ERROR("Meter %u not found", id);
+            return INDIGO_ERROR_NOT_FOUND;
+        }
+        if (INDIGO_FAILURE(result = meter_bands_parse(meter_mod, flags,
+                                                      bands, &n_bands))) {
+            return result;
+        }
+
+        if (meter == NULL) {
+            if ((meter = INDIGO_MEM_ALLOC(sizeof(*meter))) == NULL) {
+                LOG_ERROR("INDIGO_MEM_ALLOC() failed");
+                return INDIGO_ERROR_RESOURCE;
+            }
+            FORWARDING_MEMSET(meter, 0, sizeof(*meter));
+            meter->id = id;
+            meter->created_ns = meter->last_ns = ind_fwd_clock_ns();
+            bl = &meter_ht[meter_hash(id)];
+            *bl = biglist_prepend(*bl, meter);
+        }
+
+        /* Band counters restart with the new configuration */
+        meter->flags = flags;
+        meter->n_bands = n_bands;
+        FORWARDING_MEMCPY(meter->bands, bands, n_bands * sizeof(bands[0]));
+        break;
+
+    case OF_METER_MOD_COMMAND_DELETE:
+        /*
+         * Flows using the meter go first, as OF 1.3 specifies; left
+         * behind, they would be counted against a meter re-added under
+         * the same id.
+         */
+        if (id == OF_METER_ALL || (meter != NULL && meter->flow_count > 0)) {
+            ind_fwd_flows_remove(meter_flow_pick, &id);
+        }
+        if (id == OF_METER_ALL) {
+            ind_fwd_meter_finish();
+        } else if (meter != NULL) {
+            bl = &meter_ht[meter_hash(id)];
+            *bl = biglist_remove(*bl, meter);
+            INDIGO_MEM_FREE(meter);
+        }
+        break;
+
+    default:
+        LOG_ERROR("Bad meter mod command %d", command);
+        return INDIGO_ERROR_PARAM;
+    }
+
+    return INDIGO_ERROR_NONE;
+}
+
+
+/** \brief Note a flow using a meter; fails if the meter doesn't exist */
+
+indigo_error_t
+ind_fwd_meter_flow_attach(uint32_t meter_id)
+{
+    struct meter *meter;
+
+    if ((meter = meter_find(meter_id)) == NULL) {
+        LOG_ERROR("Meter %u not found", meter_id);
+        return INDIGO_ERROR_NOT_FOUND;
+    }
+
+    ++meter->flow_count;
+    return INDIGO_ERROR_NONE;
+}
+
+void
+ind_fwd_meter_flow_detach(uint32_t meter_id)
+{
+    struct meter *meter;
+
+    if ((meter = meter_find(meter_id)) != NULL && meter->flow_count > 0) {
+        --meter->flow_count;
+    }
+}
+
+
+/**
+ * \brief Meter a packet
+ *
+ * Returns METER_RESULT_DROP, METER_RESULT_PASS, or a positive number
+ * of DSCP drop precedence levels to add.  now_ns is read once by the
+ * caller and shared by every meter the packet meets.
+ */
+
+int
+ind_fwd_meter_apply(uint32_t meter_id, unsigned len, uint64_t now_ns)
+{
+    struct meter      *meter;
+    struct meter_band *band, *exceeded = NULL;
+    uint64_t          elapsed, cost;
+    unsigned          i;
+
+    if ((meter = meter_find(meter_id)) == NULL) {
+        return METER_RESULT_PASS;
+    }
+
+    ++meter->cnt_pkts;
+    meter->cnt_bytes += len;
+
+    elapsed = now_ns > meter->last_ns ? now_ns - meter->last_ns : 0;
+    meter->last_ns = now_ns;
+
+    if (meter->flags & OF_METER_FLAG_PKTPS) {
+        cost = METER_TOKENS_PER_UNIT;
+    } else {
+        cost = (uint64_t) len * 8 * 1000000;
+    }
+
+    for (i = 0; i < meter->n_bands; i++) {
+        band = &meter->bands[i];
+
+        /* Refill; a long idle period just fills the bucket */
+        if (elapsed >= band->fill_ns) {
+            band->tokens = band->capacity;
+        } else {
+            band->tokens += band->rate * elapsed;
+            if (band->tokens > band->capacity) {
+                band->tokens = band->capacity;
+            }
+        }
+
+        if (band->tokens >= cost) {
+            band->tokens -= cost;
+        } else if (exceeded == NULL || band->rate > exceeded->rate) {
+            exceeded = band;
+        }
+    }
+
+    if (exceeded == NULL) {
+        return METER_RESULT_PASS;
+    }
+
+    ++exceeded->cnt_pkts;
+    exceeded->cnt_bytes += len;
+
+    if (exceeded->type == OF_METER_BAND_DSCP_REMARK) {
+        return exceeded->prec_level;
+    }
+
+    return METER_RESULT_DROP;
+}
+
+
+static indigo_error_t
+meter_stats_append(of_list_meter_stats_t *list, struct meter *meter,
+                   uint64_t now_ns)
+{
+    indigo_error_t             result = INDIGO_ERROR_NONE;
+    of_meter_stats_t           *entry = NULL;
+    of_list_meter_band_stats_t *band_list = NULL;
+    of_meter_band_stats_t      *band_stats = NULL;
+    uint64_t                   duration_ns = now_ns - meter->created_ns;
+    unsigned                   i;
+
+    if ((entry = of_meter_stats_new(list->version)) == NULL
+        || (band_list = of_list_meter_band_stats_new(list->version)) == NULL
+        || (band_stats = of_meter_band_stats_new(list->version)) == NULL) {
+        LOG_ERROR("Failed to allocate meter stats");
+        result = INDIGO_ERROR_RESOURCE;
+        goto done;
+    }
+
+    for (i = 0; i < meter->n_bands; i++) {
+        of_meter_band_stats_packet_band_count_set(band_stats,
+                                                  meter->bands[i].cnt_pkts);
+        of_meter_band_stats_byte_band_count_set(band_stats,
+                                                meter->bands[i].cnt_bytes);
+        if (LOXI_FAILURE(of_list_meter_band_stats_append(band_list,
+                                                         band_stats))) {
+            LOG_ERROR("of_list_meter_band_stats_append() failed");
+            result = INDIGO_ERROR_UNKNOWN;
+            goto done;
+        }
+    }
+
+    of_meter_stats_meter_id_set(entry, meter->id);
+    of_meter_stats_flow_count_set(entry, meter->flow_count);
+    of_meter_stats_packet_in_count_set(entry, meter->cnt_pkts);
+    of_meter_stats_byte_in_count_set(entry, meter->cnt_bytes);
+    of_meter_stats_duration_sec_set(entry, duration_ns / 1000000000ULL);
+    of_meter_stats_duration_nsec_set(entry, duration_ns % 1000000000ULL);
+    if (LOXI_FAILURE(of_meter_stats_band_stats_set(entry, band_list))
+        || LOXI_FAILURE(of_list_meter_stats_append(list, entry))) {
+        LOG_ERROR("Failed to append meter stats entry");
+        result = INDIGO_ERROR_UNKNOWN;
+    }
+
+ done:
+    of_meter_band_stats_delete(band_stats);
+    of_list_meter_band_stats_delete(band_list);
+    of_meter_stats_delete(entry);
+
+    return result;
+}
+
+
+/** \brief Build a meter stats reply for one meter, or OF_METER_ALL */
+
+indigo_error_t
+ind_fwd_meter_stats_get(of_meter_stats_request_t *request,
+                        of_meter_stats_reply_t **reply)
+{
+    indigo_error_t        result = INDIGO_ERROR_NONE;
+    of_list_meter_stats_t *list = NULL;
+    struct meter          *meter;
+    biglist_t             *ble;
+    uint32_t              id, xid;
+    uint64_t              now_ns = ind_fwd_clock_ns();
+    unsigned              idx;
+
+    of_meter_stats_request_meter_id_get(request, &id);
+
+    if ((*reply = of_meter_stats_reply_new(request->version)) == NULL
+        || (list = of_list_meter_stats_new(request->version)) == NULL) {
+        LOG_ERROR("Failed to allocate meter stats reply");
+        result = INDIGO_ERROR_RESOURCE;
+        goto done;
+    }
+
+    of_meter_stats_request_xid_get(request, &xid);
+    of_meter_stats_reply_xid_set(*reply, xid);
+
+    if (id == OF_METER_ALL) {
+        for (idx = 0; idx < METER_HASH_TABLE_LEN; idx++) {
+            BIGLIST_FOREACH(ble, meter_ht[idx]) {
+                meter = BIGLIST_CAST(struct meter *, ble);
+                if (INDIGO_FAILURE(result = meter_stats_append(list, meter,
+                                                               now_ns))) {
+                    goto done;
+                }
+            }
+        }
+    } else if ((meter = meter_find(id)) != NULL) {
+        if (INDIGO_FAILURE(result = meter_stats_append(list, meter, now_ns))) {
+            goto done;
+        }
+    } else {
+        result = INDIGO_ERROR_NOT_FOUND;
+        goto done;
+    }
+
+    if (LOXI_FAILURE(of_meter_stats_reply_entries_set(*reply, list))) {
+        LOG_ERROR("of_meter_stats_reply_entries_set() failed");
+        result = INDIGO_ERROR_UNKNOWN;
+    }
+
+ done:
+    of_list_meter_stats_delete(list);
+    if (INDIGO_FAILURE(result)) {
+        of_meter_stats_reply_delete(*reply);
+        *reply = NULL;
+    }
+
+    return result;
+}
+
+
+/** \brief Free all meters */
+
+void
+ind_fwd_meter_finish(void)
+{
+    biglist_t *ble;
+    unsigned idx;
+
+    for (idx = 0; idx < METER_HASH_TABLE_LEN; idx++) {
+        BIGLIST_FOREACH(ble, meter_ht[idx]) {
+            INDIGO_MEM_FREE(BIGLIST_CAST(struct meter *, ble));
+        }
+        biglist_free(meter_ht[idx]);
+        meter_ht[idx] = NULL;
+    }
+}
@@ -0,0 +1,532 @@
+/****************************************************************
+ *
+ *        Copyright 2013, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ***************************************************************/
+
+/**
+ * @file
+ * @brief Flow table snapshot, for warm restart
+ *
+ * The file is a header, an array of fixed size flow records, then the
+ * flows' action lists.  Records hold the FME key as is, so the file is
+ * read through a read-only mapping with no parsing beyond the header.
+ * Each action list is kept as the wire form of a packet out carrying
+ * it, which LOXI can read back for any OpenFlow version; records point
+ * to them by file offset.
+ *
+ * Everything is in host byte order: a snapshot is for a restart on the
+ * same switch, and one with a different layout is refused, not
+ * converted.  Groups and meters are not saved; a flow whose meter is
+ * gone is not restored.
+ */
+
+#include "forwarding_log.h"
+#include "forwarding_int.h"
+#include <Forwarding/forwarding.h>
+#include <Forwarding/forwarding_porting.h>
+
+#include <indigo/memory.h>
+#include <loci/loci.h>
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC    "LRIFLOWS"
+#define SNAPSHOT_VERSION  1
+
+#define SNAPSHOT_KEY_LEN  sizeof(((fme_key_t *)0)->values)
+
+/* Round up to the record alignment */
+#define SNAPSHOT_ALIGN(x)  (((x) + 7) & ~(uint64_t)7)
+
+/* Short hand logging macros */
+#define LOG_ERROR AIM_LOG_ERROR
+#define LOG_INFO AIM_LOG_INFO
+#define LOG_TRACE AIM_LOG_TRACE
+
+struct snapshot_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_len;    /**< sizeof(struct snapshot_header) */
+    uint32_t flow_len;      /**< sizeof(struct snapshot_flow) */
+    uint32_t key_len;       /**< Bytes of key values, and of masks */
+    uint32_t of_version;
+    uint32_t n_tables;
+    uint32_t n_flows;
+    uint32_t pad;
+    uint64_t flows_off;
+    uint64_t actions_off;
+    uint64_t file_len;
+    uint64_t saved;         /**< time() at save */
+};
+
+struct snapshot_flow {
+    uint64_t flow_id;
+    uint64_t cookie;
+    uint64_t cnt_pkts;
+    uint64_t cnt_bytes;
+    int64_t  last_hit;
+    uint64_t absolute_timeout;
+    uint64_t relative_timeout;
+    uint64_t actions_off;   /**< Packet out holding the action list */
+    uint32_t actions_len;
+    uint32_t meter_id;
+    int32_t  prio;
+    uint32_t keymask;
+    int32_t  key_size;
+    uint8_t  table_id;
+    uint8_t  goto_table;
+    uint8_t  exact;
+    uint8_t  pad;
+    uint8_t  values[SNAPSHOT_KEY_LEN];
+    uint8_t  masks[SNAPSHOT_KEY_LEN];
+};
+
+/* State of a save in progress */
+struct snapshot_writer {
+    FILE                 *f;
+    unsigned             of_version;
+    struct snapshot_flow *flows;
+    unsigned             n_flows;
+    unsigned             size;      /**< Records the flows array holds */
+    uint64_t             off;       /**< Where the next action list goes */
+    indigo_error_t       rv;
+};
+
+
+/** \brief Write len bytes at off */
+
+static indigo_error_t
+snapshot_pwrite(FILE *f, uint64_t off, const void *buf, size_t len)
+{
+    if (fseeko(f, off, SEEK_SET) != 0 || fwrite(buf, 1, len, f) != len) {
+        LOG_ERROR("Snapshot write failed: %s", strerror(errno));
+        return (INDIGO_ERROR_UNKNOWN);
+    }
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Wrap an action list in a packet out and write it out */
+
+static indigo_error_t
+snapshot_actions_write(struct snapshot_writer *w, of_list_action_t *actions,
+                       struct snapshot_flow *rec)
+{
+    of_packet_out_t *packet_out;
+    of_message_t    msg;
+    indigo_error_t  rv = INDIGO_ERROR_NONE;
+
+    if ((packet_out = of_packet_out_new(w->of_version)) == NULL) {
+        LOG_ERROR("of_packet_out_new() failed");
+        return (INDIGO_ERROR_RESOURCE);
+    }
+    if (of_packet_out_actions_set(packet_out, actions) != OF_ERROR_NONE) {
+        LOG_ERROR("of_packet_out_actions_set() failed");
+        rv = INDIGO_ERROR_UNKNOWN;
+        goto done;
+    }
+
+    msg = OF_OBJECT_TO_MESSAGE(packet_out);
+    rec->actions_off = w->off;
+    rec->actions_len = of_message_length_get(msg);
+    if (INDIGO_FAILURE(rv = snapshot_pwrite(w->f, w->off, msg,
+                                            rec->actions_len))) {
+        goto done;
+    }
+    w->off = SNAPSHOT_ALIGN(w->off + rec->actions_len);
+
+ done:
+    of_packet_out_delete(packet_out);
+
+    return (rv);
+}
+
+
+/** \brief Count a flow to be saved */
+
+static void
+snapshot_flow_count(struct fme_flow_data *flow, void *cookie)
+{
+    struct snapshot_writer *w = cookie;
+
+    /* Flows left over from a restore the controller never took up */
+    if (!flow->retired) {
+        ++w->size;
+    }
+}
+
+
+/** \brief Record one flow */
+
+static void
+snapshot_flow_save(struct fme_flow_data *flow, void *cookie)
+{
+    struct snapshot_writer *w = cookie;
+    struct snapshot_flow   *rec;
+    fme_key_t              scratch;
+    const fme_key_t        *key = ind_fwd_flow_key(flow, &scratch);
+
+    if (INDIGO_FAILURE(w->rv)) {
+        return;
+    }
+
+    if (flow->retired || w->n_flows == w->size) {
+        return;
+    }
+
+    rec = &w->flows[w->n_flows];
+    memset(rec, 0, sizeof(*rec));
+    rec->flow_id = flow->flow_id;
+    rec->cookie = flow->cookie;
+    rec->cnt_pkts = flow->cnt_pkts;
+    rec->cnt_bytes = flow->cnt_bytes;
+    rec->last_hit = flow->last_hit;
+    rec->absolute_timeout = flow->hard_expiry;
+    rec->relative_timeout = flow->idle_timeout;
+    rec->meter_id = flow->meter_id;
+    rec->prio = flow->prio;
+    rec->keymask = key->keymask;
+    rec->key_size = key->size;
+    rec->table_id = flow->table_id;
+    rec->goto_table = flow->goto_table;
+    rec->exact = flow->exact;
+    memcpy(rec->values, key->values, SNAPSHOT_KEY_LEN);
+    memcpy(rec->masks, key->masks, SNAPSHOT_KEY_LEN);
+
+    if (INDIGO_FAILURE(w->rv = snapshot_actions_write(w, flow->of_list_action,
+                                                      rec))) {
+        return;
+    }
+
+    ++w->n_flows;
+}
+
+
+/**
+ * \brief Save the live flow table to path
+ *
+ * Written to a temporary file and renamed into place, so a crash
+ * mid-save leaves the previous snapshot.
+ */
+
+indigo_error_t
+ind_fwd_snapshot_write(const char *path, unsigned of_version,
+                       unsigned n_tables)
+{
+    struct snapshot_writer w;
+    struct snapshot_header hdr;
+    char                   tmp[256];
+    uint64_t               flows_len;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        LOG_ERROR("Snapshot path too long: %s", path);
+        return (INDIGO_ERROR_PARAM);
+    }
+
+    memset(&w, 0, sizeof(w));
+    w.of_version = of_version;
+    if ((w.f = fopen(tmp, "w")) == NULL) {
+        LOG_ERROR("Can't create %s: %s", tmp, strerror(errno));
+        return (INDIGO_ERROR_UNKNOWN);
+    }
+
+    /*
+     * Action lists are written as the flows are walked, after the space
+     * for the flow records, which go in last.
+     */
+    ind_fwd_flow_foreach(snapshot_flow_count, &w);
+    flows_len = (uint64_t)w.size * sizeof(struct snapshot_flow);
+    if (w.size != 0
+        && (w.flows = INDIGO_MEM_ALLOC(flows_len)) == NULL) {
+        LOG_ERROR("INDIGO_MEM_ALLOC() failed");
+        w.rv = INDIGO_ERROR_RESOURCE;
+        goto error;
+    }
+    w.off = SNAPSHOT_ALIGN(sizeof(hdr)) + flows_len;
+    ind_fwd_flow_foreach(snapshot_flow_save, &w);
+    if (INDIGO_FAILURE(w.rv)) {
+        goto error;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.header_len = sizeof(hdr);
+    hdr.flow_len = sizeof(struct snapshot_flow);
+    hdr.key_len = SNAPSHOT_KEY_LEN;
+    hdr.of_version = of_version;
+    hdr.n_tables = n_tables;
+    hdr.n_flows = w.n_flows;
+    hdr.flows_off = SNAPSHOT_ALIGN(sizeof(hdr));
+    hdr.actions_off = hdr.flows_off + flows_len;
+    hdr.file_len = w.off;
+    hdr.saved = time(NULL);
+
+    if (INDIGO_FAILURE(w.rv = snapshot_pwrite(w.f, hdr.flows_off, w.flows,
+                                              (size_t)w.n_flows
+                                              * sizeof(w.flows[0])))
+        || INDIGO_FAILURE(w.rv = snapshot_pwrite(w.f, 0, &hdr,
+                                                 sizeof(hdr)))) {
+        goto error;
+    }
+    if (fflush(w.f) != 0 || fsync(fileno(w.f)) != 0) {
+        LOG_ERROR("Can't sync %s: %s", tmp, strerror(errno));
+        w.rv = INDIGO_ERROR_UNKNOWN;
+        goto error;
+    }
+    fclose(w.f);
+    w.f = NULL;
+
+    if (rename(tmp, path) != 0) {
+        LOG_ERROR("Can't rename %s: %s", tmp, strerror(errno));
+        w.rv = INDIGO_ERROR_UNKNOWN;
+        goto error;
+    }
+
+    if (w.flows != NULL) {
+        INDIGO_MEM_FREE(w.flows);
+    }
+    LOG_INFO("Saved %u flows to %s", hdr.n_flows, path);
+
+    return (INDIGO_ERROR_NONE);
+
+ error:
+    if (w.f != NULL) {
+        fclose(w.f);
+    }
+    unlink(tmp);
+    if (w.flows != NULL) {
+        INDIGO_MEM_FREE(w.flows);
+    }
+
+    return (w.rv);
+}
+
+
+/** \brief Read a flow's action list back out of its packet out */
+
+static of_list_action_t *
+snapshot_actions_read(const uint8_t *base, const struct snapshot_flow *rec)
+{
+    of_packet_out_t  *packet_out;
+    of_list_action_t *actions;
+    uint8_t          *buf;
+
+    /* The packet out takes the buffer, so it can't be the mapping */
+    if ((buf = INDIGO_MEM_ALLOC(rec->actions_len)) == NULL) {
+        LOG_ERROR("INDIGO_MEM_ALLOC() failed");
+        return (NULL);
+    }
+    INDIGO_MEM_COPY(buf, base + rec->actions_off, rec->actions_len);
+
+    packet_out = (of_packet_out_t *)of_object_new_from_message(
+        OF_BUFFER_TO_MESSAGE(buf), rec->actions_len);
+    if (packet_out == NULL) {
+        LOG_ERROR("of_object_new_from_message() failed");
+        INDIGO_MEM_FREE(buf);
+        return (NULL);
+    }
+    if (packet_out->object_id != OF_PACKET_OUT) {
+        LOG_ERROR("Snapshot actions not a packet out");
+        of_object_delete((of_object_t *)packet_out);
+        return (NULL);
+    }
+    actions = of_packet_out_actions_get(packet_out);
+    of_packet_out_delete(packet_out);
+
+    return (actions);
+}
+
+
+/** \brief Rebuild one flow from its record and add it to the table */
+
+static indigo_error_t
+snapshot_flow_load(const uint8_t *base, const struct snapshot_header *hdr,
+                   const struct snapshot_flow *rec, time_t now)
+{
+    struct fme_flow_data *flow = NULL;
+    fme_entry_t          *entry = NULL;
+    fme_key_t            key;
+    indigo_error_t       rv;
+
+    if (rec->absolute_timeout != 0 && (time_t)rec->absolute_timeout <= now) {
+        LOG_TRACE("Flow 0x%" PRIx64 " timed out while down", rec->flow_id);
+        return (INDIGO_ERROR_NOT_FOUND);
+    }
+    if (rec->actions_off < hdr->actions_off
+        || rec->actions_off + rec->actions_len > hdr->file_len
+        || rec->key_size < 0 || rec->key_size > (int)SNAPSHOT_KEY_LEN) {
+        LOG_ERROR("Bad snapshot record for flow 0x%" PRIx64, rec->flow_id);
+        return (INDIGO_ERROR_PARAM);
+    }
+
+    FME_MEMSET(&key, 0, sizeof(key));
+    key.keymask = rec->keymask;
+    key.size = rec->key_size;
+    memcpy(key.values, rec->values, SNAPSHOT_KEY_LEN);
+    memcpy(key.masks, rec->masks, SNAPSHOT_KEY_LEN);
+
+    if ((flow = ind_fwd_flow_alloc(&key, rec->exact)) == NULL) {
+        return (INDIGO_ERROR_RESOURCE);
+    }
+
+    if (rec->meter_id != 0) {
+        if (INDIGO_FAILURE(rv = ind_fwd_meter_flow_attach(rec->meter_id))) {
+            LOG_TRACE("Flow 0x%" PRIx64 " meter %u gone", rec->flow_id,
+                      rec->meter_id);
+            goto error;
+        }
+        flow->meter_id = rec->meter_id;
+    }
+
+    if ((flow->of_list_action = snapshot_actions_read(base, rec)) == NULL) {
+        rv = INDIGO_ERROR_UNKNOWN;
+        goto error;
+    }
+    if ((flow->of_list_action = ind_fwd_actions_intern(flow->of_list_action))
+        == NULL) {
+        rv = INDIGO_ERROR_RESOURCE;
+        goto error;
+    }
+    if (FME_FAILURE(fme_entry_create(&entry))) {
+        LOG_ERROR("fme_entry_create() failed");
+        rv = INDIGO_ERROR_UNKNOWN;
+        goto error;
+    }
+
+    flow->flow_id = rec->flow_id;
+    flow->cookie = rec->cookie;
+    flow->cnt_pkts = rec->cnt_pkts;
+    flow->cnt_bytes = rec->cnt_bytes;
+    flow->last_hit = rec->last_hit;
+    flow->table_id = rec->table_id;
+    flow->goto_table = rec->goto_table;
+    flow->fme_entry = entry;
+    flow->prio = rec->prio;
+    flow->hard_expiry = rec->absolute_timeout;
+    flow->idle_timeout = rec->relative_timeout;
+
+    entry->prio = rec->prio;
+    entry->absolute_timeout = rec->absolute_timeout;
+    entry->relative_timeout = rec->relative_timeout;
+
+    if (INDIGO_FAILURE(rv = ind_fwd_flow_restore(flow, &key, rec->exact))) {
+        goto error;
+    }
+
+    return (INDIGO_ERROR_NONE);
+
+ error:
+    if (entry != NULL) fme_entry_destroy(entry);
+    if (flow->of_list_action != NULL) {
+        ind_fwd_actions_release(flow->of_list_action);
+    }
+    if (flow->meter_id != 0) {
+        ind_fwd_meter_flow_detach(flow->meter_id);
+    }
+    ind_fwd_flow_free(flow);
+
+    return (rv);
+}
+
+
+/**
+ * \brief Reload the flows saved in path into the live table
+ *
+ * Returns how many flows were restored; a missing file is not an error.
+ */
+
+unsigned
+ind_fwd_snapshot_load(const char *path, unsigned of_version,
+                      unsigned n_tables)
+{
+    const struct snapshot_header *hdr;
+    const struct snapshot_flow   *recs;
+    const uint8_t                *base = MAP_FAILED;
+    struct stat                  sb;
+    uint64_t                     start_ns;
+    time_t                       now;
+    unsigned                     i, restored = 0;
+    int                          fd;
+
+    start_ns = ind_fwd_clock_ns();
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        if (errno != ENOENT) {
+            LOG_ERROR("Can't open %s: %s", path, strerror(errno));
+        }
+        return (0);
+    }
+    if (fstat(fd, &sb) != 0 || sb.st_size < (off_t)sizeof(*hdr)) {
+        LOG_ERROR("Snapshot %s too short", path);
+        goto done;
+    }
+    base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        LOG_ERROR("Can't map %s: %s", path, strerror(errno));
+        goto done;
+    }
+
+    hdr = (const struct snapshot_header *)base;
+    if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0
+        || hdr->version != SNAPSHOT_VERSION
+        || hdr->header_len != sizeof(*hdr)
+        || hdr->flow_len != sizeof(*recs)
+        || hdr->key_len != SNAPSHOT_KEY_LEN) {
+        LOG_ERROR("Snapshot %s not in this build's format", path);
+        goto done;
+    }
+    if (hdr->of_version != of_version || hdr->n_tables != n_tables) {
+        LOG_ERROR("Snapshot %s is for another configuration", path);
+        goto done;
+    }
+    if (hdr->file_len != (uint64_t)sb.st_size
+        || hdr->flows_off + (uint64_t)hdr->n_flows * sizeof(*recs)
+           > hdr->actions_off
+        || hdr->actions_off > hdr->file_len) {
+        LOG_ERROR("Snapshot %s truncated", path);
+        goto done;
+    }
+
+    recs = (const struct snapshot_flow *)(base + hdr->flows_off);
+    now = time(NULL);
+    for (i = 0; i < hdr->n_flows; ++i) {
+        if (INDIGO_SUCCESS(snapshot_flow_load(base, hdr, &recs[i], now))) {
+            ++restored;
+        }
+    }
+
+    LOG_INFO("Restored %u of %u flows from %s in %u ms", restored,
+             hdr->n_flows, path,
+             (unsigned)((ind_fwd_clock_ns() - start_ns) / 1000000));
+
+ done:
+    if (base != MAP_FAILED) {
+        munmap((void *)base, sb.st_size);
+    }
+    close(fd);
+
+    return (restored);
+}
@@ -19,6 +19,7 @@
 
 #include <indigo/types.h>
 #include <Forwarding/forwarding_config.h>
+#include "forwarding_int.h"
 
 
 #if FORWARDING_CONFIG_INCLUDE_UCLI == 1
@@ -40,6 +41,30 @@ forwarding_ucli_ucli__config__(ucli_context_t* uc)
     return UCLI_STATUS_OK; 
 }
 
+static ucli_status_t
+forwarding_ucli_ucli__stats__(ucli_context_t* uc)
+{
+    UCLI_COMMAND_INFO(uc,
+                      "stats", 0,
+                      "$summary#Show flow table and flow mod queue stats.");
+    ind_fwd_stats_show(&uc->pvs);
+
+    return UCLI_STATUS_OK;
+}
+
+static ucli_status_t
+forwarding_ucli_ucli__snapshot__(ucli_context_t* uc)
+{
+    UCLI_COMMAND_INFO(uc,
+                      "snapshot", 0,
+                      "$summary#Save the flow table to the snapshot file.");
+    if (INDIGO_FAILURE(ind_fwd_snapshot_save(NULL))) {
+        return ucli_error(uc, "snapshot not saved");
+    }
+
+    return UCLI_STATUS_OK;
+}
+
 static ucli_status_t
 forwarding_ucli_ucli__foo__(ucli_context_t* uc)
 {
@@ -62,6 +87,8 @@ forwarding_ucli_ucli__foo__(ucli_context_t* uc)
 static ucli_command_handler_f forwarding_ucli_ucli_handlers__[] = 
 {
     forwarding_ucli_ucli__config__,
+    forwarding_ucli_ucli__stats__,
+    forwarding_ucli_ucli__snapshot__,
     forwarding_ucli_ucli__foo__,
     NULL
 };
@@ -44,7 +44,8 @@ assert_fail(unsigned line, char *expr)
 
 ind_fwd_config_t ind_fwd_config[1] = {{
         OF_VERSION_1_0,             /* of_version */
-        10                          /* max_flows */
+        10,                         /* max_flows */
+        0                           /* n_tables */
     }};
 
 struct callback_info {
@@ -128,6 +129,19 @@ indigo_core_flow_delete_callback(indigo_error_t result,
     last_bytes = flow_stats->bytes;
 }
 
+static unsigned        removed_count;
+static indigo_cookie_t removed_flow_id;
+static uint64_t        removed_packets;
+
+void
+indigo_core_flow_removed(indigo_fi_flow_removed_t reason,
+                         indigo_fi_flow_stats_t *stats)
+{
+    ++removed_count;
+    removed_flow_id = stats->flow_id;
+    removed_packets = stats->packets;
+}
+
 struct callback_info indigo_core_flow_stats_get_callback_info[1];
 
 void indigo_core_flow_stats_get_callback(
@@ -177,7 +191,7 @@ indigo_core_table_stats_get_callback(indigo_error_t result,
 
         ++n;
     }
-    TEST_ASSERT(n == 1);
+    TEST_ASSERT(n == (ind_fwd_config->n_tables ? ind_fwd_config->n_tables : 1));
 
     of_table_stats_reply_delete(table_stats_reply);
 }
@@ -363,6 +377,993 @@ test_packet_receive(void)
     tbl_stats_chk(0, 1, 0);     /* Check table stats */
 }
 
+/* Untagged IPv4/TCP 10.0.0.1:1000 -> 10.0.0.2:80 */
+static uint8_t tcp_pkt[100] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x02,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+    0x08, 0x00,
+    0x45, 0x00, 0x00, 0x56, 0x00, 0x00, 0x00, 0x00,
+    0x40, 0x06, 0x00, 0x00,
+    10, 0, 0, 1,
+    10, 0, 0, 2,
+    0x03, 0xe8, 0x00, 0x50,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x50, 0x02, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+static int flowq_on;             /* Flow mods are queued, not applied */
+
+static void
+flow_add(indigo_cookie_t flow_id, uint16_t priority, of_match_t *of_match,
+         of_port_no_t out_port)
+{
+    of_flow_add_t    *of_flow_add;
+    of_list_action_t *of_list_action;
+    of_action_t      *of_action;
+    indigo_cookie_t  callback_cookie = (indigo_cookie_t) random();
+
+    TEST_ASSERT((of_flow_add = of_flow_add_new(ind_fwd_config->of_version)) != 0);
+    of_flow_add_priority_set(of_flow_add, priority);
+    OK(of_flow_add_match_set(of_flow_add, of_match));
+    of_action = (of_action_t *) of_action_output_new(ind_fwd_config->of_version);
+    TEST_ASSERT(of_action != 0);
+    of_action_output_port_set(&of_action->output, out_port);
+    TEST_ASSERT((of_list_action = of_list_action_new(ind_fwd_config->of_version)) != 0);
+    OK(of_list_action_append(of_list_action, of_action));
+    OK(of_flow_add_actions_set(of_flow_add, of_list_action));
+
+    callback_arm(indigo_state_manager_flow_create_callback_info);
+    indigo_fwd_flow_create(flow_id, of_flow_add, callback_cookie);
+    if (flowq_on) {
+        TEST_ASSERT(!indigo_state_manager_flow_create_callback_info->calledf);
+    } else {
+        callback_chk(indigo_state_manager_flow_create_callback_info,
+                     callback_cookie);
+    }
+
+    of_action_delete(of_action);
+    of_list_action_delete(of_list_action);
+    of_flow_add_delete(of_flow_add);
+}
+
+static void
+flow_del(indigo_cookie_t flow_id)
+{
+    indigo_cookie_t callback_cookie = (indigo_cookie_t) random();
+
+    callback_arm(indigo_state_manager_flow_delete_callback_info);
+    indigo_fwd_flow_delete(flow_id, callback_cookie);
+    if (flowq_on) {
+        TEST_ASSERT(!indigo_state_manager_flow_delete_callback_info->calledf);
+    } else {
+        callback_chk(indigo_state_manager_flow_delete_callback_info,
+                     callback_cookie);
+    }
+}
+
+static void
+packet_out(uint8_t *data, unsigned len, of_port_no_t out_port)
+{
+    of_packet_out_t  *of_packet_out;
+    of_list_action_t *of_list_action;
+    of_action_t      *of_action;
+    of_octets_t      of_octets;
+
+    TEST_ASSERT((of_packet_out = of_packet_out_new(ind_fwd_config->of_version)) != 0);
+    of_packet_out_buffer_id_set(of_packet_out, -1);
+    of_packet_out_in_port_set(of_packet_out, 1);
+    of_action = (of_action_t *) of_action_output_new(ind_fwd_config->of_version);
+    TEST_ASSERT(of_action != 0);
+    of_action_output_port_set(&of_action->output, out_port);
+    TEST_ASSERT((of_list_action = of_list_action_new(ind_fwd_config->of_version)) != 0);
+    OK(of_list_action_append(of_list_action, of_action));
+    OK(of_packet_out_actions_set(of_packet_out, of_list_action));
+    of_octets.data = data;
+    of_octets.bytes = len;
+    OK(of_packet_out_data_set(of_packet_out, &of_octets));
+
+    OK(indigo_fwd_packet_out(of_packet_out));
+
+    of_action_delete(of_action);
+    of_list_action_delete(of_list_action);
+    of_packet_out_delete(of_packet_out);
+}
+
+static void
+tcp_pkt_match_set(of_match_t *of_match)
+{
+    memset(of_match, 0, sizeof(*of_match));
+    memset(&of_match->masks, 0xff, sizeof(of_match->masks));
+    of_match->fields.in_port = 1;
+    memcpy(of_match->fields.eth_dst.addr, &tcp_pkt[0], 6);
+    memcpy(of_match->fields.eth_src.addr, &tcp_pkt[6], 6);
+    of_match->fields.vlan_vid = OF_MATCH_UNTAGGED_VLAN_ID(ind_fwd_config->of_version);
+    of_match->fields.eth_type = 0x0800;
+    of_match->fields.ip_proto = 6;
+    of_match->fields.ipv4_src = 0x0a000001;
+    of_match->fields.ipv4_dst = 0x0a000002;
+    of_match->fields.tcp_src = 1000;
+    of_match->fields.tcp_dst = 80;
+}
+
+/* Exact flows are matched, and priority still holds against wildcards */
+static void
+test_exact_match(void)
+{
+    of_match_t             of_match[1];
+    ind_fwd_memory_stats_t mem;
+
+    tcp_pkt_match_set(of_match);
+    flow_add(0x1000, 100, of_match, 3);
+
+    /* The flow is in the exact tier, not the wildcard table */
+    ind_fwd_memory_stats_get(&mem);
+    TEST_ASSERT(mem.flows == 1);
+    TEST_ASSERT(mem.compact_keys == 1);
+
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(3, tcp_pkt, sizeof(tcp_pkt));
+    flow_stats_chk(0x1000, 1, sizeof(tcp_pkt));
+
+    /* Higher priority wildcard flow overrides the exact flow */
+    memset(of_match, 0, sizeof(*of_match));
+    of_match->fields.in_port = 1;
+    of_match->masks.in_port  = ~0;
+    flow_add(0x1001, 200, of_match, 2);
+
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(2, tcp_pkt, sizeof(tcp_pkt));
+
+    /* Back to the exact flow once the wildcard is gone */
+    flow_del(0x1001);
+
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(3, tcp_pkt, sizeof(tcp_pkt));
+    flow_stats_chk(0x1000, 2, 2 * sizeof(tcp_pkt));
+
+    flow_del(0x1000);
+
+    pkt_in_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_in_chk(1, tcp_pkt, sizeof(tcp_pkt), OF_PACKET_IN_REASON_NO_MATCH);
+}
+
+/* Exact flows keep compact keys, and still match */
+static void
+test_compact_key(void)
+{
+    of_match_t             of_match[1];
+    ind_fwd_memory_stats_t mem;
+
+    tcp_pkt_match_set(of_match);
+    flow_add(0x1100, 100, of_match, 3);
+    memset(of_match, 0, sizeof(*of_match));
+    of_match->fields.in_port = 2;
+    of_match->masks.in_port  = ~0;
+    flow_add(0x1101, 100, of_match, 1);
+
+    ind_fwd_memory_stats_get(&mem);
+    TEST_ASSERT(mem.flows == 2);
+    TEST_ASSERT(mem.compact_keys == 1);
+    TEST_ASSERT(mem.bytes < mem.full_key_bytes);
+
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(3, tcp_pkt, sizeof(tcp_pkt));
+    flow_stats_chk(0x1100, 1, sizeof(tcp_pkt));
+
+    flow_del(0x1100);
+    flow_del(0x1101);
+    ind_fwd_memory_stats_get(&mem);
+    TEST_ASSERT(mem.flows == 0 && mem.bytes == 0);
+}
+
+/* Flows with the same actions share one action list */
+static void
+test_action_intern(void)
+{
+    of_match_t             of_match[1];
+    ind_fwd_memory_stats_t mem;
+
+    memset(of_match, 0, sizeof(*of_match));
+    of_match->masks.in_port = ~0;
+    of_match->fields.in_port = 2;
+    flow_add(0x1200, 10, of_match, 3);
+    of_match->fields.in_port = 3;
+    flow_add(0x1201, 10, of_match, 3);
+    of_match->fields.in_port = 4;
+    flow_add(0x1202, 10, of_match, 1);
+
+    ind_fwd_memory_stats_get(&mem);
+    TEST_ASSERT(mem.action_lists == 2);
+    TEST_ASSERT(mem.action_refs == 3);
+
+    flow_del(0x1202);
+    ind_fwd_memory_stats_get(&mem);
+    TEST_ASSERT(mem.action_lists == 1);
+    TEST_ASSERT(mem.action_refs == 2);
+
+    flow_del(0x1200);
+    flow_del(0x1201);
+    ind_fwd_memory_stats_get(&mem);
+    TEST_ASSERT(mem.action_lists == 0 && mem.action_bytes == 0);
+}
+
+/* Flow mods through the command queue complete when applied */
+static void
+test_flow_queue(void)
+{
+    of_match_t of_match[1];
+
+    TEST_ASSERT(ind_fwd_flow_queue_set(FWD_FLOWQ_DEPTH_MAX + 1, 500)
+                == INDIGO_ERROR_PARAM);
+    OK(ind_fwd_flow_queue_set(4, 500));
+    flowq_on = 1;
+
+    tcp_pkt_match_set(of_match);
+    flow_add(0x2000, 100, of_match, 3);
+
+    /* Not applied yet */
+    pkt_in_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_in_chk(1, tcp_pkt, sizeof(tcp_pkt), OF_PACKET_IN_REASON_NO_MATCH);
+
+    /* Reading flow state applies what is queued first */
+    flow_stats_chk(0x2000, 0, 0);
+    TEST_ASSERT(indigo_state_manager_flow_create_callback_info->calledf);
+    TEST_ASSERT(indigo_state_manager_flow_create_callback_info->result
+                == INDIGO_ERROR_NONE);
+
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(3, tcp_pkt, sizeof(tcp_pkt));
+
+    /* A packet out comes after the flow mods queued before it */
+    memset(of_match, 0, sizeof(*of_match));
+    of_match->fields.in_port = 3;
+    of_match->masks.in_port  = ~0;
+    flow_add(0x2006, 60, of_match, 1);
+    pkt_tx_arm();
+    packet_out(tcp_pkt, sizeof(tcp_pkt), 3);
+    TEST_ASSERT(indigo_state_manager_flow_create_callback_info->calledf);
+    TEST_ASSERT(pkt_tx_info->flag && pkt_tx_info->of_port_num == 3);
+
+    /* So does a barrier reply */
+    flow_del(0x2006);
+    OK(ind_fwd_flow_barrier());
+    TEST_ASSERT(indigo_state_manager_flow_delete_callback_info->calledf);
+    TEST_ASSERT(indigo_state_manager_flow_delete_callback_info->result
+                == INDIGO_ERROR_NONE);
+
+    /* A full queue applies its oldest flow mod to make room */
+    memset(of_match, 0, sizeof(*of_match));
+    of_match->fields.in_port = 2;
+    of_match->masks.in_port  = ~0;
+    flow_add(0x2001, 10, of_match, 1);
+    flow_add(0x2002, 20, of_match, 1);
+    flow_add(0x2003, 30, of_match, 1);
+    flow_add(0x2004, 40, of_match, 1);
+    flow_add(0x2005, 50, of_match, 1);
+    TEST_ASSERT(indigo_state_manager_flow_create_callback_info->calledf);
+    TEST_ASSERT(indigo_state_manager_flow_create_callback_info->callback_cookie
+                != INDIGO_COOKIE_NULL);
+
+    /* Turning the queue off applies the rest */
+    OK(ind_fwd_flow_queue_set(0, 0));
+    flowq_on = 0;
+    flow_stats_chk(0x2005, 0, 0);
+
+    flow_del(0x2000);
+    flow_del(0x2001);
+    flow_del(0x2002);
+    flow_del(0x2003);
+    flow_del(0x2004);
+    flow_del(0x2005);
+}
+
+/* A batch is applied whole at commit, with a callback per flow mod */
+static void
+test_flow_batch(void)
+{
+    of_match_t of_match[1];
+
+    TEST_ASSERT(ind_fwd_flow_batch_commit() == INDIGO_ERROR_PARAM);
+    OK(ind_fwd_flow_batch_begin());
+    TEST_ASSERT(ind_fwd_flow_batch_begin() == INDIGO_ERROR_PARAM);
+    flowq_on = 1;
+
+    tcp_pkt_match_set(of_match);
+    flow_add(0x3000, 100, of_match, 3);
+    memset(of_match, 0, sizeof(*of_match));
+    of_match->fields.in_port = 1;
+    of_match->masks.in_port  = ~0;
+    flow_add(0x3001, 200, of_match, 2);
+
+    /* Nothing is visible before the commit */
+    pkt_in_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_in_chk(1, tcp_pkt, sizeof(tcp_pkt), OF_PACKET_IN_REASON_NO_MATCH);
+
+    /* Nor to stats requests */
+    callback_arm(indigo_core_flow_stats_get_callback_info);
+    indigo_fwd_flow_stats_get(0x3000, 0);
+    TEST_ASSERT(indigo_core_flow_stats_get_callback_info->calledf);
+    TEST_ASSERT(indigo_core_flow_stats_get_callback_info->result
+                == INDIGO_ERROR_NOT_FOUND);
+
+    OK(ind_fwd_flow_batch_commit());
+    TEST_ASSERT(indigo_state_manager_flow_create_callback_info->calledf);
+    TEST_ASSERT(indigo_state_manager_flow_create_callback_info->result
+                == INDIGO_ERROR_NONE);
+
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(2, tcp_pkt, sizeof(tcp_pkt));
+
+    /* Each flow mod gets its own result; the last one here fails */
+    OK(ind_fwd_flow_batch_begin());
+    flow_del(0x3001);
+    flow_del(0x3999);
+    OK(ind_fwd_flow_batch_commit());
+    flowq_on = 0;
+    TEST_ASSERT(indigo_state_manager_flow_delete_callback_info->calledf);
+    TEST_ASSERT(indigo_state_manager_flow_delete_callback_info->result
+                == INDIGO_ERROR_NOT_FOUND);
+
+    /* The wildcard maximum was rebuilt at commit; the exact flow wins */
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(3, tcp_pkt, sizeof(tcp_pkt));
+
+    flow_del(0x3000);
+}
+
+/* A shadow table is invisible until swapped in, and keeps counters */
+static void
+test_shadow_swap(void)
+{
+    of_match_t of_match[1];
+
+
+    tcp_pkt_match_set(of_match);
+    flow_add(0x4000, 100, of_match, 3);
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(3, tcp_pkt, sizeof(tcp_pkt));
+
+    OK(ind_fwd_shadow_begin());
+    TEST_ASSERT(ind_fwd_shadow_begin() == INDIGO_ERROR_PARAM);
+
+    /* The live flow is deleted but forwards until the swap */
+    flow_del(0x4000);
+    TEST_ASSERT(last_packets == 1);
+    flow_add(0x4001, 100, of_match, 2);
+    memset(of_match, 0, sizeof(*of_match));
+    of_match->fields.in_port = 2;
+    of_match->masks.in_port  = ~0;
+    flow_add(0x4002, 10, of_match, 1);
+
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(3, tcp_pkt, sizeof(tcp_pkt));
+    flow_stats_chk(0x4001, 0, 0);
+
+    OK(ind_fwd_shadow_commit());
+
+    /* Same cookie and match, so the new flow has the old one's counts */
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(2, tcp_pkt, sizeof(tcp_pkt));
+    flow_stats_chk(0x4001, 3, 3 * sizeof(tcp_pkt));
+    flow_stats_chk(0x4002, 0, 0);
+
+    flow_del(0x4001);
+    flow_del(0x4002);
+}
+
+/* Flows saved at shutdown forward after restart until the controller's
+   flows are swapped in */
+static void
+test_snapshot(void)
+{
+    of_match_t of_match[1];
+    char       path[64];
+
+    snprintf(path, sizeof(path), "/tmp/fwd-utest-snapshot.%d", (int)getpid());
+    TEST_ASSERT(ind_fwd_snapshot_save(NULL) == INDIGO_ERROR_PARAM);
+
+    tcp_pkt_match_set(of_match);
+    flow_add(0x5000, 100, of_match, 3);
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(3, tcp_pkt, sizeof(tcp_pkt));
+
+    OK(ind_fwd_snapshot_save(path));
+    TEST_ASSERT(ind_fwd_finish() == INDIGO_ERROR_NONE);
+    ind_fwd_config->snapshot_path = path;
+    TEST_ASSERT(INDIGO_SUCCESS(ind_fwd_init(ind_fwd_config)));
+
+    /* Restored, and held while the controller adds its flows */
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(3, tcp_pkt, sizeof(tcp_pkt));
+    TEST_ASSERT(ind_fwd_snapshot_save(NULL) == INDIGO_ERROR_PENDING);
+    flow_add(0x5001, 100, of_match, 2);
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(3, tcp_pkt, sizeof(tcp_pkt));
+
+    /* The controller's barrier ends the hold */
+    OK(ind_fwd_flow_barrier());
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(2, tcp_pkt, sizeof(tcp_pkt));
+    flow_stats_chk(0x5001, 4, 4 * sizeof(tcp_pkt));
+    flow_del(0x5001);
+
+    /* Back to no snapshot for the tests that follow */
+    TEST_ASSERT(ind_fwd_finish() == INDIGO_ERROR_NONE);
+    unlink(path);
+    ind_fwd_config->snapshot_path = NULL;
+    TEST_ASSERT(INDIGO_SUCCESS(ind_fwd_init(ind_fwd_config)));
+}
+
+/* A full table evicts a flow for a new one and reports it removed */
+static void
+test_eviction(void)
+{
+    of_match_t of_match[1];
+    unsigned   max_flows = ind_fwd_config->max_flows;
+
+    TEST_ASSERT(ind_fwd_eviction_set(99) == INDIGO_ERROR_PARAM);
+
+    TEST_ASSERT(ind_fwd_finish() == INDIGO_ERROR_NONE);
+    ind_fwd_config->max_flows = 1;
+    ind_fwd_config->eviction = IND_FWD_EVICTION_LRU;
+    TEST_ASSERT(INDIGO_SUCCESS(ind_fwd_init(ind_fwd_config)));
+
+    tcp_pkt_match_set(of_match);
+    flow_add(0x6000, 10, of_match, 3);
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(3, tcp_pkt, sizeof(tcp_pkt));
+
+    removed_count = 0;
+    memset(of_match, 0, sizeof(*of_match));
+    of_match->fields.in_port = 1;
+    of_match->masks.in_port  = ~0;
+    flow_add(0x6001, 20, of_match, 2);
+    TEST_ASSERT(removed_count == 1);
+    TEST_ASSERT(removed_flow_id == 0x6000);
+    TEST_ASSERT(removed_packets == 1);
+
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(2, tcp_pkt, sizeof(tcp_pkt));
+    flow_del(0x6001);
+
+    TEST_ASSERT(ind_fwd_finish() == INDIGO_ERROR_NONE);
+    ind_fwd_config->max_flows = max_flows;
+    ind_fwd_config->eviction = IND_FWD_EVICTION_NONE;
+    TEST_ASSERT(INDIGO_SUCCESS(ind_fwd_init(ind_fwd_config)));
+}
+
+/* Flow tables grow and shrink without losing flows or their counters */
+static void
+test_resize(void)
+{
+    of_match_t of_match[1];
+    unsigned   max_flows = ind_fwd_config->max_flows;
+
+    TEST_ASSERT(ind_fwd_max_flows_set(0) == INDIGO_ERROR_PARAM);
+
+    tcp_pkt_match_set(of_match);
+    flow_add(0x7000, 100, of_match, 3);
+    memset(of_match, 0, sizeof(*of_match));
+    of_match->fields.in_port = 2;
+    of_match->masks.in_port  = ~0;
+    flow_add(0x7001, 10, of_match, 1);
+    of_match->fields.in_port = 3;
+    flow_add(0x7002, 10, of_match, 1);
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(3, tcp_pkt, sizeof(tcp_pkt));
+
+    TEST_ASSERT(ind_fwd_max_flows_set(2) == INDIGO_ERROR_PARAM);
+    OK(ind_fwd_max_flows_set(3 * max_flows));
+    ind_fwd_config->max_flows = 3 * max_flows;
+    tbl_stats_chk(3, 1, 1);
+
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(3, tcp_pkt, sizeof(tcp_pkt));
+    flow_stats_chk(0x7000, 2, 2 * sizeof(tcp_pkt));
+
+    OK(ind_fwd_max_flows_set(3));
+    ind_fwd_config->max_flows = 3;
+    tbl_stats_chk(3, 2, 2);
+    flow_stats_chk(0x7001, 0, 0);
+
+    OK(ind_fwd_max_flows_set(max_flows));
+    ind_fwd_config->max_flows = max_flows;
+    flow_del(0x7000);
+    flow_del(0x7001);
+    flow_del(0x7002);
+}
+
+/* The exact tier fills to high load without growing */
+static void
+test_exact_load(void)
+{
+    of_match_t             of_match[1];
+    ind_fwd_memory_stats_t mem;
+    unsigned               max_flows = ind_fwd_config->max_flows;
+    unsigned               buckets, i;
+
+    ind_fwd_memory_stats_get(&mem);
+    buckets = mem.exact_buckets;
+    TEST_ASSERT(buckets > 0);
+
+    /* About 88% of one table's 256 buckets of 4 */
+    OK(ind_fwd_max_flows_set(1000));
+    ind_fwd_config->max_flows = 1000;
+    tcp_pkt_match_set(of_match);
+    for (i = 0; i < 900; i++) {
+        of_match->fields.tcp_src = 1000 + i;
+        flow_add(0x7100 + i, 100, of_match, 3);
+    }
+
+    ind_fwd_memory_stats_get(&mem);
+    TEST_ASSERT(mem.flows == 900);
+    TEST_ASSERT(mem.compact_keys == 900);
+    TEST_ASSERT(mem.exact_buckets == buckets);
+
+    /* The packet's source port is the first flow's */
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(3, tcp_pkt, sizeof(tcp_pkt));
+    flow_stats_chk(0x7100, 1, sizeof(tcp_pkt));
+
+    for (i = 0; i < 900; i++) {
+        flow_del(0x7100 + i);
+    }
+    OK(ind_fwd_max_flows_set(max_flows));
+    ind_fwd_config->max_flows = max_flows;
+}
+
+/*
+ * Add a flow with OF 1.1+ instructions; out_port of 0 means no actions,
+ * goto_table and meter_id of 0 mean no such instruction
+ */
+static indigo_error_t
+flow_add_insts(indigo_cookie_t flow_id, uint8_t table_id, of_match_t *of_match,
+               of_port_no_t out_port, uint8_t goto_table, uint32_t meter_id)
+{
+    of_version_t          version = ind_fwd_config->of_version;
+    of_flow_add_t         *of_flow_add;
+    of_list_instruction_t *of_list_instruction;
+    of_instruction_t      *of_instruction;
+    of_list_action_t      *of_list_action;
+    of_action_t           *of_action;
+    indigo_cookie_t       callback_cookie = (indigo_cookie_t) random();
+
+    TEST_ASSERT((of_flow_add = of_flow_add_new(version)) != 0);
+    of_flow_add_table_id_set(of_flow_add, table_id);
+    of_flow_add_priority_set(of_flow_add, 100);
+    OK(of_flow_add_match_set(of_flow_add, of_match));
+    TEST_ASSERT((of_list_instruction = of_list_instruction_new(version)) != 0);
+
+    if (out_port != 0) {
+        of_action = (of_action_t *) of_action_output_new(version);
+        TEST_ASSERT(of_action != 0);
+        of_action_output_port_set(&of_action->output, out_port);
+        TEST_ASSERT((of_list_action = of_list_action_new(version)) != 0);
+        OK(of_list_action_append(of_list_action, of_action));
+        of_instruction = (of_instruction_t *) of_instruction_apply_actions_new(version);
+        TEST_ASSERT(of_instruction != 0);
+        OK(of_instruction_apply_actions_actions_set(&of_instruction->apply_actions,
+                                                    of_list_action));
+        OK(of_list_instruction_append(of_list_instruction, of_instruction));
+        of_instruction_delete(of_instruction);
+        of_list_action_delete(of_list_action);
+        of_action_delete(of_action);
+    }
+
+    if (meter_id != 0) {
+        of_instruction = (of_instruction_t *) of_instruction_meter_new(version);
+        TEST_ASSERT(of_instruction != 0);
+        of_instruction_meter_meter_id_set(&of_instruction->meter, meter_id);
+        OK(of_list_instruction_append(of_list_instruction, of_instruction));
+        of_instruction_delete(of_instruction);
+    }
+
+    if (goto_table != 0) {
+        of_instruction = (of_instruction_t *) of_instruction_goto_table_new(version);
+        TEST_ASSERT(of_instruction != 0);
+        of_instruction_goto_table_table_id_set(&of_instruction->goto_table,
+                                               goto_table);
+        OK(of_list_instruction_append(of_list_instruction, of_instruction));
+        of_instruction_delete(of_instruction);
+    }
+
+    OK(of_flow_add_instructions_set(of_flow_add, of_list_instruction));
+
+    callback_arm(indigo_state_manager_flow_create_callback_info);
+    indigo_fwd_flow_create(flow_id, of_flow_add, callback_cookie);
+    TEST_ASSERT(indigo_state_manager_flow_create_callback_info->calledf);
+
+    of_list_instruction_delete(of_list_instruction);
+    of_flow_add_delete(of_flow_add);
+
+    return indigo_state_manager_flow_create_callback_info->result;
+}
+
+/* Packets walk the pipeline through goto-table */
+static void
+test_multi_table(void)
+{
+    of_match_t of_match[1];
+
+    memset(of_match, 0, sizeof(*of_match));
+    of_match->version = ind_fwd_config->of_version;
+    of_match->fields.in_port = 1;
+    of_match->masks.in_port  = ~0;
+    OK(flow_add_insts(0x2000, 0, of_match, 0, 1, 0));
+
+    memset(of_match, 0, sizeof(*of_match));
+    of_match->version = ind_fwd_config->of_version;
+    OK(flow_add_insts(0x2001, 1, of_match, 4, 0, 0));
+
+    /* Goto must point forward, to an existing table */
+    TEST_ASSERT(flow_add_insts(0x2002, 1, of_match, 4, 1, 0) == INDIGO_ERROR_PARAM);
+    TEST_ASSERT(flow_add_insts(0x2003, 0, of_match, 4, 2, 0) == INDIGO_ERROR_PARAM);
+    TEST_ASSERT(flow_add_insts(0x2004, 2, of_match, 4, 0, 0) == INDIGO_ERROR_PARAM);
+
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(4, tcp_pkt, sizeof(tcp_pkt));
+    flow_stats_chk(0x2000, 1, sizeof(tcp_pkt));
+    flow_stats_chk(0x2001, 1, sizeof(tcp_pkt));
+
+    /* A table 0 miss never reaches table 1 */
+    pkt_in_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(2, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_in_chk(2, tcp_pkt, sizeof(tcp_pkt), OF_PACKET_IN_REASON_NO_MATCH);
+    flow_stats_chk(0x2001, 1, sizeof(tcp_pkt));
+
+    flow_del(0x2000);
+    flow_del(0x2001);
+}
+
+/* Add a group whose buckets each output to, and watch, one port */
+static void
+group_add(uint32_t group_id, uint8_t group_type, of_port_no_t *ports,
+          unsigned n_ports)
+{
+    of_version_t     version = ind_fwd_config->of_version;
+    of_group_add_t   *of_group_add;
+    of_list_bucket_t *of_list_bucket;
+    of_bucket_t      *of_bucket;
+    of_list_action_t *of_list_action;
+    of_action_t      *of_action;
+    unsigned         i;
+
+    TEST_ASSERT((of_group_add = of_group_add_new(version)) != 0);
+    of_group_add_group_id_set(of_group_add, group_id);
+    of_group_add_group_type_set(of_group_add, group_type);
+    TEST_ASSERT((of_list_bucket = of_list_bucket_new(version)) != 0);
+
+    for (i = 0; i < n_ports; i++) {
+        TEST_ASSERT((of_bucket = of_bucket_new(version)) != 0);
+        of_bucket_weight_set(of_bucket, 1);
+        of_bucket_watch_port_set(of_bucket, ports[i]);
+        of_bucket_watch_group_set(of_bucket, OF_GROUP_ANY);
+        of_action = (of_action_t *) of_action_output_new(version);
+        TEST_ASSERT(of_action != 0);
+        of_action_output_port_set(&of_action->output, ports[i]);
+        TEST_ASSERT((of_list_action = of_list_action_new(version)) != 0);
+        OK(of_list_action_append(of_list_action, of_action));
+        OK(of_bucket_actions_set(of_bucket, of_list_action));
+        OK(of_list_bucket_append(of_list_bucket, of_bucket));
+        of_list_action_delete(of_list_action);
+        of_action_delete(of_action);
+        of_bucket_delete(of_bucket);
+    }
+
+    OK(of_group_add_buckets_set(of_group_add, of_list_bucket));
+    OK(ind_fwd_group_mod(of_group_add));
+
+    of_list_bucket_delete(of_list_bucket);
+    of_group_add_delete(of_group_add);
+}
+
+/*
+ * Add a fast-failover group whose first bucket outputs to port if
+ * watch_group is live, and whose second outputs to backup_port
+ */
+static void
+group_add_watch(uint32_t group_id, uint32_t watch_group, of_port_no_t port,
+                of_port_no_t backup_port)
+{
+    of_version_t     version = ind_fwd_config->of_version;
+    of_group_add_t   *of_group_add;
+    of_list_bucket_t *of_list_bucket;
+    of_bucket_t      *of_bucket;
+    of_list_action_t *of_list_action;
+    of_action_t      *of_action;
+    unsigned         i;
+
+    TEST_ASSERT((of_group_add = of_group_add_new(version)) != 0);
+    of_group_add_group_id_set(of_group_add, group_id);
+    of_group_add_group_type_set(of_group_add, OF_GROUP_TYPE_FF);
+    TEST_ASSERT((of_list_bucket = of_list_bucket_new(version)) != 0);
+
+    for (i = 0; i < 2; i++) {
+        TEST_ASSERT((of_bucket = of_bucket_new(version)) != 0);
+        of_bucket_weight_set(of_bucket, 1);
+        /* 0xffffffff is OFPP_ANY: no watch port */
+        of_bucket_watch_port_set(of_bucket, i == 0 ? 0xffffffff
+                                                   : backup_port);
+        of_bucket_watch_group_set(of_bucket, i == 0 ? watch_group
+                                                    : OF_GROUP_ANY);
+        of_action = (of_action_t *) of_action_output_new(version);
+        TEST_ASSERT(of_action != 0);
+        of_action_output_port_set(&of_action->output,
+                                  i == 0 ? port : backup_port);
+        TEST_ASSERT((of_list_action = of_list_action_new(version)) != 0);
+        OK(of_list_action_append(of_list_action, of_action));
+        OK(of_bucket_actions_set(of_bucket, of_list_action));
+        OK(of_list_bucket_append(of_list_bucket, of_bucket));
+        of_list_action_delete(of_list_action);
+        of_action_delete(of_action);
+        of_bucket_delete(of_bucket);
+    }
+
+    OK(of_group_add_buckets_set(of_group_add, of_list_bucket));
+    OK(ind_fwd_group_mod(of_group_add));
+
+    of_list_bucket_delete(of_list_bucket);
+    of_group_add_delete(of_group_add);
+}
+
+/* Add a flow matching everything, that sends to a group */
+static void
+flow_add_group(indigo_cookie_t flow_id, uint32_t group_id)
+{
+    of_version_t          version = ind_fwd_config->of_version;
+    of_flow_add_t         *of_flow_add;
+    of_match_t            of_match[1];
+    of_list_instruction_t *of_list_instruction;
+    of_instruction_t      *of_instruction;
+    of_list_action_t      *of_list_action;
+    of_action_t           *of_action;
+
+    TEST_ASSERT((of_flow_add = of_flow_add_new(version)) != 0);
+    of_flow_add_priority_set(of_flow_add, 100);
+    memset(of_match, 0, sizeof(*of_match));
+    of_match->version = version;
+    OK(of_flow_add_match_set(of_flow_add, of_match));
+
+    TEST_ASSERT((of_action = (of_action_t *) of_action_group_new(version)) != 0);
+    of_action_group_group_id_set(&of_action->group, group_id);
+    TEST_ASSERT((of_list_action = of_list_action_new(version)) != 0);
+    OK(of_list_action_append(of_list_action, of_action));
+    of_instruction = (of_instruction_t *) of_instruction_apply_actions_new(version);
+    TEST_ASSERT(of_instruction != 0);
+    OK(of_instruction_apply_actions_actions_set(&of_instruction->apply_actions,
+                                                of_list_action));
+    TEST_ASSERT((of_list_instruction = of_list_instruction_new(version)) != 0);
+    OK(of_list_instruction_append(of_list_instruction, of_instruction));
+    OK(of_flow_add_instructions_set(of_flow_add, of_list_instruction));
+
+    callback_arm(indigo_state_manager_flow_create_callback_info);
+    indigo_fwd_flow_create(flow_id, of_flow_add, (indigo_cookie_t) 0);
+    callback_chk(indigo_state_manager_flow_create_callback_info,
+                 (indigo_cookie_t) 0);
+
+    of_list_instruction_delete(of_list_instruction);
+    of_instruction_delete(of_instruction);
+    of_list_action_delete(of_list_action);
+    of_action_delete(of_action);
+    of_flow_add_delete(of_flow_add);
+}
+
+static of_port_no_t
+group_emit(uint32_t group_id)
+{
+    pkt_tx_arm();
+    OK(ind_fwd_group_emit(group_id, 1, tcp_pkt, sizeof(tcp_pkt)));
+    TEST_ASSERT(pkt_tx_info->flag);
+    TEST_ASSERT(pkt_tx_info->len == sizeof(tcp_pkt));
+
+    return pkt_tx_info->of_port_num;
+}
+
+/* Select groups stick to a bucket until it dies; fast-failover falls back */
+static void
+test_groups(void)
+{
+    of_port_no_t select_ports[] = { 5, 6 }, ff_ports[] = { 7, 8 };
+    of_port_no_t port, other_port;
+    of_group_stats_request_t *request;
+    of_group_stats_reply_t   *reply;
+    of_group_delete_t        *of_group_delete;
+
+    group_add(1, OF_GROUP_TYPE_SELECT, select_ports, 2);
+    port = group_emit(1);
+    TEST_ASSERT(port == 5 || port == 6);
+    TEST_ASSERT(group_emit(1) == port);
+
+    /* Losing the other bucket doesn't move this flow */
+    other_port = port == 5 ? 6 : 5;
+    ind_fwd_group_port_status_set(other_port, 0);
+    TEST_ASSERT(group_emit(1) == port);
+
+    ind_fwd_group_port_status_set(port, 0);
+    ind_fwd_group_port_status_set(other_port, 1);
+    TEST_ASSERT(group_emit(1) == other_port);
+    ind_fwd_group_port_status_set(port, 1);
+
+    group_add(2, OF_GROUP_TYPE_FF, ff_ports, 2);
+    TEST_ASSERT(group_emit(2) == 7);
+    ind_fwd_group_port_status_set(7, 0);
+    TEST_ASSERT(group_emit(2) == 8);
+    ind_fwd_group_port_status_set(7, 1);
+    TEST_ASSERT(group_emit(2) == 7);
+
+    /* Deleting a group removes the flows sending to it */
+    flow_add_group(0x4000, 2);
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    TEST_ASSERT(pkt_tx_info->flag);
+    TEST_ASSERT(pkt_tx_info->of_port_num == 7);   /* Sent a bucket's copy */
+
+    of_group_delete = of_group_delete_new(ind_fwd_config->of_version);
+    TEST_ASSERT(of_group_delete != NULL);
+    of_group_delete_group_id_set(of_group_delete, 2);
+    removed_count = 0;
+    OK(ind_fwd_group_mod(of_group_delete));
+    of_group_delete_delete(of_group_delete);
+    TEST_ASSERT(removed_count == 1);
+    TEST_ASSERT(removed_flow_id == 0x4000);
+
+    callback_arm(indigo_state_manager_flow_delete_callback_info);
+    indigo_fwd_flow_delete(0x4000, (indigo_cookie_t) 0);
+    TEST_ASSERT(indigo_state_manager_flow_delete_callback_info->result
+                == INDIGO_ERROR_NOT_FOUND);
+
+    /* A group watching one that is visited after it follows it both
+       ways */
+    {
+        of_port_no_t watched_ports[] = { 11 };
+
+        group_add_watch(3, 4, 9, 10);
+        TEST_ASSERT(group_emit(3) == 10);
+        group_add(4, OF_GROUP_TYPE_FF, watched_ports, 1);
+        TEST_ASSERT(group_emit(3) == 9);
+        ind_fwd_group_port_status_set(11, 0);
+        TEST_ASSERT(group_emit(3) == 10);
+        ind_fwd_group_port_status_set(11, 1);
+        TEST_ASSERT(group_emit(3) == 9);
+    }
+
+    request = of_group_stats_request_new(ind_fwd_config->of_version);
+    TEST_ASSERT(request != NULL);
+    of_group_stats_request_group_id_set(request, OF_GROUP_ALL);
+    OK(ind_fwd_group_stats_get(request, &reply));
+    TEST_ASSERT(reply != NULL);
+    of_group_stats_reply_delete(reply);
+    of_group_stats_request_delete(request);
+
+    of_group_delete = of_group_delete_new(ind_fwd_config->of_version);
+    TEST_ASSERT(of_group_delete != NULL);
+    of_group_delete_group_id_set(of_group_delete, OF_GROUP_ALL);
+    OK(ind_fwd_group_mod(of_group_delete));
+    of_group_delete_delete(of_group_delete);
+
+    TEST_ASSERT(ind_fwd_group_emit(1, 1, tcp_pkt, sizeof(tcp_pkt))
+                == INDIGO_ERROR_NOT_FOUND);
+}
+
+/* Send a meter mod with one drop band */
+static indigo_error_t
+meter_mod(uint16_t command, uint32_t meter_id, uint16_t flags,
+          uint32_t rate, uint32_t burst_size)
+{
+    of_version_t         version = ind_fwd_config->of_version;
+    of_meter_mod_t       *of_meter_mod;
+    of_list_meter_band_t *of_list_meter_band;
+    of_meter_band_t      *of_meter_band;
+    indigo_error_t       result;
+
+    TEST_ASSERT((of_meter_mod = of_meter_mod_new(version)) != 0);
+    of_meter_mod_command_set(of_meter_mod, command);
+    of_meter_mod_meter_id_set(of_meter_mod, meter_id);
+    of_meter_mod_flags_set(of_meter_mod, flags);
+    TEST_ASSERT((of_list_meter_band = of_list_meter_band_new(version)) != 0);
+    of_meter_band = (of_meter_band_t *) of_meter_band_drop_new(version);
+    TEST_ASSERT(of_meter_band != 0);
+    of_meter_band_drop_rate_set(&of_meter_band->drop, rate);
+    of_meter_band_drop_burst_size_set(&of_meter_band->drop, burst_size);
+    OK(of_list_meter_band_append(of_list_meter_band, of_meter_band));
+    OK(of_meter_mod_meters_set(of_meter_mod, of_list_meter_band));
+
+    result = ind_fwd_meter_mod(of_meter_mod);
+
+    of_meter_band_delete(of_meter_band);
+    of_list_meter_band_delete(of_list_meter_band);
+    of_meter_mod_delete(of_meter_mod);
+
+    return result;
+}
+
+/* A drop band polices the flow once its burst is used up */
+static void
+test_meters(void)
+{
+    of_match_t of_match[1];
+    of_meter_stats_request_t *request;
+    of_meter_stats_reply_t   *reply;
+
+    OK(meter_mod(OF_METER_MOD_COMMAND_ADD, 1,
+                 OF_METER_FLAG_PKTPS | OF_METER_FLAG_BURST, 1, 2));
+    TEST_ASSERT(meter_mod(OF_METER_MOD_COMMAND_ADD, 1, OF_METER_FLAG_PKTPS,
+                          1, 2) == INDIGO_ERROR_EXISTS);
+
+    memset(of_match, 0, sizeof(*of_match));
+    of_match->version = ind_fwd_config->of_version;
+    TEST_ASSERT(flow_add_insts(0x3000, 0, of_match, 4, 0, 99)
+                == INDIGO_ERROR_NOT_FOUND);
+    OK(flow_add_insts(0x3000, 0, of_match, 4, 0, 1));
+
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(4, tcp_pkt, sizeof(tcp_pkt));
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    pkt_tx_chk(4, tcp_pkt, sizeof(tcp_pkt));
+
+    /* Burst of two packets used up; one packet/s won't refill in time */
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    TEST_ASSERT(!pkt_tx_info->flag);
+    flow_stats_chk(0x3000, 3, 3 * sizeof(tcp_pkt));
+
+    request = of_meter_stats_request_new(ind_fwd_config->of_version);
+    TEST_ASSERT(request != NULL);
+    of_meter_stats_request_meter_id_set(request, 1);
+    OK(ind_fwd_meter_stats_get(request, &reply));
+    TEST_ASSERT(reply != NULL);
+    of_meter_stats_reply_delete(reply);
+    of_meter_stats_request_delete(request);
+
+    flow_del(0x3000);
+    OK(meter_mod(OF_METER_MOD_COMMAND_DELETE, 1, 0, 1, 0));
+
+    /* Deleting a meter in use removes the flows using it */
+    OK(meter_mod(OF_METER_MOD_COMMAND_ADD, 2, OF_METER_FLAG_PKTPS, 1000, 0));
+    OK(flow_add_insts(0x3001, 0, of_match, 4, 0, 2));
+    removed_count = 0;
+    OK(meter_mod(OF_METER_MOD_COMMAND_DELETE, 2, 0, 1, 0));
+    TEST_ASSERT(removed_count == 1);
+    TEST_ASSERT(removed_flow_id == 0x3001);
+
+    callback_arm(indigo_state_manager_flow_delete_callback_info);
+    indigo_fwd_flow_delete(0x3001, (indigo_cookie_t) 0);
+    TEST_ASSERT(indigo_state_manager_flow_delete_callback_info->result
+                == INDIGO_ERROR_NOT_FOUND);
+
+    /* A meter re-added under the id doesn't inherit the flow */
+    OK(meter_mod(OF_METER_MOD_COMMAND_ADD, 2, OF_METER_FLAG_PKTPS, 1000, 0));
+    pkt_tx_arm();
+    TEST_ASSERT(INDIGO_SUCCESS(indigo_fwd_packet_receive(1, tcp_pkt, sizeof(tcp_pkt))));
+    TEST_ASSERT(!pkt_tx_info->flag);
+    OK(meter_mod(OF_METER_MOD_COMMAND_DELETE, 2, 0, 1, 0));
+}
+
 int
 main(int argc, char* argv[])
 {
@@ -523,8 +1524,30 @@ main(int argc, char* argv[])
 
     tbl_stats_chk(0, 4, 2);     /* Check table stats */
 
+    test_exact_match();
+    test_compact_key();
+    test_action_intern();
+    test_flow_queue();
+    test_flow_batch();
+    test_shadow_swap();
+    test_snapshot();
+    test_eviction();
+    test_resize();
+    test_exact_load();
+
     /* Shut down module */
     TEST_ASSERT(ind_fwd_finish() == INDIGO_ERROR_NONE);
+
+    /* Again, as an OF 1.3 pipeline of two tables */
+    ind_fwd_config->of_version = OF_VERSION_1_3;
+    ind_fwd_config->n_tables = 2;
+    TEST_ASSERT(INDIGO_SUCCESS(ind_fwd_init(ind_fwd_config)));
+
+    test_multi_table();
+    test_groups();
+    test_meters();
+
+    TEST_ASSERT(ind_fwd_finish() == INDIGO_ERROR_NONE);
   
     return (0);
 }
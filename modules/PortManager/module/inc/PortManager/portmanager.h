@@ -44,6 +44,183 @@ extern indigo_error_t ind_port_mac_addr_get(of_port_no_t port_no,
 
 extern indigo_error_t ind_port_base_mac_addr_set(of_mac_addr_t *base_mac);
 
+/** Maximum number of transmit queues on a port */
+#define IND_PORT_QUEUES_MAX 8
+
+/**
+ * Configuration of one port transmit queue
+ *
+ * Queues of higher priority are always served first; queues sharing a
+ * priority are served weighted round robin, weight packets per turn.
+ */
+
+typedef struct ind_port_queue_config_s {
+    uint32_t queue_id;          /**< OpenFlow queue id */
+    uint8_t  priority;          /**< Strict priority; higher served first */
+    uint16_t weight;            /**< Round robin share; 0 means 1 */
+    uint16_t depth;             /**< Packets held before tail drop;
+                                   0 means default */
+} ind_port_queue_config_t;
+
+/**
+ * Set the transmit queues of a port
+ * @param port_no The OF port number; need not be in use yet
+ * @param queues Array of queue configurations
+ * @param n_queues Number of queues; 0 restores the single default queue
+ * @returns An error code
+ */
+
+extern indigo_error_t ind_port_queue_config_set(
+    of_port_no_t port_no, ind_port_queue_config_t *queues, unsigned n_queues);
+
+/**
+ * Set the egress shaper of a port
+ *
+ * A shaped port sends from its queues no faster than rate, after an
+ * initial burst; what does not fit waits in the queues, and what does
+ * not fit there is dropped.
+ *
+ * @param port_no The OF port number; need not be in use yet
+ * @param rate Rate in kb/s; 0 turns shaping off
+ * @param burst Bucket size in bytes; at least one maximum size packet
+ * @returns An error code
+ */
+
+extern indigo_error_t ind_port_shaper_set(of_port_no_t port_no,
+                                          uint32_t rate, uint32_t burst);
+
+/**
+ * Set the storm control thresholds of a port
+ *
+ * Received broadcast and multicast frames over their threshold are
+ * dropped before classification.  Unicast frames the switch would
+ * flood, or send to ALL, count as unknown unicast and are dropped
+ * before replication.
+ *
+ * @param port_no The OF port number; need not be in use yet
+ * @param bcast_pps Broadcast frames per second; 0 means unlimited
+ * @param mcast_pps Multicast frames per second; 0 means unlimited
+ * @param uucast_pps Unknown unicast frames per second; 0 means unlimited
+ * @returns An error code
+ */
+
+extern indigo_error_t ind_port_storm_control_set(of_port_no_t port_no,
+                                                 uint32_t bcast_pps,
+                                                 uint32_t mcast_pps,
+                                                 uint32_t uucast_pps);
+
+/** Classic BPF instruction; the layout of Linux struct sock_filter */
+
+typedef struct ind_port_bpf_insn_s {
+    uint16_t code;
+    uint8_t  jt;
+    uint8_t  jf;
+    uint32_t k;
+} ind_port_bpf_insn_t;
+
+/** Longest classic BPF program accepted */
+#define IND_PORT_BPF_INSNS_MAX 4096
+
+/**
+ * Set kernel-side receive filtering of a port
+ *
+ * Applies to ports whose interface is read through a packet socket;
+ * others log a warning and receive unfiltered.  Frames the filter
+ * rejects never reach the switch.
+ *
+ * @param port_no The OF port number; need not be in use yet
+ * @param inbound_only If set, frames the host transmits are not received
+ * @param insns Classic BPF program; NULL for none
+ * @param n_insns Number of instructions
+ * @returns An error code
+ */
+
+extern indigo_error_t ind_port_rx_filter_set(of_port_no_t port_no,
+                                             int inbound_only,
+                                             ind_port_bpf_insn_t *insns,
+                                             unsigned n_insns);
+
+/** How received frames of a port are spread over its sockets */
+
+typedef enum ind_port_fanout_mode_e {
+    IND_PORT_FANOUT_NONE,       /**< A single socket */
+    IND_PORT_FANOUT_HASH,       /**< By flow hash; a flow stays in order */
+    IND_PORT_FANOUT_CPU,        /**< By the CPU that received the frame */
+    IND_PORT_FANOUT_ROLLOVER,   /**< Fill one socket before the next */
+} ind_port_fanout_mode_t;
+
+/** Most sockets reading one port */
+#define IND_PORT_FANOUT_MAX 8
+
+/**
+ * Set the receive fanout of a port
+ *
+ * The port's interface is read through n_sockets packet sockets joined
+ * in a kernel fanout group.  Applies when the interface is next added,
+ * as a socket cannot leave its group.
+ *
+ * @param port_no The OF port number; need not be in use yet
+ * @param mode How frames are spread over the sockets
+ * @param n_sockets Number of sockets, up to IND_PORT_FANOUT_MAX
+ * @returns An error code
+ */
+
+extern indigo_error_t ind_port_fanout_set(of_port_no_t port_no,
+                                          ind_port_fanout_mode_t mode,
+                                          unsigned n_sockets);
+
+/** Receive priority classes; the highest is served first */
+#define IND_PORT_RX_PRIORITIES 4
+
+/** Largest receive quantum, in frames */
+#define IND_PORT_RX_QUANTUM_MAX 1024
+
+/**
+ * Set how a port is served by the receive scheduler
+ *
+ * Ports with frames waiting are served in strict order of priority
+ * class, and round robin within a class, reading up to quantum frames
+ * per turn.
+ *
+ * @param port_no The OF port number; need not be in use yet
+ * @param quantum Frames per turn; 0 for the default
+ * @param priority Class, from 0 (the default) to IND_PORT_RX_PRIORITIES - 1
+ * @returns An error code
+ */
+
+extern indigo_error_t ind_port_rx_sched_set(of_port_no_t port_no,
+                                            unsigned quantum,
+                                            unsigned priority);
+
+/**
+ * Turn TX offload on or off
+ *
+ * With offload on, packets leaving a port's transmit queues are handed
+ * through a lock-free ring to a dedicated thread, which sends them in
+ * batches, so a slow send does not hold up forwarding.  Applies to
+ * ports transmitting on a raw socket; others keep sending inline.
+ *
+ * @param enable TRUE to send from the TX thread
+ * @returns An error code
+ */
+
+extern indigo_error_t ind_port_tx_offload_set(int enable);
+
+/** Most OpenFlow ports the port table may hold */
+#define IND_PORT_MAX_PORTS_MAX 4096
+
+/**
+ * Resize the port table
+ *
+ * Ports in use keep their numbers and keep forwarding.  The table may
+ * not shrink past a port in use.
+ *
+ * @param max_ports New number of OpenFlow ports
+ * @returns An error code
+ */
+
+extern indigo_error_t ind_port_max_ports_set(unsigned max_ports);
+
 /**
  * Initialize the port manager
  * @param config The port manager specific config data
@@ -137,5 +137,16 @@ int portmanager_config_show(struct aim_pvs_s* pvs);
 #define PORTMANAGER_CONFIG_INCLUDE_VPI_PCAPDUMP 0
 #endif
 
+/**
+ * PORTMANAGER_CONFIG_INCLUDE_TX_BATCH
+ *
+ * Send to Linux interfaces in batches with sendmmsg() on a raw socket,
+ * rather than one vpi_send() per packet.  Not used with VPI_PCAPDUMP,
+ * which needs every packet to pass through the VPI. */
+
+#ifndef PORTMANAGER_CONFIG_INCLUDE_TX_BATCH
+#define PORTMANAGER_CONFIG_INCLUDE_TX_BATCH 1
+#endif
+
 
 #endif /* __PORTMANAGER_CONFIG_H__ */
@@ -22,6 +22,10 @@
  * @brief Implementation of Port Manager for Indigo Linux Ref
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* sendmmsg() */
+#endif
+
 #include "portmanager_log.h"
 #include "portmanager_int.h"
 
@@ -35,9 +39,13 @@
 #include <linux/if_packet.h>
 #include <linux/if_ether.h>
 #include <linux/sockios.h>
+#include <linux/filter.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <errno.h>
+#include <time.h>
+#include <stdlib.h>
+#include <inttypes.h>
 #include <VPI/vpi.h>
 
 #include <indigo/memory.h>
@@ -65,24 +73,192 @@ static int init_done = 0;
 static int module_enabled = 0; /**< Module enable state */
 
 #define MAX_PKT_LEN   16384     /**< Maximum packet length */
+#define PORT_RX_BURST 32        /**< Packets read per socket wakeup */
+#define PORT_RX_BUDGET_NS 250000 /**< Longest a wakeup may process */
+#define SHAPER_TICK_MS 1        /**< Shaper backlog service period */
+#define LINK_POLL_MS   1000     /**< Link state poll period */
+
+/* Shaper tokens are 1e-6 bit, so refill = rate in kb/s * elapsed ns */
+#define SHAPER_TOKENS_PER_BYTE  8000000ULL
+
+#define TX_BATCH_MAX          32        /**< Packets per send syscall */
+#define TX_FLUSH_HIST_BUCKETS 6         /**< Flush sizes 1, 2-3, ..., 32 */
+#define TX_FLUSH_DEADLINE_NS  50000     /**< Longest deferral in a burst */
+
+#define PORT_CACHE_LINE       64        /**< Port table entry alignment */
+
+/* Storm control buckets hold 100ms of their rate; tokens are 1e-9
+   packet, so refill = rate in pps * elapsed ns */
+#define STORM_TOKENS_PER_PKT  1000000000ULL
+#define STORM_BURST_NS        100000000ULL
+#define STORM_QUIET_NS        1000000000ULL /**< Drop-free time ending
+                                                a storm event */
+
+/** \brief Traffic classes policed by storm control */
+enum port_storm_class {
+    PORT_STORM_BCAST,
+    PORT_STORM_MCAST,
+    PORT_STORM_UUCAST,          /**< Unicast sent to flood or ALL */
+    PORT_STORM_CLASSES
+};
+
+static const char *const port_storm_class_names[PORT_STORM_CLASSES] = {
+    "broadcast", "multicast", "unknown-unicast"
+};
+
+#define OFPQ_ALL (~0)           /** \todo Remove this, belongs in LOXI */
+
+#ifndef PACKET_IGNORE_OUTGOING
+#define PACKET_IGNORE_OUTGOING 23   /* Linux 4.20 */
+#endif
+#ifndef PACKET_FANOUT_FLAG_UNIQUEID
+#define PACKET_FANOUT_FLAG_UNIQUEID 0x2000  /* Linux 4.12 */
+#endif
+
+static const char *const port_fanout_mode_names[] = {
+    "none", "hash", "cpu", "rollover"
+};
 
 static ind_port_config_t my_config[1];
 
-/** \brief Per-port data */
+/** \brief Per-port data
+
+What every packet received or sent on the port reads comes first, and
+the packet and byte counters have a cache line to themselves.  Entries
+are cache line aligned, so neighbouring ports never share a line; the
+name and MAC are in of_port_info_tbl.
+*/
 struct of_port {
-    char     ifname[128];      /**< Name of port's VPI or Linux network interface */
-    of_mac_addr_t mac;          /**< MAC */
     vpi_t    vpi;              /**< VPI handle; NULL = not in use */
     uint32_t config;            /**< OpenFlow's port config,
                                    from of_port_mod */
+    int      tx_fd;             /**< Raw socket for batched TX;
+                                   -1 = send with vpi_send() */
+    struct port_tx_ring *tx_ring;   /**< TX offload; NULL = send inline */
+    unsigned tx_pending;        /**< TRUE <=> On tx_pending_tbl */
+    unsigned rx_packet_socket;  /**< TRUE <=> VPI reads a packet socket */
+    unsigned n_rx_members;      /**< Sockets read; 1 without fanout */
+    uint64_t cnt_rx_pkts        /**< Received packets counter */
+                 __attribute__((aligned(PORT_CACHE_LINE)));
+    uint64_t cnt_rx_bytes;      /**< Received bytes counter */
     uint64_t cnt_tx_pkts;       /**< Transmitted packets counter */
     uint64_t cnt_tx_bytes;      /**< Transmitted bytes counter */
-    uint64_t cnt_rx_pkts;       /**< Received packets counter */
-    uint64_t cnt_rx_bytes;      /**< Received bytes counter */
+    uint64_t cnt_tx_syscalls;   /**< Send syscalls made */
+    struct port_sched sched     /**< Transmit queues */
+                 __attribute__((aligned(PORT_CACHE_LINE)));
+    uint64_t cnt_tx_thread_errors;  /**< From rings since destroyed */
+    uint64_t tx_flush_hist[TX_FLUSH_HIST_BUCKETS];
+                                /**< Flushes by log2 of packets sent */
+    uint64_t cnt_fanout_errors; /**< Flood/ALL copies not queued */
+    struct port_storm {
+        uint32_t pps;           /**< Threshold; 0 = not policed */
+        uint64_t capacity;      /**< Bucket size, in tokens */
+        uint64_t tokens;        /**< Current fill */
+        uint64_t last_ns;       /**< Time of last refill */
+        uint64_t last_drop_ns;  /**< Time of last drop */
+        unsigned storming;      /**< TRUE <=> In a storm event */
+        uint64_t cnt_dropped;   /**< Frames dropped */
+        uint64_t cnt_events;    /**< Storm events started */
+    } storm[PORT_STORM_CLASSES];
+    struct port_shaper {
+        uint32_t rate;          /**< kb/s; 0 = not shaped */
+        uint64_t capacity;      /**< Bucket size, in tokens */
+        uint64_t tokens;        /**< Current fill */
+        uint64_t last_ns;       /**< Time of last refill */
+        unsigned waiting;       /**< TRUE <=> On shaper_wait_tbl */
+        uint64_t cnt_shaped;    /**< Packets whose TX was delayed */
+    } shaper;
+    uint64_t cnt_rx_kernel_drops; /**< From PACKET_STATISTICS */
+    unsigned link_down;         /**< TRUE <=> No carrier when last polled */
+    struct port_rx_member {
+        int          fd;        /**< Member 0 is the VPI's descriptor */
+        of_port_no_t of_port_num;
+        uint64_t     cnt_rx_pkts;
+        uint64_t     cnt_rx_bytes;
+        uint64_t     cnt_kernel_drops;
+        struct port_rx_member *rx_next; /**< In its port_rx_ready_tbl queue */
+        unsigned     rx_queued;         /**< TRUE <=> Queued for service */
+        unsigned     rx_class;          /**< Priority queued at */
+        uint64_t     rx_ready_ns;       /**< When queued */
+    } rx_members[IND_PORT_FANOUT_MAX];
+    uint64_t cnt_rx_turns;      /**< Times served by the RX scheduler */
+    uint64_t cnt_rx_quantum_exhausted;  /**< Turns ending with frames left */
+    uint64_t rx_last_service_ns;
+    uint64_t rx_max_wait_ns;    /**< Longest from queued to served */
 };
 
 static struct of_port *of_port_tbl;  /**< Table of all ports */
 
+/** \brief Name and MAC of a port
+
+Kept apart from struct of_port so the packet path doesn't pull them
+into cache; read for port descriptions, lists and logs.
+*/
+
+struct of_port_info {
+    char          ifname[128];  /**< Name of port's VPI or Linux network interface */
+    of_mac_addr_t mac;          /**< MAC */
+};
+
+static struct of_port_info *of_port_info_tbl;
+
+/** \brief Configured transmit settings of a port
+
+Kept apart from struct of_port because it outlives the interface.
+*/
+
+struct of_port_cfg {
+    unsigned                n_queues;
+    ind_port_queue_config_t queues[IND_PORT_QUEUES_MAX];
+    uint32_t                shaper_rate;    /**< kb/s; 0 = not shaped */
+    uint32_t                shaper_burst;   /**< Bytes */
+    uint32_t                storm_pps[PORT_STORM_CLASSES];
+    unsigned                rx_all_directions;  /**< Receive own TX too */
+    ind_port_bpf_insn_t     *rx_filter;         /**< NULL = none */
+    unsigned                rx_filter_len;
+    ind_port_fanout_mode_t  fanout_mode;
+    unsigned                fanout_sockets;
+    unsigned                rx_quantum;     /**< Frames; 0 = PORT_RX_BURST */
+    unsigned                rx_priority;
+};
+
+static struct of_port_cfg *of_port_cfg_tbl;
+
+/* Receive sockets with frames waiting, a queue per priority class */
+static struct port_rx_queue {
+    struct port_rx_member *head, *tail;
+} port_rx_ready_tbl[IND_PORT_RX_PRIORITIES];
+
+/* While a receive burst is processed, transmission is deferred so the
+   queue scheduler sees the whole burst's output; ports with packets
+   queued are listed here and drained at the end of the burst */
+static int          tx_defer;
+static of_port_no_t *tx_pending_tbl;
+static unsigned     tx_pending_cnt;
+static uint64_t     tx_pending_since_ns;    /**< When the list filled */
+
+/* Shaped ports holding packets they may not send yet; served from a
+   periodic timer that runs only while this list is non-empty */
+static of_port_no_t *shaper_wait_tbl;
+static unsigned     shaper_wait_cnt;
+static int          shaper_timer_on;
+
+static int          link_poll_on;       /**< TRUE <=> link_poll_timer set */
+static int          link_sd = -1;       /**< For interface flag ioctls */
+
+/* TRUE <=> Ports with a raw TX socket hand packets to the TX thread */
+static int          tx_offload;
+
+/* Time used by the shapers; read once per receive burst or timer tick */
+static uint64_t     tx_clock_ns;
+
+/* Port sets for flood and ALL output, bit (n - 1) for port n; kept up to
+   date on port add, remove and modify so fan-out need not scan the
+   port table */
+static uint32_t     *port_set_all;      /**< Ports in use */
+static uint32_t     *port_set_flood;    /**< In use and not NO_FLOOD */
+static unsigned     port_set_words;
+
 /** \brief Check if a port number is valid
 
 \note OF spec specifies that port numbers start at 1.
@@ -104,6 +280,80 @@ of_port_num_to_ptr(of_port_no_t of_port_num)
 }
 
 
+/** \brief Return pointer to name and MAC of given port number */
+
+static struct of_port_info *
+of_port_num_to_info(of_port_no_t of_port_num)
+{
+    return (&of_port_info_tbl[of_port_num - 1]);
+}
+
+
+/** \brief Allocate a port table, cache line aligned; NULL if no memory */
+
+static struct of_port *
+of_port_tbl_alloc(unsigned max_ports)
+{
+    void *tbl;
+
+    if (posix_memalign(&tbl, PORT_CACHE_LINE,
+                       max_ports * sizeof(struct of_port)) != 0) {
+        return (NULL);
+    }
+
+    return (tbl);
+}
+
+
+/** \brief Destroy port table */
+
+static void
+of_port_tbl_delete(void)
+{
+    struct of_port            *p;
+    struct port_tx_ring_stats tx_ring_stats;
+    unsigned                  n;
+
+    if (of_port_cfg_tbl != NULL) {
+        for (n = 0; n < my_config->max_ports; ++n) {
+            INDIGO_MEM_FREE(of_port_cfg_tbl[n].rx_filter);
+        }
+    }
+
+    if (of_port_tbl != NULL) {
+        for (p = of_port_tbl, n = my_config->max_ports; n; --n, ++p) {
+            if (p->vpi != NULL) {
+                if (p->tx_ring != NULL) {
+                    ind_port_tx_ring_destroy(p->tx_ring, &tx_ring_stats);
+                }
+                ind_port_sched_destroy(&p->sched);
+                if (p->tx_fd >= 0)  close(p->tx_fd);
+                /* Member 0 belongs to the VPI */
+                while (p->n_rx_members > 1) {
+                    close(p->rx_members[--p->n_rx_members].fd);
+                }
+            }
+        }
+    }
+
+    INDIGO_MEM_SET(port_rx_ready_tbl, 0, sizeof(port_rx_ready_tbl));
+    free(of_port_tbl);
+    INDIGO_MEM_FREE(of_port_info_tbl);
+    INDIGO_MEM_FREE(of_port_cfg_tbl);
+    INDIGO_MEM_FREE(tx_pending_tbl);
+    INDIGO_MEM_FREE(shaper_wait_tbl);
+    INDIGO_MEM_FREE(port_set_all);
+    INDIGO_MEM_FREE(port_set_flood);
+    port_set_all = NULL;
+    port_set_flood = NULL;
+    of_port_tbl = NULL;
+    of_port_info_tbl = NULL;
+    of_port_cfg_tbl = NULL;
+    tx_pending_tbl = NULL;
+    shaper_wait_tbl = NULL;
+}
+
+
 /** \brief Initialize port table */
 
 static indigo_error_t
@@ -112,9 +362,7 @@ of_port_tbl_init(void)
     unsigned       n;
     struct of_port *p;
 
-    if ((of_port_tbl = (struct of_port *)
-         INDIGO_MEM_ALLOC(my_config->max_ports * sizeof(struct of_port))) == 0
-        ) {
+    if ((of_port_tbl = of_port_tbl_alloc(my_config->max_ports)) == 0) {
         LOG_ERROR("No memory");
         return (INDIGO_ERROR_UNKNOWN);
     }
@@ -123,16 +371,34 @@ of_port_tbl_init(void)
         p->vpi = NULL; /* Mark all port slots as not in use */
     }
 
-    return (INDIGO_ERROR_NONE);
-}
-
-
-/** \brief Destroy port table */
+    of_port_info_tbl = INDIGO_MEM_ALLOC(my_config->max_ports
+                                        * sizeof(*of_port_info_tbl));
+    of_port_cfg_tbl = INDIGO_MEM_ALLOC(my_config->max_ports
+                                             * sizeof(*of_port_cfg_tbl));
+    tx_pending_tbl = INDIGO_MEM_ALLOC(my_config->max_ports
+                                      * sizeof(*tx_pending_tbl));
+    shaper_wait_tbl = INDIGO_MEM_ALLOC(my_config->max_ports
+                                       * sizeof(*shaper_wait_tbl));
+    port_set_words = (my_config->max_ports + 31) / 32;
+    port_set_all = INDIGO_MEM_ALLOC(port_set_words * sizeof(uint32_t));
+    port_set_flood = INDIGO_MEM_ALLOC(port_set_words * sizeof(uint32_t));
+    if (of_port_info_tbl == NULL || of_port_cfg_tbl == NULL
+        || tx_pending_tbl == NULL || shaper_wait_tbl == NULL
+        || port_set_all == NULL || port_set_flood == NULL) {
+        LOG_ERROR("No memory");
+        of_port_tbl_delete();
+        return (INDIGO_ERROR_UNKNOWN);
+    }
+    INDIGO_MEM_SET(of_port_info_tbl, 0,
+                   my_config->max_ports * sizeof(*of_port_info_tbl));
+    INDIGO_MEM_SET(of_port_cfg_tbl, 0,
+                   my_config->max_ports * sizeof(*of_port_cfg_tbl));
+    INDIGO_MEM_SET(port_set_all, 0, port_set_words * sizeof(uint32_t));
+    INDIGO_MEM_SET(port_set_flood, 0, port_set_words * sizeof(uint32_t));
+    tx_pending_cnt = 0;
+    shaper_wait_cnt = 0;
 
-static void
-of_port_tbl_delete(void)
-{
-    INDIGO_MEM_FREE(of_port_tbl);
+    return (INDIGO_ERROR_NONE);
 }
 
 
@@ -151,6 +417,28 @@ of_port_no_flood(struct of_port *p)
 }
 
 
+/** \brief Bring a port's membership of the flood and ALL sets up to date */
+
+static void
+port_sets_update(of_port_no_t of_port_num, struct of_port *p)
+{
+    unsigned word = (of_port_num - 1) / 32;
+    uint32_t bit = 1u << ((of_port_num - 1) % 32);
+
+    if (of_port_inuse(p)) {
+        port_set_all[word] |= bit;
+    } else {
+        port_set_all[word] &= ~bit;
+    }
+
+    if (of_port_inuse(p) && !of_port_no_flood(p)) {
+        port_set_flood[word] |= bit;
+    } else {
+        port_set_flood[word] &= ~bit;
+    }
+}
+
+
 /** \brief Return a pollable file descriptor */
 
 static int
@@ -160,6 +448,184 @@ of_port_fd(struct of_port *p)
 }
 
 
+/** \brief Collect the kernel's drop count for a port's packet socket
+
+PACKET_STATISTICS clears the kernel counters as it reads them, so they
+are accumulated here.
+*/
+
+static void
+port_rx_kernel_stats_update(struct of_port *p)
+{
+    struct port_rx_member *m;
+    struct tpacket_stats  st;
+    socklen_t             len;
+    unsigned              n;
+
+    if (!p->rx_packet_socket)  return;
+
+    for (m = p->rx_members, n = p->n_rx_members; n; --n, ++m) {
+        len = sizeof(st);
+        if (getsockopt(m->fd, SOL_PACKET, PACKET_STATISTICS,
+                       &st, &len) == 0) {
+            m->cnt_kernel_drops += st.tp_drops;
+            p->cnt_rx_kernel_drops += st.tp_drops;
+        }
+    }
+}
+
+
+/** \brief Read a port's receive sockets through fanout
+
+The VPI's packet socket founds a kernel fanout group, which further raw
+sockets on the same interface join.  On any failure the port keeps
+reading the sockets it has.
+*/
+
+static void
+port_rx_fanout_open(of_port_no_t of_port_num, struct of_port *p)
+{
+    static const int   types[] = {
+        0, PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG,
+        PACKET_FANOUT_CPU, PACKET_FANOUT_ROLLOVER
+    };
+    struct of_port_cfg *cfg = &of_port_cfg_tbl[of_port_num - 1];
+    struct sockaddr_ll sll;
+    unsigned           ifindex;
+    socklen_t          len = sizeof(int);
+    int                arg, fd;
+
+    if (cfg->fanout_mode == IND_PORT_FANOUT_NONE || cfg->fanout_sockets < 2) {
+        return;
+    }
+    if (!p->rx_packet_socket
+        || (ifindex = if_nametoindex(of_port_num_to_info(of_port_num)->ifname))
+           == 0) {
+        LOG_WARN("Port %u is not read from a Linux interface; "
+                 "fanout not used", of_port_num);
+        return;
+    }
+
+    /* Defragmenting before hashing keeps a fragmented flow together; the
+       kernel picks a group id free in the namespace */
+    arg = (types[cfg->fanout_mode] | PACKET_FANOUT_FLAG_UNIQUEID) << 16;
+    if (setsockopt(p->rx_members[0].fd, SOL_PACKET, PACKET_FANOUT,
+                   &arg, sizeof(arg)) < 0
+        || getsockopt(p->rx_members[0].fd, SOL_PACKET, PACKET_FANOUT,
+                      &arg, &len) < 0) {
+        LOG_ERROR("Port %u: could not create fanout group: %s",
+                  of_port_num, strerror(errno));
+        return;
+    }
+    arg = (arg & 0xffff) | (types[cfg->fanout_mode] << 16);
+
+    INDIGO_MEM_SET(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+
+    while (p->n_rx_members < cfg->fanout_sockets) {
+        if ((fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) {
+            LOG_ERROR("Port %u: no socket for fanout: %s",
+                      of_port_num, strerror(errno));
+            break;
+        }
+        if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0
+            || setsockopt(fd, SOL_PACKET, PACKET_FANOUT,
+                          &arg, sizeof(arg)) < 0) {
+            LOG_ERROR("Port %u: could not join fanout group: %s",
+                      of_port_num, strerror(errno));
+            close(fd);
+            break;
+        }
+        p->rx_members[p->n_rx_members].fd = fd;
+        p->rx_members[p->n_rx_members].of_port_num = of_port_num;
+        ++p->n_rx_members;
+    }
+
+    LOG_VERBOSE("Port %u: %s fanout over %u sockets", of_port_num,
+                port_fanout_mode_names[cfg->fanout_mode], p->n_rx_members);
+}
+
+
+/** \brief Drop a receive socket from its queue; for port removal */
+
+static void
+port_rx_unqueue(struct port_rx_member *m)
+{
+    struct port_rx_queue  *rq;
+    struct port_rx_member **pm, *prev = NULL;
+
+    if (!m->rx_queued)  return;
+
+    rq = &port_rx_ready_tbl[m->rx_class];
+    for (pm = &rq->head; *pm != m; prev = *pm, pm = &(*pm)->rx_next);
+    *pm = m->rx_next;
+    if (rq->tail == m)  rq->tail = prev;
+    m->rx_queued = 0;
+}
+
+
+/** \brief Stop reading a port's receive sockets, closing fanout members */
+
+static void
+port_rx_members_close(struct of_port *p)
+{
+    unsigned n;
+
+    for (n = 0; n < p->n_rx_members; ++n) {
+        ind_soc_socket_unregister(p->rx_members[n].fd);
+        port_rx_unqueue(&p->rx_members[n]);
+        if (n > 0)  close(p->rx_members[n].fd);
+    }
+    p->n_rx_members = 0;
+}
+
+
+/** \brief Apply a port's receive filtering to its packet socket */
+
+static void
+port_rx_filter_apply(of_port_no_t of_port_num, struct of_port *p)
+{
+    struct of_port_cfg *cfg = &of_port_cfg_tbl[of_port_num - 1];
+    struct sock_fprog  prog;
+    int                fd, val;
+    unsigned           n;
+
+    if (!p->rx_packet_socket) {
+        if (cfg->rx_filter != NULL) {
+            LOG_WARN("Port %u does not read a packet socket; "
+                     "BPF filter not applied", of_port_num);
+        }
+        return;
+    }
+
+    for (n = 0; n < p->n_rx_members; ++n) {
+        fd = p->rx_members[n].fd;
+
+        val = !cfg->rx_all_directions;
+        if (setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+                       &val, sizeof(val)) < 0) {
+            LOG_VERBOSE("Port %u: kernel cannot ignore outgoing frames: %s",
+                        of_port_num, strerror(errno));
+        }
+
+        if (cfg->rx_filter != NULL) {
+            prog.len = cfg->rx_filter_len;
+            prog.filter = (struct sock_filter *)cfg->rx_filter;
+            if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER,
+                           &prog, sizeof(prog)) < 0) {
+                LOG_ERROR("Port %u: could not attach BPF filter: %s",
+                          of_port_num, strerror(errno));
+            }
+        } else {
+            /* Fails harmlessly if no filter is attached */
+            (void)setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+        }
+    }
+}
+
+
 /** \brief Set of port stats */
 
 struct of_port_stats {
@@ -190,7 +656,9 @@ struct of_port_stats {
 static indigo_error_t
 port_stats_get(of_port_no_t of_port_num, struct of_port_stats *port_stats)
 {
-    struct of_port *p;
+    struct of_port  *p;
+    struct port_txq *q;
+    unsigned        n;
 
     INDIGO_MEM_SET(port_stats, 0, sizeof(*port_stats));
 
@@ -215,6 +683,28 @@ port_stats_get(of_port_no_t of_port_num, struct of_port_stats *port_stats)
         port_stats->tx_packets = p->cnt_tx_pkts;
         port_stats->rx_bytes   = p->cnt_rx_bytes;
         port_stats->tx_bytes   = p->cnt_tx_bytes;
+        port_stats->tx_errors  = p->cnt_tx_thread_errors;
+
+        /* Queue overflows, typically behind the shaper, are TX drops */
+        if (of_port_inuse(p)) {
+            for (q = p->sched.queues, n = p->sched.n_queues; n; --n, ++q) {
+                port_stats->tx_dropped += q->cnt_dropped;
+                port_stats->tx_errors  += q->cnt_tx_errors;
+            }
+            for (n = 0; n < PORT_STORM_CLASSES; ++n) {
+                port_stats->rx_dropped += p->storm[n].cnt_dropped;
+            }
+            port_rx_kernel_stats_update(p);
+            port_stats->rx_dropped += p->cnt_rx_kernel_drops;
+            if (p->tx_ring != NULL) {
+                struct port_tx_ring_stats stats;
+
+                ind_port_tx_ring_stats_get(p->tx_ring, &stats);
+                port_stats->tx_packets += stats.cnt_tx_pkts;
+                port_stats->tx_bytes   += stats.cnt_tx_bytes;
+                port_stats->tx_errors  += stats.cnt_tx_errors;
+            }
+        }
     } else {
         return INDIGO_ERROR_NOT_FOUND;
     }
@@ -275,44 +765,32 @@ port_stats_add(of_list_port_stats_entry_t *port_stats_list,
 }
 
 
-/** \brief Add statistics for a queue to a queue stats list */
+/** \brief Append one queue stats entry to a queue stats list */
 
 static indigo_error_t
-queue_stats_add(of_list_queue_stats_entry_t *queue_stats_list,
-                of_port_no_t                of_port_num,
-                unsigned                    queue_id
-                )
+queue_stats_entry_add(of_list_queue_stats_entry_t *queue_stats_list,
+                      of_port_no_t                of_port_num,
+                      uint32_t                    queue_id,
+                      uint64_t                    tx_packets,
+                      uint64_t                    tx_bytes,
+                      uint64_t                    tx_errors
+                      )
 {
     indigo_error_t         result = INDIGO_ERROR_NONE;
-    struct of_port_stats   port_stats[1];
-    of_queue_stats_entry_t *of_queue_stats_entry = NULL;
-
-    if (queue_id != 0) {
-        LOG_ERROR("Queue id %u out of range", queue_id);
-        result = INDIGO_ERROR_PARAM;
-        goto done;
-    }
-
-    if (INDIGO_FAILURE(result = port_stats_get(of_port_num, port_stats))) {
-        LOG_ERROR("port_stats_get(of_port_num=%u) failed",
-                         of_port_num
-                         );
-        goto done;
-    }
+    of_queue_stats_entry_t *of_queue_stats_entry;
 
     of_queue_stats_entry =
         of_queue_stats_entry_new(queue_stats_list->version);
     if (of_queue_stats_entry == NULL) {
         LOG_ERROR("of_queue_stats_entry_new() failed");
-        result = INDIGO_ERROR_UNKNOWN;
-        goto done;
+        return (INDIGO_ERROR_UNKNOWN);
     }
 
     of_queue_stats_entry_port_no_set(of_queue_stats_entry, of_port_num);
     of_queue_stats_entry_queue_id_set(of_queue_stats_entry, queue_id);
-    of_queue_stats_entry_tx_bytes_set(of_queue_stats_entry, port_stats->tx_bytes);
-    of_queue_stats_entry_tx_packets_set(of_queue_stats_entry, port_stats->tx_packets);
-    of_queue_stats_entry_tx_errors_set(of_queue_stats_entry, 0);
+    of_queue_stats_entry_tx_bytes_set(of_queue_stats_entry, tx_bytes);
+    of_queue_stats_entry_tx_packets_set(of_queue_stats_entry, tx_packets);
+    of_queue_stats_entry_tx_errors_set(of_queue_stats_entry, tx_errors);
 
     if (LOXI_FAILURE(of_list_queue_stats_entry_append(queue_stats_list,
                                                       of_queue_stats_entry
@@ -321,111 +799,549 @@ queue_stats_add(of_list_queue_stats_entry_t *queue_stats_list,
         ) {
         LOG_ERROR("of_list_queue_stats_entry_append() failed");
         result = INDIGO_ERROR_UNKNOWN;
-        goto done;
     }
 
- done:
-    if (of_queue_stats_entry != NULL) {
-        of_queue_stats_entry_delete(of_queue_stats_entry);
-    }
+    of_queue_stats_entry_delete(of_queue_stats_entry);
 
     return (result);
 }
 
 
-/** \brief Set of port status items */
-
-struct port_status {
-    unsigned linkup;              /**< TRUE <=> Link is up */
-};
-
+/** \brief Add statistics for a port's queue(s) to a queue stats list
 
-/** \brief Get status of a port */
+Returns INDIGO_ERROR_NOT_FOUND if the port has no such queue.
+*/
 
 static indigo_error_t
-port_status_get(of_port_no_t of_port_num, struct port_status *port_status)
+queue_stats_add(of_list_queue_stats_entry_t *queue_stats_list,
+                of_port_no_t                of_port_num,
+                uint32_t                    queue_id
+                )
 {
-    INDIGO_MEM_SET(port_status, 0, sizeof(*port_status));
+    indigo_error_t       result = INDIGO_ERROR_NONE;
+    struct of_port_stats port_stats[1];
+    struct port_txq      *q;
+    unsigned             n, found = 0;
 
-    /** \todo Get proper status of Linux network interface;
-     */
+    if (of_port_num == OF_PORT_DEST_CONTROLLER) {
+        /* The controller port has the one queue, carrying all its TX */
+        if (queue_id != OFPQ_ALL && queue_id != 0) {
+            return (INDIGO_ERROR_NOT_FOUND);
+        }
 
-    port_status->linkup = 1;      /* Assume link is up */
+        if (INDIGO_FAILURE(result = port_stats_get(of_port_num, port_stats))) {
+            LOG_ERROR("port_stats_get(of_port_num=%u) failed",
+                             of_port_num
+                             );
+            return (result);
+        }
 
-    return (INDIGO_ERROR_NONE);
+        return (queue_stats_entry_add(queue_stats_list, of_port_num, 0,
+                                      port_stats->tx_packets,
+                                      port_stats->tx_bytes, 0));
+    }
+
+    /* Queue drops are overruns, which OpenFlow counts as TX errors */
+    for (q = of_port_num_to_ptr(of_port_num)->sched.queues,
+             n = of_port_num_to_ptr(of_port_num)->sched.n_queues;
+         n;
+         --n, ++q
+         ) {
+        if (queue_id != OFPQ_ALL && q->queue_id != queue_id)  continue;
+
+        result = queue_stats_entry_add(queue_stats_list, of_port_num,
+                                       q->queue_id,
+                                       q->cnt_tx_pkts, q->cnt_tx_bytes,
+                                       q->cnt_tx_errors + q->cnt_dropped);
+        if (INDIGO_FAILURE(result))  return (result);
+        found = 1;
+    }
+
+    return (found || queue_id == OFPQ_ALL
+            ? INDIGO_ERROR_NONE : INDIGO_ERROR_NOT_FOUND);
 }
 
 
-/** \brief Fill in LOXI of_port_desc for given port */
+/** \brief Read the clock the shapers run on */
 
-static indigo_error_t
-port_desc_set(of_port_desc_t *of_port_desc, of_port_no_t of_port_num)
+static void
+tx_clock_update(void)
 {
-    indigo_error_t     result = INDIGO_ERROR_NONE;
-    struct of_port     *p;
-    struct port_status port_status[1];
-    uint32_t           of_port_state;
+    struct timespec ts;
 
-    if (INDIGO_FAILURE(result = port_status_get(of_port_num, port_status))) {
-        LOG_ERROR("port_status_get(of_port_num=%u) failed", of_port_num);
-        return (result);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    tx_clock_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/** \brief Take tokens for a packet from a port's shaper
+
+Returns TRUE if the packet may be sent now.
+*/
+
+static int
+port_shaper_admit(struct port_shaper *shaper, unsigned len)
+{
+    uint64_t cost = len * SHAPER_TOKENS_PER_BYTE;
+
+    uint64_t elapsed;
+
+    if (tx_clock_ns > shaper->last_ns) {
+        elapsed = tx_clock_ns - shaper->last_ns;
+        /* Compare before multiplying; a long idle time would overflow */
+        if (elapsed >= (shaper->capacity - shaper->tokens) / shaper->rate) {
+            shaper->tokens = shaper->capacity;
+        } else {
+            shaper->tokens += elapsed * shaper->rate;
+        }
+        shaper->last_ns = tx_clock_ns;
     }
-  
-    of_port_state = 0;
-    if (!port_status->linkup) {
-        OF_PORT_STATE_FLAG_LINK_DOWN_SET(of_port_state, of_port_desc->version);
+
+    if (shaper->tokens < cost) {
+        return 0;
     }
 
-    p = of_port_num_to_ptr(of_port_num);
+    shaper->tokens -= cost;
+    return 1;
+}
 
-    of_port_desc_port_no_set(of_port_desc, of_port_num);
-    of_port_desc_hw_addr_set(of_port_desc, p->mac);
 
-    of_port_desc_name_set(of_port_desc, p->ifname);
-    of_port_desc_config_set(of_port_desc, p->config);
-    of_port_desc_state_set(of_port_desc, of_port_state);
+static void shaper_timer(void *cookie);
 
-    /** \todo Get proper current, advertised supported and peer values;
-     */
+/** \brief Note that a shaped port holds packets it may not send yet */
 
-    of_port_desc_curr_set(of_port_desc, 0);
-    of_port_desc_advertised_set(of_port_desc, 0);
-    of_port_desc_supported_set(of_port_desc, 0);
-    of_port_desc_peer_set(of_port_desc, 0);
+static void
+port_shaper_wait(of_port_no_t of_port_num, struct of_port *p)
+{
+    if (p->shaper.waiting)  return;
 
-    return (INDIGO_ERROR_NONE);
+    p->shaper.waiting = 1;
+    shaper_wait_tbl[shaper_wait_cnt++] = of_port_num;
+
+    if (!shaper_timer_on) {
+        if (INDIGO_FAILURE(ind_soc_timer_event_register(shaper_timer, NULL,
+                                                        SHAPER_TICK_MS))) {
+            LOG_ERROR("Could not register shaper timer");
+            return;
+        }
+        shaper_timer_on = 1;
+    }
 }
 
 
-/** \brief Compose LOXI object for port status change, and send to peer */
+/** \brief Open a raw socket for batched transmission on an interface
 
-static indigo_error_t
-port_status_notify(of_port_no_t of_port_num, unsigned reason)
+Returns -1 if batching is not available, in which case the port sends
+with vpi_send().
+*/
+
+static int
+port_tx_socket_open(const char *ifname)
 {
-    indigo_error_t   result = INDIGO_ERROR_NONE;
-    of_port_desc_t   *of_port_desc   = 0;
-    of_port_status_t *of_port_status = 0;
+#if PORTMANAGER_CONFIG_INCLUDE_TX_BATCH == 1 && \
+    PORTMANAGER_CONFIG_INCLUDE_VPI_PCAPDUMP == 0
+    struct sockaddr_ll sll;
+    unsigned           ifindex;
+    int                fd;
 
-    /* Don't know the cxn this is going to, so use configured version */
-    if ((of_port_desc = of_port_desc_new(my_config->of_version)) == 0) {
-        LOG_ERROR("of_port_desc_new() failed");
-        result = INDIGO_ERROR_UNKNOWN;
-        goto done;
+    if ((ifindex = if_nametoindex(ifname)) == 0) {
+        return -1;
     }
 
-    if ((result = port_desc_set(of_port_desc, of_port_num))
-        != INDIGO_ERROR_NONE
-        ) {
-        LOG_ERROR("port_desc_set() failed");
-        goto done;
+    /* Protocol 0: the socket never receives */
+    if ((fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0) {
+        LOG_VERBOSE("No raw socket for %s, sending unbatched", ifname);
+        return -1;
     }
 
-    if ((of_port_status = of_port_status_new(my_config->of_version)) == 0) {
-        LOG_ERROR("of_port_status_new() failed");
-        result = INDIGO_ERROR_UNKNOWN;
-        goto done;
+    INDIGO_MEM_SET(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_ifindex = ifindex;
+    if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        LOG_VERBOSE("Could not bind raw socket to %s, sending unbatched",
+                    ifname);
+        close(fd);
+        return -1;
     }
-    
+
+    return fd;
+#else
+    (void)ifname;
+    return -1;
+#endif
+}
+
+
+/** \brief Send a batch of packets taken off a port's queues
+
+Uses one sendmmsg() for the batch where the port has a raw socket.
+Frees the packets; returns the number that failed to send.
+*/
+
+static unsigned
+port_tx_batch_send(of_port_no_t of_port_num, struct of_port *p,
+                   struct port_txq_pkt **pkts, struct port_txq **queues,
+                   unsigned n)
+{
+    struct mmsghdr msgs[TX_BATCH_MAX];
+    struct iovec   iovs[TX_BATCH_MAX];
+    uint8_t        failed[TX_BATCH_MAX];
+    unsigned       i, sent, bucket, errors = 0;
+    int            rv;
+
+    for (bucket = 0;
+         bucket < TX_FLUSH_HIST_BUCKETS - 1 && (2u << bucket) <= n;
+         ++bucket);
+    ++p->tx_flush_hist[bucket];
+
+    if (p->tx_ring != NULL) {
+        /* Queue counters count the hand-off; the ring counts the send */
+        for (i = 0; i < n; ++i) {
+            if (ind_port_tx_ring_push(p->tx_ring, pkts[i])) {
+                ++queues[i]->cnt_tx_pkts;
+                queues[i]->cnt_tx_bytes += pkts[i]->len;
+            } else {
+                ++queues[i]->cnt_dropped;
+                ++errors;
+                ind_port_pkt_free(pkts[i]);
+            }
+        }
+        ind_port_txthread_kick();
+        return (errors);
+    }
+
+    INDIGO_MEM_SET(failed, 0, n);
+
+    if (p->tx_fd >= 0) {
+        INDIGO_MEM_SET(msgs, 0, n * sizeof(msgs[0]));
+        for (i = 0; i < n; ++i) {
+            iovs[i].iov_base = pkts[i]->data;
+            iovs[i].iov_len = pkts[i]->len;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        /* The error is that of the first message not sent; the rest
+           of the batch is still tried */
+        for (sent = 0; sent < n; sent += rv) {
+            ++p->cnt_tx_syscalls;
+            if ((rv = sendmmsg(p->tx_fd, msgs + sent, n - sent, 0)) <= 0) {
+                if (rv < 0 && errno == EINTR) {
+                    rv = 0;
+                    continue;
+                }
+                LOG_ERROR("sendmmsg() failed on port %u: %s",
+                          of_port_num, strerror(errno));
+                failed[sent] = 1;
+                rv = 1;
+            }
+        }
+    } else {
+        for (i = 0; i < n; ++i) {
+            ++p->cnt_tx_syscalls;
+            if (vpi_send(p->vpi, pkts[i]->data, pkts[i]->len) < 0) {
+                LOG_ERROR("vpi_send() failed on port %u", of_port_num);
+                failed[i] = 1;
+            }
+        }
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (failed[i]) {
+            ++queues[i]->cnt_tx_errors;
+            ++errors;
+        } else {
+            ++queues[i]->cnt_tx_pkts;
+            queues[i]->cnt_tx_bytes += pkts[i]->len;
+            ++p->cnt_tx_pkts;
+            p->cnt_tx_bytes += pkts[i]->len;
+        }
+        ind_port_pkt_free(pkts[i]);
+    }
+
+    return (errors);
+}
+
+
+/** \brief Hand a port's transmission to the TX thread
+
+Only ports sending on their own raw socket are offloaded; vpi_send()
+shares the VPI with the receive path and stays in the main thread.
+*/
+
+static void
+port_tx_offload_attach(of_port_no_t of_port_num, struct of_port *p)
+{
+    if (p->tx_fd < 0 || p->tx_ring != NULL)  return;
+
+    if ((p->tx_ring = ind_port_tx_ring_create(of_port_num, p->tx_fd))
+        == NULL) {
+        LOG_WARN("No TX ring for port %u, sending inline", of_port_num);
+    }
+}
+
+
+/** \brief Take a port's transmission back from the TX thread */
+
+static void
+port_tx_offload_detach(struct of_port *p)
+{
+    struct port_tx_ring_stats stats;
+
+    if (p->tx_ring == NULL)  return;
+
+    ind_port_tx_ring_destroy(p->tx_ring, &stats);
+    p->tx_ring = NULL;
+    p->cnt_tx_pkts += stats.cnt_tx_pkts;
+    p->cnt_tx_bytes += stats.cnt_tx_bytes;
+    p->cnt_tx_syscalls += stats.cnt_tx_syscalls;
+    p->cnt_tx_thread_errors += stats.cnt_tx_errors;
+}
+
+
+/** \brief Transmit what a port has queued, in scheduler order
+
+Packets go out in batches of up to TX_BATCH_MAX.  Stops early if the
+port's shaper runs out of tokens.  Returns the number of packets that
+failed to send.
+*/
+
+static unsigned
+port_tx_drain(of_port_no_t of_port_num, struct of_port *p)
+{
+    struct port_txq     *q;
+    struct port_txq_pkt *pkt;
+    struct port_txq_pkt *pkts[TX_BATCH_MAX];
+    struct port_txq     *queues[TX_BATCH_MAX];
+    unsigned            n = 0, errors = 0;
+
+    while ((pkt = ind_port_sched_peek(&p->sched, &q)) != NULL) {
+        if (p->shaper.rate && !port_shaper_admit(&p->shaper, pkt->len)) {
+            if (!pkt->delayed) {
+                pkt->delayed = 1;
+                ++p->shaper.cnt_shaped;
+            }
+            port_shaper_wait(of_port_num, p);
+            break;
+        }
+
+        pkts[n] = ind_port_sched_pop(&p->sched, q);
+        queues[n++] = q;
+        if (n == TX_BATCH_MAX) {
+            errors += port_tx_batch_send(of_port_num, p, pkts, queues, n);
+            n = 0;
+        }
+    }
+
+    if (n) {
+        errors += port_tx_batch_send(of_port_num, p, pkts, queues, n);
+    }
+
+    return (errors);
+}
+
+
+/** \brief Serve shaped ports with a backlog; runs every SHAPER_TICK_MS */
+
+static void
+shaper_timer(void *cookie)
+{
+    struct of_port *p;
+    of_port_no_t   of_port_num;
+    unsigned       i, n;
+
+    (void)cookie;
+
+    tx_clock_update();
+
+    /* Ports still waiting re-add themselves at or before their own
+       slot, so the list can be rebuilt in place */
+    n = shaper_wait_cnt;
+    shaper_wait_cnt = 0;
+    for (i = 0; i < n; ++i) {
+        of_port_num = shaper_wait_tbl[i];
+        p = of_port_num_to_ptr(of_port_num);
+        p->shaper.waiting = 0;
+        if (of_port_inuse(p))  (void)port_tx_drain(of_port_num, p);
+    }
+
+    if (shaper_wait_cnt == 0) {
+        ind_soc_timer_event_unregister(shaper_timer, NULL);
+        shaper_timer_on = 0;
+    }
+}
+
+
+/** \brief Take a port off the shaper's wait list */
+
+static void
+port_shaper_wait_remove(of_port_no_t of_port_num, struct of_port *p)
+{
+    unsigned i;
+
+    if (!p->shaper.waiting)  return;
+
+    for (i = 0; i < shaper_wait_cnt; ++i) {
+        if (shaper_wait_tbl[i] == of_port_num) {
+            shaper_wait_tbl[i] = shaper_wait_tbl[--shaper_wait_cnt];
+            break;
+        }
+    }
+    p->shaper.waiting = 0;
+}
+
+
+/** \brief Load a port's shaper from its configured settings */
+
+static void
+port_shaper_setup(of_port_no_t of_port_num, struct of_port *p)
+{
+    struct of_port_cfg *cfg = &of_port_cfg_tbl[of_port_num - 1];
+    uint64_t           burst;
+
+    /* The bucket must hold at least one maximum size packet */
+    burst = cfg->shaper_burst < MAX_PKT_LEN ? MAX_PKT_LEN : cfg->shaper_burst;
+
+    p->shaper.rate = cfg->shaper_rate;
+    p->shaper.capacity = burst * SHAPER_TOKENS_PER_BYTE;
+    p->shaper.tokens = p->shaper.capacity;
+    tx_clock_update();
+    p->shaper.last_ns = tx_clock_ns;
+}
+
+
+/** \brief Drain all ports that queued packets during a receive burst */
+
+static void
+port_tx_flush(void)
+{
+    struct of_port *p;
+    unsigned       i;
+
+    for (i = 0; i < tx_pending_cnt; ++i) {
+        p = of_port_num_to_ptr(tx_pending_tbl[i]);
+        p->tx_pending = 0;
+        if (of_port_inuse(p))  (void)port_tx_drain(tx_pending_tbl[i], p);
+    }
+    tx_pending_cnt = 0;
+}
+
+
+/** \brief Set of port status items */
+
+struct port_status {
+    unsigned linkup;              /**< TRUE <=> Link is up */
+};
+
+
+/**
+ * \brief Get status of a port
+ *
+ * The link of a Linux interface is up while it has a carrier; other
+ * VPIs have no link to lose, and are always up.
+ */
+
+static indigo_error_t
+port_status_get(of_port_no_t of_port_num, struct port_status *port_status)
+{
+    const char   *ifname = of_port_num_to_info(of_port_num)->ifname;
+    struct ifreq ifr;
+
+    INDIGO_MEM_SET(port_status, 0, sizeof(*port_status));
+    port_status->linkup = 1;      /* Assume link is up */
+
+    if (strchr(ifname, '|') != NULL || strlen(ifname) >= IFNAMSIZ) {
+        return (INDIGO_ERROR_NONE);
+    }
+    if (link_sd < 0 && (link_sd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        LOG_ERROR("Could not open socket for link state: %s",
+                  strerror(errno));
+        return (INDIGO_ERROR_UNKNOWN);
+    }
+
+    INDIGO_MEM_SET(&ifr, 0, sizeof(ifr));
+    strcpy(ifr.ifr_name, ifname);
+    if (ioctl(link_sd, SIOCGIFFLAGS, &ifr) < 0) {
+        /* An interface that has gone away has no link */
+        if (errno == ENODEV) {
+            port_status->linkup = 0;
+            return (INDIGO_ERROR_NONE);
+        }
+        LOG_ERROR("Could not get flags of %s: %s", ifname, strerror(errno));
+        return (INDIGO_ERROR_UNKNOWN);
+    }
+    port_status->linkup = (ifr.ifr_flags & IFF_RUNNING) != 0;
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Fill in LOXI of_port_desc for given port */
+
+static indigo_error_t
+port_desc_set(of_port_desc_t *of_port_desc, of_port_no_t of_port_num)
+{
+    struct of_port      *p;
+    struct of_port_info *info;
+    uint32_t            of_port_state;
+
+    p = of_port_num_to_ptr(of_port_num);
+    info = of_port_num_to_info(of_port_num);
+
+    /* As last polled, so that port status messages report changes */
+    of_port_state = 0;
+    if (p->link_down) {
+        OF_PORT_STATE_FLAG_LINK_DOWN_SET(of_port_state, of_port_desc->version);
+    }
+
+    of_port_desc_port_no_set(of_port_desc, of_port_num);
+    of_port_desc_hw_addr_set(of_port_desc, info->mac);
+
+    of_port_desc_name_set(of_port_desc, info->ifname);
+    of_port_desc_config_set(of_port_desc, p->config);
+    of_port_desc_state_set(of_port_desc, of_port_state);
+
+    /** \todo Get proper current, advertised supported and peer values;
+     */
+
+    of_port_desc_curr_set(of_port_desc, 0);
+    of_port_desc_advertised_set(of_port_desc, 0);
+    of_port_desc_supported_set(of_port_desc, 0);
+    of_port_desc_peer_set(of_port_desc, 0);
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Compose LOXI object for port status change, and send to peer */
+
+static indigo_error_t
+port_status_notify(of_port_no_t of_port_num, unsigned reason)
+{
+    indigo_error_t   result = INDIGO_ERROR_NONE;
+    of_port_desc_t   *of_port_desc   = 0;
+    of_port_status_t *of_port_status = 0;
+
+    /* Don't know the cxn this is going to, so use configured version */
+    if ((of_port_desc = of_port_desc_new(my_config->of_version)) == 0) {
+        LOG_ERROR("of_port_desc_new() failed");
+        result = INDIGO_ERROR_UNKNOWN;
+        goto done;
+    }
+
+    if ((result = port_desc_set(of_port_desc, of_port_num))
+        != INDIGO_ERROR_NONE
+        ) {
+        LOG_ERROR("port_desc_set() failed");
+        goto done;
+    }
+
+    if ((of_port_status = of_port_status_new(my_config->of_version)) == 0) {
+        LOG_ERROR("of_port_status_new() failed");
+        result = INDIGO_ERROR_UNKNOWN;
+        goto done;
+    }
+    
     of_port_status_reason_set(of_port_status, reason);
     of_port_status_desc_set(of_port_status, of_port_desc);
     of_port_desc_delete(of_port_desc);
@@ -443,7 +1359,258 @@ port_status_notify(of_port_no_t of_port_num, unsigned reason)
 }
 
 
-/** \brief Process packet received on socket */
+/** \brief Load a port's storm control from its configured settings */
+
+static void
+port_storm_setup(of_port_no_t of_port_num, struct of_port *p)
+{
+    struct port_storm *storm;
+    unsigned          cls;
+
+    for (cls = 0; cls < PORT_STORM_CLASSES; ++cls) {
+        storm = &p->storm[cls];
+        storm->pps = of_port_cfg_tbl[of_port_num - 1].storm_pps[cls];
+        storm->capacity = storm->pps * STORM_BURST_NS;
+        if (storm->capacity < STORM_TOKENS_PER_PKT) {
+            storm->capacity = STORM_TOKENS_PER_PKT;
+        }
+        storm->tokens = storm->capacity;
+        storm->last_ns = tx_clock_ns;
+        storm->storming = 0;
+    }
+}
+
+
+/** \brief Police a received frame of a storm control class
+
+Returns TRUE if the frame may proceed.  The caller keeps tx_clock_ns
+current.
+*/
+
+static int
+port_storm_admit(of_port_no_t of_port_num, struct of_port *p,
+                 enum port_storm_class cls)
+{
+    struct port_storm *storm = &p->storm[cls];
+    uint64_t          elapsed;
+
+    if (tx_clock_ns > storm->last_ns) {
+        elapsed = tx_clock_ns - storm->last_ns;
+        if (elapsed >= (storm->capacity - storm->tokens) / storm->pps) {
+            storm->tokens = storm->capacity;
+        } else {
+            storm->tokens += elapsed * storm->pps;
+        }
+        storm->last_ns = tx_clock_ns;
+    }
+
+    if (storm->tokens >= STORM_TOKENS_PER_PKT) {
+        storm->tokens -= STORM_TOKENS_PER_PKT;
+        if (storm->storming
+            && tx_clock_ns - storm->last_drop_ns >= STORM_QUIET_NS) {
+            storm->storming = 0;
+            LOG_INFO("Port %u %s storm over; %"PRIu64" frames dropped",
+                     of_port_num, port_storm_class_names[cls],
+                     storm->cnt_dropped);
+        }
+        return 1;
+    }
+
+    ++storm->cnt_dropped;
+    storm->last_drop_ns = tx_clock_ns;
+    if (!storm->storming) {
+        storm->storming = 1;
+        ++storm->cnt_events;
+        LOG_WARN("Port %u %s storm: over %u pps, dropping",
+                 of_port_num, port_storm_class_names[cls], storm->pps);
+    }
+
+    return 0;
+}
+
+
+/** \brief Read one frame from a port's receive socket
+
+Fanout members are plain packet sockets; member 0 goes through the VPI.
+Returns 0 if no frame is waiting.
+*/
+
+static int
+port_rx_recv(struct of_port *p, struct port_rx_member *m,
+             unsigned char *buf, unsigned size)
+{
+    int len;
+
+    if (m == p->rx_members) {
+        return vpi_recv(p->vpi, buf, size, 0);
+    }
+
+    if ((len = recv(m->fd, buf, size, MSG_DONTWAIT)) < 0
+        && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        len = 0;
+    }
+
+    return len;
+}
+
+
+/** \brief Queue a receive socket for service, if not queued already */
+
+static void
+port_rx_ready(struct port_rx_member *m)
+{
+    struct port_rx_queue *rq;
+
+    if (m->rx_queued)  return;
+
+    m->rx_class = of_port_cfg_tbl[m->of_port_num - 1].rx_priority;
+    rq = &port_rx_ready_tbl[m->rx_class];
+    m->rx_next = NULL;
+    if (rq->tail == NULL) {
+        rq->head = m;
+    } else {
+        rq->tail->rx_next = m;
+    }
+    rq->tail = m;
+    m->rx_queued = 1;
+    m->rx_ready_ns = tx_clock_ns;
+}
+
+
+/** \brief Take the next receive socket to serve off its queue
+
+Strict priority between classes, round robin within one.
+*/
+
+static struct port_rx_member *
+port_rx_next(void)
+{
+    struct port_rx_queue  *rq;
+    struct port_rx_member *m;
+    int                   cls;
+
+    for (cls = IND_PORT_RX_PRIORITIES - 1; cls >= 0; --cls) {
+        rq = &port_rx_ready_tbl[cls];
+        if ((m = rq->head) != NULL) {
+            if ((rq->head = m->rx_next) == NULL)  rq->tail = NULL;
+            m->rx_queued = 0;
+            return (m);
+        }
+    }
+
+    return (NULL);
+}
+
+
+/** \brief Serve a receive socket for up to its port's quantum of frames
+
+Returns TRUE if the socket was drained, FALSE if frames may be left.
+The clock is read once, after the quantum; the caller checks the
+wakeup's budget against it.
+*/
+
+static int
+port_rx_serve(struct port_rx_member *m)
+{
+    indigo_error_t result;
+    of_port_no_t   of_port_num = m->of_port_num;
+    struct of_port *p = of_port_num_to_ptr(of_port_num);
+    unsigned char  buf[MAX_PKT_LEN];
+    unsigned       n;
+    int            len, drained = 0;
+
+    n = of_port_cfg_tbl[of_port_num - 1].rx_quantum;
+    if (n == 0)  n = PORT_RX_BURST;
+
+    ++p->cnt_rx_turns;
+    if (tx_clock_ns - m->rx_ready_ns > p->rx_max_wait_ns) {
+        p->rx_max_wait_ns = tx_clock_ns - m->rx_ready_ns;
+    }
+    p->rx_last_service_ns = tx_clock_ns;
+
+    for (; n; --n) {
+        /* Get packet data */
+        LOG_TRACE("Reading for port %u", of_port_num);
+
+        if ((len = port_rx_recv(p, m, buf, sizeof(buf))) < 0) {
+            LOG_ERROR("Receive failed on port %s",
+                      of_port_num_to_info(of_port_num)->ifname);
+            drained = 1;
+            break;
+        }
+
+        if(len == 0) {
+            /* No packet */
+            drained = 1;
+            break;
+        }
+
+        LOG_TRACE("Read %d bytes for port %u", len, of_port_num);
+
+        if (!OF_PORT_CONFIG_FLAG_PORT_DOWN_TEST(p->config,
+                                                my_config->of_version)
+            && !OF_PORT_CONFIG_FLAG_NO_RECV_TEST(p->config,
+                                                 my_config->of_version)
+            ) {
+            /* Port is enabled and port receive is enabled */
+
+            /* Update port stats */
+
+            ++p->cnt_rx_pkts;
+            p->cnt_rx_bytes += (unsigned) len;
+            ++m->cnt_rx_pkts;
+            m->cnt_rx_bytes += (unsigned) len;
+
+            /* Storm control acts before the packet is classified */
+            if ((buf[0] & 1) && len >= 6) {
+                if (buf[0] == 0xff && buf[1] == 0xff && buf[2] == 0xff
+                    && buf[3] == 0xff && buf[4] == 0xff && buf[5] == 0xff) {
+                    if (p->storm[PORT_STORM_BCAST].pps
+                        && !port_storm_admit(of_port_num, p,
+                                             PORT_STORM_BCAST)) {
+                        continue;
+                    }
+                } else if (p->storm[PORT_STORM_MCAST].pps
+                           && !port_storm_admit(of_port_num, p,
+                                                PORT_STORM_MCAST)) {
+                    continue;
+                }
+            }
+
+            /* Run packet through forwarding */
+            result = indigo_fwd_packet_receive(of_port_num, buf, len);
+            if (INDIGO_FAILURE(result)) {
+                LOG_ERROR("indigo_fwd_pkt_rx() failed");
+            }
+        }
+    }
+
+    /* Output held for batching must not wait out a slow quantum */
+    tx_clock_update();
+    if (tx_pending_cnt
+        && tx_clock_ns - tx_pending_since_ns >= TX_FLUSH_DEADLINE_NS) {
+        port_tx_flush();
+    }
+
+    if (!drained) {
+        ++p->cnt_rx_quantum_exhausted;
+    }
+    return drained;
+}
+
+
+/** \brief Process packets received on socket
+
+The socket manager's call order does not decide which port is served:
+the socket is queued, then queued sockets are served by priority class
+and round robin within a class, each for its port's quantum of frames,
+until PORT_RX_BUDGET_NS is spent.  Sockets not drained go to the back
+of their queue.
+
+What the frames produced is then transmitted, so that the queue
+scheduler orders the output by priority.  The cookie is the receiving
+socket's struct port_rx_member.
+*/
 
 void pkt_rx(int fd,
             void *cookie,
@@ -451,13 +1618,10 @@ void pkt_rx(int fd,
             int write_ready,
             int error_seen)
 {
-    indigo_error_t result = INDIGO_ERROR_NONE;
-    struct of_port *p;
-    of_port_no_t   of_port_num;
-    unsigned char  buf[MAX_PKT_LEN];
+    struct port_rx_member *m = cookie;
+    uint64_t              start_ns;
 
     /* Ignore some params */
-    (void)cookie;
     (void)write_ready;
     (void)error_seen;
 
@@ -465,53 +1629,29 @@ void pkt_rx(int fd,
 
     LOG_TRACE("Packet RX for %d", fd);
 
-    for (p = of_port_tbl, of_port_num = 1;
-         of_port_num <= my_config->max_ports;
-         ++of_port_num, ++p
-         ) {
-        if (fd == of_port_fd(p)) {
-            int len;
-      
-            /* Get packet data */
-            LOG_TRACE("Reading for port %s", p->ifname);
-
-            if ((len = vpi_recv(p->vpi, buf, sizeof(buf), 0)) < 0) {
-                LOG_ERROR("vpi_recv() failed");
-                return;
-            }
-            
-            if(len == 0) {
-                /* No packet */
-                return; 
-            }
-
-            LOG_TRACE("Read %d bytes for port %s", len, p->ifname);
-
-            if (!OF_PORT_CONFIG_FLAG_PORT_DOWN_TEST(p->config, 
-                                                    my_config->of_version)
-                && !OF_PORT_CONFIG_FLAG_NO_RECV_TEST(p->config, 
-                                                     my_config->of_version)
-                ) {
-                /* Port is enabled and port receive is enabled */
+    if (m == NULL || fd != m->fd
+        || !of_port_inuse(of_port_num_to_ptr(m->of_port_num))) {
+        LOG_ERROR("Socket not found");
+        return;
+    }
 
-                /* Update port stats */
+    tx_clock_update();
+    start_ns = tx_clock_ns;
+    port_rx_ready(m);
 
-                ++p->cnt_rx_pkts;
-                p->cnt_rx_bytes += (unsigned) len;
-        
-                /* Run packet through forwarding */
-                result = indigo_fwd_packet_receive(of_port_num, buf, len);
-                if (INDIGO_FAILURE(result)) {
-                    LOG_ERROR("indigo_fwd_pkt_rx() failed");
-                }
-            }
+    tx_defer = 1;
 
-            return;
+    while ((m = port_rx_next()) != NULL) {
+        if (!port_rx_serve(m)) {
+            port_rx_ready(m);
+        }
+        if (tx_clock_ns - start_ns >= PORT_RX_BUDGET_NS) {
+            break;
         }
     }
 
-    LOG_ERROR("Socket not found");
-    return;
+    tx_defer = 0;
+    port_tx_flush();
 }
 
 /***************************************************************************/
@@ -575,6 +1715,64 @@ indigo_port_features_get(of_features_reply_t *features)
 }
 
 
+/**
+ * \brief Tell forwarding whether a port can carry group traffic
+ *
+ * A port is live while its link is up and it is not administratively
+ * down.
+ */
+
+static void
+port_liveness_notify(of_port_no_t of_port_num, struct of_port *p)
+{
+    ind_fwd_group_port_status_set(of_port_num,
+                                  of_port_inuse(p)
+                                  && !p->link_down
+                                  && !OF_PORT_CONFIG_FLAG_PORT_DOWN_TEST(
+                                      p->config, my_config->of_version));
+}
+
+
+/** \brief Poll a port's link; a change is reported to the controller */
+
+static void
+port_link_update(of_port_no_t of_port_num, struct of_port *p)
+{
+    struct port_status port_status[1];
+
+    if (INDIGO_FAILURE(port_status_get(of_port_num, port_status))
+        || port_status->linkup == !p->link_down) {
+        return;
+    }
+
+    p->link_down = !port_status->linkup;
+    LOG_INFO("Port %u link %s", of_port_num, p->link_down ? "down" : "up");
+
+    if (INDIGO_FAILURE(port_status_notify(of_port_num,
+                                          OF_PORT_CHANGE_REASON_MODIFY))) {
+        LOG_ERROR("port_status_notify() failed");
+    }
+    port_liveness_notify(of_port_num, p);
+}
+
+
+/** \brief Poll every port's link; runs every LINK_POLL_MS */
+
+static void
+link_poll_timer(void *cookie)
+{
+    struct of_port *p;
+    of_port_no_t   of_port_num;
+
+    (void)cookie;
+
+    for (of_port_num = 1; of_port_num <= my_config->max_ports; ++of_port_num) {
+        p = of_port_num_to_ptr(of_port_num);
+        if (of_port_inuse(p))  port_link_update(of_port_num, p);
+    }
+}
+
+
 /** \brief Modify an OF port's configuration */
 
 
@@ -606,6 +1804,9 @@ indigo_port_modify(of_port_mod_t *port_mod,
 
     p->config = (config & mask) | (p->config & ~mask);
 
+    port_sets_update(of_port_num, p);
+    port_liveness_notify(of_port_num, p);
+
  done:
     indigo_core_port_modify_callback(result, callback_cookie);
 }
@@ -687,22 +1888,68 @@ void
 indigo_port_queue_config_get(of_queue_get_config_request_t *request,
                              indigo_cookie_t callback_cookie)
 {
-    /* @fixme Stubbed out for now */
     of_queue_get_config_reply_t *reply;
-    indigo_error_t result = INDIGO_ERROR_NONE;
-    uint32_t xid;
+    indigo_error_t              result = INDIGO_ERROR_NONE;
+    of_list_packet_queue_t      *queues = NULL;
+    of_packet_queue_t           *queue = NULL;
+    of_port_no_t                of_port_num;
+    struct of_port              *p;
+    struct port_txq             *q;
+    unsigned                    n;
+    uint32_t                    xid;
 
     reply = of_queue_get_config_reply_new(request->version);
     if (reply == NULL) {
         result = INDIGO_ERROR_RESOURCE;
         LOG_ERROR("Could not allocate queue config reply");
-    } else {
-        of_queue_get_config_request_xid_get(request, &xid);
-        of_queue_get_config_reply_xid_set(reply, xid);
+        goto done;
+    }
+
+    of_queue_get_config_request_xid_get(request, &xid);
+    of_queue_get_config_reply_xid_set(reply, xid);
+    of_queue_get_config_request_port_get(request, &of_port_num);
+    of_queue_get_config_reply_port_set(reply, of_port_num);
+
+    if (!of_port_num_valid(of_port_num)) {
+        LOG_ERROR("Port number out of range");
+        result = INDIGO_ERROR_PARAM;
+        goto done;
+    }
+    if (!of_port_inuse(p = of_port_num_to_ptr(of_port_num))) {
+        LOG_ERROR("Port not in use");
+        result = INDIGO_ERROR_PARAM;
+        goto done;
+    }
+
+    if ((queues = of_list_packet_queue_new(request->version)) == NULL
+        || (queue = of_packet_queue_new(request->version)) == NULL) {
+        LOG_ERROR("Could not allocate queue list");
+        result = INDIGO_ERROR_RESOURCE;
+        goto done;
+    }
+
+    /* Scheduling parameters have no OpenFlow queue property; the queues
+       are listed with their ids only */
+    for (q = p->sched.queues, n = p->sched.n_queues; n; --n, ++q) {
+        of_packet_queue_queue_id_set(queue, q->queue_id);
+        if (request->version >= OF_VERSION_1_2) {
+            of_packet_queue_port_set(queue, of_port_num);
+        }
+        if (LOXI_FAILURE(of_list_packet_queue_append(queues, queue))) {
+            LOG_ERROR("of_list_packet_queue_append() failed");
+            result = INDIGO_ERROR_UNKNOWN;
+            goto done;
+        }
+    }
+
+    if (LOXI_FAILURE(of_queue_get_config_reply_queues_set(reply, queues))) {
+        LOG_ERROR("of_queue_get_config_reply_queues_set() failed");
+        result = INDIGO_ERROR_UNKNOWN;
     }
 
-    /* @FIXME */
-    LOG_WARN("Queue config get not implemented");
+ done:
+    if (queue != NULL)  of_packet_queue_delete(queue);
+    if (queues != NULL)  of_list_packet_queue_delete(queues);
 
     indigo_core_queue_config_get_callback(result, reply, callback_cookie);
 }
@@ -748,19 +1995,11 @@ indigo_port_queue_stats_get(of_queue_stats_request_t *request,
             result = INDIGO_ERROR_PARAM;
             goto done;
         }
-        if (!of_port_inuse(p = of_port_num_to_ptr(req_of_port_num))) {
-            LOG_ERROR("Port not in use");
-            result = INDIGO_ERROR_PARAM;
-            goto done;
-        }
-    }
-  
-#define OFPQ_ALL (~0)           /** \todo Remove this, belongs in LOXI */
-
-    if (queue_id != OFPQ_ALL && queue_id != 0) {
-        LOG_ERROR("Queue id out of range");
-        result = INDIGO_ERROR_PARAM;
-        goto done;
+        if (!of_port_inuse(p = of_port_num_to_ptr(req_of_port_num))) {
+            LOG_ERROR("Port not in use");
+            result = INDIGO_ERROR_PARAM;
+            goto done;
+        }
     }
 
     if (req_of_port_num == OF_PORT_DEST_ALL) {
@@ -771,16 +2010,23 @@ indigo_port_queue_stats_get(of_queue_stats_request_t *request,
              ) {
             if (!of_port_inuse(p))  continue;
 
-            result = queue_stats_add(entry, of_port_num, 0);
-            if (INDIGO_FAILURE(result)) {
-                LOG_ERROR("port_stats_add() failed");
+            /* Ports without the requested queue are skipped */
+            result = queue_stats_add(entry, of_port_num, queue_id);
+            if (result == INDIGO_ERROR_NOT_FOUND) {
+                result = INDIGO_ERROR_NONE;
+            } else if (INDIGO_FAILURE(result)) {
+                LOG_ERROR("queue_stats_add() failed");
                 goto done;
             }
         }
     } else {
-        result = queue_stats_add(entry, req_of_port_num, 0);
-        if (INDIGO_FAILURE(result)) {
-            LOG_ERROR("port_stats_add() failed");
+        result = queue_stats_add(entry, req_of_port_num, queue_id);
+        if (result == INDIGO_ERROR_NOT_FOUND) {
+            LOG_ERROR("Queue id %u out of range", queue_id);
+            result = INDIGO_ERROR_PARAM;
+            goto done;
+        } else if (INDIGO_FAILURE(result)) {
+            LOG_ERROR("queue_stats_add() failed");
             goto done;
         }
     }
@@ -811,6 +2057,7 @@ indigo_port_interface_add(indigo_port_name_t   ifname,
 {
     indigo_error_t result = INDIGO_ERROR_NONE;
     struct of_port *p;
+    struct of_port_info *info;
     vpi_t vpi = NULL;
     int fd;
     char vpi_spec[1024];
@@ -853,210 +2100,787 @@ indigo_port_interface_add(indigo_port_name_t   ifname,
 #endif /* PORTMANAGER_CONFIG_INCLUDE_VPI_PCAPDUMP */
 
 
-    INDIGO_MEM_SET(p, 0, sizeof(*p));
-    strncpy(p->ifname, ifname, sizeof(p->ifname) - 1);
-    p->ifname[sizeof(p->ifname) - 1] = 0;
-    p->vpi = vpi;
-    if (config->disable_on_add) {
-        /* Port added as disabled */
-        LOG_VERBOSE("Disabling port %d due to config", of_port_num);
-        OF_PORT_CONFIG_FLAG_PORT_DOWN_SET(p->config, my_config->of_version);
+    INDIGO_MEM_SET(p, 0, sizeof(*p));
+    if (INDIGO_FAILURE(result = ind_port_sched_init(
+                           &p->sched,
+                           of_port_cfg_tbl[of_port_num - 1].queues,
+                           of_port_cfg_tbl[of_port_num - 1].n_queues))) {
+        LOG_ERROR("ind_port_sched_init() failed");
+        vpi_destroy(vpi);
+        return (result);
+    }
+    port_shaper_setup(of_port_num, p);
+    port_storm_setup(of_port_num, p);
+    /* Plain interface names are Linux interfaces, which can batch */
+    p->tx_fd = strchr(ifname, '|') == NULL ? port_tx_socket_open(ifname) : -1;
+    if (tx_offload)  port_tx_offload_attach(of_port_num, p);
+    info = of_port_num_to_info(of_port_num);
+    strncpy(info->ifname, ifname, sizeof(info->ifname) - 1);
+    info->ifname[sizeof(info->ifname) - 1] = 0;
+    p->vpi = vpi;
+    if (config->disable_on_add) {
+        /* Port added as disabled */
+        LOG_VERBOSE("Disabling port %d due to config", of_port_num);
+        OF_PORT_CONFIG_FLAG_PORT_DOWN_SET(p->config, my_config->of_version);
+    }
+
+    if ((fd = of_port_fd(p)) == -1) {
+        LOG_ERROR("of_port_fd() failed");
+        result = INDIGO_ERROR_UNKNOWN;
+        goto done;
+    }
+
+    {
+        int       domain;
+        socklen_t len = sizeof(domain);
+
+        p->rx_packet_socket =
+            getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == 0
+            && domain == AF_PACKET;
+    }
+    p->rx_members[0].fd = fd;
+    p->rx_members[0].of_port_num = of_port_num;
+    p->n_rx_members = 1;
+    port_rx_fanout_open(of_port_num, p);
+    port_rx_filter_apply(of_port_num, p);
+
+    /* Ask sockman to call our receive function when a packet is received
+       on any of port's sockets
+    */
+    {
+        unsigned n;
+
+        for (n = 0; n < p->n_rx_members; ++n) {
+            ind_soc_socket_register(p->rx_members[n].fd, pkt_rx,
+                                    &p->rx_members[n]);
+        }
+    }
+
+    /* Link state as of the addition; link_poll_timer() follows it */
+    {
+        struct port_status port_status[1];
+
+        p->link_down = INDIGO_SUCCESS(port_status_get(of_port_num,
+                                                      port_status))
+            && !port_status->linkup;
+    }
+    if (!link_poll_on) {
+        if (INDIGO_FAILURE(ind_soc_timer_event_register(link_poll_timer, NULL,
+                                                        LINK_POLL_MS))) {
+            LOG_ERROR("Could not register link poll timer");
+        } else {
+            link_poll_on = 1;
+        }
+    }
+
+    /* Notify core of port addition */
+    if (INDIGO_FAILURE(result = port_status_notify(of_port_num,
+                                                   OF_PORT_CHANGE_REASON_ADD
+                                                   )
+                       )
+        ) {
+        LOG_ERROR("port_status_notify() failed");
+        goto done;
+    }
+
+    port_sets_update(of_port_num, p);
+    port_liveness_notify(of_port_num, p);
+
+ done:
+    if (INDIGO_FAILURE(result)) {
+        if (vpi != NULL) {
+            if (p->vpi != NULL) {
+                port_rx_members_close(p);
+                port_tx_offload_detach(p);
+                ind_port_sched_destroy(&p->sched);
+                if (p->tx_fd >= 0)  close(p->tx_fd);
+            }
+            vpi_destroy(vpi);
+            p->vpi = NULL;
+        }
+    }
+
+    return (result);
+}
+
+/** \brief Stop using the given Linux network interface as an OF port */
+
+indigo_error_t
+indigo_port_interface_remove(indigo_port_name_t ifname)
+{
+    indigo_error_t result = INDIGO_ERROR_NONE;
+    struct of_port *p;
+    of_port_no_t   of_port_num;
+
+    LOG_INFO("Removing interface %s", ifname);
+
+    for (of_port_num = 1; of_port_num <= my_config->max_ports; ++of_port_num) {
+        if (strcmp(ifname, of_port_num_to_info(of_port_num)->ifname) == 0) {
+            break;
+        }
+    }
+
+    if (of_port_num > my_config->max_ports) {
+        LOG_ERROR("Invalid OF port number");
+        return (INDIGO_ERROR_NOT_FOUND);
+    }
+
+    if (!of_port_inuse(p = of_port_num_to_ptr(of_port_num))) {
+        LOG_ERROR("OF port not in use");
+        return (INDIGO_ERROR_UNKNOWN);
+    }
+
+    /* Notify core of port deletion */
+    result = port_status_notify(of_port_num, OF_PORT_CHANGE_REASON_DELETE);
+    if (INDIGO_FAILURE(result)) {
+        LOG_ERROR("port_status_notify() failed");
+        return (result);
+    }
+
+    port_rx_members_close(p);
+    port_shaper_wait_remove(of_port_num, p);
+    port_tx_offload_detach(p);
+    ind_port_sched_destroy(&p->sched);
+    if (p->tx_fd >= 0) {
+        close(p->tx_fd);
+        p->tx_fd = -1;
+    }
+    vpi_destroy(p->vpi);
+
+    of_port_num_to_info(of_port_num)->ifname[0] = 0;
+    p->vpi = NULL;
+
+    port_sets_update(of_port_num, p);
+    port_liveness_notify(of_port_num, p);
+    
+    return (INDIGO_ERROR_NONE);
+}
+
+
+
+indigo_error_t
+indigo_port_interface_list(indigo_port_info_t** list)
+{
+    indigo_port_info_t* head = NULL; 
+    struct of_port *p; 
+    of_port_no_t of_port_num; 
+    
+    if(list == NULL) { 
+        return INDIGO_ERROR_PARAM; 
+    }
+    for(of_port_num = my_config->max_ports; of_port_num >= 1; of_port_num--) { 
+        p = of_port_tbl + of_port_num - 1; 
+        if(of_port_inuse(p)) { 
+            indigo_port_info_t* entry = INDIGO_MEM_ALLOC(sizeof(*entry)); 
+            strncpy(entry->port_name, of_port_num_to_info(of_port_num)->ifname,
+                    sizeof(entry->port_name) - 1);
+            entry->of_port = of_port_num;
+            entry->next = head; 
+            head = entry; 
+        }
+    }
+    *list = head; 
+    return INDIGO_ERROR_NONE; 
+}
+
+
+void
+indigo_port_interface_list_destroy(indigo_port_info_t* list)
+{
+    indigo_port_info_t* e = list; 
+    while(e) { 
+        indigo_port_info_t* link = e->next; 
+        INDIGO_MEM_FREE(e); 
+        e = link;
+    }
+}
+
+
+indigo_error_t 
+indigo_port_desc_stats_get(of_port_desc_stats_reply_t *port_desc_stats_reply)
+{
+    LOG_TRACE("Port desc_stats_get called");
+
+    return INDIGO_ERROR_NOT_SUPPORTED;
+}
+
+
+/**
+ * Currently no experimenter messages supported in the port module
+ */
+
+indigo_error_t
+indigo_port_experimenter(of_experimenter_t *experimenter,
+                         indigo_cxn_id_t cxn_id)
+{
+    LOG_TRACE("Port experimenter called");
+
+    return INDIGO_ERROR_NOT_SUPPORTED;    
+}
+
+
+/***************************************************************************/
+
+/** \brief Put a packet on one of a port's transmit queues
+
+The port must be in use.  Outside tx_defer the caller drains the port.
+Returns INDIGO_ERROR_PARAM for an unknown queue and
+INDIGO_ERROR_RESOURCE if the packet was dropped.
+*/
+
+static indigo_error_t
+port_packet_queue(of_port_no_t of_port_num, struct of_port *p,
+                  unsigned queue_id, uint8_t *data, unsigned len)
+{
+    indigo_error_t  result;
+    struct port_txq *q;
+
+    if (OF_PORT_CONFIG_FLAG_PORT_DOWN_TEST(p->config, my_config->of_version)
+        || OF_PORT_CONFIG_FLAG_NO_FWD_TEST(p->config, my_config->of_version)
+        ) {
+        /* Port is disabled or forwarding is disabled for port */
+        return (INDIGO_ERROR_NONE);
+    }
+
+    /* A full queue is flushed early rather than dropping */
+    if (tx_defer && p->tx_pending
+        && (q = ind_port_sched_queue_find(&p->sched, queue_id)) != NULL
+        && q->count == q->depth) {
+        (void)port_tx_drain(of_port_num, p);
+    }
+
+    result = ind_port_sched_enqueue(&p->sched, queue_id, data, len);
+    if (result == INDIGO_ERROR_NOT_FOUND) {
+        LOG_ERROR("Invalid transmit queue");
+        return (INDIGO_ERROR_PARAM);
+    }
+    if (result == INDIGO_ERROR_RESOURCE) {
+        /* Tail drop; counted against the queue */
+        LOG_TRACE("Queue %u of port %u full", queue_id, of_port_num);
+        return (result);
+    }
+
+    if (tx_defer && !p->tx_pending) {
+        if (tx_pending_cnt == 0) {
+            tx_pending_since_ns = tx_clock_ns;
+        }
+        p->tx_pending = 1;
+        tx_pending_tbl[tx_pending_cnt++] = of_port_num;
+    }
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Transmit given packet out OF port
+
+The packet goes on the given transmit queue.  Outside a receive burst
+the port's queues are drained right away; within one, at its end.
+*/
+
+indigo_error_t
+indigo_port_packet_emit(of_port_no_t of_port_num,
+                        unsigned queue_id,
+                        uint8_t *data,
+                        unsigned len)
+{      
+    indigo_error_t     result;
+    struct of_port     *p;
+  
+    LOG_TRACE("Emit %d bytes to port %d, queue %d", 
+              len, of_port_num, queue_id);
+
+    if (!of_port_num_valid(of_port_num)) {
+        LOG_ERROR("Invalid OF port number");
+        return (INDIGO_ERROR_PARAM);
+    }
+
+    if (!of_port_inuse(p = of_port_num_to_ptr(of_port_num))) {
+        LOG_ERROR("OF port not in use");
+        return (INDIGO_ERROR_NOT_FOUND);
+    }
+
+    result = port_packet_queue(of_port_num, p, queue_id, data, len);
+    if (result == INDIGO_ERROR_RESOURCE) {
+        return (INDIGO_ERROR_NONE);
+    }
+    if (INDIGO_FAILURE(result) || tx_defer) {
+        return (result);
+    }
+
+    if (p->shaper.rate) {
+        tx_clock_update();
+    }
+
+    if (port_tx_drain(of_port_num, p) != 0) {
+        return (INDIGO_ERROR_UNKNOWN);
+    }
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Transmit a packet to every member of a port set but one
+
+Copies are queued on each member's queue 0 and sent together, as one
+batch per port.  A member that fails to take its copy is counted and
+the first failure returned; the others still get theirs.
+*/
+
+static indigo_error_t
+port_set_emit(uint32_t *set, of_port_no_t skip_of_port_num,
+              uint8_t *data, unsigned len)
+{
+    indigo_error_t result = INDIGO_ERROR_NONE, rv;
+    struct of_port *p;
+    of_port_no_t   of_port_num;
+    uint32_t       bits;
+    unsigned       word;
+    int            outer;
+
+    /* Within a receive burst the burst's flush sends these too */
+    if ((outer = !tx_defer)) {
+        tx_defer = 1;
+        tx_clock_update();
+    }
+
+    /* Unicast reaching flood or ALL is unknown unicast; police it
+       against its ingress port before it is replicated */
+    if (len >= 6 && !(data[0] & 1) && of_port_num_valid(skip_of_port_num)) {
+        p = of_port_num_to_ptr(skip_of_port_num);
+        if (of_port_inuse(p) && p->storm[PORT_STORM_UUCAST].pps
+            && !port_storm_admit(skip_of_port_num, p, PORT_STORM_UUCAST)) {
+            goto done;
+        }
+    }
+
+    for (word = 0; word < port_set_words; ++word) {
+        for (bits = set[word]; bits; bits &= bits - 1) {
+            of_port_num = word * 32 + __builtin_ctz(bits) + 1;
+            if (of_port_num == skip_of_port_num)  continue;
+
+            p = of_port_num_to_ptr(of_port_num);
+            rv = port_packet_queue(of_port_num, p, 0, data, len);
+            if (INDIGO_FAILURE(rv)) {
+                ++p->cnt_fanout_errors;
+                if (result == INDIGO_ERROR_NONE)  result = rv;
+            }
+        }
+    }
+
+done:
+    if (outer) {
+        tx_defer = 0;
+        port_tx_flush();
+    }
+
+    return (result);
+}
+
+
+/** \brief Set the transmit queues of a port
+
+Takes effect at once on a port in use, after what it has queued is sent;
+otherwise when an interface is next added as the port.
+*/
+
+indigo_error_t
+ind_port_queue_config_set(of_port_no_t port_no,
+                          ind_port_queue_config_t *queues,
+                          unsigned n_queues)
+{
+    indigo_error_t    result;
+    struct of_port    *p;
+    struct port_sched sched[1];
+
+    if (!of_port_num_valid(port_no)) {
+        LOG_ERROR("Queue config: Port number out of range");
+        return INDIGO_ERROR_PARAM;
     }
 
-    if ((fd = of_port_fd(p)) == -1) {
-        LOG_ERROR("of_port_fd() failed");
-        result = INDIGO_ERROR_UNKNOWN;
-        goto done;
+    /* Validates the configuration */
+    if (INDIGO_FAILURE(result = ind_port_sched_init(sched, queues,
+                                                    n_queues))) {
+        return result;
     }
 
-    /* Ask sockman to call our receive function when a packet is received
-       on port's socket
-    */
-    ind_soc_socket_register(fd, pkt_rx, INDIGO_COOKIE_NULL);
-
-    /* Notify core of port addition */
-    if (INDIGO_FAILURE(result = port_status_notify(of_port_num,
-                                                   OF_PORT_CHANGE_REASON_ADD
-                                                   )
-                       )
-        ) {
-        LOG_ERROR("port_status_notify() failed");
-        goto done;
+    of_port_cfg_tbl[port_no - 1].n_queues = n_queues;
+    if (n_queues) {
+        PORTMANAGER_MEMCPY(of_port_cfg_tbl[port_no - 1].queues, queues,
+                           n_queues * sizeof(*queues));
     }
 
- done:
-    if (INDIGO_FAILURE(result)) {
-        if (vpi != NULL) {
-            vpi_destroy(vpi);
-            p->vpi = NULL;
-        }
+    if (of_port_inuse(p = of_port_num_to_ptr(port_no))) {
+        /* What the shaper still holds back is dropped */
+        tx_clock_update();
+        (void)port_tx_drain(port_no, p);
+        ind_port_sched_destroy(&p->sched);
+        p->sched = *sched;
+    } else {
+        ind_port_sched_destroy(sched);
     }
 
-    return (result);
+    return INDIGO_ERROR_NONE;
 }
 
-/** \brief Stop using the given Linux network interface as an OF port */
+
+/** \brief Set the egress shaper of a port
+
+Takes effect at once on a port in use; otherwise when an interface is
+next added as the port.
+*/
 
 indigo_error_t
-indigo_port_interface_remove(indigo_port_name_t ifname)
+ind_port_shaper_set(of_port_no_t port_no, uint32_t rate, uint32_t burst)
 {
-    indigo_error_t result = INDIGO_ERROR_NONE;
     struct of_port *p;
-    of_port_no_t   of_port_num;
 
-    LOG_INFO("Removing interface %s", ifname);
-
-    for (p = of_port_tbl, of_port_num = 1;
-         of_port_num <= my_config->max_ports;
-         ++of_port_num, ++p
-         ) {
-        if (strcmp(ifname, p->ifname) == 0)  break;
+    if (!of_port_num_valid(port_no)) {
+        LOG_ERROR("Shaper: Port number out of range");
+        return INDIGO_ERROR_PARAM;
     }
 
-    if (of_port_num > my_config->max_ports) {
-        LOG_ERROR("Invalid OF port number");
-        return (INDIGO_ERROR_NOT_FOUND);
-    }
+    of_port_cfg_tbl[port_no - 1].shaper_rate = rate;
+    of_port_cfg_tbl[port_no - 1].shaper_burst = burst;
 
-    if (!of_port_inuse(p)) {
-        LOG_ERROR("OF port not in use");
-        return (INDIGO_ERROR_UNKNOWN);
+    if (of_port_inuse(p = of_port_num_to_ptr(port_no))) {
+        port_shaper_setup(port_no, p);
+        /* Unshaped now, or a full bucket: release any backlog */
+        (void)port_tx_drain(port_no, p);
     }
 
-    /* Notify core of port deletion */
-    result = port_status_notify(of_port_num, OF_PORT_CHANGE_REASON_DELETE);
-    if (INDIGO_FAILURE(result)) {
-        LOG_ERROR("port_status_notify() failed");
-        return (result);
+    return INDIGO_ERROR_NONE;
+}
+
+
+/** \brief Set the storm control thresholds of a port
+
+Takes effect at once on a port in use; otherwise when an interface is
+next added as the port.  Counters are kept.
+*/
+
+indigo_error_t
+ind_port_storm_control_set(of_port_no_t port_no, uint32_t bcast_pps,
+                           uint32_t mcast_pps, uint32_t uucast_pps)
+{
+    struct of_port_cfg *cfg;
+    struct of_port     *p;
+
+    if (!of_port_num_valid(port_no)) {
+        LOG_ERROR("Storm control: Port number out of range");
+        return INDIGO_ERROR_PARAM;
     }
 
-    ind_soc_socket_unregister(of_port_fd(p));
-    vpi_destroy(p->vpi);
+    cfg = &of_port_cfg_tbl[port_no - 1];
+    cfg->storm_pps[PORT_STORM_BCAST] = bcast_pps;
+    cfg->storm_pps[PORT_STORM_MCAST] = mcast_pps;
+    cfg->storm_pps[PORT_STORM_UUCAST] = uucast_pps;
 
-    p->ifname[0] = 0;
-    p->vpi = NULL;
-    
-    return (INDIGO_ERROR_NONE);
+    if (of_port_inuse(p = of_port_num_to_ptr(port_no))) {
+        tx_clock_update();
+        port_storm_setup(port_no, p);
+    }
+
+    return INDIGO_ERROR_NONE;
 }
 
 
+/** \brief Set kernel-side receive filtering of a port
+
+Takes effect at once on a port in use; otherwise when an interface is
+next added as the port.
+*/
 
 indigo_error_t
-indigo_port_interface_list(indigo_port_info_t** list)
+ind_port_rx_filter_set(of_port_no_t port_no, int inbound_only,
+                       ind_port_bpf_insn_t *insns, unsigned n_insns)
 {
-    indigo_port_info_t* head = NULL; 
-    struct of_port *p; 
-    of_port_no_t of_port_num; 
-    
-    if(list == NULL) { 
-        return INDIGO_ERROR_PARAM; 
+    struct of_port_cfg  *cfg;
+    struct of_port      *p;
+    ind_port_bpf_insn_t *filter = NULL;
+
+    if (!of_port_num_valid(port_no)) {
+        LOG_ERROR("RX filter: Port number out of range");
+        return INDIGO_ERROR_PARAM;
     }
-    for(of_port_num = my_config->max_ports; of_port_num >= 1; of_port_num--) { 
-        p = of_port_tbl + of_port_num - 1; 
-        if(of_port_inuse(p)) { 
-            indigo_port_info_t* entry = INDIGO_MEM_ALLOC(sizeof(*entry)); 
-            strncpy(entry->port_name, p->ifname, sizeof(entry->port_name) - 1);
-            entry->of_port = of_port_num;
-            entry->next = head; 
-            head = entry; 
+
+    if (insns != NULL && n_insns > 0) {
+        if (n_insns > IND_PORT_BPF_INSNS_MAX) {
+            LOG_ERROR("RX filter: %u instructions is too many", n_insns);
+            return INDIGO_ERROR_PARAM;
         }
+        if ((filter = INDIGO_MEM_ALLOC(n_insns * sizeof(*filter))) == NULL) {
+            return INDIGO_ERROR_RESOURCE;
+        }
+        PORTMANAGER_MEMCPY(filter, insns, n_insns * sizeof(*filter));
     }
-    *list = head; 
-    return INDIGO_ERROR_NONE; 
+
+    cfg = &of_port_cfg_tbl[port_no - 1];
+    INDIGO_MEM_FREE(cfg->rx_filter);
+    cfg->rx_filter = filter;
+    cfg->rx_filter_len = filter != NULL ? n_insns : 0;
+    cfg->rx_all_directions = !inbound_only;
+
+    if (of_port_inuse(p = of_port_num_to_ptr(port_no))) {
+        port_rx_filter_apply(port_no, p);
+    }
+
+    return INDIGO_ERROR_NONE;
 }
 
 
-void
-indigo_port_interface_list_destroy(indigo_port_info_t* list)
+/** \brief Set how the receive scheduler serves a port */
+
+indigo_error_t
+ind_port_rx_sched_set(of_port_no_t port_no, unsigned quantum,
+                      unsigned priority)
 {
-    indigo_port_info_t* e = list; 
-    while(e) { 
-        indigo_port_info_t* link = e->next; 
-        INDIGO_MEM_FREE(e); 
-        e = link;
+    struct of_port_cfg *cfg;
+
+    if (!of_port_num_valid(port_no)) {
+        LOG_ERROR("RX sched: Port number out of range");
+        return INDIGO_ERROR_PARAM;
     }
+    if (quantum > IND_PORT_RX_QUANTUM_MAX
+        || priority >= IND_PORT_RX_PRIORITIES) {
+        LOG_ERROR("RX sched: Bad quantum %u or priority %u",
+                  quantum, priority);
+        return INDIGO_ERROR_PARAM;
+    }
+
+    /* Sockets already queued keep their class until served */
+    cfg = &of_port_cfg_tbl[port_no - 1];
+    cfg->rx_quantum = quantum;
+    cfg->rx_priority = priority;
+
+    return INDIGO_ERROR_NONE;
 }
 
 
-indigo_error_t 
-indigo_port_desc_stats_get(of_port_desc_stats_reply_t *port_desc_stats_reply)
-{
-    LOG_TRACE("Port desc_stats_get called");
+/** \brief Where a receive socket of the old port table is in the new */
 
-    return INDIGO_ERROR_NOT_SUPPORTED;
+static struct port_rx_member *
+port_rx_member_move(struct port_rx_member *m, struct of_port *from,
+                    struct of_port *to)
+{
+    return (m == NULL ? NULL
+            : (struct port_rx_member *)((char *)to + ((char *)m
+                                                      - (char *)from)));
 }
 
 
-/**
- * Currently no experimenter messages supported in the port module
- */
+/** \brief Change the number of OpenFlow ports
+
+Ports in use keep their numbers and their traffic: the table is copied
+between packets, and receive sockets are registered again with their
+new place.  The table can't shrink past a port in use.
+*/
 
 indigo_error_t
-indigo_port_experimenter(of_experimenter_t *experimenter,
-                         indigo_cxn_id_t cxn_id)
+ind_port_max_ports_set(unsigned max_ports)
 {
-    LOG_TRACE("Port experimenter called");
+    struct of_port      *tbl = NULL, *p;
+    struct of_port_info *info_tbl = NULL;
+    struct of_port_cfg  *cfg_tbl = NULL;
+    of_port_no_t       *pending = NULL, *wait = NULL;
+    uint32_t           *set_all = NULL, *set_flood = NULL;
+    unsigned           n, words, old_max = my_config->max_ports, keep;
+    unsigned           i, cls;
+
+    if (!init_done) {
+        return INDIGO_ERROR_INIT;
+    }
+    if (max_ports == 0 || max_ports > IND_PORT_MAX_PORTS_MAX) {
+        LOG_ERROR("Bad port table size %u", max_ports);
+        return INDIGO_ERROR_PARAM;
+    }
+    if (max_ports == old_max) {
+        return INDIGO_ERROR_NONE;
+    }
+    for (n = max_ports + 1; n <= old_max; ++n) {
+        if (of_port_num_to_ptr(n)->vpi != NULL) {
+            LOG_ERROR("Port %u in use, can't shrink to %u ports",
+                      n, max_ports);
+            return INDIGO_ERROR_PARAM;
+        }
+    }
 
-    return INDIGO_ERROR_NOT_SUPPORTED;    
-}
+    words = (max_ports + 31) / 32;
+    tbl = of_port_tbl_alloc(max_ports);
+    info_tbl = INDIGO_MEM_ALLOC(max_ports * sizeof(*info_tbl));
+    cfg_tbl = INDIGO_MEM_ALLOC(max_ports * sizeof(*cfg_tbl));
+    pending = INDIGO_MEM_ALLOC(max_ports * sizeof(*pending));
+    wait = INDIGO_MEM_ALLOC(max_ports * sizeof(*wait));
+    set_all = INDIGO_MEM_ALLOC(words * sizeof(uint32_t));
+    set_flood = INDIGO_MEM_ALLOC(words * sizeof(uint32_t));
+    if (tbl == NULL || info_tbl == NULL || cfg_tbl == NULL || pending == NULL
+        || wait == NULL || set_all == NULL || set_flood == NULL) {
+        LOG_ERROR("No memory");
+        free(tbl);
+        INDIGO_MEM_FREE(info_tbl);
+        INDIGO_MEM_FREE(cfg_tbl);
+        INDIGO_MEM_FREE(pending);
+        INDIGO_MEM_FREE(wait);
+        INDIGO_MEM_FREE(set_all);
+        INDIGO_MEM_FREE(set_flood);
+        return INDIGO_ERROR_RESOURCE;
+    }
+
+    /* Slots past the old end are free; those past the new end are too */
+    keep = max_ports < old_max ? max_ports : old_max;
+    INDIGO_MEM_COPY(tbl, of_port_tbl, keep * sizeof(*tbl));
+    for (p = tbl + keep, n = max_ports - keep; n; --n, ++p) {
+        p->vpi = NULL;
+    }
+    for (n = keep; n < old_max; ++n) {
+        INDIGO_MEM_FREE(of_port_cfg_tbl[n].rx_filter);
+    }
+    INDIGO_MEM_SET(info_tbl, 0, max_ports * sizeof(*info_tbl));
+    INDIGO_MEM_COPY(info_tbl, of_port_info_tbl, keep * sizeof(*info_tbl));
+    INDIGO_MEM_SET(cfg_tbl, 0, max_ports * sizeof(*cfg_tbl));
+    INDIGO_MEM_COPY(cfg_tbl, of_port_cfg_tbl, keep * sizeof(*cfg_tbl));
+    /* Only ports in use, all below the new end, are listed */
+    INDIGO_MEM_COPY(pending, tx_pending_tbl,
+                    tx_pending_cnt * sizeof(*pending));
+    INDIGO_MEM_COPY(wait, shaper_wait_tbl,
+                    shaper_wait_cnt * sizeof(*wait));
+    INDIGO_MEM_SET(set_all, 0, words * sizeof(uint32_t));
+    INDIGO_MEM_SET(set_flood, 0, words * sizeof(uint32_t));
+    n = words < port_set_words ? words : port_set_words;
+    INDIGO_MEM_COPY(set_all, port_set_all, n * sizeof(uint32_t));
+    INDIGO_MEM_COPY(set_flood, port_set_flood, n * sizeof(uint32_t));
+
+    /* Receive sockets are known by address to sockman and the RX queues */
+    for (cls = 0; cls < IND_PORT_RX_PRIORITIES; ++cls) {
+        struct port_rx_queue  *rq = &port_rx_ready_tbl[cls];
+        struct port_rx_member *m;
+
+        rq->head = port_rx_member_move(rq->head, of_port_tbl, tbl);
+        rq->tail = port_rx_member_move(rq->tail, of_port_tbl, tbl);
+        for (m = rq->head; m != NULL; m = m->rx_next) {
+            m->rx_next = port_rx_member_move(m->rx_next, of_port_tbl, tbl);
+        }
+    }
+    for (p = tbl, n = keep; n; --n, ++p) {
+        if (p->vpi == NULL)  continue;
+        for (i = 0; i < p->n_rx_members; ++i) {
+            ind_soc_socket_unregister(p->rx_members[i].fd);
+            ind_soc_socket_register(p->rx_members[i].fd, pkt_rx,
+                                    &p->rx_members[i]);
+        }
+    }
 
+    free(of_port_tbl);
+    INDIGO_MEM_FREE(of_port_info_tbl);
+    INDIGO_MEM_FREE(of_port_cfg_tbl);
+    INDIGO_MEM_FREE(tx_pending_tbl);
+    INDIGO_MEM_FREE(shaper_wait_tbl);
+    INDIGO_MEM_FREE(port_set_all);
+    INDIGO_MEM_FREE(port_set_flood);
+    of_port_tbl = tbl;
+    of_port_info_tbl = info_tbl;
+    of_port_cfg_tbl = cfg_tbl;
+    tx_pending_tbl = pending;
+    shaper_wait_tbl = wait;
+    port_set_all = set_all;
+    port_set_flood = set_flood;
+    port_set_words = words;
+    my_config->max_ports = max_ports;
+
+    LOG_INFO("Port table resized from %u to %u ports", old_max, max_ports);
 
-/***************************************************************************/
+    return INDIGO_ERROR_NONE;
+}
 
-/** \brief Transmit given packet out OF port */
+
+/** \brief Turn TX offload to a dedicated thread on or off */
 
 indigo_error_t
-indigo_port_packet_emit(of_port_no_t of_port_num,
-                        unsigned queue_id,
-                        uint8_t *data,
-                        unsigned len)
-{      
-    struct of_port     *p;
-  
-    LOG_TRACE("Emit %d bytes to port %d, queue %d", 
-              len, of_port_num, queue_id);
+ind_port_tx_offload_set(int enable)
+{
+    indigo_error_t rv;
+    struct of_port *p;
+    of_port_no_t   of_port_num;
 
-    if (!of_port_num_valid(of_port_num)) {
-        LOG_ERROR("Invalid OF port number");
-        return (INDIGO_ERROR_PARAM);
+    if (!init_done) {
+        return (INDIGO_ERROR_INIT);
     }
 
-    if (queue_id != 0) {
-        LOG_ERROR("Invalid transmit queue");
-        return (INDIGO_ERROR_PARAM);
+    enable = enable != 0;
+    if (enable == tx_offload) {
+        return (INDIGO_ERROR_NONE);
     }
 
-    if (!of_port_inuse(p = of_port_num_to_ptr(of_port_num))) {
-        LOG_ERROR("OF port not in use");
-        return (INDIGO_ERROR_NOT_FOUND);
+    if (!enable) {
+        (void)ind_port_txthread_stop();
     }
-    
-    if (!OF_PORT_CONFIG_FLAG_PORT_DOWN_TEST(p->config, my_config->of_version)
-        && !OF_PORT_CONFIG_FLAG_NO_FWD_TEST(p->config, my_config->of_version)
-        ) {
-        /* Port is enabled and forwarding is enabled for port */
-    
-        /* Send packet out network interface */
-        if (vpi_send(p->vpi, data, len) < 0) {
-            LOG_ERROR("vpi_send() failed");
-            return (INDIGO_ERROR_UNKNOWN);
+    for (p = of_port_tbl, of_port_num = 1;
+         of_port_num <= my_config->max_ports;
+         ++of_port_num, ++p
+         ) {
+        if (!of_port_inuse(p))  continue;
+        if (enable) {
+            port_tx_offload_attach(of_port_num, p);
+        } else {
+            port_tx_offload_detach(p);
+        }
+    }
+    if (enable && INDIGO_FAILURE(rv = ind_port_txthread_start())) {
+        for (p = of_port_tbl, of_port_num = 1;
+             of_port_num <= my_config->max_ports;
+             ++of_port_num, ++p
+             ) {
+            if (of_port_inuse(p))  port_tx_offload_detach(p);
         }
+        return (rv);
+    }
+
+    LOG_INFO("TX offload %s", enable ? "on" : "off");
+    tx_offload = enable;
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Set the receive fanout of a port */
+
+indigo_error_t
+ind_port_fanout_set(of_port_no_t port_no, ind_port_fanout_mode_t mode,
+                    unsigned n_sockets)
+{
+    struct of_port_cfg *cfg;
+
+    if (!of_port_num_valid(port_no)) {
+        LOG_ERROR("Fanout: Port number out of range");
+        return INDIGO_ERROR_PARAM;
+    }
+    if (mode > IND_PORT_FANOUT_ROLLOVER || n_sockets > IND_PORT_FANOUT_MAX) {
+        LOG_ERROR("Fanout: Bad mode %d or socket count %u",
+                  mode, n_sockets);
+        return INDIGO_ERROR_PARAM;
+    }
 
-        /* Update port stats */
+    cfg = &of_port_cfg_tbl[port_no - 1];
+    if (cfg->fanout_mode == mode && cfg->fanout_sockets == n_sockets) {
+        return INDIGO_ERROR_NONE;
+    }
+    cfg->fanout_mode = mode;
+    cfg->fanout_sockets = n_sockets;
 
-        ++p->cnt_tx_pkts;
-        p->cnt_tx_bytes += len;
+    if (of_port_inuse(of_port_num_to_ptr(port_no))) {
+        LOG_INFO("Port %u: fanout change applies when its interface "
+                 "is next added", port_no);
     }
 
-    return (INDIGO_ERROR_NONE);
+    return INDIGO_ERROR_NONE;
 }
 
 
 /**
  * @brief Transmit given packet out a group of ports
  *
- * The only group ID currently supported is "flood".  The value for the
- * flood group is the port-flood id, 0xfffffffb.
+ * Flood, the port-flood id 0xfffffffb, is handled here.  Any other id is
+ * an OpenFlow group, which the forwarding module owns.
  */
 
 
@@ -1067,30 +2891,13 @@ indigo_port_packet_emit_group(of_port_no_t group_id,
                               unsigned     len
                               )
 {
-    indigo_error_t result = INDIGO_ERROR_NONE;
-    struct of_port *p;
-    unsigned       of_port_num, n;
-
     LOG_TRACE("Send %d bytes to group 0x%x", len, group_id);
 
     if (group_id != OF_PORT_DEST_FLOOD) {
-        return INDIGO_ERROR_PARAM;
-    }
-
-    for (p = of_port_tbl, of_port_num = 1, n = my_config->max_ports;
-         n;
-         --n, ++of_port_num, ++p
-         ) {
-        if (!of_port_inuse(p) ||
-            of_port_num == ingress_port_num ||
-            /* @fixme This is where the assumption is that we're flooding */
-            of_port_no_flood(p))  {
-            continue;
-        }
-        result = indigo_port_packet_emit(of_port_num, 0, data, len);
+        return ind_fwd_group_emit(group_id, ingress_port_num, data, len);
     }
 
-    return (result);
+    return port_set_emit(port_set_flood, ingress_port_num, data, len);
 }
 
 
@@ -1102,22 +2909,9 @@ indigo_port_packet_emit_all(of_port_no_t skip_of_port_num,
                             unsigned     len
                             )
 {       
-    indigo_error_t result = INDIGO_ERROR_NONE;
-    struct of_port *p;
-    unsigned       of_port_num, n;
-
     LOG_TRACE("Emit all, %d bytes", len);
 
-    for (p = of_port_tbl, of_port_num = 1, n = my_config->max_ports;
-         n;
-         --n, ++of_port_num, ++p
-         ) {
-        if (!of_port_inuse(p) || of_port_num == skip_of_port_num)  continue;
-
-        result = indigo_port_packet_emit(of_port_num, 0, data, len);
-    }
-
-    return (result);
+    return port_set_emit(port_set_all, skip_of_port_num, data, len);
 }
 
 /**
@@ -1142,7 +2936,8 @@ ind_port_mac_addr_set(of_port_no_t port_no, of_mac_addr_t *mac_addr)
         return INDIGO_ERROR_NOT_FOUND;
     }
 
-    PORTMANAGER_MEMCPY(&port->mac, mac_addr, sizeof(of_mac_addr_t));
+    PORTMANAGER_MEMCPY(&of_port_num_to_info(port_no)->mac, mac_addr,
+                       sizeof(of_mac_addr_t));
 
     return INDIGO_ERROR_NONE;
 }
@@ -1165,7 +2960,8 @@ ind_port_mac_addr_get(of_port_no_t port_no, of_mac_addr_t *mac_addr)
         return INDIGO_ERROR_NOT_FOUND;
     }
 
-    PORTMANAGER_MEMCPY(mac_addr, &port->mac, sizeof(of_mac_addr_t));
+    PORTMANAGER_MEMCPY(mac_addr, &of_port_num_to_info(port_no)->mac,
+                       sizeof(of_mac_addr_t));
 
     return INDIGO_ERROR_NONE;
 }
@@ -1179,15 +2975,15 @@ ind_port_mac_addr_get(of_port_no_t port_no, of_mac_addr_t *mac_addr)
 indigo_error_t
 ind_port_base_mac_addr_set(of_mac_addr_t *base_mac)
 {
-    struct of_port *port;
+    struct of_port_info *info;
     of_mac_addr_t mac_addr;
     int n;
 
     LOG_TRACE("Setting base mac addr for ports");
 
     PORTMANAGER_MEMCPY(&mac_addr, base_mac, sizeof(mac_addr));
-    for (port = of_port_tbl, n = my_config->max_ports; n; --n, ++port) {
-        PORTMANAGER_MEMCPY(&port->mac, &mac_addr, sizeof(of_mac_addr_t));
+    for (info = of_port_info_tbl, n = my_config->max_ports; n; --n, ++info) {
+        PORTMANAGER_MEMCPY(&info->mac, &mac_addr, sizeof(of_mac_addr_t));
         /* We only roll over on the lower 3 bytes to leave OUI alone  */
         if (++(mac_addr.addr[5]) == 0) {
             if (++(mac_addr.addr[4]) == 0) {
@@ -1201,6 +2997,121 @@ ind_port_base_mac_addr_set(of_mac_addr_t *base_mac)
 }
 
 
+/** \brief Print transmit queue and shaper state of ports in use */
+
+void
+ind_port_stats_show(aim_pvs_t *pvs)
+{
+    struct of_port  *p;
+    struct port_txq *q;
+    of_port_no_t    of_port_num;
+    unsigned        n;
+    uint64_t        now;
+
+    tx_clock_update();
+    now = tx_clock_ns;
+
+    for (p = of_port_tbl, of_port_num = 1;
+         of_port_num <= my_config->max_ports;
+         ++of_port_num, ++p
+         ) {
+        if (!of_port_inuse(p))  continue;
+
+        port_rx_kernel_stats_update(p);
+        aim_printf(pvs, "port %u (%s): rx %"PRIu64" pkts, tx %"PRIu64" pkts\n",
+                   of_port_num, of_port_num_to_info(of_port_num)->ifname,
+                   p->cnt_rx_pkts, p->cnt_tx_pkts);
+        aim_printf(pvs, "  rx prio %u quantum %u: %"PRIu64" turns, "
+                   "%"PRIu64" quantum exhausted, ",
+                   of_port_cfg_tbl[of_port_num - 1].rx_priority,
+                   of_port_cfg_tbl[of_port_num - 1].rx_quantum
+                   ? of_port_cfg_tbl[of_port_num - 1].rx_quantum
+                   : PORT_RX_BURST,
+                   p->cnt_rx_turns, p->cnt_rx_quantum_exhausted);
+        if (p->cnt_rx_turns) {
+            aim_printf(pvs, "last served %"PRIu64" us ago, "
+                       "max wait %"PRIu64" us\n",
+                       (now - p->rx_last_service_ns) / 1000,
+                       p->rx_max_wait_ns / 1000);
+        } else {
+            aim_printf(pvs, "never served\n");
+        }
+        if (p->rx_packet_socket) {
+            aim_printf(pvs, "  rx %s%s, kernel drops %"PRIu64"\n",
+                       of_port_cfg_tbl[of_port_num - 1].rx_all_directions
+                       ? "all directions" : "inbound only",
+                       of_port_cfg_tbl[of_port_num - 1].rx_filter != NULL
+                       ? ", BPF filtered" : "",
+                       p->cnt_rx_kernel_drops);
+        }
+        for (n = 0; p->n_rx_members > 1 && n < p->n_rx_members; ++n) {
+            aim_printf(pvs, "  rx %s fanout socket %u: %"PRIu64" pkts, "
+                       "%"PRIu64" bytes, kernel drops %"PRIu64"\n",
+                       port_fanout_mode_names[
+                           of_port_cfg_tbl[of_port_num - 1].fanout_mode],
+                       n, p->rx_members[n].cnt_rx_pkts,
+                       p->rx_members[n].cnt_rx_bytes,
+                       p->rx_members[n].cnt_kernel_drops);
+        }
+        aim_printf(pvs, "  tx %s: %"PRIu64" syscalls, flushes",
+                   p->tx_ring != NULL ? "thread"
+                   : p->tx_fd >= 0 ? "sendmmsg" : "vpi_send",
+                   p->cnt_tx_syscalls);
+        for (n = 0; n < TX_FLUSH_HIST_BUCKETS; ++n) {
+            aim_printf(pvs, " %s%u:%"PRIu64,
+                       n == TX_FLUSH_HIST_BUCKETS - 1 ? ">=" : "",
+                       1u << n, p->tx_flush_hist[n]);
+        }
+        aim_printf(pvs, "\n");
+        if (p->tx_ring != NULL) {
+            struct port_tx_ring_stats stats;
+
+            ind_port_tx_ring_stats_get(p->tx_ring, &stats);
+            aim_printf(pvs, "  tx ring depth %u, max %u, overflow %"PRIu64", "
+                       "%"PRIu64" syscalls, errors %"PRIu64"\n",
+                       stats.depth, stats.depth_max, stats.cnt_overflow,
+                       stats.cnt_tx_syscalls, stats.cnt_tx_errors);
+            aim_printf(pvs, "  tx ring latency avg %"PRIu64" us, "
+                       "max %"PRIu64" us,",
+                       stats.cnt_timed
+                       ? stats.lat_sum_ns / stats.cnt_timed / 1000 : 0,
+                       stats.lat_max_ns / 1000);
+            for (n = 0; n < PORT_TX_LAT_BUCKETS; ++n) {
+                aim_printf(pvs, " %s%uus:%"PRIu64,
+                           n == PORT_TX_LAT_BUCKETS - 1 ? ">=" : "<",
+                           n == PORT_TX_LAT_BUCKETS - 1 ? 1u << (n - 1)
+                           : 1u << n,
+                           stats.lat_hist[n]);
+            }
+            aim_printf(pvs, "\n");
+        }
+        if (p->cnt_fanout_errors) {
+            aim_printf(pvs, "  flood/all copies failed: %"PRIu64"\n",
+                       p->cnt_fanout_errors);
+        }
+        for (n = 0; n < PORT_STORM_CLASSES; ++n) {
+            if (!p->storm[n].pps && !p->storm[n].cnt_dropped)  continue;
+            aim_printf(pvs, "  storm control %s %u pps: %"PRIu64" dropped, "
+                       "%"PRIu64" events%s\n",
+                       port_storm_class_names[n], p->storm[n].pps,
+                       p->storm[n].cnt_dropped, p->storm[n].cnt_events,
+                       p->storm[n].storming ? ", storming" : "");
+        }
+        if (p->shaper.rate) {
+            aim_printf(pvs, "  shaper %u kb/s: %"PRIu64" shaped%s\n",
+                       p->shaper.rate, p->shaper.cnt_shaped,
+                       p->shaper.waiting ? ", waiting" : "");
+        }
+        for (q = p->sched.queues, n = p->sched.n_queues; n; --n, ++q) {
+            aim_printf(pvs, "  queue %u prio %u weight %u: queued %u/%u, "
+                       "tx %"PRIu64", dropped %"PRIu64", errors %"PRIu64"\n",
+                       q->queue_id, q->priority, q->weight, q->count, q->depth,
+                       q->cnt_tx_pkts, q->cnt_dropped, q->cnt_tx_errors);
+        }
+    }
+}
+
+
 /***************************************************************************/
 
 /** \brief Initialize module */
@@ -1246,7 +3157,22 @@ indigo_error_t
 ind_port_finish(void)
 {
     LOG_TRACE("Finish called");
+    if (shaper_timer_on) {
+        ind_soc_timer_event_unregister(shaper_timer, NULL);
+        shaper_timer_on = 0;
+    }
+    if (link_poll_on) {
+        ind_soc_timer_event_unregister(link_poll_timer, NULL);
+        link_poll_on = 0;
+    }
+    if (link_sd >= 0) {
+        close(link_sd);
+        link_sd = -1;
+    }
+    (void)ind_port_txthread_stop();
     of_port_tbl_delete();
+    ind_port_txthread_finish();
+    tx_offload = 0;
 
     init_done = 0;
 
@@ -22,8 +22,10 @@
 #include "portmanager_int.h" 
 #include "portmanager_log.h"
 #include <stdlib.h>
+#include <string.h>
 #include <cjson/cJSON.h>
 #include <Configuration/configuration.h>
+#include <indigo/memory.h>
 
 /* <auto.start.cdefs(PORTMANAGER_CONFIG_HEADER).source> */
 #define __portmanager_config_STRINGIFY_NAME(_x) #_x
@@ -114,16 +116,436 @@ str2mac(const char *str, of_mac_addr_t *mac)
     return -1;
 }
 
+/** \brief Settings of one port from the "ports" object */
+
+struct port_cfg {
+    of_port_no_t            of_port_num;
+    unsigned                n_queues;
+    ind_port_queue_config_t queues[IND_PORT_QUEUES_MAX];
+    unsigned                shaper_rate;    /**< kb/s; 0 = not shaped */
+    unsigned                shaper_burst;   /**< Bytes */
+    unsigned                bcast_pps;      /**< 0 = unlimited */
+    unsigned                mcast_pps;
+    unsigned                uucast_pps;
+    unsigned                inbound_only;
+    ind_port_bpf_insn_t     *bpf_filter;    /**< NULL = none */
+    unsigned                bpf_filter_len;
+    ind_port_fanout_mode_t  fanout_mode;
+    unsigned                fanout_sockets;
+    unsigned                rx_quantum;
+    unsigned                rx_priority;
+    unsigned                unapplied;      /**< PORT_CFG_* that failed */
+};
+
+/* Port settings applied separately, so that only what changed is */
+#define PORT_CFG_QUEUES     0x01
+#define PORT_CFG_SHAPER     0x02
+#define PORT_CFG_STORM      0x04
+#define PORT_CFG_RX_FILTER  0x08
+#define PORT_CFG_FANOUT     0x10
+#define PORT_CFG_RX_SCHED   0x20
+#define PORT_CFG_ALL        0x3f
+
 static struct {
     uint32_t log_flags;
     char mac_base_valid;
     of_mac_addr_t mac_base;
+    struct port_cfg *ports;
+    unsigned n_ports;
+    int tx_offload;
+    unsigned max_ports;         /**< 0 = left as it is */
 } staged_config;
 
+/* Ports configured by the last commit, to revert those dropped later */
+static struct port_cfg *committed_ports;
+static unsigned committed_n_ports;
+
+static void
+ports_free(struct port_cfg *ports, unsigned n_ports)
+{
+    unsigned i;
+
+    for (i = 0; i < n_ports; ++i) {
+        INDIGO_MEM_FREE(ports[i].bpf_filter);
+    }
+    INDIGO_MEM_FREE(ports);
+}
+
+/** \brief Read an optional non-negative integer member of a JSON object */
+
+static indigo_error_t
+cfg_uint_get(cJSON *obj, const char *name, unsigned max, unsigned *val)
+{
+    cJSON *item;
+
+    if ((item = cJSON_GetObjectItem(obj, name)) == NULL) {
+        return INDIGO_ERROR_NONE;
+    }
+
+    if (item->type != cJSON_Number
+        || item->valuedouble < 0 || item->valuedouble > max) {
+        AIM_LOG_ERROR("Config: %s must be an integer from 0 to %u",
+                      name, max);
+        return INDIGO_ERROR_PARAM;
+    }
+
+    *val = (unsigned)item->valuedouble;
+    return INDIGO_ERROR_NONE;
+}
+
+/**
+ * Parse the "queues" array of a port:
+ *
+ *   "queues": [ { "id": 0, "priority": 1, "weight": 1, "depth": 64 }, ... ]
+ *
+ * Every member is optional; "id" defaults to the array index.
+ */
+
+static indigo_error_t
+port_queues_parse(cJSON *item, struct port_cfg *port)
+{
+    cJSON *q;
+    unsigned n, val;
+    indigo_error_t err;
+
+    if (item->type != cJSON_Array) {
+        AIM_LOG_ERROR("Config: queues of port %u must be an array",
+                      port->of_port_num);
+        return INDIGO_ERROR_PARAM;
+    }
+
+    for (q = item->child, n = 0; q != NULL; q = q->next, ++n) {
+        ind_port_queue_config_t *cfg = &port->queues[n];
+
+        if (n == IND_PORT_QUEUES_MAX) {
+            AIM_LOG_ERROR("Config: port %u has more than %u queues",
+                          port->of_port_num, IND_PORT_QUEUES_MAX);
+            return INDIGO_ERROR_PARAM;
+        }
+        if (q->type != cJSON_Object) {
+            AIM_LOG_ERROR("Config: queue of port %u must be an object",
+                          port->of_port_num);
+            return INDIGO_ERROR_PARAM;
+        }
+
+        cfg->queue_id = n;
+        cfg->priority = 0;
+        cfg->weight = 1;
+        cfg->depth = 0;
+
+        val = cfg->queue_id;
+        if ((err = cfg_uint_get(q, "id", 0xfffffffe, &val)) < 0) return err;
+        cfg->queue_id = val;
+        val = cfg->priority;
+        if ((err = cfg_uint_get(q, "priority", 0xff, &val)) < 0) return err;
+        cfg->priority = val;
+        val = cfg->weight;
+        if ((err = cfg_uint_get(q, "weight", 0xffff, &val)) < 0) return err;
+        cfg->weight = val;
+        val = cfg->depth;
+        if ((err = cfg_uint_get(q, "depth", PORT_QUEUE_DEPTH_MAX,
+                                &val)) < 0) return err;
+        cfg->depth = val;
+    }
+    port->n_queues = n;
+
+    return ind_port_sched_config_check(port->queues, port->n_queues);
+}
+
+/**
+ * Parse the "shaper" object of a port:
+ *
+ *   "shaper": { "rate": 10000, "burst": 32768 }
+ *
+ * Rate is in kb/s, burst in bytes.
+ */
+
+static indigo_error_t
+port_shaper_parse(cJSON *item, struct port_cfg *port)
+{
+    indigo_error_t err;
+
+    if (item->type != cJSON_Object) {
+        AIM_LOG_ERROR("Config: shaper of port %u must be an object",
+                      port->of_port_num);
+        return INDIGO_ERROR_PARAM;
+    }
+
+    if ((err = cfg_uint_get(item, "rate", 0xffffffff,
+                            &port->shaper_rate)) < 0) {
+        return err;
+    }
+
+    return cfg_uint_get(item, "burst", 0xffffffff, &port->shaper_burst);
+}
+
+/**
+ * Parse the "storm_control" object of a port, thresholds in frames/s:
+ *
+ *   "storm_control": { "broadcast": 1000, "multicast": 5000,
+ *                      "unknown_unicast": 5000 }
+ */
+
+static indigo_error_t
+port_storm_parse(cJSON *item, struct port_cfg *port)
+{
+    indigo_error_t err;
+
+    if (item->type != cJSON_Object) {
+        AIM_LOG_ERROR("Config: storm_control of port %u must be an object",
+                      port->of_port_num);
+        return INDIGO_ERROR_PARAM;
+    }
+
+    if ((err = cfg_uint_get(item, "broadcast", 0xffffffff,
+                            &port->bcast_pps)) < 0) {
+        return err;
+    }
+    if ((err = cfg_uint_get(item, "multicast", 0xffffffff,
+                            &port->mcast_pps)) < 0) {
+        return err;
+    }
+
+    return cfg_uint_get(item, "unknown_unicast", 0xffffffff,
+                        &port->uucast_pps);
+}
+
+/**
+ * Parse the "rx" object of a port, its receive scheduling:
+ *
+ *   "rx": { "quantum": 64, "priority": 1 }
+ */
+
+static indigo_error_t
+port_rx_parse(cJSON *item, struct port_cfg *port)
+{
+    indigo_error_t err;
+
+    if (item->type != cJSON_Object) {
+        AIM_LOG_ERROR("Config: rx of port %u must be an object",
+                      port->of_port_num);
+        return INDIGO_ERROR_PARAM;
+    }
+
+    if ((err = cfg_uint_get(item, "quantum", IND_PORT_RX_QUANTUM_MAX,
+                            &port->rx_quantum)) < 0) {
+        return err;
+    }
+
+    return cfg_uint_get(item, "priority", IND_PORT_RX_PRIORITIES - 1,
+                        &port->rx_priority);
+}
+
+/**
+ * Parse the "fanout" object of a port:
+ *
+ *   "fanout": { "mode": "hash", "sockets": 4 }
+ *
+ * Modes are "none", "hash", "cpu" and "rollover".
+ */
+
+static indigo_error_t
+port_fanout_parse(cJSON *item, struct port_cfg *port)
+{
+    static const char *const modes[] = { "none", "hash", "cpu", "rollover" };
+    cJSON *mode;
+    unsigned i;
+
+    if (item->type != cJSON_Object) {
+        AIM_LOG_ERROR("Config: fanout of port %u must be an object",
+                      port->of_port_num);
+        return INDIGO_ERROR_PARAM;
+    }
+
+    if ((mode = cJSON_GetObjectItem(item, "mode")) != NULL) {
+        for (i = 0; i < AIM_ARRAYSIZE(modes); ++i) {
+            if (mode->type == cJSON_String
+                && strcmp(mode->valuestring, modes[i]) == 0) {
+                break;
+            }
+        }
+        if (i == AIM_ARRAYSIZE(modes)) {
+            AIM_LOG_ERROR("Config: unknown fanout mode for port %u",
+                          port->of_port_num);
+            return INDIGO_ERROR_PARAM;
+        }
+        port->fanout_mode = i;
+    }
+
+    return cfg_uint_get(item, "sockets", IND_PORT_FANOUT_MAX,
+                        &port->fanout_sockets);
+}
+
+/**
+ * Parse the "bpf_filter" array of a port, a classic BPF program as
+ * printed by tcpdump -dd:
+ *
+ *   "bpf_filter": [ [ 40, 0, 0, 12 ], [ 21, 0, 1, 34525 ], ... ]
+ *
+ * Each instruction is [ code, jt, jf, k ].
+ */
+
+static indigo_error_t
+port_bpf_parse(cJSON *item, struct port_cfg *port)
+{
+    static const unsigned max[4] = { 0xffff, 0xff, 0xff, 0xffffffff };
+    cJSON *insn, *field;
+    unsigned n, i, val[4];
+
+    if (item->type != cJSON_Array) {
+        AIM_LOG_ERROR("Config: bpf_filter of port %u must be an array",
+                      port->of_port_num);
+        return INDIGO_ERROR_PARAM;
+    }
+
+    for (insn = item->child, n = 0; insn != NULL; insn = insn->next, ++n);
+    if (n == 0) {
+        return INDIGO_ERROR_NONE;
+    }
+    if (n > IND_PORT_BPF_INSNS_MAX) {
+        AIM_LOG_ERROR("Config: bpf_filter of port %u is too long",
+                      port->of_port_num);
+        return INDIGO_ERROR_PARAM;
+    }
+    if ((port->bpf_filter = INDIGO_MEM_ALLOC(
+             n * sizeof(*port->bpf_filter))) == NULL) {
+        return INDIGO_ERROR_RESOURCE;
+    }
+    port->bpf_filter_len = n;
+
+    for (insn = item->child, n = 0; insn != NULL; insn = insn->next, ++n) {
+        for (field = insn->type == cJSON_Array ? insn->child : NULL, i = 0;
+             field != NULL && i < 4;
+             field = field->next, ++i) {
+            if (field->type != cJSON_Number || field->valuedouble < 0
+                || field->valuedouble > max[i]) {
+                break;
+            }
+            val[i] = (unsigned)field->valuedouble;
+        }
+        if (i != 4 || field != NULL) {
+            AIM_LOG_ERROR("Config: bpf_filter instruction %u of port %u "
+                          "must be [ code, jt, jf, k ]",
+                          n, port->of_port_num);
+            return INDIGO_ERROR_PARAM;
+        }
+        port->bpf_filter[n].code = val[0];
+        port->bpf_filter[n].jt = val[1];
+        port->bpf_filter[n].jf = val[2];
+        port->bpf_filter[n].k = val[3];
+    }
+
+    return INDIGO_ERROR_NONE;
+}
+
+/**
+ * Parse the optional "ports" object, keyed by OF port number:
+ *
+ *   "ports": { "1": { "queues": [ ... ], "shaper": { ... },
+ *                     "storm_control": { ... },
+ *                     "inbound_only": true, "bpf_filter": [ ... ],
+ *                     "fanout": { ... }, "rx": { ... } }, ... }
+ */
+
+static indigo_error_t
+ports_parse(cJSON *config)
+{
+    cJSON *ports, *item, *queues, *shaper, *storm, *inbound, *bpf, *fanout;
+    cJSON *rx;
+    struct port_cfg *port;
+    unsigned n;
+    char *end;
+    unsigned long of_port_num;
+    indigo_error_t err;
+
+    ports_free(staged_config.ports, staged_config.n_ports);
+    staged_config.ports = NULL;
+    staged_config.n_ports = 0;
+
+    if ((ports = cJSON_GetObjectItem(config, "ports")) == NULL) {
+        return INDIGO_ERROR_NONE;
+    }
+    if (ports->type != cJSON_Object) {
+        AIM_LOG_ERROR("Config: ports must be an object");
+        return INDIGO_ERROR_PARAM;
+    }
+
+    for (item = ports->child, n = 0; item != NULL; item = item->next, ++n);
+    if (n == 0) {
+        return INDIGO_ERROR_NONE;
+    }
+    if ((staged_config.ports = INDIGO_MEM_ALLOC(n * sizeof(*port))) == NULL) {
+        return INDIGO_ERROR_RESOURCE;
+    }
+    INDIGO_MEM_SET(staged_config.ports, 0, n * sizeof(*port));
+
+    for (item = ports->child; item != NULL; item = item->next) {
+        of_port_num = strtoul(item->string, &end, 10);
+        if (*item->string == 0 || *end != 0 || of_port_num == 0
+            || of_port_num >= 0xffffff00 /* Reserved port numbers */
+            || item->type != cJSON_Object) {
+            AIM_LOG_ERROR("Config: bad entry \"%s\" in ports", item->string);
+            return INDIGO_ERROR_PARAM;
+        }
+
+        port = &staged_config.ports[staged_config.n_ports++];
+        port->of_port_num = of_port_num;
+        port->inbound_only = 1;
+
+        if ((queues = cJSON_GetObjectItem(item, "queues")) != NULL) {
+            if ((err = port_queues_parse(queues, port)) < 0) {
+                return err;
+            }
+        }
+
+        if ((shaper = cJSON_GetObjectItem(item, "shaper")) != NULL) {
+            if ((err = port_shaper_parse(shaper, port)) < 0) {
+                return err;
+            }
+        }
+
+        if ((storm = cJSON_GetObjectItem(item, "storm_control")) != NULL) {
+            if ((err = port_storm_parse(storm, port)) < 0) {
+                return err;
+            }
+        }
+
+        if ((inbound = cJSON_GetObjectItem(item, "inbound_only")) != NULL) {
+            if (inbound->type != cJSON_True && inbound->type != cJSON_False) {
+                AIM_LOG_ERROR("Config: inbound_only of port %u must be "
+                              "true or false", port->of_port_num);
+                return INDIGO_ERROR_PARAM;
+            }
+            port->inbound_only = inbound->type == cJSON_True;
+        }
+
+        if ((bpf = cJSON_GetObjectItem(item, "bpf_filter")) != NULL) {
+            if ((err = port_bpf_parse(bpf, port)) < 0) {
+                return err;
+            }
+        }
+
+        if ((fanout = cJSON_GetObjectItem(item, "fanout")) != NULL) {
+            if ((err = port_fanout_parse(fanout, port)) < 0) {
+                return err;
+            }
+        }
+
+        if ((rx = cJSON_GetObjectItem(item, "rx")) != NULL) {
+            if ((err = port_rx_parse(rx, port)) < 0) {
+                return err;
+            }
+        }
+    }
+
+    return INDIGO_ERROR_NONE;
+}
+
 static indigo_error_t
 ind_port_cfg_stage(cJSON *config)
 {
     char *str;
+    cJSON *item;
     indigo_error_t err;
 
     err = ind_cfg_parse_loglevel(config, "logging.dataplane",
@@ -135,6 +557,26 @@ ind_port_cfg_stage(cJSON *config)
 
     /* Not supporting setting log options yet */
 
+    staged_config.tx_offload = 0;
+    if ((item = cJSON_GetObjectItem(config, "tx_offload")) != NULL) {
+        if (item->type != cJSON_True && item->type != cJSON_False) {
+            AIM_LOG_ERROR("Config: tx_offload must be true or false");
+            return INDIGO_ERROR_PARAM;
+        }
+        staged_config.tx_offload = item->type == cJSON_True;
+    }
+
+    staged_config.max_ports = 0;
+    if ((item = cJSON_GetObjectItem(config, "max_ports")) != NULL) {
+        if (item->type != cJSON_Number || item->valuedouble < 1
+            || item->valuedouble > IND_PORT_MAX_PORTS_MAX) {
+            AIM_LOG_ERROR("Config: max_ports must be 1 to %u",
+                          IND_PORT_MAX_PORTS_MAX);
+            return INDIGO_ERROR_PARAM;
+        }
+        staged_config.max_ports = (unsigned)item->valuedouble;
+    }
+
     if (ind_cfg_lookup_string(config, "of_mac_addr_base", &str) == 0) {
         if (str2mac(str, &staged_config.mac_base) == 0) {
             staged_config.mac_base_valid = 1;
@@ -145,13 +587,71 @@ ind_port_cfg_stage(cJSON *config)
         AIM_LOG_WARN("Config: Could not parse of_mac_addr_base");
     }
 
-    return INDIGO_ERROR_NONE;
+    return ports_parse(config);
+}
+
+/**
+ * Which settings of a port differ from those last committed; all of
+ * them for a port not configured before.  Settings that failed to
+ * apply last time count as changed, so they are retried.
+ */
+
+static unsigned
+port_cfg_changed(const struct port_cfg *port)
+{
+    const struct port_cfg *old = NULL;
+    unsigned i, changed = 0;
+
+    for (i = 0; i < committed_n_ports; ++i) {
+        if (committed_ports[i].of_port_num == port->of_port_num) {
+            old = &committed_ports[i];
+            break;
+        }
+    }
+    if (old == NULL) {
+        return PORT_CFG_ALL;
+    }
+
+    if (old->n_queues != port->n_queues
+        || memcmp(old->queues, port->queues,
+                  port->n_queues * sizeof(port->queues[0])) != 0) {
+        changed |= PORT_CFG_QUEUES;
+    }
+    if (old->shaper_rate != port->shaper_rate
+        || old->shaper_burst != port->shaper_burst) {
+        changed |= PORT_CFG_SHAPER;
+    }
+    if (old->bcast_pps != port->bcast_pps
+        || old->mcast_pps != port->mcast_pps
+        || old->uucast_pps != port->uucast_pps) {
+        changed |= PORT_CFG_STORM;
+    }
+    if (old->inbound_only != port->inbound_only
+        || old->bpf_filter_len != port->bpf_filter_len
+        || (port->bpf_filter_len != 0
+            && memcmp(old->bpf_filter, port->bpf_filter,
+                      port->bpf_filter_len
+                      * sizeof(port->bpf_filter[0])) != 0)) {
+        changed |= PORT_CFG_RX_FILTER;
+    }
+    if (old->fanout_mode != port->fanout_mode
+        || old->fanout_sockets != port->fanout_sockets) {
+        changed |= PORT_CFG_FANOUT;
+    }
+    if (old->rx_quantum != port->rx_quantum
+        || old->rx_priority != port->rx_priority) {
+        changed |= PORT_CFG_RX_SCHED;
+    }
+
+    return changed | old->unapplied;
 }
 
 static void
 ind_port_cfg_commit(void)
 {
     aim_log_t *lobj;
+    struct port_cfg *port;
+    unsigned i, j, changed;
 
     if ((lobj = aim_log_find("portmanager")) == NULL) {
         AIM_LOG_WARN("Could not find log module");
@@ -162,6 +662,95 @@ ind_port_cfg_commit(void)
     if (staged_config.mac_base_valid) {
         (void)ind_port_base_mac_addr_set(&staged_config.mac_base);
     }
+
+    if (ind_port_tx_offload_set(staged_config.tx_offload) < 0) {
+        AIM_LOG_ERROR("Config: could not set TX offload");
+    }
+
+    /* Before port settings, which may name the new ports */
+    if (staged_config.max_ports != 0
+        && ind_port_max_ports_set(staged_config.max_ports) < 0) {
+        AIM_LOG_ERROR("Config: could not resize port table to %u",
+                      staged_config.max_ports);
+    }
+
+    /* Ports no longer mentioned go back to defaults */
+    for (i = 0; i < committed_n_ports; ++i) {
+        for (j = 0; j < staged_config.n_ports; ++j) {
+            if (staged_config.ports[j].of_port_num
+                == committed_ports[i].of_port_num) break;
+        }
+        if (j == staged_config.n_ports) {
+            (void)ind_port_queue_config_set(committed_ports[i].of_port_num,
+                                            NULL, 0);
+            (void)ind_port_shaper_set(committed_ports[i].of_port_num, 0, 0);
+            (void)ind_port_storm_control_set(committed_ports[i].of_port_num,
+                                             0, 0, 0);
+            (void)ind_port_rx_filter_set(committed_ports[i].of_port_num,
+                                         1, NULL, 0);
+            (void)ind_port_fanout_set(committed_ports[i].of_port_num,
+                                      IND_PORT_FANOUT_NONE, 0);
+            (void)ind_port_rx_sched_set(committed_ports[i].of_port_num,
+                                        0, 0);
+        }
+    }
+
+    /* Re-applying queues or a shaper would drop what they hold, and
+       zero the queue counters; only what changed is applied */
+    for (i = 0; i < staged_config.n_ports; ++i) {
+        port = &staged_config.ports[i];
+        changed = port_cfg_changed(port);
+        if ((changed & PORT_CFG_QUEUES)
+            && ind_port_queue_config_set(port->of_port_num, port->queues,
+                                         port->n_queues) < 0) {
+            AIM_LOG_ERROR("Config: could not set queues of port %u",
+                          port->of_port_num);
+            port->unapplied |= PORT_CFG_QUEUES;
+        }
+        if ((changed & PORT_CFG_SHAPER)
+            && ind_port_shaper_set(port->of_port_num, port->shaper_rate,
+                                   port->shaper_burst) < 0) {
+            AIM_LOG_ERROR("Config: could not set shaper of port %u",
+                          port->of_port_num);
+            port->unapplied |= PORT_CFG_SHAPER;
+        }
+        if ((changed & PORT_CFG_STORM)
+            && ind_port_storm_control_set(port->of_port_num,
+                                          port->bcast_pps, port->mcast_pps,
+                                          port->uucast_pps) < 0) {
+            AIM_LOG_ERROR("Config: could not set storm control of port %u",
+                          port->of_port_num);
+            port->unapplied |= PORT_CFG_STORM;
+        }
+        if ((changed & PORT_CFG_RX_FILTER)
+            && ind_port_rx_filter_set(port->of_port_num, port->inbound_only,
+                                      port->bpf_filter,
+                                      port->bpf_filter_len) < 0) {
+            AIM_LOG_ERROR("Config: could not set RX filter of port %u",
+                          port->of_port_num);
+            port->unapplied |= PORT_CFG_RX_FILTER;
+        }
+        if ((changed & PORT_CFG_FANOUT)
+            && ind_port_fanout_set(port->of_port_num, port->fanout_mode,
+                                   port->fanout_sockets) < 0) {
+            AIM_LOG_ERROR("Config: could not set fanout of port %u",
+                          port->of_port_num);
+            port->unapplied |= PORT_CFG_FANOUT;
+        }
+        if ((changed & PORT_CFG_RX_SCHED)
+            && ind_port_rx_sched_set(port->of_port_num, port->rx_quantum,
+                                     port->rx_priority) < 0) {
+            AIM_LOG_ERROR("Config: could not set RX scheduling of port %u",
+                          port->of_port_num);
+            port->unapplied |= PORT_CFG_RX_SCHED;
+        }
+    }
+
+    ports_free(committed_ports, committed_n_ports);
+    committed_ports = staged_config.ports;
+    committed_n_ports = staged_config.n_ports;
+    staged_config.ports = NULL;
+    staged_config.n_ports = 0;
 }
 
 const struct ind_cfg_ops ind_port_cfg_ops = {
@@ -26,4 +26,101 @@
 
 extern const struct ind_cfg_ops ind_port_cfg_ops;
 
+extern void ind_port_stats_show(aim_pvs_t *pvs);
+
+#define PORT_QUEUE_DEPTH_DEFAULT 64   /**< Packets per queue, default */
+#define PORT_QUEUE_DEPTH_MAX     4096 /**< Packets per queue, limit */
+
+/** \brief Packet held in a transmit queue */
+
+struct port_txq_pkt {
+    unsigned len;
+    uint8_t  delayed;           /**< TRUE <=> Held back by the shaper */
+    uint8_t  pooled;            /**< TRUE <=> Buffer from the packet pool */
+    uint64_t enq_ns;            /**< When queued; 0 = not timed */
+    uint8_t  data[];
+};
+
+/** \brief One transmit queue of a port */
+
+struct port_txq {
+    uint32_t queue_id;
+    uint8_t  priority;          /**< Strict priority; higher served first */
+    uint16_t weight;            /**< Packets per round robin turn */
+    uint16_t credit;            /**< Packets left in this turn */
+    unsigned depth;             /**< Ring capacity */
+    unsigned head;              /**< Index of oldest packet */
+    unsigned count;             /**< Packets held */
+    struct port_txq_pkt **ring;
+    uint64_t cnt_tx_pkts;       /**< Transmitted packets counter */
+    uint64_t cnt_tx_bytes;      /**< Transmitted bytes counter */
+    uint64_t cnt_tx_errors;     /**< Transmit failures counter */
+    uint64_t cnt_dropped;       /**< Tail drops counter */
+};
+
+/** \brief Transmit scheduler of a port
+
+Queues are kept sorted by descending priority, so the first non-empty
+queue names the priority level to serve.
+*/
+
+struct port_sched {
+    unsigned        n_queues;
+    struct port_txq queues[IND_PORT_QUEUES_MAX];
+    unsigned        rr_next;    /**< Round robin position */
+    unsigned        pending;    /**< Packets held over all queues */
+};
+
+extern indigo_error_t ind_port_sched_config_check(
+    ind_port_queue_config_t *queues, unsigned n_queues);
+extern indigo_error_t ind_port_sched_init(struct port_sched *sched,
+                                          ind_port_queue_config_t *queues,
+                                          unsigned n_queues);
+extern void ind_port_sched_destroy(struct port_sched *sched);
+extern struct port_txq *ind_port_sched_queue_find(struct port_sched *sched,
+                                                  uint32_t queue_id);
+extern indigo_error_t ind_port_sched_enqueue(struct port_sched *sched,
+                                             uint32_t queue_id,
+                                             uint8_t *data, unsigned len);
+extern struct port_txq_pkt *ind_port_sched_peek(struct port_sched *sched,
+                                                struct port_txq **queue);
+extern struct port_txq_pkt *ind_port_sched_pop(struct port_sched *sched,
+                                               struct port_txq *q);
+
+extern struct port_txq_pkt *ind_port_pkt_alloc(unsigned len);
+extern void ind_port_pkt_free(struct port_txq_pkt *pkt);
+
+#define PORT_TX_LAT_BUCKETS 10  /**< Latency <1us, <2us, ..., >=256us */
+
+/** \brief Counters of a TX thread ring */
+
+struct port_tx_ring_stats {
+    unsigned depth;             /**< Packets waiting now */
+    unsigned depth_max;
+    uint64_t cnt_overflow;      /**< Packets dropped on a full ring */
+    uint64_t cnt_tx_pkts;
+    uint64_t cnt_tx_bytes;
+    uint64_t cnt_tx_errors;
+    uint64_t cnt_tx_syscalls;
+    uint64_t cnt_timed;         /**< Packets with an enqueue time */
+    uint64_t lat_sum_ns;        /**< Enqueue to send, over cnt_timed */
+    uint64_t lat_max_ns;
+    uint64_t lat_hist[PORT_TX_LAT_BUCKETS];
+};
+
+struct port_tx_ring;
+
+extern indigo_error_t ind_port_txthread_start(void);
+extern int ind_port_txthread_stop(void);
+extern void ind_port_txthread_kick(void);
+extern void ind_port_txthread_finish(void);
+extern struct port_tx_ring *ind_port_tx_ring_create(of_port_no_t of_port_num,
+                                                    int fd);
+extern void ind_port_tx_ring_destroy(struct port_tx_ring *ring,
+                                     struct port_tx_ring_stats *stats);
+extern int ind_port_tx_ring_push(struct port_tx_ring *ring,
+                                 struct port_txq_pkt *pkt);
+extern void ind_port_tx_ring_stats_get(struct port_tx_ring *ring,
+                                       struct port_tx_ring_stats *stats);
+
 #endif /* __PORTMANAGER_INT_H__ */
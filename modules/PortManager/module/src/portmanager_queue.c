@@ -0,0 +1,301 @@
+/****************************************************************
+ *
+ *        Copyright 2013, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ***************************************************************/
+
+/**
+ * @file
+ * @brief Port transmit queues and their scheduler
+ *
+ * Each queue is a bounded ring of packet copies.  The scheduler serves
+ * the highest priority level holding packets; within a level, queues
+ * take turns of weight packets each (weighted round robin).
+ */
+
+#include "portmanager_log.h"
+#include "portmanager_int.h"
+
+#include <indigo/memory.h>
+#include <PortManager/portmanager.h>
+#include <PortManager/portmanager_porting.h>
+
+/* Short hand logging macros */
+#define LOG_ERROR AIM_LOG_ERROR
+#define LOG_TRACE AIM_LOG_TRACE
+
+
+/** \brief Check a port's queue configuration
+
+Queue 0 must always be configured, as it carries output that names no
+queue.
+*/
+
+indigo_error_t
+ind_port_sched_config_check(ind_port_queue_config_t *queues,
+                            unsigned n_queues)
+{
+    unsigned i, j;
+
+    if (n_queues == 0) {
+        return INDIGO_ERROR_NONE;
+    }
+
+    if (n_queues > IND_PORT_QUEUES_MAX) {
+        LOG_ERROR("Too many queues (%u)", n_queues);
+        return INDIGO_ERROR_PARAM;
+    }
+
+    for (i = 0; i < n_queues && queues[i].queue_id != 0; ++i);
+    if (i == n_queues) {
+        LOG_ERROR("Queue 0 must be configured");
+        return INDIGO_ERROR_PARAM;
+    }
+
+    for (i = 0; i < n_queues; ++i) {
+        if (queues[i].depth > PORT_QUEUE_DEPTH_MAX) {
+            LOG_ERROR("Queue %u depth %u too large",
+                      queues[i].queue_id, queues[i].depth);
+            return INDIGO_ERROR_PARAM;
+        }
+        for (j = 0; j < i; ++j) {
+            if (queues[j].queue_id == queues[i].queue_id) {
+                LOG_ERROR("Duplicate queue id %u", queues[i].queue_id);
+                return INDIGO_ERROR_PARAM;
+            }
+        }
+    }
+
+    return INDIGO_ERROR_NONE;
+}
+
+
+/** \brief Set up a port's queues from configuration
+
+With no queues configured, the port gets the single queue 0.
+*/
+
+indigo_error_t
+ind_port_sched_init(struct port_sched *sched,
+                    ind_port_queue_config_t *queues,
+                    unsigned n_queues)
+{
+    ind_port_queue_config_t dflt[1];
+    struct port_txq         *q, tmp;
+    unsigned                i, j;
+    indigo_error_t          result;
+
+    if (INDIGO_FAILURE(result = ind_port_sched_config_check(queues,
+                                                            n_queues))) {
+        return result;
+    }
+
+    if (n_queues == 0) {
+        INDIGO_MEM_SET(dflt, 0, sizeof(dflt));
+        queues = dflt;
+        n_queues = 1;
+    }
+
+    INDIGO_MEM_SET(sched, 0, sizeof(*sched));
+
+    for (i = 0; i < n_queues; ++i) {
+        q = &sched->queues[i];
+        q->queue_id = queues[i].queue_id;
+        q->priority = queues[i].priority;
+        q->weight   = queues[i].weight ? queues[i].weight : 1;
+        q->credit   = q->weight;
+        q->depth    = queues[i].depth ? queues[i].depth
+            : PORT_QUEUE_DEPTH_DEFAULT;
+        q->ring = INDIGO_MEM_ALLOC(q->depth * sizeof(q->ring[0]));
+        if (q->ring == NULL) {
+            LOG_ERROR("No memory for queue %u", q->queue_id);
+            sched->n_queues = i;
+            ind_port_sched_destroy(sched);
+            return INDIGO_ERROR_RESOURCE;
+        }
+    }
+    sched->n_queues = n_queues;
+
+    /* Insertion sort by descending priority; stable, so configuration
+       order decides round robin order within a level */
+    for (i = 1; i < n_queues; ++i) {
+        tmp = sched->queues[i];
+        for (j = i; j > 0 && sched->queues[j - 1].priority < tmp.priority;
+             --j) {
+            sched->queues[j] = sched->queues[j - 1];
+        }
+        sched->queues[j] = tmp;
+    }
+
+    return INDIGO_ERROR_NONE;
+}
+
+
+/** \brief Free a port's queues, dropping any held packets */
+
+void
+ind_port_sched_destroy(struct port_sched *sched)
+{
+    struct port_txq *q;
+    unsigned        i;
+
+    for (q = sched->queues, i = sched->n_queues; i; --i, ++q) {
+        for (; q->count; --q->count) {
+            ind_port_pkt_free(q->ring[q->head]);
+            q->head = (q->head + 1) % q->depth;
+        }
+        INDIGO_MEM_FREE(q->ring);
+        q->ring = NULL;
+    }
+    sched->n_queues = 0;
+    sched->pending = 0;
+}
+
+
+/** \brief Look up a queue by OpenFlow queue id */
+
+struct port_txq *
+ind_port_sched_queue_find(struct port_sched *sched, uint32_t queue_id)
+{
+    struct port_txq *q;
+    unsigned        i;
+
+    for (q = sched->queues, i = sched->n_queues; i; --i, ++q) {
+        if (q->queue_id == queue_id)  return (q);
+    }
+
+    return (NULL);
+}
+
+
+/** \brief Copy a packet onto the tail of a queue
+
+Returns INDIGO_ERROR_NOT_FOUND for an unknown queue, and
+INDIGO_ERROR_RESOURCE if the packet was tail dropped.
+*/
+
+indigo_error_t
+ind_port_sched_enqueue(struct port_sched *sched, uint32_t queue_id,
+                       uint8_t *data, unsigned len)
+{
+    struct port_txq     *q;
+    struct port_txq_pkt *pkt;
+
+    if ((q = ind_port_sched_queue_find(sched, queue_id)) == NULL) {
+        return INDIGO_ERROR_NOT_FOUND;
+    }
+
+    if (q->count == q->depth
+        || (pkt = ind_port_pkt_alloc(len)) == NULL) {
+        ++q->cnt_dropped;
+        return INDIGO_ERROR_RESOURCE;
+    }
+
+    PORTMANAGER_MEMCPY(pkt->data, data, len);
+    q->ring[(q->head + q->count) % q->depth] = pkt;
+    ++q->count;
+    ++sched->pending;
+
+    return INDIGO_ERROR_NONE;
+}
+
+
+/** \brief Pick the queue to serve next */
+
+static struct port_txq *
+sched_pick(struct port_sched *sched)
+{
+    struct port_txq *q;
+    unsigned        first, end, n, i, pass;
+
+    /* Highest priority level with packets is [first, end) */
+    for (first = 0; first < sched->n_queues; ++first) {
+        if (sched->queues[first].count)  break;
+    }
+    if (first == sched->n_queues)  return (NULL);
+    while (first > 0
+           && sched->queues[first - 1].priority
+               == sched->queues[first].priority) {
+        --first;
+    }
+    for (end = first + 1;
+         end < sched->n_queues
+             && sched->queues[end].priority == sched->queues[first].priority;
+         ++end);
+    n = end - first;
+
+    if (sched->rr_next < first || sched->rr_next >= end) {
+        sched->rr_next = first;
+    }
+
+    /* A queue keeps the turn until its credit is spent or it empties;
+       once every backlogged queue of the level is out of credit, the
+       round is over and credits are refilled */
+    for (pass = 0; pass < 2; ++pass) {
+        for (i = 0; i < n; ++i) {
+            q = &sched->queues[first + (sched->rr_next - first + i) % n];
+            if (q->count && q->credit) {
+                sched->rr_next = q - sched->queues;
+                return (q);
+            }
+        }
+        for (q = &sched->queues[first], i = n; i; --i, ++q) {
+            q->credit = q->weight;
+        }
+    }
+
+    return (NULL);
+}
+
+
+/** \brief Return the next packet to transmit, leaving it queued
+
+Sets *queue to the packet's queue, to be passed to
+ind_port_sched_pop() once the packet is sent.
+*/
+
+struct port_txq_pkt *
+ind_port_sched_peek(struct port_sched *sched, struct port_txq **queue)
+{
+    struct port_txq *q;
+
+    if (sched->pending == 0 || (q = sched_pick(sched)) == NULL) {
+        return (NULL);
+    }
+
+    *queue = q;
+    return (q->ring[q->head]);
+}
+
+
+/** \brief Remove the packet ind_port_sched_peek() returned
+
+The caller owns the returned packet and must ind_port_pkt_free() it.
+*/
+
+struct port_txq_pkt *
+ind_port_sched_pop(struct port_sched *sched, struct port_txq *q)
+{
+    struct port_txq_pkt *pkt;
+
+    pkt = q->ring[q->head];
+    q->head = (q->head + 1) % q->depth;
+    --q->count;
+    --q->credit;
+    --sched->pending;
+
+    return (pkt);
+}
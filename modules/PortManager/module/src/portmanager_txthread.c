@@ -0,0 +1,572 @@
+/****************************************************************
+ *
+ *        Copyright 2013, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ***************************************************************/
+
+/**
+ * @file
+ * @brief TX offload thread and the transmit packet pool
+ *
+ * With TX offload on, packets leaving a port's queues are pushed onto a
+ * per-port single producer, single consumer ring instead of being sent
+ * inline.  The producer is the main thread; the consumer is a dedicated
+ * thread that drains every ring with sendmmsg() and hands the buffers
+ * back to the pool.  The rings need no locks: each index is written by
+ * one side only and published with release/acquire ordering.
+ *
+ * The thread sleeps on an eventfd when all rings are empty.  It flags
+ * itself idle before a last look at the rings, and the producer checks
+ * the flag after publishing, so a wakeup cannot be lost.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* sendmmsg() */
+#endif
+
+#include "portmanager_log.h"
+#include "portmanager_int.h"
+
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <indigo/memory.h>
+#include <PortManager/portmanager.h>
+#include <PortManager/portmanager_porting.h>
+
+/* Short hand logging macros */
+#define LOG_ERROR AIM_LOG_ERROR
+#define LOG_TRACE AIM_LOG_TRACE
+
+#define TX_RING_SIZE      1024  /**< Slots per ring; a power of 2 */
+#define TX_THREAD_BATCH   32    /**< Packets per sendmmsg() */
+
+#define PKT_POOL_BUF_LEN  2048  /**< Data bytes of a pooled buffer */
+#define PKT_POOL_MAX      4096  /**< Pooled buffers; a power of 2 */
+
+/** \brief A port's ring of packets waiting for the TX thread */
+
+struct port_tx_ring {
+    struct port_tx_ring *next;          /**< On tx_ring_list */
+    of_port_no_t        of_port_num;
+    int                 fd;             /**< Raw socket of the port */
+    struct port_txq_pkt *slots[TX_RING_SIZE];
+
+    /* Written by the main thread */
+    unsigned head __attribute__((aligned(64)));
+    unsigned depth_max;
+    uint64_t cnt_overflow;
+
+    /* Written by the TX thread; read with relaxed atomics */
+    unsigned tail __attribute__((aligned(64)));
+    uint64_t cnt_tx_pkts;
+    uint64_t cnt_tx_bytes;
+    uint64_t cnt_tx_errors;
+    uint64_t cnt_tx_syscalls;
+    uint64_t cnt_timed;
+    uint64_t lat_sum_ns;
+    uint64_t lat_max_ns;
+    uint64_t lat_hist[PORT_TX_LAT_BUCKETS];
+};
+
+/* Single writer counter update, readable from the other thread */
+#define TX_STAT_ADD(_c, _n) \
+    __atomic_store_n(&(_c), (_c) + (_n), __ATOMIC_RELAXED)
+
+/* Rings served by the thread; only changed while it is stopped */
+static struct port_tx_ring *tx_ring_list;
+
+static pthread_t tx_thread;
+static int       tx_thread_running;     /**< Main thread only */
+static int       tx_thread_stop;        /**< Set to make the thread exit */
+static int       tx_thread_idle;        /**< TRUE <=> Thread may sleep */
+static int       tx_wake_fd = -1;       /**< eventfd the thread sleeps on */
+
+/* Packet pool; buffers are taken and freed by the main thread, and
+   come back from the TX thread through a return ring.  Neither can
+   overflow, as each holds up to every buffer ever allocated. */
+static struct port_txq_pkt *pkt_pool_free[PKT_POOL_MAX];
+static unsigned            pkt_pool_free_cnt;
+static unsigned            pkt_pool_total;
+static struct port_txq_pkt *pkt_pool_ret[PKT_POOL_MAX];
+static unsigned            pkt_pool_ret_head;   /**< Written by TX thread */
+static unsigned            pkt_pool_ret_tail;   /**< Written by main */
+
+
+static uint64_t
+tx_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/** \brief Move buffers the TX thread has finished with to the free list */
+
+static void
+pkt_pool_reclaim(void)
+{
+    unsigned head;
+
+    head = __atomic_load_n(&pkt_pool_ret_head, __ATOMIC_ACQUIRE);
+    while (pkt_pool_ret_tail != head) {
+        pkt_pool_free[pkt_pool_free_cnt++] =
+            pkt_pool_ret[pkt_pool_ret_tail++ & (PKT_POOL_MAX - 1)];
+    }
+    __atomic_store_n(&pkt_pool_ret_tail, pkt_pool_ret_tail, __ATOMIC_RELEASE);
+}
+
+
+/** \brief Allocate a transmit packet of len bytes
+
+Packets that fit a pool buffer come from the pool while it lasts.  The
+enqueue time is recorded while the TX thread runs.
+*/
+
+struct port_txq_pkt *
+ind_port_pkt_alloc(unsigned len)
+{
+    struct port_txq_pkt *pkt = NULL;
+
+    if (len <= PKT_POOL_BUF_LEN) {
+        if (pkt_pool_free_cnt == 0) {
+            pkt_pool_reclaim();
+        }
+        if (pkt_pool_free_cnt) {
+            pkt = pkt_pool_free[--pkt_pool_free_cnt];
+        } else if (pkt_pool_total < PKT_POOL_MAX
+                   && (pkt = INDIGO_MEM_ALLOC(sizeof(*pkt)
+                                              + PKT_POOL_BUF_LEN)) != NULL) {
+            ++pkt_pool_total;
+        }
+    }
+
+    if (pkt != NULL) {
+        pkt->pooled = 1;
+    } else if ((pkt = INDIGO_MEM_ALLOC(sizeof(*pkt) + len)) != NULL) {
+        pkt->pooled = 0;
+    } else {
+        return (NULL);
+    }
+
+    pkt->len = len;
+    pkt->delayed = 0;
+    pkt->enq_ns = tx_thread_running ? tx_time_ns() : 0;
+
+    return (pkt);
+}
+
+
+/** \brief Free a transmit packet; main thread only */
+
+void
+ind_port_pkt_free(struct port_txq_pkt *pkt)
+{
+    if (pkt->pooled) {
+        pkt_pool_free[pkt_pool_free_cnt++] = pkt;
+    } else {
+        INDIGO_MEM_FREE(pkt);
+    }
+}
+
+
+/** \brief Free a transmit packet; TX thread only */
+
+static void
+tx_pkt_release(struct port_txq_pkt *pkt)
+{
+    if (pkt->pooled) {
+        pkt_pool_ret[pkt_pool_ret_head & (PKT_POOL_MAX - 1)] = pkt;
+        __atomic_store_n(&pkt_pool_ret_head, pkt_pool_ret_head + 1,
+                         __ATOMIC_RELEASE);
+    } else {
+        INDIGO_MEM_FREE(pkt);
+    }
+}
+
+
+/** \brief Free the pool's buffers
+
+All buffers must be back, with the TX thread stopped.
+*/
+
+static void
+pkt_pool_finish(void)
+{
+    pkt_pool_reclaim();
+    if (pkt_pool_free_cnt != pkt_pool_total) {
+        LOG_ERROR("%u pooled packets not returned",
+                  pkt_pool_total - pkt_pool_free_cnt);
+    }
+    while (pkt_pool_free_cnt) {
+        INDIGO_MEM_FREE(pkt_pool_free[--pkt_pool_free_cnt]);
+    }
+    pkt_pool_total = 0;
+}
+
+
+/***************************************************************************/
+
+/** \brief Send up to TX_THREAD_BATCH packets off a ring
+
+Returns the number of packets taken off the ring.
+*/
+
+static unsigned
+tx_ring_drain(struct port_tx_ring *r)
+{
+    struct mmsghdr      msgs[TX_THREAD_BATCH];
+    struct iovec        iovs[TX_THREAD_BATCH];
+    struct port_txq_pkt *pkts[TX_THREAD_BATCH];
+    unsigned            tail, n, i, b, sent;
+    uint64_t            now, lat, bytes = 0, lat_sum = 0;
+    int                 rv;
+
+    tail = r->tail;
+    n = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+    if (n == 0) {
+        return (0);
+    }
+    if (n > TX_THREAD_BATCH) {
+        n = TX_THREAD_BATCH;
+    }
+
+    INDIGO_MEM_SET(msgs, 0, n * sizeof(msgs[0]));
+    for (i = 0; i < n; ++i) {
+        pkts[i] = r->slots[(tail + i) & (TX_RING_SIZE - 1)];
+        iovs[i].iov_base = pkts[i]->data;
+        iovs[i].iov_len = pkts[i]->len;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* The slots are copied, so the producer may reuse them */
+    __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+
+    for (sent = 0; sent < n; sent += rv) {
+        TX_STAT_ADD(r->cnt_tx_syscalls, 1);
+        if ((rv = sendmmsg(r->fd, msgs + sent, n - sent, 0)) <= 0) {
+            if (rv < 0 && errno == EINTR) {
+                rv = 0;
+                continue;
+            }
+            LOG_ERROR("sendmmsg() failed on port %u: %s",
+                      r->of_port_num, strerror(errno));
+            break;
+        }
+    }
+
+    now = tx_time_ns();
+    for (i = 0; i < n; ++i) {
+        if (i < sent && pkts[i]->enq_ns) {
+            lat = now - pkts[i]->enq_ns;
+            lat_sum += lat;
+            if (lat > r->lat_max_ns) {
+                __atomic_store_n(&r->lat_max_ns, lat, __ATOMIC_RELAXED);
+            }
+            for (b = 0;
+                 b < PORT_TX_LAT_BUCKETS - 1 && (1000ULL << b) <= lat;
+                 ++b);
+            TX_STAT_ADD(r->lat_hist[b], 1);
+            TX_STAT_ADD(r->cnt_timed, 1);
+        }
+        if (i < sent) {
+            bytes += pkts[i]->len;
+        }
+        tx_pkt_release(pkts[i]);
+    }
+
+    TX_STAT_ADD(r->cnt_tx_pkts, sent);
+    TX_STAT_ADD(r->cnt_tx_bytes, bytes);
+    TX_STAT_ADD(r->cnt_tx_errors, n - sent);
+    TX_STAT_ADD(r->lat_sum_ns, lat_sum);
+
+    return (n);
+}
+
+
+/** \brief TX thread; serves the rings until told to stop */
+
+static void *
+tx_thread_main(void *arg)
+{
+    struct port_tx_ring *r;
+    unsigned            work;
+    uint64_t            val;
+
+    (void)arg;
+
+    for (;;) {
+        work = 0;
+        for (r = tx_ring_list; r != NULL; r = r->next) {
+            work += tx_ring_drain(r);
+        }
+        if (work) {
+            continue;
+        }
+
+        /* Rings are empty; stopping drains them first */
+        if (__atomic_load_n(&tx_thread_stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        __atomic_store_n(&tx_thread_idle, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        for (r = tx_ring_list; r != NULL; r = r->next) {
+            if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail) {
+                break;
+            }
+        }
+        if (r == NULL && !__atomic_load_n(&tx_thread_stop, __ATOMIC_ACQUIRE)) {
+            if (read(tx_wake_fd, &val, sizeof(val)) < 0 && errno != EINTR) {
+                LOG_ERROR("TX thread wakeup failed: %s", strerror(errno));
+            }
+        }
+        __atomic_store_n(&tx_thread_idle, 0, __ATOMIC_RELAXED);
+    }
+
+    return (NULL);
+}
+
+
+/** \brief Wake the TX thread if it sleeps; call after pushing packets */
+
+void
+ind_port_txthread_kick(void)
+{
+    uint64_t one = 1;
+
+    if (!tx_thread_running) {
+        return;
+    }
+
+    /* Orders the ring head stores before the idle load */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&tx_thread_idle, __ATOMIC_RELAXED)
+        && __atomic_exchange_n(&tx_thread_idle, 0, __ATOMIC_SEQ_CST)) {
+        if (write(tx_wake_fd, &one, sizeof(one)) < 0) {
+            LOG_ERROR("TX thread wakeup failed: %s", strerror(errno));
+        }
+    }
+}
+
+
+/** \brief Start the TX thread */
+
+indigo_error_t
+ind_port_txthread_start(void)
+{
+    sigset_t all, saved;
+    int      rv;
+
+    if (tx_thread_running) {
+        return (INDIGO_ERROR_NONE);
+    }
+
+    if (tx_wake_fd < 0 && (tx_wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        LOG_ERROR("eventfd() failed: %s", strerror(errno));
+        return (INDIGO_ERROR_UNKNOWN);
+    }
+
+    tx_thread_stop = 0;
+    tx_thread_idle = 0;
+
+    /* Signals stay with the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    rv = pthread_create(&tx_thread, NULL, tx_thread_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (rv != 0) {
+        LOG_ERROR("pthread_create() failed: %s", strerror(rv));
+        return (INDIGO_ERROR_RESOURCE);
+    }
+
+    tx_thread_running = 1;
+    LOG_TRACE("TX thread started");
+
+    return (INDIGO_ERROR_NONE);
+}
+
+
+/** \brief Stop the TX thread once it has emptied the rings
+
+Returns TRUE if the thread was running.
+*/
+
+int
+ind_port_txthread_stop(void)
+{
+    uint64_t one = 1;
+
+    if (!tx_thread_running) {
+        return (0);
+    }
+
+    __atomic_store_n(&tx_thread_stop, 1, __ATOMIC_RELEASE);
+    if (write(tx_wake_fd, &one, sizeof(one)) < 0) {
+        LOG_ERROR("TX thread wakeup failed: %s", strerror(errno));
+    }
+    pthread_join(tx_thread, NULL);
+    tx_thread_running = 0;
+    LOG_TRACE("TX thread stopped");
+
+    return (1);
+}
+
+
+/** \brief Stop the TX thread and release the packet pool
+
+Rings must have been destroyed and transmit queues freed.
+*/
+
+void
+ind_port_txthread_finish(void)
+{
+    (void)ind_port_txthread_stop();
+    if (tx_wake_fd >= 0) {
+        close(tx_wake_fd);
+        tx_wake_fd = -1;
+    }
+    pkt_pool_finish();
+}
+
+
+/***************************************************************************/
+
+/** \brief Create the ring of a port sending on fd
+
+The TX thread, if running, is paused while the ring is added.
+*/
+
+struct port_tx_ring *
+ind_port_tx_ring_create(of_port_no_t of_port_num, int fd)
+{
+    struct port_tx_ring *r;
+    int                 running;
+
+    if ((r = INDIGO_MEM_ALLOC(sizeof(*r))) == NULL) {
+        return (NULL);
+    }
+    INDIGO_MEM_SET(r, 0, sizeof(*r));
+    r->of_port_num = of_port_num;
+    r->fd = fd;
+
+    running = ind_port_txthread_stop();
+    r->next = tx_ring_list;
+    tx_ring_list = r;
+    if (running) {
+        (void)ind_port_txthread_start();
+    }
+
+    return (r);
+}
+
+
+/** \brief Destroy a ring, returning its final counters in stats
+
+Packets still on the ring are sent first if the TX thread is running,
+and dropped otherwise.
+*/
+
+void
+ind_port_tx_ring_destroy(struct port_tx_ring *ring,
+                         struct port_tx_ring_stats *stats)
+{
+    struct port_tx_ring **rp;
+    int                 running;
+
+    running = ind_port_txthread_stop();
+    for (rp = &tx_ring_list; *rp != NULL; rp = &(*rp)->next) {
+        if (*rp == ring) {
+            *rp = ring->next;
+            break;
+        }
+    }
+    if (running) {
+        (void)ind_port_txthread_start();
+    }
+
+    for (; ring->tail != ring->head; ++ring->tail) {
+        ind_port_pkt_free(ring->slots[ring->tail & (TX_RING_SIZE - 1)]);
+        ++ring->cnt_tx_errors;
+    }
+    pkt_pool_reclaim();
+
+    ind_port_tx_ring_stats_get(ring, stats);
+    INDIGO_MEM_FREE(ring);
+}
+
+
+/** \brief Hand a packet to the TX thread
+
+Returns FALSE, leaving the packet with the caller, if the ring is full.
+*/
+
+int
+ind_port_tx_ring_push(struct port_tx_ring *ring, struct port_txq_pkt *pkt)
+{
+    unsigned head = ring->head;
+    unsigned depth;
+
+    depth = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (depth == TX_RING_SIZE) {
+        ++ring->cnt_overflow;
+        return (0);
+    }
+
+    ring->slots[head & (TX_RING_SIZE - 1)] = pkt;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    if (depth + 1 > ring->depth_max) {
+        ring->depth_max = depth + 1;
+    }
+
+    return (1);
+}
+
+
+/** \brief Read a ring's counters; main thread only */
+
+void
+ind_port_tx_ring_stats_get(struct port_tx_ring *ring,
+                           struct port_tx_ring_stats *stats)
+{
+    unsigned i;
+
+    stats->depth = ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    stats->depth_max = ring->depth_max;
+    stats->cnt_overflow = ring->cnt_overflow;
+    stats->cnt_tx_pkts = __atomic_load_n(&ring->cnt_tx_pkts, __ATOMIC_RELAXED);
+    stats->cnt_tx_bytes =
+        __atomic_load_n(&ring->cnt_tx_bytes, __ATOMIC_RELAXED);
+    stats->cnt_tx_errors =
+        __atomic_load_n(&ring->cnt_tx_errors, __ATOMIC_RELAXED);
+    stats->cnt_tx_syscalls =
+        __atomic_load_n(&ring->cnt_tx_syscalls, __ATOMIC_RELAXED);
+    stats->cnt_timed = __atomic_load_n(&ring->cnt_timed, __ATOMIC_RELAXED);
+    stats->lat_sum_ns = __atomic_load_n(&ring->lat_sum_ns, __ATOMIC_RELAXED);
+    stats->lat_max_ns = __atomic_load_n(&ring->lat_max_ns, __ATOMIC_RELAXED);
+    for (i = 0; i < PORT_TX_LAT_BUCKETS; ++i) {
+        stats->lat_hist[i] =
+            __atomic_load_n(&ring->lat_hist[i], __ATOMIC_RELAXED);
+    }
+}
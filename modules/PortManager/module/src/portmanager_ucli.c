@@ -19,6 +19,7 @@
 
 #include <indigo/types.h>
 #include <PortManager/portmanager_config.h>
+#include "portmanager_int.h"
 
 
 #if PORTMANAGER_CONFIG_INCLUDE_UCLI == 1
@@ -40,6 +41,17 @@ portmanager_ucli_ucli__config__(ucli_context_t* uc)
     return UCLI_STATUS_OK; 
 }
 
+static ucli_status_t
+portmanager_ucli_ucli__stats__(ucli_context_t* uc)
+{
+    UCLI_COMMAND_INFO(uc,
+                      "stats", 0,
+                      "$summary#Show port transmit queue and shaper stats.");
+    ind_port_stats_show(&uc->pvs);
+
+    return UCLI_STATUS_OK;
+}
+
 static ucli_status_t
 portmanager_ucli_ucli__foo__(ucli_context_t* uc)
 {
@@ -62,6 +74,7 @@ portmanager_ucli_ucli__foo__(ucli_context_t* uc)
 static ucli_command_handler_f portmanager_ucli_ucli_handlers__[] = 
 {
     portmanager_ucli_ucli__config__,
+    portmanager_ucli_ucli__stats__,
     portmanager_ucli_ucli__foo__,
     NULL
 };
@@ -74,6 +74,21 @@ ind_soc_socket_unregister(int socket_id)
     return INDIGO_ERROR_NONE;
 }
 
+indigo_error_t
+ind_soc_timer_event_register(ind_soc_timer_callback_f callback,
+                             void *cookie,
+                             int repeat_time_ms)
+{
+    return INDIGO_ERROR_NONE;
+}
+
+indigo_error_t
+ind_soc_timer_event_unregister(ind_soc_timer_callback_f callback,
+                               void *cookie)
+{
+    return INDIGO_ERROR_NONE;
+}
+
 void
 indigo_core_flow_create_callback(indigo_error_t result,
                                  indigo_cookie_t flow_id,
@@ -178,6 +193,10 @@ indigo_core_port_modify_callback(indigo_error_t result,
 }
 
 struct callback_info indigo_core_port_stats_callback_info[1];
+uint64_t port_stats_tx_packets;
+uint64_t port_stats_tx_bytes;
+uint64_t port_stats_tx_dropped;
+uint64_t port_stats_rx_dropped;
 
 
 void
@@ -197,14 +216,13 @@ indigo_core_port_stats_get_callback(indigo_error_t result,
     n = 0;
     OF_LIST_PORT_STATS_ENTRY_ITER(&list, &entry, rv) {
         of_port_no_t of_port_num;
-        uint64_t     stat;
 
         of_port_stats_entry_port_no_get(&entry, &of_port_num);
         TEST_ASSERT(of_port_num == TEST_OF_PORT_NUM);
-        of_port_stats_entry_tx_packets_get(&entry, &stat);
-        TEST_ASSERT(stat == 1);
-        of_port_stats_entry_tx_bytes_get(&entry, &stat);
-        TEST_ASSERT(stat == TEST_PKT_LEN);
+        of_port_stats_entry_tx_packets_get(&entry, &port_stats_tx_packets);
+        of_port_stats_entry_tx_bytes_get(&entry, &port_stats_tx_bytes);
+        of_port_stats_entry_tx_dropped_get(&entry, &port_stats_tx_dropped);
+        of_port_stats_entry_rx_dropped_get(&entry, &port_stats_rx_dropped);
 
         ++n;
     }
@@ -214,6 +232,7 @@ indigo_core_port_stats_get_callback(indigo_error_t result,
 }
 
 struct callback_info indigo_core_queue_config_callback_info[1];
+unsigned queue_config_n_queues;
 
 
 void
@@ -221,12 +240,31 @@ indigo_core_queue_config_get_callback(indigo_error_t result,
                                       of_queue_get_config_reply_t *reply,
                                       indigo_cookie_t callback_cookie)
 {
+    of_list_packet_queue_t list;
+    of_packet_queue_t      queue;
+    int                    rv;
+
     callback_record(indigo_core_queue_config_callback_info, result,
                     callback_cookie);
+
+    queue_config_n_queues = 0;
+    if (result == INDIGO_ERROR_NONE) {
+        of_queue_get_config_reply_queues_bind(reply, &list);
+        OF_LIST_PACKET_QUEUE_ITER(&list, &queue, rv) {
+            ++queue_config_n_queues;
+        }
+        TEST_ASSERT(rv == OF_ERROR_RANGE);
+    }
+    of_queue_get_config_reply_delete(reply);
 }
 
 struct callback_info indigo_core_queue_stats_callback_info[1];
 
+/* What each queue stats entry should report */
+uint32_t queue_stats_exp_queue_id;
+uint64_t queue_stats_exp_packets;
+unsigned queue_stats_exp_entries;
+
 
 void
 indigo_core_queue_stats_get_callback(indigo_error_t result,
@@ -251,19 +289,93 @@ indigo_core_queue_stats_get_callback(indigo_error_t result,
         of_queue_stats_entry_port_no_get(&entry, &of_port_num);
         TEST_ASSERT(of_port_num == TEST_OF_PORT_NUM);
         of_queue_stats_entry_queue_id_get(&entry, &queue_id);
-        TEST_ASSERT(queue_id == 0);
+        TEST_ASSERT(queue_id == queue_stats_exp_queue_id);
         of_queue_stats_entry_tx_packets_get(&entry, &stat);
-        TEST_ASSERT(stat == 1);
+        TEST_ASSERT(stat == queue_stats_exp_packets);
         of_queue_stats_entry_tx_bytes_get(&entry, &stat);
-        TEST_ASSERT(stat == TEST_PKT_LEN);
+        TEST_ASSERT(stat == queue_stats_exp_packets * TEST_PKT_LEN);
 
         ++n;
     }
     TEST_ASSERT(rv == OF_ERROR_RANGE);
-    TEST_ASSERT(n == 1);
+    TEST_ASSERT(n == queue_stats_exp_entries);
     of_queue_stats_reply_delete(reply);
 }
 
+/* Request stats for all ports; the one port's counters are recorded */
+
+void
+port_stats_fetch(void)
+{
+    of_port_stats_request_t *request;
+    indigo_cookie_t         callback_cookie = (indigo_cookie_t) random();
+
+    request = of_port_stats_request_new(ind_port_config->of_version);
+    TEST_ASSERT(request != NULL);
+    of_port_stats_request_port_no_set(request, OF_PORT_DEST_ALL);
+
+    callback_arm(indigo_core_port_stats_callback_info);
+
+    indigo_port_stats_get(request, callback_cookie);
+
+    callback_chk(indigo_core_port_stats_callback_info, INDIGO_ERROR_NONE,
+                 callback_cookie);
+
+    of_port_stats_request_delete(request);
+}
+
+/* Request stats for a port's queue(s) and check the entries returned */
+
+void
+queue_stats_chk(of_port_no_t of_port_num, uint32_t queue_id,
+                uint32_t exp_queue_id, uint64_t exp_packets,
+                unsigned exp_entries, indigo_error_t exp_result)
+{
+    of_queue_stats_request_t *request;
+    indigo_cookie_t          callback_cookie = (indigo_cookie_t) random();
+
+    request = of_queue_stats_request_new(ind_port_config->of_version);
+    TEST_ASSERT(request != NULL);
+    of_queue_stats_request_port_no_set(request, of_port_num);
+    of_queue_stats_request_queue_id_set(request, queue_id);
+
+    queue_stats_exp_queue_id = exp_queue_id;
+    queue_stats_exp_packets = exp_packets;
+    queue_stats_exp_entries = exp_entries;
+    callback_arm(indigo_core_queue_stats_callback_info);
+
+    indigo_port_queue_stats_get(request, callback_cookie);
+
+    callback_chk(indigo_core_queue_stats_callback_info, exp_result,
+                 callback_cookie);
+
+    of_queue_stats_request_delete(request);
+}
+
+/* Request a port's queue configuration; returns the number of queues */
+
+unsigned
+queue_config_chk(of_port_no_t of_port_num)
+{
+    of_queue_get_config_request_t *request;
+    indigo_cookie_t               callback_cookie = (indigo_cookie_t) random();
+
+    request = of_queue_get_config_request_new(ind_port_config->of_version);
+    TEST_ASSERT(request != NULL);
+    of_queue_get_config_request_port_set(request, of_port_num);
+
+    callback_arm(indigo_core_queue_config_callback_info);
+
+    indigo_port_queue_config_get(request, callback_cookie);
+
+    callback_chk(indigo_core_queue_config_callback_info, INDIGO_ERROR_NONE,
+                 callback_cookie);
+
+    of_queue_get_config_request_delete(request);
+
+    return queue_config_n_queues;
+}
+
 /* Fake notifications to Forwarding */
 
 void
@@ -429,43 +541,197 @@ main(int argc, char* argv[])
     }
 
     /* Get port's statistics */
+    port_stats_fetch();
+    TEST_ASSERT(port_stats_tx_packets == 1);
+    TEST_ASSERT(port_stats_tx_bytes == TEST_PKT_LEN);
+    TEST_ASSERT(port_stats_tx_dropped == 0);
+
+    /* Get queue statistics */
+    queue_stats_chk(OF_PORT_DEST_ALL, OF_QUEUE_ALL, 0, 1, 1, INDIGO_ERROR_NONE);
+
+    /* Transmit queues */
     {
-        of_port_stats_request_t      *request = 0;
-        indigo_cookie_t              callback_cookie = (indigo_cookie_t) random();
+        ind_port_queue_config_t queues[2];
+        uint8_t                 buf[TEST_PKT_LEN];
+
+        memset(buf, 0, sizeof(buf));
+
+        /* Default is the single queue 0 */
+        TEST_ASSERT(queue_config_chk(TEST_OF_PORT_NUM) == 1);
+        TEST_ASSERT(indigo_port_packet_emit(TEST_OF_PORT_NUM, 1, buf,
+                                            sizeof(buf))
+                    == INDIGO_ERROR_PARAM);
+
+        memset(queues, 0, sizeof(queues));
+        queues[0].queue_id = 1;
+        queues[0].priority = 1;
+        queues[1].queue_id = 2;
+
+        /* Queue 0 is required */
+        TEST_ASSERT(ind_port_queue_config_set(TEST_OF_PORT_NUM, queues, 2)
+                    == INDIGO_ERROR_PARAM);
+        queues[1].queue_id = 0;
+        queues[1].weight = 4;
+        OK(ind_port_queue_config_set(TEST_OF_PORT_NUM, queues, 2));
+        TEST_ASSERT(queue_config_chk(TEST_OF_PORT_NUM) == 2);
+
+        OK(indigo_port_packet_emit(TEST_OF_PORT_NUM, 1, buf, sizeof(buf)));
+        OK(indigo_port_packet_emit(TEST_OF_PORT_NUM, 1, buf, sizeof(buf)));
+        OK(indigo_port_packet_emit(TEST_OF_PORT_NUM, 0, buf, sizeof(buf)));
+
+        queue_stats_chk(TEST_OF_PORT_NUM, 1, 1, 2, 1, INDIGO_ERROR_NONE);
+        queue_stats_chk(TEST_OF_PORT_NUM, 0, 0, 1, 1, INDIGO_ERROR_NONE);
+        queue_stats_chk(TEST_OF_PORT_NUM, 5, 0, 0, 0, INDIGO_ERROR_PARAM);
+
+        /* Back to the default queue; counters start over */
+        OK(ind_port_queue_config_set(TEST_OF_PORT_NUM, NULL, 0));
+        TEST_ASSERT(queue_config_chk(TEST_OF_PORT_NUM) == 1);
+    }
 
-        request = of_port_stats_request_new(ind_port_config->of_version);
-        TEST_ASSERT(request != NULL);
-        of_port_stats_request_port_no_set(request, OF_PORT_DEST_ALL);
+    /* Egress shaper */
+    {
+        uint8_t  buf[TEST_PKT_LEN];
+        unsigned i, burst_pkts;
 
-        callback_arm(indigo_core_port_stats_callback_info);
+        memset(buf, 0, sizeof(buf));
 
-        indigo_port_stats_get(request, callback_cookie);
+        /* At 1 kb/s nothing refills during the test; the 16KB minimum
+           bucket passes the first packets, the queue takes 64 more and
+           the rest are dropped */
+        OK(ind_port_shaper_set(TEST_OF_PORT_NUM, 1, 0));
+        for (i = 0; i < 300; ++i) {
+            OK(indigo_port_packet_emit(TEST_OF_PORT_NUM, 0, buf, sizeof(buf)));
+        }
+        burst_pkts = 16384 / TEST_PKT_LEN;
 
-        callback_chk(indigo_core_port_stats_callback_info, INDIGO_ERROR_NONE,
-                     callback_cookie);
+        port_stats_fetch();
+        TEST_ASSERT(port_stats_tx_packets == 4 + burst_pkts);
+        TEST_ASSERT(port_stats_tx_dropped == 300 - burst_pkts - 64);
 
-        of_port_stats_request_delete(request);
+        /* Turning the shaper off releases the backlog */
+        OK(ind_port_shaper_set(TEST_OF_PORT_NUM, 0, 0));
+        port_stats_fetch();
+        TEST_ASSERT(port_stats_tx_packets == 4 + burst_pkts + 64);
     }
 
-    /* Get queue statistics */
+    /* Flood and ALL fan-out */
     {
-        of_queue_stats_request_t      *request = 0;
-        indigo_cookie_t               callback_cookie = (indigo_cookie_t) random();
+        uint8_t  buf[TEST_PKT_LEN];
+        uint64_t before;
 
-        request = of_queue_stats_request_new(ind_port_config->of_version);
-        TEST_ASSERT(request != NULL);
-        of_queue_stats_request_port_no_set(request, OF_PORT_DEST_ALL);
+        memset(buf, 0, sizeof(buf));
+        port_stats_fetch();
+        before = port_stats_tx_packets;
 
-        of_queue_stats_request_queue_id_set(request, OF_QUEUE_ALL);
+        OK(indigo_port_packet_emit_all(TEST_OF_PORT_NUM + 1, buf, sizeof(buf)));
+        OK(indigo_port_packet_emit_group(OF_PORT_DEST_FLOOD,
+                                         TEST_OF_PORT_NUM + 1,
+                                         buf, sizeof(buf)));
+        /* The ingress port is skipped */
+        OK(indigo_port_packet_emit_all(TEST_OF_PORT_NUM, buf, sizeof(buf)));
 
-        callback_arm(indigo_core_queue_stats_callback_info);
+        port_stats_fetch();
+        TEST_ASSERT(port_stats_tx_packets == before + 2);
+    }
 
-        indigo_port_queue_stats_get(request, callback_cookie);
+    /* Resizing the port table keeps ports in use, their counters,
+       names and MACs */
+    {
+        uint8_t            buf[TEST_PKT_LEN];
+        uint64_t           before;
+        of_mac_addr_t      mac_exp = {{0, 1, 2, 3, 4, 5}};
+        of_mac_addr_t      mac_in;
+        indigo_port_info_t *list;
+
+        memset(buf, 0, sizeof(buf));
+        TEST_ASSERT(ind_port_max_ports_set(0) == INDIGO_ERROR_PARAM);
+        TEST_ASSERT(ind_port_rx_sched_set(300, 0, 0) == INDIGO_ERROR_PARAM);
+        port_stats_fetch();
+        before = port_stats_tx_packets;
+
+        OK(ind_port_max_ports_set(300));
+        OK(ind_port_rx_sched_set(300, 0, 0));
+        OK(indigo_port_packet_emit(TEST_OF_PORT_NUM, 0, buf, sizeof(buf)));
+        port_stats_fetch();
+        TEST_ASSERT(port_stats_tx_packets == before + 1);
+
+        OK(ind_port_max_ports_set(ind_port_config->max_ports));
+        TEST_ASSERT(ind_port_rx_sched_set(300, 0, 0) == INDIGO_ERROR_PARAM);
+        OK(indigo_port_packet_emit(TEST_OF_PORT_NUM, 0, buf, sizeof(buf)));
+        port_stats_fetch();
+        TEST_ASSERT(port_stats_tx_packets == before + 2);
+
+        OK(ind_port_mac_addr_get(TEST_OF_PORT_NUM, &mac_in));
+        TEST_ASSERT(memcmp(&mac_exp, &mac_in, sizeof(mac_in)) == 0);
+        OK(indigo_port_interface_list(&list));
+        TEST_ASSERT(list != NULL && list->of_port == TEST_OF_PORT_NUM
+                    && strcmp(list->port_name, TEST_IFACE) == 0);
+        indigo_port_interface_list_destroy(list);
+    }
 
-        callback_chk(indigo_core_queue_stats_callback_info, INDIGO_ERROR_NONE,
-                     callback_cookie);
+    /* Storm control of unknown unicast, at 1 pps */
+    {
+        uint8_t buf[TEST_PKT_LEN];
+        int     i;
+
+        memset(buf, 0, sizeof(buf));
+        OK(ind_port_storm_control_set(TEST_OF_PORT_NUM, 0, 0, 1));
+        for (i = 0; i < 3; ++i) {
+            OK(indigo_port_packet_emit_group(OF_PORT_DEST_FLOOD,
+                                             TEST_OF_PORT_NUM,
+                                             buf, sizeof(buf)));
+        }
+        port_stats_fetch();
+        TEST_ASSERT(port_stats_rx_dropped == 2);
+
+        /* Broadcast is a different class */
+        memset(buf, 0xff, 6);
+        OK(indigo_port_packet_emit_group(OF_PORT_DEST_FLOOD, TEST_OF_PORT_NUM,
+                                         buf, sizeof(buf)));
+        port_stats_fetch();
+        TEST_ASSERT(port_stats_rx_dropped == 2);
+
+        OK(ind_port_storm_control_set(TEST_OF_PORT_NUM, 0, 0, 0));
+    }
+
+    /* RX filter; the udp VPI is not a packet socket, so it is only kept */
+    {
+        ind_port_bpf_insn_t accept_all[] = { { 0x06, 0, 0, 0xffff } };
 
-        of_queue_stats_request_delete(request);
+        TEST_ASSERT(ind_port_rx_filter_set(0, 1, NULL, 0)
+                    == INDIGO_ERROR_PARAM);
+        OK(ind_port_rx_filter_set(TEST_OF_PORT_NUM, 1, accept_all, 1));
+        OK(ind_port_rx_filter_set(TEST_OF_PORT_NUM, 1, NULL, 0));
+    }
+
+    /* Fanout is kept for the next add of the interface */
+    {
+        TEST_ASSERT(ind_port_fanout_set(TEST_OF_PORT_NUM,
+                                        IND_PORT_FANOUT_HASH,
+                                        IND_PORT_FANOUT_MAX + 1)
+                    == INDIGO_ERROR_PARAM);
+        OK(ind_port_fanout_set(TEST_OF_PORT_NUM, IND_PORT_FANOUT_HASH, 4));
+        OK(ind_port_fanout_set(TEST_OF_PORT_NUM, IND_PORT_FANOUT_NONE, 0));
+    }
+
+    /* Receive scheduling */
+    {
+        TEST_ASSERT(ind_port_rx_sched_set(TEST_OF_PORT_NUM, 0,
+                                          IND_PORT_RX_PRIORITIES)
+                    == INDIGO_ERROR_PARAM);
+        TEST_ASSERT(ind_port_rx_sched_set(TEST_OF_PORT_NUM,
+                                          IND_PORT_RX_QUANTUM_MAX + 1, 0)
+                    == INDIGO_ERROR_PARAM);
+        OK(ind_port_rx_sched_set(TEST_OF_PORT_NUM, 8,
+                                 IND_PORT_RX_PRIORITIES - 1));
+        OK(ind_port_rx_sched_set(TEST_OF_PORT_NUM, 0, 0));
+    }
+
+    /* TX offload; the UDP test port keeps sending inline */
+    {
+        OK(ind_port_tx_offload_set(1));
+        OK(ind_port_tx_offload_set(1));
+        OK(ind_port_tx_offload_set(0));
     }
 
     /* Modify port's configuration */
@@ -0,0 +1,63 @@
+/****************************************************************
+ *
+ *        Copyright 2013, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ***************************************************************/
+
+/**
+ * @file
+ * @brief Benchmarks for the Linux reference switch
+ */
+
+#ifndef _LRI_BENCH_H_
+#define _LRI_BENCH_H_
+
+#include <stdint.h>
+
+/** \brief Latency samples, in microseconds */
+
+typedef struct bench_samples_s {
+    uint32_t *us;
+    unsigned count;
+    unsigned max;
+} bench_samples_t;
+
+extern uint64_t bench_time_ns(void);
+extern int bench_misses_open(void);
+extern void bench_misses_start(int fd);
+extern uint64_t bench_misses_stop(int fd);
+extern void bench_samples_init(bench_samples_t *s, unsigned max);
+extern void bench_samples_add(bench_samples_t *s, uint64_t ns);
+extern void bench_samples_print(const char *name, bench_samples_t *s,
+                                unsigned lost);
+extern void bench_samples_free(bench_samples_t *s);
+
+/** Controller connection under a port flood; see bench_cxn.c */
+extern int bench_cxn(int argc, char *argv[]);
+
+/** Flow mod throughput, single versus batched; see bench_flowmod.c */
+extern int bench_flowmod(int argc, char *argv[]);
+
+/** Warm restart flow table save and reload; see bench_flowmod.c */
+extern int bench_snapshot(int argc, char *argv[]);
+
+/** Flow lookup cost and cache misses; see bench_flowmod.c */
+extern int bench_lookup(int argc, char *argv[]);
+
+/** Port transmit over many ports, with cache misses; see bench_ports.c */
+extern int bench_ports(int argc, char *argv[]);
+
+#endif /* _LRI_BENCH_H_ */
@@ -0,0 +1,453 @@
+/****************************************************************
+ *
+ *        Copyright 2013, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ***************************************************************/
+
+/**
+ * @file
+ * @brief Controller connection latency under a datapath flood
+ *
+ * Acts as the OpenFlow 1.0 controller lri connects to.  Every probe
+ * interval it sends an echo request, and a flow mod followed by a
+ * barrier; the echo reply gives the echo RTT and the barrier reply the
+ * flow mod latency.  The run is done twice, first with the datapath
+ * idle, then while a thread floods broadcast frames into one of the
+ * switch's ports (the peer end of a veth pair, say).
+ *
+ * Messages are built by hand so this benchmark needs nothing but AIM.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+#include "bench.h"
+
+#define OFP_VERSION            1
+#define OFPT_HELLO             0
+#define OFPT_ECHO_REQUEST      2
+#define OFPT_ECHO_REPLY        3
+#define OFPT_FEATURES_REQUEST  5
+#define OFPT_PACKET_IN         10
+#define OFPT_FLOW_MOD          14
+#define OFPT_BARRIER_REQUEST   18
+#define OFPT_BARRIER_REPLY     19
+
+#define OFP_HEADER_LEN         8
+#define OFP_FLOW_MOD_LEN       72       /**< Without actions */
+#define OFPFW_ALL              ((1 << 22) - 1)
+#define OFPFW_DL_DST           (1 << 3)
+
+#define PROBE_INTERVAL_NS      10000000ULL
+#define PROBE_TIMEOUT_NS       1000000000ULL
+#define PROBE_FLOWS            256      /**< Distinct flows cycled */
+#define FLOOD_FRAME_LEN        64
+#define RX_BUF_LEN             (1 << 16)
+
+/* Probe xids: the top bit tells a barrier from an echo */
+#define XID_BARRIER            0x80000000u
+
+struct cxn_phase {
+    bench_samples_t echo;
+    bench_samples_t flow_mod;
+    unsigned        echo_lost;
+    unsigned        flow_mod_lost;
+    uint64_t        packet_ins;
+    uint64_t        frames_sent;
+};
+
+/* Flood thread state */
+static volatile int flood_run;
+static int          flood_fd = -1;
+static unsigned     flood_pps;
+static uint64_t     flood_sent;
+
+
+static void *
+flood_main(void *arg)
+{
+    uint8_t  frame[FLOOD_FRAME_LEN];
+    uint64_t start = bench_time_ns(), due;
+    uint32_t seq = 0;
+
+    (void)arg;
+
+    /* Broadcast, so each frame is flooded or sent to the controller */
+    memset(frame, 0, sizeof(frame));
+    memset(frame, 0xff, 6);
+    frame[6] = 0x02;
+    frame[12] = 0x88;           /* Local experimental ethertype */
+    frame[13] = 0xb5;
+
+    while (flood_run) {
+        frame[11] = seq & 0xff;     /* Vary the source, as hosts would */
+        frame[10] = (seq >> 8) & 0xff;
+        ++seq;
+        if (send(flood_fd, frame, sizeof(frame), 0) == sizeof(frame)) {
+            ++flood_sent;
+        }
+        if (flood_pps != 0) {
+            due = start + flood_sent * 1000000000ULL / flood_pps;
+            while (flood_run && bench_time_ns() < due);
+        }
+    }
+
+    return NULL;
+}
+
+
+static int
+flood_open(const char *ifname)
+{
+    struct sockaddr_ll sll;
+    int                fd;
+
+    if ((fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0) {
+        perror("socket(AF_PACKET)");
+        return -1;
+    }
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    if ((sll.sll_ifindex = if_nametoindex(ifname)) == 0
+        || bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        fprintf(stderr, "Cannot bind to %s\n", ifname);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+static void
+ofp_header_put(uint8_t *buf, uint8_t type, uint16_t len, uint32_t xid)
+{
+    buf[0] = OFP_VERSION;
+    buf[1] = type;
+    *(uint16_t *)(buf + 2) = htons(len);
+    *(uint32_t *)(buf + 4) = htonl(xid);
+}
+
+
+static int
+ofp_send(int fd, uint8_t *buf, unsigned len)
+{
+    unsigned off = 0;
+    int      rv;
+
+    while (off < len) {
+        if ((rv = send(fd, buf + off, len - off, 0)) < 0) {
+            if (errno == EINTR || errno == EAGAIN)  continue;
+            return -1;
+        }
+        off += rv;
+    }
+
+    return 0;
+}
+
+
+static int
+ofp_send_simple(int fd, uint8_t type, uint32_t xid)
+{
+    uint8_t buf[OFP_HEADER_LEN];
+
+    ofp_header_put(buf, type, sizeof(buf), xid);
+    return ofp_send(fd, buf, sizeof(buf));
+}
+
+
+/** \brief Send a flow mod adding flow n, output to port 1, then a barrier */
+
+static int
+flow_mod_send(int fd, uint32_t xid, unsigned n)
+{
+    uint8_t buf[OFP_FLOW_MOD_LEN + 8 + OFP_HEADER_LEN];
+    uint8_t *fm = buf, *match = buf + OFP_HEADER_LEN, *act;
+
+    memset(buf, 0, sizeof(buf));
+    ofp_header_put(fm, OFPT_FLOW_MOD, OFP_FLOW_MOD_LEN + 8, xid);
+
+    *(uint32_t *)match = htonl(OFPFW_ALL & ~OFPFW_DL_DST);
+    match[12] = 0x02;                       /* dl_dst 02:00:00:00:xx:xx */
+    match[16] = (n >> 8) & 0xff;
+    match[17] = n & 0xff;
+
+    /* cookie 0, command ADD, no timeouts, then: */
+    *(uint16_t *)(fm + 62) = htons(0x8000);     /* priority */
+    *(uint32_t *)(fm + 64) = htonl(0xffffffff); /* buffer_id */
+    *(uint16_t *)(fm + 68) = htons(0xffff);     /* out_port none */
+
+    act = fm + OFP_FLOW_MOD_LEN;
+    *(uint16_t *)(act + 2) = htons(8);          /* output, length 8 */
+    *(uint16_t *)(act + 4) = htons(1);          /* port 1 */
+
+    ofp_header_put(buf + OFP_FLOW_MOD_LEN + 8, OFPT_BARRIER_REQUEST,
+                   OFP_HEADER_LEN, xid | XID_BARRIER);
+
+    return ofp_send(fd, buf, sizeof(buf));
+}
+
+
+/** \brief Probes outstanding, by xid */
+
+struct probe {
+    uint32_t xid;
+    uint64_t sent_ns;
+};
+
+struct probes {
+    struct probe echo, barrier;
+};
+
+
+/** \brief Handle the messages in the receive buffer; returns bytes used */
+
+static unsigned
+msgs_handle(int fd, uint8_t *buf, unsigned len, struct probes *pr,
+            struct cxn_phase *ph)
+{
+    unsigned off = 0, msg_len;
+    uint32_t xid;
+    uint64_t now = bench_time_ns();
+
+    while (len - off >= OFP_HEADER_LEN) {
+        msg_len = ntohs(*(uint16_t *)(buf + off + 2));
+        if (msg_len < OFP_HEADER_LEN) {
+            msg_len = OFP_HEADER_LEN;   /* Resynchronize on garbage */
+        }
+        if (len - off < msg_len)  break;
+        xid = ntohl(*(uint32_t *)(buf + off + 4));
+
+        switch (buf[off + 1]) {
+        case OFPT_ECHO_REQUEST:
+            /* Keep the switch's keepalive happy */
+            buf[off + 1] = OFPT_ECHO_REPLY;
+            (void)ofp_send(fd, buf + off, msg_len);
+            break;
+        case OFPT_ECHO_REPLY:
+            if (pr->echo.sent_ns && xid == pr->echo.xid) {
+                bench_samples_add(&ph->echo, now - pr->echo.sent_ns);
+                pr->echo.sent_ns = 0;
+            }
+            break;
+        case OFPT_BARRIER_REPLY:
+            if (pr->barrier.sent_ns && xid == pr->barrier.xid) {
+                bench_samples_add(&ph->flow_mod, now - pr->barrier.sent_ns);
+                pr->barrier.sent_ns = 0;
+            }
+            break;
+        case OFPT_PACKET_IN:
+            ++ph->packet_ins;
+            break;
+        default:
+            break;
+        }
+        off += msg_len;
+    }
+
+    return off;
+}
+
+
+/** \brief Probe the connection for a number of seconds */
+
+static int
+phase_run(int fd, unsigned seconds, struct cxn_phase *ph, uint32_t *xid)
+{
+    static uint8_t buf[RX_BUF_LEN];
+    static unsigned buf_len;
+    struct probes  pr;
+    struct pollfd  pfd;
+    uint64_t       now, end, next_probe;
+    unsigned       flow = 0, used;
+    int            rv;
+
+    memset(&pr, 0, sizeof(pr));
+    now = bench_time_ns();
+    end = now + seconds * 1000000000ULL;
+    next_probe = now;
+
+    while ((now = bench_time_ns()) < end) {
+        if (now >= next_probe) {
+            next_probe += PROBE_INTERVAL_NS;
+
+            /* A probe unanswered within its timeout is lost */
+            if (pr.echo.sent_ns && now - pr.echo.sent_ns > PROBE_TIMEOUT_NS) {
+                pr.echo.sent_ns = 0;
+                ++ph->echo_lost;
+            }
+            if (pr.barrier.sent_ns
+                && now - pr.barrier.sent_ns > PROBE_TIMEOUT_NS) {
+                pr.barrier.sent_ns = 0;
+                ++ph->flow_mod_lost;
+            }
+
+            if (!pr.echo.sent_ns) {
+                pr.echo.xid = ++*xid & ~XID_BARRIER;
+                pr.echo.sent_ns = bench_time_ns();
+                if (ofp_send_simple(fd, OFPT_ECHO_REQUEST, pr.echo.xid) < 0) {
+                    return -1;
+                }
+            }
+            if (!pr.barrier.sent_ns) {
+                pr.barrier.xid = (++*xid & ~XID_BARRIER) | XID_BARRIER;
+                pr.barrier.sent_ns = bench_time_ns();
+                if (flow_mod_send(fd, pr.barrier.xid & ~XID_BARRIER,
+                                  flow++ % PROBE_FLOWS) < 0) {
+                    return -1;
+                }
+            }
+        }
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 1) <= 0)  continue;
+
+        if ((rv = recv(fd, buf + buf_len, sizeof(buf) - buf_len, 0)) <= 0) {
+            if (rv < 0 && errno == EINTR)  continue;
+            fprintf(stderr, "Switch closed the connection\n");
+            return -1;
+        }
+        buf_len += rv;
+        used = msgs_handle(fd, buf, buf_len, &pr, ph);
+        memmove(buf, buf + used, buf_len - used);
+        buf_len -= used;
+    }
+
+    /* Probes still out at the end count as lost */
+    ph->echo_lost += pr.echo.sent_ns != 0;
+    ph->flow_mod_lost += pr.barrier.sent_ns != 0;
+
+    return 0;
+}
+
+
+static void
+phase_print(const char *title, struct cxn_phase *ph, unsigned seconds)
+{
+    printf("%s:\n", title);
+    bench_samples_print("echo RTT", &ph->echo, ph->echo_lost);
+    bench_samples_print("flow mod + barrier", &ph->flow_mod,
+                        ph->flow_mod_lost);
+    printf("  %-24s %"PRIu64" (%"PRIu64"/s)\n", "packet-ins",
+           ph->packet_ins, ph->packet_ins / seconds);
+    if (ph->frames_sent) {
+        printf("  %-24s %"PRIu64" (%"PRIu64"/s)\n", "frames flooded",
+               ph->frames_sent, ph->frames_sent / seconds);
+    }
+}
+
+
+int
+bench_cxn(int argc, char *argv[])
+{
+    struct cxn_phase   idle, flood;
+    struct sockaddr_in addr;
+    pthread_t          thread;
+    unsigned           port = 6633, seconds = 10, samples;
+    uint32_t           xid = 0;
+    int                lfd = -1, fd = -1, one = 1, rv = 1;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: cxn <flood-ifname> "
+                "[controller-port [seconds [pps]]]\n");
+        return 1;
+    }
+    if (argc > 2)  port = atoi(argv[2]);
+    if (argc > 3)  seconds = atoi(argv[3]);
+    if (argc > 4)  flood_pps = atoi(argv[4]);
+    if (seconds == 0)  seconds = 1;
+
+    memset(&idle, 0, sizeof(idle));
+    memset(&flood, 0, sizeof(flood));
+    if ((flood_fd = flood_open(argv[1])) < 0) {
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0
+        || setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+        || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(lfd, 1) < 0) {
+        perror("controller socket");
+        goto done;
+    }
+
+    printf("Waiting for the switch on port %u\n", port);
+    if ((fd = accept(lfd, NULL, NULL)) < 0) {
+        perror("accept");
+        goto done;
+    }
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (ofp_send_simple(fd, OFPT_HELLO, ++xid) < 0
+        || ofp_send_simple(fd, OFPT_FEATURES_REQUEST, ++xid) < 0) {
+        perror("send");
+        goto done;
+    }
+
+    samples = seconds * (1000000000ULL / PROBE_INTERVAL_NS) + 1;
+    bench_samples_init(&idle.echo, samples);
+    bench_samples_init(&idle.flow_mod, samples);
+    bench_samples_init(&flood.echo, samples);
+    bench_samples_init(&flood.flow_mod, samples);
+
+    if (phase_run(fd, seconds, &idle, &xid) < 0) {
+        goto done;
+    }
+
+    flood_run = 1;
+    if (pthread_create(&thread, NULL, flood_main, NULL) != 0) {
+        fprintf(stderr, "Cannot start the flood thread\n");
+        goto done;
+    }
+    rv = phase_run(fd, seconds, &flood, &xid) < 0;
+    flood_run = 0;
+    pthread_join(thread, NULL);
+    flood.frames_sent = flood_sent;
+
+    phase_print("Datapath idle", &idle, seconds);
+    phase_print("Datapath flooded", &flood, seconds);
+
+ done:
+    bench_samples_free(&idle.echo);
+    bench_samples_free(&idle.flow_mod);
+    bench_samples_free(&flood.echo);
+    bench_samples_free(&flood.flow_mod);
+    if (fd >= 0)  close(fd);
+    if (lfd >= 0)  close(lfd);
+    close(flood_fd);
+
+    return rv;
+}
@@ -0,0 +1,505 @@
+/****************************************************************
+ *
+ *        Copyright 2013, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ***************************************************************/
+
+/**
+ * @file
+ * @brief Flow mod throughput, one at a time versus batched
+ *
+ * Drives the Forwarding module in process, the way a controller resync
+ * would: a table's worth of flow adds, then deletes of all of them,
+ * first applied one flow mod at a time, then as a single batch each.
+ * Flows are wildcard flows of distinct priority, deleted highest
+ * priority first, which is the worst case for per-flow index upkeep.
+ *
+ * The snapshot benchmark saves a table of flows for warm restart, then
+ * times a restart that reloads it.
+ *
+ * The lookup benchmark sends packets through a table of exact flows,
+ * first all to one flow, then each to a random one, so that flow data
+ * is rarely in cache; the difference is what a table lookup costs in
+ * cache misses.  Misses are read from the CPU's counters where the
+ * kernel allows it.
+ *
+ * The state manager entry points Forwarding calls are stubbed out below,
+ * as in the Forwarding unit test.  The port manager is the real one,
+ * for the ports benchmark, and is not initialized here: these
+ * benchmarks send no packet that would reach it.
+ */
+
+#include <Forwarding/forwarding.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define FLOWMOD_FLOWS_DEFAULT  50000
+#define FLOWMOD_FLOWS_MAX      65535    /**< One priority per flow */
+#define SNAPSHOT_FLOWS_DEFAULT 100000
+#define SNAPSHOT_FLOWS_MAX     1000000
+#define LOOKUP_FLOWS_DEFAULT   200000
+#define LOOKUP_FLOWS_MAX       1000000
+#define LOOKUP_PACKETS         2000000
+
+static unsigned cb_ok;
+static unsigned cb_failed;
+
+
+/* Fake state manager functions */
+
+static void
+cb_count(indigo_error_t result)
+{
+    if (INDIGO_SUCCESS(result)) {
+        ++cb_ok;
+    } else {
+        ++cb_failed;
+    }
+}
+
+void
+indigo_core_flow_create_callback(indigo_error_t result,
+                                 indigo_cookie_t flow_id,
+                                 uint8_t table_id,
+                                 indigo_cookie_t callback_cookie)
+{
+    cb_count(result);
+}
+
+void
+indigo_core_flow_modify_callback(indigo_error_t result,
+                                 indigo_fi_flow_stats_t *flow_stats,
+                                 indigo_cookie_t callback_cookie)
+{
+    cb_count(result);
+}
+
+void
+indigo_core_flow_delete_callback(indigo_error_t result,
+                                 indigo_fi_flow_stats_t *flow_stats,
+                                 indigo_cookie_t callback_cookie)
+{
+    cb_count(result);
+}
+
+void
+indigo_core_flow_stats_get_callback(indigo_error_t result,
+                                    indigo_fi_flow_stats_t *flow_stats,
+                                    indigo_cookie_t callback_cookie)
+{
+}
+
+void
+indigo_core_table_stats_get_callback(indigo_error_t result,
+                                     of_table_stats_reply_t *reply,
+                                     indigo_cookie_t callback_cookie)
+{
+    if (reply != NULL) {
+        of_table_stats_reply_delete(reply);
+    }
+}
+
+void
+indigo_core_flow_removed(indigo_fi_flow_removed_t reason,
+                         indigo_fi_flow_stats_t *stats)
+{
+}
+
+indigo_error_t
+indigo_core_packet_in(of_packet_in_t *of_packet_in)
+{
+    of_packet_in_delete(of_packet_in);
+    return INDIGO_ERROR_NONE;
+}
+
+
+/**
+ * \brief Build flow add i: IPv4 to 10.x.y.z, out port 1
+ *
+ * Priority is i + 1, wrapping after FLOWMOD_FLOWS_MAX flows.
+ */
+
+static of_flow_add_t *
+flow_add_build(unsigned i)
+{
+    of_flow_add_t    *flow_add;
+    of_list_action_t *actions;
+    of_action_t      *action;
+    of_match_t       match;
+
+    if ((flow_add = of_flow_add_new(OF_VERSION_1_0)) == NULL) {
+        return NULL;
+    }
+
+    memset(&match, 0, sizeof(match));
+    match.fields.eth_type = 0x0800;
+    match.masks.eth_type = 0xffff;
+    match.fields.ipv4_dst = 0x0a000000 + i;
+    match.masks.ipv4_dst = 0xffffffff;
+    of_flow_add_priority_set(flow_add, i % FLOWMOD_FLOWS_MAX + 1);
+    of_flow_add_match_set(flow_add, &match);
+
+    action = (of_action_t *)of_action_output_new(OF_VERSION_1_0);
+    actions = of_list_action_new(OF_VERSION_1_0);
+    if (action == NULL || actions == NULL) {
+        if (action != NULL) of_action_delete(action);
+        if (actions != NULL) of_list_action_delete(actions);
+        of_flow_add_delete(flow_add);
+        return NULL;
+    }
+    of_action_output_port_set(&action->output, 1);
+    of_list_action_append(actions, action);
+    of_flow_add_actions_set(flow_add, actions);
+    of_action_delete(action);
+    of_list_action_delete(actions);
+
+    return flow_add;
+}
+
+
+/** \brief Add then delete every flow; return the time each phase took */
+
+static void
+flowmod_round(of_flow_add_t **flows, unsigned n, int batched,
+              uint64_t *add_ns, uint64_t *del_ns)
+{
+    uint64_t start;
+    unsigned i;
+
+    start = bench_time_ns();
+    if (batched) ind_fwd_flow_batch_begin();
+    for (i = 0; i < n; ++i) {
+        indigo_fwd_flow_create(i + 1, flows[i], 0);
+    }
+    if (batched) ind_fwd_flow_batch_commit();
+    *add_ns = bench_time_ns() - start;
+
+    start = bench_time_ns();
+    if (batched) ind_fwd_flow_batch_begin();
+    for (i = n; i > 0; --i) {
+        indigo_fwd_flow_delete(i, 0);
+    }
+    if (batched) ind_fwd_flow_batch_commit();
+    *del_ns = bench_time_ns() - start;
+}
+
+
+static void
+flowmod_print(const char *name, unsigned n, uint64_t ns)
+{
+    printf("  %-24s %8.1f ms  %10.0f flow mods/s\n", name, ns / 1e6,
+           ns ? n * 1e9 / ns : 0.0);
+}
+
+
+int
+bench_flowmod(int argc, char *argv[])
+{
+    ind_fwd_config_t config;
+    of_flow_add_t    **flows = NULL;
+    unsigned         n = FLOWMOD_FLOWS_DEFAULT, i;
+    uint64_t         add_ns, del_ns;
+    int              rv = 1;
+
+    if (argc >= 2) {
+        n = strtoul(argv[1], NULL, 0);
+    }
+    if (n == 0 || n > FLOWMOD_FLOWS_MAX) {
+        fprintf(stderr, "flows must be 1 to %u\n", FLOWMOD_FLOWS_MAX);
+        return 1;
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.of_version = OF_VERSION_1_0;
+    config.max_flows = n;
+    if (INDIGO_FAILURE(ind_fwd_init(&config))) {
+        fprintf(stderr, "ind_fwd_init() failed\n");
+        return 1;
+    }
+
+    /* Messages are built up front so only Forwarding is timed */
+    if ((flows = calloc(n, sizeof(flows[0]))) == NULL) {
+        fprintf(stderr, "calloc() failed\n");
+        goto done;
+    }
+    for (i = 0; i < n; ++i) {
+        if ((flows[i] = flow_add_build(i)) == NULL) {
+            fprintf(stderr, "flow_add_build() failed\n");
+            goto done;
+        }
+    }
+
+    printf("%u flows\n", n);
+
+    cb_ok = cb_failed = 0;
+    flowmod_round(flows, n, 0, &add_ns, &del_ns);
+    printf("one at a time (%u ok, %u failed)\n", cb_ok, cb_failed);
+    flowmod_print("add", n, add_ns);
+    flowmod_print("delete", n, del_ns);
+
+    cb_ok = cb_failed = 0;
+    flowmod_round(flows, n, 1, &add_ns, &del_ns);
+    printf("batched (%u ok, %u failed)\n", cb_ok, cb_failed);
+    flowmod_print("add", n, add_ns);
+    flowmod_print("delete", n, del_ns);
+
+    rv = 0;
+
+ done:
+    if (flows != NULL) {
+        for (i = 0; i < n; ++i) {
+            if (flows[i] != NULL) {
+                of_flow_add_delete(flows[i]);
+            }
+        }
+        free(flows);
+    }
+    ind_fwd_finish();
+
+    return rv;
+}
+
+
+int
+bench_snapshot(int argc, char *argv[])
+{
+    ind_fwd_config_t config;
+    of_flow_add_t    *flow_add;
+    char             path[64];
+    unsigned         n = SNAPSHOT_FLOWS_DEFAULT, i;
+    uint64_t         start, save_ns, load_ns;
+    int              rv = 1;
+
+    if (argc >= 2) {
+        n = strtoul(argv[1], NULL, 0);
+    }
+    if (n == 0 || n > SNAPSHOT_FLOWS_MAX) {
+        fprintf(stderr, "flows must be 1 to %u\n", SNAPSHOT_FLOWS_MAX);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "/tmp/lri-bench-snapshot.%d", (int)getpid());
+
+    memset(&config, 0, sizeof(config));
+    config.of_version = OF_VERSION_1_0;
+    config.max_flows = n;
+    if (INDIGO_FAILURE(ind_fwd_init(&config))) {
+        fprintf(stderr, "ind_fwd_init() failed\n");
+        return 1;
+    }
+
+    cb_ok = cb_failed = 0;
+    for (i = 0; i < n; ++i) {
+        if ((flow_add = flow_add_build(i)) == NULL) {
+            fprintf(stderr, "flow_add_build() failed\n");
+            ind_fwd_finish();
+            return 1;
+        }
+        indigo_fwd_flow_create(i + 1, flow_add, 0);
+        of_flow_add_delete(flow_add);
+    }
+    printf("%u flows (%u ok, %u failed)\n", n, cb_ok, cb_failed);
+
+    start = bench_time_ns();
+    if (INDIGO_FAILURE(ind_fwd_snapshot_save(path))) {
+        fprintf(stderr, "ind_fwd_snapshot_save() failed\n");
+        ind_fwd_finish();
+        goto done;
+    }
+    save_ns = bench_time_ns() - start;
+    ind_fwd_finish();
+
+    /* The restart: init finds the snapshot and reloads it */
+    config.snapshot_path = path;
+    start = bench_time_ns();
+    if (INDIGO_FAILURE(ind_fwd_init(&config))) {
+        fprintf(stderr, "ind_fwd_init() failed\n");
+        goto done;
+    }
+    load_ns = bench_time_ns() - start;
+    ind_fwd_finish();
+
+    printf("  %-24s %8.1f ms\n", "save", save_ns / 1e6);
+    printf("  %-24s %8.1f ms\n", "init with reload", load_ns / 1e6);
+
+    rv = 0;
+
+ done:
+    unlink(path);
+
+    return rv;
+}
+
+
+/* A TCP packet; flow i matches it with destination 11.0.0.0 + i */
+static const uint8_t lookup_pkt[64] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x02,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+    0x08, 0x00,
+    0x45, 0x00, 0x00, 0x32, 0x00, 0x00, 0x00, 0x00,
+    0x40, 0x06, 0x00, 0x00,
+    10, 0, 0, 1,
+    11, 0, 0, 0,
+    0x03, 0xe8, 0x00, 0x50,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x50, 0x02, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+#define LOOKUP_PKT_DST_OFFSET 30
+
+
+/**
+ * \brief Build flow add i: every field of lookup_pkt to 11.0.0.0 + i
+ *
+ * The flow has no actions, so packets are dropped and no port output is
+ * timed with the lookup.
+ */
+
+static of_flow_add_t *
+flow_exact_build(unsigned i)
+{
+    of_flow_add_t    *flow_add;
+    of_list_action_t *actions;
+    of_match_t       match;
+
+    if ((flow_add = of_flow_add_new(OF_VERSION_1_0)) == NULL) {
+        return NULL;
+    }
+
+    memset(&match, 0, sizeof(match));
+    memset(&match.masks, 0xff, sizeof(match.masks));
+    match.fields.in_port = 1;
+    memcpy(match.fields.eth_dst.addr, &lookup_pkt[0], 6);
+    memcpy(match.fields.eth_src.addr, &lookup_pkt[6], 6);
+    match.fields.vlan_vid = OF_MATCH_UNTAGGED_VLAN_ID(OF_VERSION_1_0);
+    match.fields.eth_type = 0x0800;
+    match.fields.ip_proto = 6;
+    match.fields.ipv4_src = 0x0a000001;
+    match.fields.ipv4_dst = 0x0b000000 + i;
+    match.fields.tcp_src = 1000;
+    match.fields.tcp_dst = 80;
+    of_flow_add_priority_set(flow_add, 100);
+    of_flow_add_match_set(flow_add, &match);
+
+    if ((actions = of_list_action_new(OF_VERSION_1_0)) == NULL) {
+        of_flow_add_delete(flow_add);
+        return NULL;
+    }
+    of_flow_add_actions_set(flow_add, actions);
+    of_list_action_delete(actions);
+
+    return flow_add;
+}
+
+
+/** \brief Send LOOKUP_PACKETS packets, to flow 0 or to random flows */
+
+static void
+lookup_round(const char *name, unsigned n, int spread, int perf_fd)
+{
+    uint8_t  pkt[sizeof(lookup_pkt)];
+    uint32_t rand = 1, dst;
+    uint64_t start, ns, misses;
+    unsigned i;
+
+    memcpy(pkt, lookup_pkt, sizeof(pkt));
+    bench_misses_start(perf_fd);
+    start = bench_time_ns();
+    for (i = 0; i < LOOKUP_PACKETS; i++) {
+        dst = 0x0b000000;
+        if (spread) {
+            /* xorshift32 */
+            rand ^= rand << 13;
+            rand ^= rand >> 17;
+            rand ^= rand << 5;
+            dst += rand % n;
+        }
+        pkt[LOOKUP_PKT_DST_OFFSET + 0] = dst >> 24;
+        pkt[LOOKUP_PKT_DST_OFFSET + 1] = dst >> 16;
+        pkt[LOOKUP_PKT_DST_OFFSET + 2] = dst >> 8;
+        pkt[LOOKUP_PKT_DST_OFFSET + 3] = dst;
+        indigo_fwd_packet_receive(1, pkt, sizeof(pkt));
+    }
+    ns = bench_time_ns() - start;
+    misses = bench_misses_stop(perf_fd);
+
+    printf("  %-24s %8.1f ns/packet", name, (double)ns / LOOKUP_PACKETS);
+    if (perf_fd >= 0) {
+        printf("  %6.2f cache misses/packet",
+               (double)misses / LOOKUP_PACKETS);
+    }
+    printf("\n");
+}
+
+
+int
+bench_lookup(int argc, char *argv[])
+{
+    ind_fwd_config_t       config;
+    ind_fwd_memory_stats_t mem;
+    of_flow_add_t          *flow_add;
+    unsigned               n = LOOKUP_FLOWS_DEFAULT, i;
+    int                    perf_fd;
+
+    if (argc >= 2) {
+        n = strtoul(argv[1], NULL, 0);
+    }
+    if (n == 0 || n > LOOKUP_FLOWS_MAX) {
+        fprintf(stderr, "flows must be 1 to %u\n", LOOKUP_FLOWS_MAX);
+        return 1;
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.of_version = OF_VERSION_1_0;
+    config.max_flows = n;
+    if (INDIGO_FAILURE(ind_fwd_init(&config))) {
+        fprintf(stderr, "ind_fwd_init() failed\n");
+        return 1;
+    }
+    ind_fwd_enable_set(1);
+
+    cb_ok = cb_failed = 0;
+    for (i = 0; i < n; ++i) {
+        if ((flow_add = flow_exact_build(i)) == NULL) {
+            fprintf(stderr, "flow_exact_build() failed\n");
+            ind_fwd_finish();
+            return 1;
+        }
+        indigo_fwd_flow_create(i + 1, flow_add, 0);
+        of_flow_add_delete(flow_add);
+    }
+    ind_fwd_memory_stats_get(&mem);
+    printf("%u exact flows (%u ok, %u failed), %"PRIu64" bytes/flow\n",
+           n, cb_ok, cb_failed, mem.flows ? mem.bytes / mem.flows : 0);
+
+    if ((perf_fd = bench_misses_open()) < 0) {
+        printf("cache miss counter not available\n");
+    }
+    lookup_round("one flow", n, 0, perf_fd);
+    lookup_round("random flows", n, 1, perf_fd);
+    if (perf_fd >= 0) {
+        close(perf_fd);
+    }
+
+    ind_fwd_finish();
+
+    return 0;
+}
@@ -0,0 +1,262 @@
+/****************************************************************
+ *
+ *        Copyright 2013, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ***************************************************************/
+
+/**
+ * @file
+ * @brief Port manager transmit over many ports
+ *
+ * Adds a few hundred ports, each a UDP VPI sending to one local sink
+ * socket, and sends packets through the port manager: all out of one
+ * port, then each out of a random port, then flooded to every port.
+ * With hundreds of ports the port table doesn't stay in cache, and the
+ * cache misses per packet show how much of a port entry a packet
+ * touches.  Every packet is also a sendto(), the same cost whatever the
+ * table layout; misses are counted in user space only.
+ *
+ * The state manager entry points the port manager calls are stubbed
+ * out below.
+ */
+
+#include <PortManager/portmanager.h>
+#include <indigo/port_manager.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "bench.h"
+
+#define PORTS_DEFAULT   256
+#define PORTS_PACKETS   200000
+#define PORTS_PKT_LEN   64
+
+
+/* Fake state manager functions */
+
+void
+indigo_core_port_status_update(of_port_status_t *of_port_status)
+{
+    of_port_status_delete(of_port_status);
+}
+
+void
+indigo_core_port_modify_callback(indigo_error_t result,
+                                 indigo_cookie_t callback_cookie)
+{
+}
+
+void
+indigo_core_port_stats_get_callback(indigo_error_t result,
+                                    of_port_stats_reply_t *reply,
+                                    indigo_cookie_t callback_cookie)
+{
+}
+
+void
+indigo_core_queue_config_get_callback(indigo_error_t result,
+                                      of_queue_get_config_reply_t *reply,
+                                      indigo_cookie_t callback_cookie)
+{
+}
+
+void
+indigo_core_queue_stats_get_callback(indigo_error_t result,
+                                     of_queue_stats_reply_t *reply,
+                                     indigo_cookie_t callback_cookie)
+{
+}
+
+
+/** \brief Open a UDP socket that takes whatever the ports send */
+
+static int
+sink_open(uint16_t *port)
+{
+    struct sockaddr_in addr;
+    socklen_t          len = sizeof(addr);
+    int                fd;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+
+    return fd;
+}
+
+
+/**
+ * \brief Name of port n's interface
+ *
+ * Each port sends to its own loopback address, so that names differ.
+ */
+
+static void
+port_ifname(char *buf, unsigned size, unsigned n, uint16_t sink_port)
+{
+    snprintf(buf, size, "udp|send:127.%u.%u.%u:%u",
+             (n >> 16) & 0xff, (n >> 8) & 0xff, n & 0xff, sink_port);
+}
+
+
+static void
+ports_print(const char *name, unsigned count, uint64_t ns, int perf_fd,
+            uint64_t misses)
+{
+    printf("  %-24s %8.1f ns/packet", name, (double)ns / count);
+    if (perf_fd >= 0) {
+        printf("  %6.2f cache misses/packet", (double)misses / count);
+    }
+    printf("\n");
+}
+
+
+/** \brief Send PORTS_PACKETS packets, out of port 1 or random ports */
+
+static void
+ports_round(const char *name, unsigned n, int spread, int perf_fd)
+{
+    uint8_t  pkt[PORTS_PKT_LEN];
+    uint32_t rand = 1;
+    uint64_t start, ns, misses;
+    unsigned i, port = 1;
+
+    memset(pkt, 0, sizeof(pkt));
+    pkt[0] = 0x02;              /* Locally administered unicast */
+    bench_misses_start(perf_fd);
+    start = bench_time_ns();
+    for (i = 0; i < PORTS_PACKETS; i++) {
+        if (spread) {
+            /* xorshift32 */
+            rand ^= rand << 13;
+            rand ^= rand >> 17;
+            rand ^= rand << 5;
+            port = rand % n + 1;
+        }
+        indigo_port_packet_emit(port, 0, pkt, sizeof(pkt));
+    }
+    ns = bench_time_ns() - start;
+    misses = bench_misses_stop(perf_fd);
+
+    ports_print(name, PORTS_PACKETS, ns, perf_fd, misses);
+}
+
+
+/** \brief Flood broadcasts to every port; counted per copy sent */
+
+static void
+ports_flood_round(unsigned n, int perf_fd)
+{
+    uint8_t  pkt[PORTS_PKT_LEN];
+    uint64_t start, ns, misses;
+    unsigned i, floods = PORTS_PACKETS / n + 1;
+
+    memset(pkt, 0, sizeof(pkt));
+    memset(pkt, 0xff, 6);
+    bench_misses_start(perf_fd);
+    start = bench_time_ns();
+    for (i = 0; i < floods; i++) {
+        indigo_port_packet_emit_all(0, pkt, sizeof(pkt));
+    }
+    ns = bench_time_ns() - start;
+    misses = bench_misses_stop(perf_fd);
+
+    ports_print("flood, per port", floods * n, ns, perf_fd, misses);
+}
+
+
+int
+bench_ports(int argc, char *argv[])
+{
+    ind_port_config_t    config;
+    indigo_port_config_t port_config;
+    char                 ifname[64];
+    unsigned             n = PORTS_DEFAULT, i, added = 0;
+    uint16_t             sink_port;
+    int                  sink_fd, perf_fd, rv = 1;
+
+    if (argc >= 2) {
+        n = strtoul(argv[1], NULL, 0);
+    }
+    if (n == 0 || n > IND_PORT_MAX_PORTS_MAX) {
+        fprintf(stderr, "ports must be 1 to %u\n", IND_PORT_MAX_PORTS_MAX);
+        return 1;
+    }
+
+    if ((sink_fd = sink_open(&sink_port)) < 0) {
+        perror("sink socket");
+        return 1;
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.of_version = OF_VERSION_1_0;
+    config.max_ports = n;
+    if (INDIGO_FAILURE(ind_port_init(&config))) {
+        fprintf(stderr, "ind_port_init() failed\n");
+        close(sink_fd);
+        return 1;
+    }
+    ind_port_enable_set(1);
+
+    memset(&port_config, 0, sizeof(port_config));
+    for (added = 0; added < n; ++added) {
+        port_ifname(ifname, sizeof(ifname), added + 1, sink_port);
+        if (INDIGO_FAILURE(indigo_port_interface_add(ifname, added + 1,
+                                                     &port_config))) {
+            fprintf(stderr, "Adding port %u failed; out of descriptors?\n",
+                    added + 1);
+            goto done;
+        }
+    }
+    printf("%u ports\n", n);
+
+    if ((perf_fd = bench_misses_open()) < 0) {
+        printf("cache miss counter not available\n");
+    }
+    ports_round("one port", n, 0, perf_fd);
+    ports_round("random ports", n, 1, perf_fd);
+    ports_flood_round(n, perf_fd);
+    if (perf_fd >= 0) {
+        close(perf_fd);
+    }
+    rv = 0;
+
+ done:
+    for (i = 0; i < added; ++i) {
+        port_ifname(ifname, sizeof(ifname), i + 1, sink_port);
+        indigo_port_interface_remove(ifname);
+    }
+    ind_port_finish();
+    close(sink_fd);
+
+    return rv;
+}
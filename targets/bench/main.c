@@ -0,0 +1,190 @@
+/****************************************************************
+ *
+ *        Copyright 2013, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ***************************************************************/
+
+/************************************************************//**
+ *
+ * Benchmark driver for the Linux reference switch.
+ *
+ *     lri-bench <benchmark> [args...]
+ *
+ ****************************************************************/
+
+#include <AIM/aim.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "bench.h"
+
+static const struct {
+    const char *name;
+    int (*run)(int argc, char *argv[]);
+    const char *usage;
+} benchmarks[] = {
+    { "cxn", bench_cxn,
+      "<flood-ifname> [controller-port [seconds [pps]]]\n"
+      "        Echo RTT and flow mod latency, idle then under a flood" },
+    { "flowmod", bench_flowmod,
+      "[flows]\n"
+      "        Flow mod throughput, one at a time then batched" },
+    { "snapshot", bench_snapshot,
+      "[flows]\n"
+      "        Flow table save, then reload at init, for warm restart" },
+    { "lookup", bench_lookup,
+      "[flows]\n"
+      "        Exact flow lookup, one flow then random flows, with cache misses" },
+    { "ports", bench_ports,
+      "[ports]\n"
+      "        Port transmit, one port, random ports, then flood, with cache misses" },
+};
+
+
+uint64_t
+bench_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/** \brief Open a user space cache miss counter; -1 if not allowed */
+
+int
+bench_misses_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+void
+bench_misses_start(int fd)
+{
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+
+/** \brief Cache misses since bench_misses_start(); 0 without a counter */
+
+uint64_t
+bench_misses_stop(int fd)
+{
+    uint64_t misses;
+
+    if (fd < 0) {
+        return 0;
+    }
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+        return 0;
+    }
+    return misses;
+}
+
+
+void
+bench_samples_init(bench_samples_t *s, unsigned max)
+{
+    s->us = calloc(max, sizeof(s->us[0]));
+    s->count = 0;
+    s->max = s->us != NULL ? max : 0;
+}
+
+
+void
+bench_samples_add(bench_samples_t *s, uint64_t ns)
+{
+    if (s->count < s->max) {
+        s->us[s->count++] = ns / 1000;
+    }
+}
+
+
+static int
+samples_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+void
+bench_samples_print(const char *name, bench_samples_t *s, unsigned lost)
+{
+    if (s->count == 0) {
+        printf("  %-24s no samples, %u lost\n", name, lost);
+        return;
+    }
+
+    qsort(s->us, s->count, sizeof(s->us[0]), samples_cmp);
+    printf("  %-24s n %u  p50 %u us  p99 %u us  max %u us  lost %u\n",
+           name, s->count, s->us[s->count / 2],
+           s->us[(s->count * 99) / 100], s->us[s->count - 1], lost);
+}
+
+
+void
+bench_samples_free(bench_samples_t *s)
+{
+    free(s->us);
+    s->us = NULL;
+    s->count = s->max = 0;
+}
+
+
+int
+aim_main(int argc, char *argv[])
+{
+    unsigned i;
+
+    for (i = 0; argc >= 2 && i < AIM_ARRAYSIZE(benchmarks); ++i) {
+        if (strcmp(argv[1], benchmarks[i].name) == 0) {
+            return benchmarks[i].run(argc - 1, argv + 1);
+        }
+    }
+
+    fprintf(stderr, "usage: %s <benchmark> [args...]\n", argv[0]);
+    for (i = 0; i < AIM_ARRAYSIZE(benchmarks); ++i) {
+        fprintf(stderr, "    %s %s\n",
+                benchmarks[i].name, benchmarks[i].usage);
+    }
+
+    return 1;
+}
@@ -34,6 +34,7 @@
 
 
 #include <unistd.h>
+#include <signal.h>
 #include <sys/types.h>
 
 /**
@@ -67,6 +68,14 @@
 #define LRI_MAX_FLOWS 1024
 #endif
 
+/**
+ * Where the flow table is saved at exit and reloaded at start;
+ * empty for none.
+ */
+#ifndef LRI_FLOW_SNAPSHOT
+#define LRI_FLOW_SNAPSHOT ""
+#endif
+
 /**
  * The default controller connection. 
  */
@@ -85,6 +94,19 @@
 #define LRI_CONFIG_ROOT_ACCESS_CHECK 1
 #endif
 
+/**
+ * SIGTERM and SIGINT stop the event loop, so the agent shuts down
+ * cleanly and the flow table snapshot is saved.  Disabling the
+ * socket manager only clears a flag, and the loop checks it after
+ * each pass; the signal itself ends the wait.
+ */
+static void
+lri_stop(int sig)
+{
+    (void)sig;
+    ind_soc_enable_set(0);
+}
+
 int 
 aim_main(int argc, char* argv[])
 {
@@ -106,6 +128,9 @@ aim_main(int argc, char* argv[])
     /** The Indigo Port configuration for added ports. */
     indigo_port_config_t port_add_config; 
 
+    /** Shutdown signal handling. */
+    struct sigaction stop_action;
+
 
     /*************************************************************
      *
@@ -138,6 +163,7 @@ aim_main(int argc, char* argv[])
     AIM_ZERO(fwd); 
     fwd.of_version = OF_VERSION_1_0;
     fwd.max_flows = LRI_MAX_FLOWS; 
+    fwd.snapshot_path = LRI_FLOW_SNAPSHOT;
 
     AIM_ZERO(core); 
     core.expire_flows = 1; 
@@ -233,9 +259,20 @@ aim_main(int argc, char* argv[])
      *
      * Step 6:
      * 
-     * Run the Indigo select() loop with no timeout. 
+     * Run the Indigo select() loop with no timeout, until 
+     * SIGTERM or SIGINT. 
+     *
+     * Made with LRI_EVENT_LOOP=epoll, this is the epoll() loop in
+     * socketmanager_epoll.c instead.
      *
      ************************************************************/
+    AIM_ZERO(stop_action);
+    stop_action.sa_handler = lri_stop;
+    sigemptyset(&stop_action.sa_mask);
+    /* No SA_RESTART: the loop's wait must return */
+    sigaction(SIGTERM, &stop_action, NULL);
+    sigaction(SIGINT, &stop_action, NULL);
+
     ind_soc_select_and_run(-1); 
 
 
@@ -245,8 +282,9 @@ aim_main(int argc, char* argv[])
      * 
      * Example de-initialization. 
      *
-     * You won't get here unless the ind_soc_select_and_run() timeout
-     * value is not infinite or an error occured. 
+     * You won't get here unless the event loop was stopped by a 
+     * signal or an error occured.  ind_fwd_finish() saves the flow 
+     * table snapshot, if one is configured. 
      *
      ************************************************************/
     TRY(ind_core_finish()); 
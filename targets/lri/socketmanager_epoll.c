@@ -0,0 +1,570 @@
+/****************************************************************
+ *
+ *        Copyright 2013, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ***************************************************************/
+
+/**
+ * @file
+ * @brief epoll() implementation of the SocketManager event loop
+ *
+ * Linked into lri in place of the SocketManager module when the target
+ * is made with LRI_EVENT_LOOP=epoll.  The API is SocketManager's own, so
+ * port, controller connection and timer registrations are unchanged.
+ *
+ * Sockets are registered level-triggered, as select() callers expect.
+ * A socket still readable after its callback, as when a port has read
+ * one burst and left the rest, is reported again by the next
+ * epoll_wait() and joins the ready list behind the sockets already on
+ * it.  Write readiness is reported only between ind_soc_data_out_ready()
+ * and ind_soc_data_out_clear(), which switch EPOLLOUT on and off.
+ *
+ * Each pass runs due timers first, then every ready control socket,
+ * then ready datapath sockets until LRI_DATA_BUDGET_US is spent.  A
+ * packet flood thus delays echo replies and flow mods by at most one
+ * budget.  Datapath sockets not reached are served first next pass.
+ * Packet sockets and UDP sockets (the port VPIs) count as datapath;
+ * controller connections and anything else are control.
+ *
+ * Nothing is dispatched while the loop is disabled, and disabling it
+ * from a callback ends ind_soc_select_and_run() after that pass.
+ */
+
+#if LRI_CONFIG_EPOLL == 1
+
+#include <SocketManager/socketmanager.h>
+#include <indigo/error.h>
+#include <indigo/memory.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define SOC_EVENTS_MAX 64       /**< Events taken per epoll_wait() */
+#define SOC_TIMERS_MAX 128      /**< Timers registered at once */
+#define SOC_TBL_GROW   64       /**< Socket table growth, in fds */
+
+/** Datapath time allowed per pass of the loop */
+#ifndef LRI_DATA_BUDGET_US
+#define LRI_DATA_BUDGET_US 2000
+#endif
+
+/** \brief Service classes, in the order a pass serves them */
+
+enum soc_class {
+    SOC_CLASS_CONTROL,
+    SOC_CLASS_DATA,
+    SOC_CLASSES
+};
+
+/** \brief A registered socket, indexed by fd */
+
+struct soc_socket {
+    ind_soc_socket_ready_callback_f callback;   /**< NULL = free */
+    void     *cookie;
+    unsigned gen;               /**< Bumped by each registration */
+    unsigned ready;             /**< TRUE <=> On its class' ready list */
+    unsigned cls;               /**< enum soc_class */
+    unsigned want_out;          /**< TRUE <=> EPOLLOUT is requested */
+    uint32_t events;            /**< Seen since last callback */
+};
+
+/** \brief Entry of the ready list; stale once the fd is re-registered */
+
+struct soc_ready {
+    int      fd;
+    unsigned gen;
+};
+
+/** \brief A timer */
+
+struct soc_timer {
+    ind_soc_timer_callback_f callback;  /**< NULL = free */
+    void     *cookie;
+    int      repeat_ms;         /**< <= 0: fires once */
+    uint64_t due_ns;
+};
+
+static int               soc_epfd = -1;
+static int               soc_enabled;
+static struct soc_socket *soc_tbl;
+static int               soc_tbl_size;
+static struct soc_ready  *soc_ready[SOC_CLASSES];   /**< Sized as soc_tbl */
+static unsigned          soc_ready_cnt[SOC_CLASSES];
+static struct soc_timer  soc_timers[SOC_TIMERS_MAX];
+
+/* Passes that ended datapath service with sockets still ready */
+static uint64_t          soc_cnt_budget_exhausted;
+
+
+static uint64_t
+soc_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/** \brief Make room in the socket table for fd */
+
+static indigo_error_t
+soc_tbl_grow(int fd)
+{
+    struct soc_socket *tbl;
+    struct soc_ready  *lists[SOC_CLASSES];
+    int               size = fd + SOC_TBL_GROW;
+    unsigned          i, failed = 0;
+
+    tbl = INDIGO_MEM_ALLOC(size * sizeof(*tbl));
+    for (i = 0; i < SOC_CLASSES; ++i) {
+        lists[i] = INDIGO_MEM_ALLOC(size * sizeof(*lists[i]));
+        failed |= lists[i] == NULL;
+    }
+    if (tbl == NULL || failed) {
+        INDIGO_MEM_FREE(tbl);
+        for (i = 0; i < SOC_CLASSES; ++i)  INDIGO_MEM_FREE(lists[i]);
+        return INDIGO_ERROR_RESOURCE;
+    }
+
+    /* Called from callbacks too, so the lists' contents are kept */
+    INDIGO_MEM_SET(tbl, 0, size * sizeof(*tbl));
+    if (soc_tbl != NULL) {
+        INDIGO_MEM_COPY(tbl, soc_tbl, soc_tbl_size * sizeof(*tbl));
+    }
+    INDIGO_MEM_FREE(soc_tbl);
+    soc_tbl = tbl;
+    for (i = 0; i < SOC_CLASSES; ++i) {
+        if (soc_ready[i] != NULL) {
+            INDIGO_MEM_COPY(lists[i], soc_ready[i],
+                            soc_tbl_size * sizeof(*lists[i]));
+        }
+        INDIGO_MEM_FREE(soc_ready[i]);
+        soc_ready[i] = lists[i];
+    }
+    soc_tbl_size = size;
+
+    return INDIGO_ERROR_NONE;
+}
+
+
+/** \brief Whether a registered fd carries datapath or control traffic */
+
+static unsigned
+soc_class_get(int fd)
+{
+    int       domain, type;
+    socklen_t len = sizeof(domain);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0) {
+        return SOC_CLASS_CONTROL;
+    }
+    if (domain == AF_PACKET) {
+        return SOC_CLASS_DATA;
+    }
+
+    len = sizeof(type);
+    if ((domain == AF_INET || domain == AF_INET6)
+        && getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0
+        && type == SOCK_DGRAM) {
+        return SOC_CLASS_DATA;
+    }
+
+    return SOC_CLASS_CONTROL;
+}
+
+
+indigo_error_t
+ind_soc_socket_register(int socket_id,
+                        ind_soc_socket_ready_callback_f callback,
+                        void *cookie)
+{
+    struct epoll_event ev;
+    struct soc_socket  *s;
+    indigo_error_t     rv;
+
+    if (socket_id < 0 || callback == NULL) {
+        return INDIGO_ERROR_PARAM;
+    }
+    if (socket_id >= soc_tbl_size
+        && INDIGO_FAILURE(rv = soc_tbl_grow(socket_id))) {
+        return rv;
+    }
+
+    s = &soc_tbl[socket_id];
+    if (s->callback != NULL) {
+        return INDIGO_ERROR_EXISTS;
+    }
+
+    /* An fd already readable is reported by the first epoll_wait() */
+    INDIGO_MEM_SET(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = socket_id;
+    if (epoll_ctl(soc_epfd, EPOLL_CTL_ADD, socket_id, &ev) < 0) {
+        return INDIGO_ERROR_UNKNOWN;
+    }
+
+    s->callback = callback;
+    s->cookie = cookie;
+    s->ready = 0;
+    s->cls = soc_class_get(socket_id);
+    s->want_out = 0;
+    s->events = 0;
+    ++s->gen;
+
+    return INDIGO_ERROR_NONE;
+}
+
+
+indigo_error_t
+ind_soc_socket_unregister(int socket_id)
+{
+    struct soc_socket *s;
+
+    if (socket_id < 0 || socket_id >= soc_tbl_size
+        || (s = &soc_tbl[socket_id])->callback == NULL) {
+        return INDIGO_ERROR_NOT_FOUND;
+    }
+
+    /* Fails harmlessly if the fd was closed first */
+    (void)epoll_ctl(soc_epfd, EPOLL_CTL_DEL, socket_id, NULL);
+
+    /* A ready list entry is now stale, and is dropped when reached */
+    s->callback = NULL;
+    s->cookie = NULL;
+    s->ready = 0;
+
+    return INDIGO_ERROR_NONE;
+}
+
+
+/** \brief Switch EPOLLOUT on or off for a registered socket */
+
+static indigo_error_t
+soc_out_set(int socket_id, unsigned want_out)
+{
+    struct epoll_event ev;
+    struct soc_socket  *s;
+
+    if (socket_id < 0 || socket_id >= soc_tbl_size
+        || (s = &soc_tbl[socket_id])->callback == NULL) {
+        return INDIGO_ERROR_NOT_FOUND;
+    }
+    if (s->want_out == want_out) {
+        return INDIGO_ERROR_NONE;
+    }
+
+    INDIGO_MEM_SET(&ev, 0, sizeof(ev));
+    ev.events = want_out ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.fd = socket_id;
+    if (epoll_ctl(soc_epfd, EPOLL_CTL_MOD, socket_id, &ev) < 0) {
+        return INDIGO_ERROR_UNKNOWN;
+    }
+    s->want_out = want_out;
+
+    return INDIGO_ERROR_NONE;
+}
+
+
+indigo_error_t
+ind_soc_data_out_ready(int socket_id)
+{
+    return soc_out_set(socket_id, 1);
+}
+
+
+indigo_error_t
+ind_soc_data_out_clear(int socket_id)
+{
+    return soc_out_set(socket_id, 0);
+}
+
+
+indigo_error_t
+ind_soc_timer_event_register(ind_soc_timer_callback_f callback,
+                             void *cookie,
+                             int repeat_time_ms)
+{
+    struct soc_timer *t, *free_slot = NULL;
+
+    if (callback == NULL) {
+        return INDIGO_ERROR_PARAM;
+    }
+
+    /* Registering again reschedules the timer */
+    for (t = soc_timers; t < soc_timers + SOC_TIMERS_MAX; ++t) {
+        if (t->callback == callback && t->cookie == cookie)  break;
+        if (t->callback == NULL && free_slot == NULL)  free_slot = t;
+    }
+    if (t == soc_timers + SOC_TIMERS_MAX && (t = free_slot) == NULL) {
+        return INDIGO_ERROR_RESOURCE;
+    }
+
+    t->callback = callback;
+    t->cookie = cookie;
+    t->repeat_ms = repeat_time_ms;
+    t->due_ns = soc_time_ns()
+        + (repeat_time_ms > 0 ? repeat_time_ms * 1000000ULL : 0);
+
+    return INDIGO_ERROR_NONE;
+}
+
+
+indigo_error_t
+ind_soc_timer_event_unregister(ind_soc_timer_callback_f callback,
+                               void *cookie)
+{
+    struct soc_timer *t;
+
+    for (t = soc_timers; t < soc_timers + SOC_TIMERS_MAX; ++t) {
+        if (t->callback == callback && t->cookie == cookie) {
+            t->callback = NULL;
+            return INDIGO_ERROR_NONE;
+        }
+    }
+
+    return INDIGO_ERROR_NOT_FOUND;
+}
+
+
+/** \brief Run the timers that are due */
+
+static void
+soc_timers_run(uint64_t now)
+{
+    struct soc_timer         *t;
+    ind_soc_timer_callback_f callback;
+    void                     *cookie;
+
+    for (t = soc_timers; t < soc_timers + SOC_TIMERS_MAX; ++t) {
+        if (t->callback == NULL || t->due_ns > now)  continue;
+
+        callback = t->callback;
+        cookie = t->cookie;
+        if (t->repeat_ms > 0) {
+            /* Skip ticks missed while the loop was busy */
+            t->due_ns += t->repeat_ms * 1000000ULL;
+            if (t->due_ns <= now) {
+                t->due_ns = now + t->repeat_ms * 1000000ULL;
+            }
+        } else {
+            t->callback = NULL;
+        }
+
+        /* May register or unregister timers, this one included */
+        callback(cookie);
+    }
+}
+
+
+/** \brief Milliseconds epoll_wait() may block; -1 = indefinitely */
+
+static int
+soc_timeout_ms(uint64_t now, uint64_t end_ns)
+{
+    struct soc_timer *t;
+    uint64_t         wake = end_ns;
+    unsigned         i;
+
+    for (i = 0; i < SOC_CLASSES; ++i) {
+        if (soc_ready_cnt[i])  return 0;
+    }
+
+    for (t = soc_timers; t < soc_timers + SOC_TIMERS_MAX; ++t) {
+        if (t->callback != NULL && t->due_ns < wake)  wake = t->due_ns;
+    }
+
+    if (wake == UINT64_MAX) {
+        return -1;
+    }
+    if (wake <= now) {
+        return 0;
+    }
+
+    /* Round up, so a timer is never woken for early */
+    return (int)((wake - now + 999999) / 1000000);
+}
+
+
+/** \brief Add epoll events to the ready list */
+
+static void
+soc_events_take(struct epoll_event *events, int n)
+{
+    struct soc_socket *s;
+    int               fd;
+
+    for (; n > 0; --n, ++events) {
+        fd = events->data.fd;
+        if (fd < 0 || fd >= soc_tbl_size
+            || (s = &soc_tbl[fd])->callback == NULL) {
+            continue;
+        }
+        s->events |= events->events;
+        if (!s->ready) {
+            s->ready = 1;
+            soc_ready[s->cls][soc_ready_cnt[s->cls]].fd = fd;
+            soc_ready[s->cls][soc_ready_cnt[s->cls]].gen = s->gen;
+            ++soc_ready_cnt[s->cls];
+        }
+    }
+}
+
+
+/** \brief Give the ready sockets of a class one callback each
+
+Stops early once budget_end_ns (0 = no budget) has passed.  Sockets not
+reached move to the head of the list for the next pass.  Those called
+leave it; epoll_wait() reports them again while they stay ready.
+*/
+
+static void
+soc_ready_run(unsigned cls, uint64_t budget_end_ns)
+{
+    struct soc_socket *s;
+    struct soc_ready  r;
+    unsigned          i, n = soc_ready_cnt[cls];
+    uint32_t          events;
+
+    /* Callbacks may grow the tables, so entries are always reached
+       through the globals */
+    for (i = 0; i < n; ++i) {
+        if (budget_end_ns && i > 0 && soc_time_ns() >= budget_end_ns) {
+            ++soc_cnt_budget_exhausted;
+            break;
+        }
+
+        r = soc_ready[cls][i];
+        s = &soc_tbl[r.fd];
+        if (s->callback == NULL || s->gen != r.gen) {
+            continue;
+        }
+
+        /* Write readiness only counts while it is wanted; it may have
+           been cleared since the event was taken */
+        events = s->events;
+        s->events = 0;
+        s->ready = 0;
+        if (!s->want_out) {
+            events &= ~EPOLLOUT;
+        }
+        if (events == 0) {
+            continue;
+        }
+        s->callback(r.fd, s->cookie,
+                    (events & EPOLLIN) != 0,
+                    (events & EPOLLOUT) != 0,
+                    (events & (EPOLLERR | EPOLLHUP)) != 0);
+    }
+
+    memmove(soc_ready[cls], soc_ready[cls] + i,
+            (n - i) * sizeof(soc_ready[cls][0]));
+    soc_ready_cnt[cls] = n - i;
+}
+
+
+indigo_error_t
+ind_soc_select_and_run(int run_for_ms)
+{
+    struct epoll_event events[SOC_EVENTS_MAX];
+    uint64_t           now, end_ns;
+    int                n;
+
+    if (!soc_enabled) {
+        return INDIGO_ERROR_INIT;
+    }
+
+    now = soc_time_ns();
+    end_ns = run_for_ms < 0 ? UINT64_MAX : now + run_for_ms * 1000000ULL;
+
+    do {
+        n = epoll_wait(soc_epfd, events, SOC_EVENTS_MAX,
+                       soc_timeout_ms(now, end_ns));
+        if (n < 0 && errno != EINTR) {
+            return INDIGO_ERROR_UNKNOWN;
+        }
+        soc_events_take(events, n);
+
+        soc_timers_run(now = soc_time_ns());
+        soc_ready_run(SOC_CLASS_CONTROL, 0);
+        soc_ready_run(SOC_CLASS_DATA,
+                      soc_time_ns() + LRI_DATA_BUDGET_US * 1000ULL);
+        now = soc_time_ns();
+    } while (soc_enabled && now < end_ns);
+
+    return INDIGO_ERROR_NONE;
+}
+
+
+indigo_error_t
+ind_soc_init(ind_soc_config_t *config)
+{
+    (void)config;
+
+    if (soc_epfd >= 0) {
+        return INDIGO_ERROR_NONE;
+    }
+    if ((soc_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        return INDIGO_ERROR_UNKNOWN;
+    }
+
+    return INDIGO_ERROR_NONE;
+}
+
+
+indigo_error_t
+ind_soc_enable_set(int enable)
+{
+    soc_enabled = enable;
+    return INDIGO_ERROR_NONE;
+}
+
+
+indigo_error_t
+ind_soc_enable_get(int *enable)
+{
+    *enable = soc_enabled;
+    return INDIGO_ERROR_NONE;
+}
+
+
+indigo_error_t
+ind_soc_finish(void)
+{
+    unsigned i;
+
+    if (soc_epfd >= 0) {
+        close(soc_epfd);
+        soc_epfd = -1;
+    }
+    INDIGO_MEM_FREE(soc_tbl);
+    soc_tbl = NULL;
+    for (i = 0; i < SOC_CLASSES; ++i) {
+        INDIGO_MEM_FREE(soc_ready[i]);
+        soc_ready[i] = NULL;
+        soc_ready_cnt[i] = 0;
+    }
+    soc_tbl_size = 0;
+    INDIGO_MEM_SET(soc_timers, 0, sizeof(soc_timers));
+
+    return INDIGO_ERROR_NONE;
+}
+
+#endif /* LRI_CONFIG_EPOLL */
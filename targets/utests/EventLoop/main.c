@@ -0,0 +1,234 @@
+/****************************************************************
+ *
+ *        Copyright 2013, Big Switch Networks, Inc.
+ *
+ * Licensed under the Eclipse Public License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *        http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the
+ * License.
+ *
+ ***************************************************************/
+
+/*
+ * Unit test for lri's epoll() event loop.  The loop's source is included
+ * whole, so that its statics can be checked.
+ */
+
+#include "../../lri/socketmanager_epoll.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define OK(x) TEST_ASSERT((x) == INDIGO_ERROR_NONE)
+
+void
+assert_fail(unsigned line, char *expr)
+{
+    printf("Assertion failed, line=%u, expr=\"%s\"\n", line, expr);
+}
+
+#define TEST_ASSERT(expr)  do { if (!(expr)) { assert_fail(__LINE__, # expr); } } while (0)
+
+#define TRUE   1
+#define FALSE  0
+
+/* One socket under test; the callback reads one message per call */
+
+struct soc_info {
+    int      fd;
+    unsigned called_cnt;
+    unsigned order;             /* Of the last call, from 1 */
+    int      read_ready;
+    int      write_ready;
+    int      error_seen;
+};
+
+static unsigned callback_order;
+
+void
+soc_info_arm(struct soc_info *info)
+{
+    info->called_cnt = 0;
+    info->order = 0;
+    info->read_ready = -1;
+    info->write_ready = -1;
+    info->error_seen = -1;
+}
+
+void
+soc_callback(int socket_id, void *cookie,
+             int read_ready, int write_ready, int error_seen)
+{
+    struct soc_info *info = cookie;
+    char            buf[64];
+
+    TEST_ASSERT(socket_id == info->fd);
+
+    ++info->called_cnt;
+    info->order = ++callback_order;
+    info->read_ready = read_ready;
+    info->write_ready = write_ready;
+    info->error_seen = error_seen;
+
+    /* A closed peer reads as end of file */
+    if (read_ready) {
+        TEST_ASSERT(recv(socket_id, buf, sizeof(buf), 0) > 0 || error_seen);
+    }
+}
+
+/* A UDP socket bound to loopback, which sends to itself: datapath class */
+
+int
+udp_open(void)
+{
+    struct sockaddr_in addr;
+    socklen_t          len = sizeof(addr);
+    int                fd;
+
+    TEST_ASSERT((fd = socket(AF_INET, SOCK_DGRAM, 0)) >= 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    TEST_ASSERT(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    TEST_ASSERT(getsockname(fd, (struct sockaddr *)&addr, &len) == 0);
+    TEST_ASSERT(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+    return fd;
+}
+
+int
+main(int argc, char* argv[])
+{
+    struct soc_info ctl[1], data[1];
+    int             pair[2];
+
+    OK(ind_soc_init(NULL));
+
+    /* Disabled, the loop runs nothing */
+    TEST_ASSERT(ind_soc_select_and_run(0) == INDIGO_ERROR_INIT);
+    OK(ind_soc_enable_set(1));
+
+    /* A stream socket pair stands in for a controller connection */
+    TEST_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+    ctl->fd = pair[0];
+    data->fd = udp_open();
+    TEST_ASSERT(soc_class_get(ctl->fd) == SOC_CLASS_CONTROL);
+    TEST_ASSERT(soc_class_get(data->fd) == SOC_CLASS_DATA);
+
+    /* Data socket registered first, so it is also reported first */
+    OK(ind_soc_socket_register(data->fd, soc_callback, data));
+    OK(ind_soc_socket_register(ctl->fd, soc_callback, ctl));
+    TEST_ASSERT(ind_soc_socket_register(ctl->fd, soc_callback, ctl)
+                == INDIGO_ERROR_EXISTS);
+
+    /* Nothing ready: nothing called */
+    soc_info_arm(ctl);
+    soc_info_arm(data);
+    OK(ind_soc_select_and_run(0));
+    TEST_ASSERT(ctl->called_cnt == 0);
+    TEST_ASSERT(data->called_cnt == 0);
+
+    /* One pass serves the control socket, then the data socket */
+    {
+        TEST_ASSERT(send(data->fd, "d1", 2, 0) == 2);
+        TEST_ASSERT(send(data->fd, "d2", 2, 0) == 2);
+        TEST_ASSERT(send(pair[1], "c", 1, 0) == 1);
+
+        soc_info_arm(ctl);
+        soc_info_arm(data);
+        callback_order = 0;
+        OK(ind_soc_select_and_run(0));
+        TEST_ASSERT(ctl->called_cnt == 1);
+        TEST_ASSERT(ctl->order == 1);
+        TEST_ASSERT(ctl->read_ready == TRUE);
+        TEST_ASSERT(ctl->write_ready == FALSE);
+        TEST_ASSERT(ctl->error_seen == FALSE);
+        TEST_ASSERT(data->called_cnt == 1);
+        TEST_ASSERT(data->order == 2);
+        TEST_ASSERT(data->read_ready == TRUE);
+        TEST_ASSERT(data->write_ready == FALSE);
+        TEST_ASSERT(data->error_seen == FALSE);
+    }
+
+    /* The data socket still holds a datagram, and is called again */
+    {
+        soc_info_arm(ctl);
+        soc_info_arm(data);
+        OK(ind_soc_select_and_run(0));
+        TEST_ASSERT(ctl->called_cnt == 0);
+        TEST_ASSERT(data->called_cnt == 1);
+        TEST_ASSERT(data->read_ready == TRUE);
+
+        /* Drained now */
+        soc_info_arm(data);
+        OK(ind_soc_select_and_run(0));
+        TEST_ASSERT(data->called_cnt == 0);
+    }
+
+    /* Write readiness is reported only while requested */
+    {
+        TEST_ASSERT(ind_soc_data_out_ready(pair[1]) == INDIGO_ERROR_NOT_FOUND);
+        OK(ind_soc_data_out_ready(ctl->fd));
+
+        soc_info_arm(ctl);
+        soc_info_arm(data);
+        OK(ind_soc_select_and_run(0));
+        TEST_ASSERT(ctl->called_cnt == 1);
+        TEST_ASSERT(ctl->read_ready == FALSE);
+        TEST_ASSERT(ctl->write_ready == TRUE);
+        TEST_ASSERT(data->called_cnt == 0);
+
+        /* Readable and writable in one callback */
+        TEST_ASSERT(send(pair[1], "c", 1, 0) == 1);
+        soc_info_arm(ctl);
+        OK(ind_soc_select_and_run(0));
+        TEST_ASSERT(ctl->called_cnt == 1);
+        TEST_ASSERT(ctl->read_ready == TRUE);
+        TEST_ASSERT(ctl->write_ready == TRUE);
+
+        OK(ind_soc_data_out_clear(ctl->fd));
+        soc_info_arm(ctl);
+        OK(ind_soc_select_and_run(0));
+        TEST_ASSERT(ctl->called_cnt == 0);
+    }
+
+    /* Peer closed: the control socket sees the error */
+    {
+        close(pair[1]);
+        soc_info_arm(ctl);
+        OK(ind_soc_select_and_run(0));
+        TEST_ASSERT(ctl->called_cnt == 1);
+        TEST_ASSERT(ctl->error_seen == TRUE);
+        OK(ind_soc_socket_unregister(ctl->fd));
+        TEST_ASSERT(ind_soc_socket_unregister(ctl->fd)
+                    == INDIGO_ERROR_NOT_FOUND);
+    }
+
+    /* Unregistered sockets are not called */
+    {
+        TEST_ASSERT(send(data->fd, "d3", 2, 0) == 2);
+        OK(ind_soc_socket_unregister(data->fd));
+        soc_info_arm(data);
+        OK(ind_soc_select_and_run(0));
+        TEST_ASSERT(data->called_cnt == 0);
+    }
+
+    close(ctl->fd);
+    close(data->fd);
+    OK(ind_soc_finish());
+
+    return 0;
+}